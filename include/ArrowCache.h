@@ -8,19 +8,28 @@
 #ifndef ARROWCACHE_H
 #define ARROWCACHE_H
 
+#include "NFmiPath.h"
+
 #include <map>
+#include <mutex>
 #include <string>
 
 class ArrowCache
 {
  public:
   const std::string& find(const std::string& theName);
+  const Imagine::NFmiPath& findPath(const std::string& theName);
   bool empty() const;
   void clear();
 
  private:
+  const std::string& read(const std::string& theName);
+
   typedef std::map<std::string, std::string> cache_type;
+  typedef std::map<std::string, Imagine::NFmiPath> path_cache_type;
   cache_type itsCache;
+  path_cache_type itsPathCache;
+  mutable std::mutex itsMutex;
 
 };  // class ArrowCache
 
@@ -21,17 +21,35 @@
  * A good principle is to change nothing but the projection, the
  * background and foreground images and the savepath.
  *
+ * The cache may be shared by several threads, all methods are
+ * internally synchronized.
+ *
+ * The size of the cache may be limited by setting the maximum
+ * number of bytes the cached paths may use. When the limit is
+ * exceeded, the least recently used contours are discarded.
+ *
+ * Optionally the contours are also stored in a directory, from
+ * which later processes can load them instead of recalculating.
+ * The files are identified by the name, modification time and
+ * size of the querydata file in addition to the usual settings,
+ * plus a variant number with which the caller can identify for
+ * example the interpolation method and the contoured values.
+ *
+ * A nonzero variant must include a hash of the contoured values.
+ * The contours of identical values at different times of the same
+ * data are then stored only once, under the time of the first one
+ * cached, so that unchanged fields are contoured only once. The
+ * times are forgotten once their contours have been discarded.
+ *
  * Typical use is shown below.
  * \code
  * ContourCache cache;
  *
  * NFmiPath path;
- * if(cache.contains(lolimit, hilimit, querydata, time))
- *    path = cache.find(lolimit, hilimit, querydata, time);
- * else
+ * if(!cache.find(path, lolimit, hilimit, time, querydata))
  * {
  *    path = ... some means of calculating it;
- *    cache.insert(path, lolimit, hilimit, querydata, time);
+ *    cache.insert(path, lolimit, hilimit, time, querydata);
  * }
  * path.Project(area);
  * path.Fill(image, color, rule);
@@ -43,8 +61,12 @@
 #define CONTOURCACHE_H
 
 #include "NFmiPath.h"
-#include <map>
+#include <cstddef>
+#include <list>
+#include <mutex>
 #include <string>
+#include <unordered_map>
+#include <utility>
 
 class LazyQueryData;
 class NFmiTime;
@@ -52,8 +74,66 @@ class NFmiTime;
 class ContourCache
 {
  private:
-  typedef std::map<std::string, Imagine::NFmiPath> storage_type;
+  struct Key
+  {
+    float lolimit;
+    float hilimit;
+    unsigned int file;
+    unsigned long param;
+    float level;
+    long long time;
+    long long origintime;
+    std::size_t variant;
+    std::size_t hash;
+
+    bool operator==(const Key& theOther) const;
+  };
+
+  struct KeyHash
+  {
+    std::size_t operator()(const Key& theKey) const { return theKey.hash; }
+  };
+
+  struct Slice
+  {
+    long long time;         // the first time the values were seen
+    std::size_t digest;     // independent digest of the values, 0 if unknown
+    std::size_t contours;   // the number of cached contours of the slice
+  };
+
+  struct File
+  {
+    unsigned int number;
+    long long mtime;
+    long long size;
+  };
+
+  typedef std::list<std::pair<Key, Imagine::NFmiPath> > lru_type;
+  typedef std::unordered_map<Key, lru_type::iterator, KeyHash> storage_type;
+
+  Key make_key(float theLoLimit,
+               float theHiLimit,
+               const NFmiTime& theTime,
+               const LazyQueryData& theData,
+               std::size_t theVariant,
+               std::size_t theDigest) const;
+  static void rehash(Key& theKey);
+  static Key slice_key(const Key& theKey);
+  std::string signature(const Key& theKey, const LazyQueryData& theData) const;
+  std::string disk_file(const std::string& theSignature) const;
+  void store(const Key& theKey, const Imagine::NFmiPath& thePath, std::size_t theDigest);
+  void evict();
+
+  lru_type itsList;  // most recently used first
   storage_type itsData;
+  mutable std::unordered_map<std::string, File> itsFiles;
+  mutable unsigned int itsFileNumbers = 0;  // numbers given to files so far
+  std::unordered_map<Key, Slice, KeyHash> itsSlices;  // slices with cached contours
+  std::size_t itsBytes = 0;
+  std::size_t itsMaxBytes = 0;
+  std::string itsDirectory;
+  std::string itsPrefix;
+  mutable std::mutex itsMutex;
 
  public:
   typedef storage_type::size_type size_type;
@@ -68,22 +148,39 @@ class ContourCache
   bool empty() const;
   void clear();
   size_type size() const;
+  std::size_t bytes() const;
+  void maxbytes(std::size_t theMaxBytes);
+  void directory(const std::string& theDirectory, const std::string& thePrefix);
 
   bool contains(float theLoLimit,
                 float theHiLimit,
                 const NFmiTime& theTime,
-                const LazyQueryData& theData) const;
+                const LazyQueryData& theData,
+                std::size_t theVariant = 0,
+                std::size_t theDigest = 0) const;
+
+  Imagine::NFmiPath find(float theLoLimit,
+                         float theHiLimit,
+                         const NFmiTime& theTime,
+                         const LazyQueryData& theData,
+                         std::size_t theVariant = 0,
+                         std::size_t theDigest = 0);
 
-  const Imagine::NFmiPath& find(float theLoLimit,
-                                float theHiLimit,
-                                const NFmiTime& theTime,
-                                const LazyQueryData& theData) const;
+  bool find(Imagine::NFmiPath& thePath,
+            float theLoLimit,
+            float theHiLimit,
+            const NFmiTime& theTime,
+            const LazyQueryData& theData,
+            std::size_t theVariant = 0,
+            std::size_t theDigest = 0);
 
-  void insert(const Imagine::NFmiPath& thePath,
+  bool insert(const Imagine::NFmiPath& thePath,
               float theLoLimit,
               float theHiLimit,
               const NFmiTime& theTime,
-              const LazyQueryData& theData);
+              const LazyQueryData& theData,
+              std::size_t theVariant = 0,
+              std::size_t theDigest = 0);
 
 };  // class ContourCache
 
@@ -19,6 +19,9 @@
 
 #include <memory>
 #include <memory>
+#include <string>
+#include <utility>
+#include <vector>
 
 #include "ContourInterpolation.h"
 
@@ -27,6 +30,7 @@ class NFmiDataMatrix;
 
 class ContourCalculatorPimple;
 class LazyQueryData;
+class NFmiArea;
 class NFmiTime;
 
 namespace Imagine
@@ -34,6 +38,14 @@ namespace Imagine
 class NFmiPath;
 }
 
+namespace geos
+{
+namespace geom
+{
+class Geometry;
+}
+}  // namespace geos
+
 class ContourCalculator
 {
  public:
@@ -51,10 +63,55 @@ class ContourCalculator
                             const NFmiTime &theTime,
                             ContourInterpolation theInterpolation);
 
+  std::vector<Imagine::NFmiPath> contours(const LazyQueryData &theData,
+                                          const std::vector<std::pair<float, float> > &theLimits,
+                                          const NFmiTime &theTime,
+                                          ContourInterpolation theInterpolation);
+
+  std::vector<Imagine::NFmiPath> contours(const LazyQueryData &theData,
+                                          const std::vector<float> &theValues,
+                                          const NFmiTime &theTime,
+                                          ContourInterpolation theInterpolation);
+
+  std::vector<Imagine::NFmiPath> contours(const LazyQueryData &theData,
+                                          const std::vector<std::pair<float, float> > &theLimits,
+                                          const NFmiTime &theTime,
+                                          ContourInterpolation theInterpolation,
+                                          const NFmiArea &theArea,
+                                          const std::string &theAreaKey);
+
+  std::vector<Imagine::NFmiPath> contours(const LazyQueryData &theData,
+                                          const std::vector<float> &theValues,
+                                          const NFmiTime &theTime,
+                                          ContourInterpolation theInterpolation,
+                                          const NFmiArea &theArea,
+                                          const std::string &theAreaKey,
+                                          double theSimplifyTolerance);
+
+  std::vector<std::shared_ptr<geos::geom::Geometry> > geometries(
+      const std::vector<std::pair<float, float> > &theLimits,
+      ContourInterpolation theInterpolation);
+
+  std::vector<std::shared_ptr<geos::geom::Geometry> > geometries(
+      const std::vector<float> &theValues, ContourInterpolation theInterpolation);
+
   void data(const NFmiDataMatrix<float> &theData);
+  void data(const NFmiDataMatrix<float> &theData,
+            std::size_t theI1,
+            std::size_t theJ1,
+            std::size_t theI2,
+            std::size_t theJ2);
+  void data(const NFmiDataMatrix<float> &theData, float theX0, float theY0, float theStep);
   void clearCache();
+  void shareCache(const ContourCalculator &theCalc);
   void cache(bool);
+  void cacheMaxBytes(std::size_t theMaxBytes);
+  void cacheDirectory(const std::string &theDirectory);
   bool wasCached(void) const;
+  bool wasCached(std::size_t theIndex) const;
+  void threads(unsigned int theThreads);
+  void stripes(unsigned int theRows);
+  void isobands(bool theFlag);
 
  private:
   ContourCalculator(const ContourCalculator &theCalc);
@@ -85,7 +85,11 @@ class ContourSpec
   void despeckle(
       float theLoLimit, float theHiLimit, int theRadius, float theWeight, int theIterations);
 
-  void despeckle(NFmiDataMatrix<float>& theValues) const;
+  void despeckle(NFmiDataMatrix<float>& theValues, unsigned int theThreads = 1) const;
+
+  // Identifies the value processing settings
+
+  std::string processingKey() const;
 
   // Label specific methods
 
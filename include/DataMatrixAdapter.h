@@ -1,38 +1,108 @@
-#pragma once
-
-#include <newbase/NFmiDataMatrix.h>
-
-class DataMatrixAdapter
-{
- public:
-  using value_type = float;
-  using coord_type = float;
-
-  using size_type = NFmiDataMatrix<float>::size_type;
-
-  DataMatrixAdapter(const NFmiDataMatrix<float> &theMatrix)
-      : itsMatrix(theMatrix), itsWidth(theMatrix.NX()), itsHeight(theMatrix.NY())
-  {
-  }
-
-  // Provide wrap-around capability for world data
-  const value_type &operator()(size_type i, size_type j) const
-  {
-    return itsMatrix[i % itsWidth][j];
-  }
-
-  // No wrap-around for coordinates, we need both left and right
-  // edge coordinates for world data
-  coord_type x(size_type i, size_type j) const { return static_cast<float>(i); }
-  coord_type y(size_type i, size_type j) const { return static_cast<float>(j); }
-  size_type width() const { return itsWidth; }
-  size_type height() const { return itsHeight; }
-  bool valid(size_type i, size_type j) const { return true; }
-
- private:
-  DataMatrixAdapter();
-  const NFmiDataMatrix<float> &itsMatrix;
-  const size_type itsWidth;
-  const size_type itsHeight;
-
-};  // class DataMatrixAdapter
+#pragma once
+
+#include <newbase/NFmiDataMatrix.h>
+
+class DataMatrixAdapter
+{
+ public:
+  using value_type = float;
+  using coord_type = float;
+
+  using size_type = NFmiDataMatrix<float>::size_type;
+
+  DataMatrixAdapter(const NFmiDataMatrix<float> &theMatrix)
+      : itsMatrix(theMatrix),
+        itsFullWidth(theMatrix.NX()),
+        itsI1(0),
+        itsJ1(0),
+        itsWidth(theMatrix.NX()),
+        itsHeight(theMatrix.NY()),
+        itsX0(0),
+        itsY0(0),
+        itsStep(1)
+  {
+  }
+
+  // Adapt only the window [i1,i2) x [j1,j2). The coordinates remain
+  // those of the full grid, so that the contours can be mapped back
+  // to the grid as usual.
+  DataMatrixAdapter(const NFmiDataMatrix<float> &theMatrix,
+                    size_type theI1,
+                    size_type theJ1,
+                    size_type theI2,
+                    size_type theJ2)
+      : itsMatrix(theMatrix),
+        itsFullWidth(theMatrix.NX()),
+        itsI1(theI1),
+        itsJ1(theJ1),
+        itsWidth(theI2 - theI1),
+        itsHeight(theJ2 - theJ1),
+        itsX0(static_cast<float>(theI1)),
+        itsY0(static_cast<float>(theJ1)),
+        itsStep(1)
+  {
+  }
+
+  // Adapt a reduced resolution copy of a grid. Element (i,j) of the
+  // copy is located at (x0 + i*step, y0 + j*step) in the full grid.
+  DataMatrixAdapter(const NFmiDataMatrix<float> &theMatrix,
+                    coord_type theX0,
+                    coord_type theY0,
+                    coord_type theStep)
+      : itsMatrix(theMatrix),
+        itsFullWidth(theMatrix.NX()),
+        itsI1(0),
+        itsJ1(0),
+        itsWidth(theMatrix.NX()),
+        itsHeight(theMatrix.NY()),
+        itsX0(theX0),
+        itsY0(theY0),
+        itsStep(theStep)
+  {
+  }
+
+  // Adapt only the rows [j1,j2) of another adapter. The coordinates
+  // remain those of the other adapter.
+  DataMatrixAdapter(const DataMatrixAdapter &theData, size_type theJ1, size_type theJ2)
+      : itsMatrix(theData.itsMatrix),
+        itsFullWidth(theData.itsFullWidth),
+        itsI1(theData.itsI1),
+        itsJ1(theData.itsJ1 + theJ1),
+        itsWidth(theData.itsWidth),
+        itsHeight(theJ2 - theJ1),
+        itsX0(theData.itsX0),
+        itsY0(theData.y(0, theJ1)),
+        itsStep(theData.itsStep)
+  {
+  }
+
+  // Provide wrap-around capability for world data
+  const value_type &operator()(size_type i, size_type j) const
+  {
+    return itsMatrix[(i + itsI1) % itsFullWidth][j + itsJ1];
+  }
+
+  // No wrap-around for coordinates, we need both left and right
+  // edge coordinates for world data
+  coord_type x(size_type i, size_type j) const { return itsX0 + itsStep * i; }
+  coord_type y(size_type i, size_type j) const { return itsY0 + itsStep * j; }
+  size_type width() const { return itsWidth; }
+  size_type height() const { return itsHeight; }
+  coord_type x0() const { return itsX0; }
+  coord_type y0() const { return itsY0; }
+  coord_type step() const { return itsStep; }
+  bool valid(size_type i, size_type j) const { return true; }
+
+ private:
+  DataMatrixAdapter();
+  const NFmiDataMatrix<float> &itsMatrix;
+  const size_type itsFullWidth;
+  const size_type itsI1;
+  const size_type itsJ1;
+  const size_type itsWidth;
+  const size_type itsHeight;
+  const coord_type itsX0;
+  const coord_type itsY0;
+  const coord_type itsStep;
+
+};  // class DataMatrixAdapter
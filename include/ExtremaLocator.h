@@ -25,9 +25,11 @@ class ExtremaLocator
 
   bool empty() const;
   void clear();
+  void swapHistory(ExtremaLocator& theOther);
 
   void minDistanceToSame(float theDistance);
   void minDistanceToDifferent(float theDistance);
+  void coherence(float theTolerance);
 
   void nextTime();
 
@@ -47,23 +49,13 @@ class ExtremaLocator
 
   float itsMinDistanceToSame;
   float itsMinDistanceToDifferent;
+  float itsCoherence;
 
   ExtremaCoordinates itsPreviousCoordinates;
   ExtremaCoordinates itsCurrentCoordinates;
 
   // Private methods:
 
-  Coordinates::const_iterator chooseOne(const Coordinates& theCandidates, Extremum theType);
-
-  Coordinates::const_iterator chooseClosestToPrevious(const Coordinates& theCandidates,
-                                                      const Coordinates& thePreviousChoices,
-                                                      Extremum theType);
-
-  Coordinates::const_iterator chooseClosestToBorder(const Coordinates& theCandidates,
-                                                    Extremum theType);
-
-  void removeCandidates(ExtremaCoordinates& theCandidates, const XY& thePoint, Extremum theType);
-
   void removeEmpties(ExtremaCoordinates& theCandidates);
 
 };  // class ExtremaLocator
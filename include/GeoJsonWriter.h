@@ -0,0 +1,72 @@
+// ======================================================================
+/*!
+ * \file
+ * \brief Interface of class GeoJsonWriter
+ */
+// ======================================================================
+/*!
+ * \class GeoJsonWriter
+ * \brief Streams contour geometries as a GeoJSON feature collection
+ *
+ * The geometries calculated by the contourer are in grid coordinates.
+ * The writer converts them to geographic coordinates as they are
+ * written, hence no intermediate paths are needed. The coordinates
+ * may be quantized to a fixed number of decimals, in which case
+ * repeated points and degenerate parts are left out.
+ */
+// ======================================================================
+
+#ifndef GEOJSONWRITER_H
+#define GEOJSONWRITER_H
+
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+class NFmiGrid;
+
+namespace geos
+{
+namespace geom
+{
+class Geometry;
+class LineString;
+class Polygon;
+}  // namespace geom
+}  // namespace geos
+
+class GeoJsonWriter
+{
+ public:
+  GeoJsonWriter(std::ostream& theOutput, int thePrecision);
+
+  void feature(const geos::geom::Geometry& theGeometry,
+               const NFmiGrid& theGrid,
+               const std::string& theProperties);
+  void finish();
+
+ private:
+  GeoJsonWriter(const GeoJsonWriter& theWriter);
+  GeoJsonWriter& operator=(const GeoJsonWriter& theWriter);
+
+  typedef std::vector<std::pair<double, double> > Points;
+
+  bool geometry(const geos::geom::Geometry& theGeometry);
+  bool points(const geos::geom::LineString& theLine, std::size_t theMinimum);
+  bool polygon(const geos::geom::Polygon& thePolygon);
+  void write(const std::string& theText);
+
+  std::ostream& itsOutput;
+  const NFmiGrid* itsGrid = nullptr;
+  int itsPrecision;
+  double itsScale = 0;
+  bool itsFirstFeature = true;
+  bool isFinished = false;
+  std::string itsText;  // the geometry being written
+
+};  // class GeoJsonWriter
+
+#endif  // GEOJSONWRITER_H
+
+// ======================================================================
@@ -14,7 +14,10 @@
 #include "ExtremaLocator.h"
 #include "ImageCache.h"
 #include "LabelLocator.h"
+#include "QueryDataPool.h"
+#include "ShapeCache.h"
 #include "ShapeSpec.h"
+#include "TextCache.h"
 #include "UnitsConverter.h"
 
 #include "imagine-config.h"
@@ -86,6 +89,13 @@ struct RoundArrowSize
   }
 };
 
+struct RenderTarget
+{
+  std::string projection;  // projection definition
+  std::string background;  // background image name, empty if none
+  std::string savepath;    // image output path
+};
+
 struct Globals
 {
   ~Globals();
@@ -93,12 +103,14 @@ struct Globals
 
   void setImageModes(Imagine::NFmiImage &) const;
   std::shared_ptr<NFmiArea> createArea() const;
+  static std::shared_ptr<NFmiArea> createArea(const std::string &theProjection);
   const std::string getImageStampText(const NFmiTime &theTime) const;
 
   void drawImageStampText(ImagineXr_or_NFmiImage &d, const std::string &text) const;
   void drawCombine(ImagineXr_or_NFmiImage &d) const;
 
   const ImagineXr_or_NFmiImage &getImage(const std::string &filename) const;
+  void releaseImages() const;
 
   RoundArrowColor getRoundArrowFillColor(float speed) const;
   RoundArrowColor getRoundArrowStrokeColor(float speed) const;
@@ -111,8 +123,20 @@ struct Globals
 
   bool verbose;                          // -v option
   bool force;                            // -f option
+  unsigned int threads;                  // -j option, rendering threads
+  unsigned int writers;                  // image writing threads
+  unsigned int scriptjobs;               // draw commands executed concurrently
+  int followinterval;                    // seconds between checks for new data, 0 for none
+  int followtimeout;                     // seconds to wait for new data, 0 for ever
+  bool manifest;                         // skip images whose inputs have not changed?
+  std::size_t scripthash;                // hash of the commands processed so far
   std::string cmdline_querydata;         // -q option
   std::string cmdline_conf;              // -c option
+  std::string cmdline_serve;             // -S option, socket or - for stdin
+  unsigned int shard;                    // -s option, index of this node
+  unsigned int shards;                   // -s option, number of nodes, 0 for none
+  unsigned long shardimages;             // images enumerated so far
+  std::string jobfile;                   // -J option, shared file of claimed images
   std::list<std::string> cmdline_files;  // command line parameters
 
   // Status variables
@@ -159,14 +183,24 @@ struct Globals
   std::string mask;            // mask image name
   std::string combine;         // combine image name
 
+  std::vector<RenderTarget> targets;  // images rendered by "draw contours"
+  int vectorprecision;                // decimals in "draw vectors" output, negative for all
+  float autoresolution;               // grid cells per pixel before reducing, 0 for never
+  unsigned int contourstripes;        // minimum rows per parallel stripe, 0 for none
+  unsigned int prefetch;              // time steps read ahead in serial mode, 0 for none
+  unsigned int filltiles;             // minimum rows per parallel fill tile, 0 for none
+  bool reuseframes;                   // link unchanged images to the previous ones
+
   int combinex;
   int combiney;
   std::string combinerule;
   float combinefactor;
 
-  std::string erase;       // background color
-  std::string fillrule;    // normal filling rule
-  std::string strokerule;  // normal stroking rule
+  std::string erase;            // background color
+  std::string fillrule;         // normal filling rule
+  std::string contourfillmode;  // vector or raster
+  std::string contourengine;    // tron or isobands
+  std::string strokerule;       // normal stroking rule
 
   double contourlinewidth;  // width of contour lines
   double arrowlinewidth;    // width of wind arrow lines
@@ -201,9 +235,9 @@ struct Globals
   std::list<NFmiPoint> arrowpoints;  // Active wind arrows
 
   std::string queryfilelist;                // querydata files in use
+  std::string queryfilestamp;               // identities of the files in use
   std::vector<std::string> queryfilenames;  // querydata files in use
 
-  std::shared_ptr<LazyQueryData> queryinfo;  // active data, does not own pointer
   int querydatalevel;                          // level value (-1 for first)
   int timesteps;                               // how many images to draw?
   int timestep;                                // timestep, 0 = all valid
@@ -234,6 +268,7 @@ struct Globals
   std::string lowpressurerule;
   float lowpressurefactor;
   float lowpressuremaximum;
+  float pressureradius;  // extrema search radius in km, 0 for 7 grid points
 
   // Active storage
 
@@ -257,6 +292,13 @@ struct Globals
 
   ArrowCache itsArrowCache;
 
+  ShapeCache itsShapeCache;
+
+  TextCache itsTextCache;
+  bool itsTextCacheOn;
+
+  QueryDataPool itsQueryDataPool;
+
   std::string graticulecolor;
   double graticulelon1;
   double graticulelat1;
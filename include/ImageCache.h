@@ -1,6 +1,12 @@
 // ======================================================================
 /*!
  * \brief Interface of class ImageCache
+ *
+ * Images are decoded only once and kept until cleared. The memory
+ * used may be limited by setting the maximum number of bytes the
+ * decoded images may use, in which case release() discards the least
+ * recently used images exceeding the limit. Since getImage() returns
+ * references, images are never discarded while they are being used.
  */
 // ======================================================================
 
@@ -13,18 +19,35 @@
 #endif
 
 #include "NFmiImage.h"
-#include <map>
+#include <condition_variable>
+#include <cstddef>
+#include <list>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <unordered_map>
+#include <utility>
 
 class ImageCache
 {
  public:
   const ImagineXr_or_NFmiImage& getImage(const std::string& theFile) const;
   void clear() const;
+  void release() const;
+  void maxbytes(std::size_t theMaxBytes);
+  std::size_t bytes() const;
 
  private:
-  typedef std::map<std::string, ImagineXr_or_NFmiImage> storage_type;
+  // null while the image is being decoded
+  typedef std::list<std::pair<std::string, std::unique_ptr<ImagineXr_or_NFmiImage> > > lru_type;
+  typedef std::unordered_map<std::string, lru_type::iterator> storage_type;
+
+  mutable lru_type itsList;  // most recently used first
   mutable storage_type itsCache;
+  mutable std::size_t itsBytes = 0;
+  std::size_t itsMaxBytes = 0;
+  mutable std::mutex itsMutex;
+  mutable std::condition_variable itsDecoded;  // signalled when a decoding ends
 };
 
 #endif  // IMAGECACHE_H
@@ -0,0 +1,33 @@
+// ======================================================================
+/*!
+ * \file
+ * \brief Interface of namespace IsobandTools
+ */
+// ======================================================================
+
+#ifndef ISOBANDTOOLS_H
+#define ISOBANDTOOLS_H
+
+#include "DataMatrixAdapter.h"
+#include "NFmiPath.h"
+#include <utility>
+#include <vector>
+
+namespace IsobandTools
+{
+// lower and upper limit, kFloatMissing for an open limit
+typedef std::pair<float, float> Band;
+
+// test whether a band can be contoured, at least one limit must be set
+bool contourable(const Band& theBand);
+
+// linearly interpolated fills of all the bands in grid coordinates
+std::vector<Imagine::NFmiPath> fills(const DataMatrixAdapter& theData,
+                                     const std::vector<Band>& theBands,
+                                     unsigned int theThreads);
+
+}  // namespace IsobandTools
+
+#endif  // ISOBANDTOOLS_H
+
+// ======================================================================
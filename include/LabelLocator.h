@@ -19,11 +19,13 @@ class LabelLocator
 
   bool empty() const;
   void clear();
+  void swapHistory(LabelLocator& theOther);
 
   void boundingBox(int theX1, int theY1, int theX2, int theY2);
   void minDistanceToSameValue(float theDistance);
   void minDistanceToDifferentValue(float theDistance);
   void minDistanceToDifferentParameter(float theDistance);
+  void coherence(float theTolerance);
 
   void parameter(int theParameter);
   void nextTime();
@@ -52,6 +54,7 @@ class LabelLocator
   float itsMinDistanceToSameValue;
   float itsMinDistanceToDifferentValue;
   float itsMinDistanceToDifferentParameter;
+  float itsCoherence;
 
   int itsActiveParameter;
   ParamCoordinates itsPreviousCoordinates;
@@ -63,11 +66,6 @@ class LabelLocator
 
   float distanceToBorder(float theX, float theY) const;
 
-  void removeCandidates(ParamCoordinates& theCandidates,
-                        const XY& thePoint,
-                        int theParam,
-                        float theContour);
-
   void removeEmpties(ParamCoordinates& theCandidates);
 
 };  // class LabelLocator
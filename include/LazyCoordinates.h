@@ -13,8 +13,8 @@
  *
  * To optimize the code we hence use a lazy matrix of coordinates,
  * which acts like a Fmi::CoordinateMatrix, except that
- * the coordinates are only fetched from the global querydata
- * holder if necessary.
+ * the coordinates are only fetched from the given querydata
+ * if necessary.
  *
  */
 // ======================================================================
@@ -22,10 +22,10 @@
 #ifndef LAZYCOORDINATES_H
 #define LAZYCOORDINATES_H
 
-#include "Globals.h"
 #include "LazyQueryData.h"
 #include <gis/CoordinateMatrix.h>
 #include <newbase/NFmiPoint.h>
+#include <memory>
 
 namespace
 {
@@ -39,19 +39,20 @@ class LazyCoordinates
   typedef NFmiPoint element_type;
   typedef std::size_t size_type;
 
-  LazyCoordinates(const NFmiArea &theArea);
+  LazyCoordinates(const NFmiArea &theArea, const LazyQueryData &theData);
   NFmiPoint operator()(size_type i, size_type j) const;
   NFmiPoint operator()(int i, int j, const NFmiPoint &theDefault) const;
   const data_type &operator*() const;
-  data_type &operator*();
+  std::shared_ptr<data_type> shared() const;
 
   size_type NX() const;
   size_type NY() const;
 
  private:
   const NFmiArea &itsArea;
+  const LazyQueryData &itsQueryData;
   mutable bool itsInitialized;
-  mutable data_type itsData;
+  mutable std::shared_ptr<data_type> itsData;
 
   void init() const;
 
@@ -66,7 +67,7 @@ class LazyCoordinates
 inline LazyCoordinates::element_type LazyCoordinates::operator()(size_type i, size_type j) const
 {
   init();
-  return itsData(i, j);
+  return (*itsData)(i, j);
 }
 
 // ----------------------------------------------------------------------
@@ -79,10 +80,10 @@ inline LazyCoordinates::element_type LazyCoordinates::operator()(
     int i, int j, const element_type &theDefault) const
 {
   init();
-  if (i >= 0 && j >= 0 && static_cast<size_type>(i) < itsData.width() &&
-      static_cast<size_type>(j) < itsData.height())
+  if (i >= 0 && j >= 0 && static_cast<size_type>(i) < itsData->width() &&
+      static_cast<size_type>(j) < itsData->height())
   {
-    return itsData(i, j);
+    return (*itsData)(i, j);
   }
   return dummy;
 }
@@ -96,16 +97,16 @@ inline LazyCoordinates::element_type LazyCoordinates::operator()(
 inline const LazyCoordinates::data_type &LazyCoordinates::operator*() const
 {
   init();
-  return itsData;
+  return *itsData;
 }
 
 // ----------------------------------------------------------------------
 /*!
- * \brief Non-const dereference
+ * \brief The shared coordinate matrix
  */
 // ----------------------------------------------------------------------
 
-inline LazyCoordinates::data_type &LazyCoordinates::operator*()
+inline std::shared_ptr<LazyCoordinates::data_type> LazyCoordinates::shared() const
 {
   init();
   return itsData;
@@ -120,7 +121,7 @@ inline LazyCoordinates::data_type &LazyCoordinates::operator*()
 inline LazyCoordinates::size_type LazyCoordinates::NX() const
 {
   init();
-  return itsData.width();
+  return itsData->width();
 }
 
 // ----------------------------------------------------------------------
@@ -132,7 +133,7 @@ inline LazyCoordinates::size_type LazyCoordinates::NX() const
 inline LazyCoordinates::size_type LazyCoordinates::NY() const
 {
   init();
-  return itsData.height();
+  return itsData->height();
 }
 
 // ----------------------------------------------------------------------
@@ -146,7 +147,7 @@ inline void LazyCoordinates::init() const
   if (itsInitialized)
     return;
 
-  itsData = *globals.queryinfo->LocationsWorldXY(itsArea);
+  itsData = itsQueryData.LocationsWorldXY(itsArea);
   itsInitialized = true;
 }
 
@@ -27,6 +27,7 @@
 #include <newbase/NFmiParameterName.h>
 #include <memory>
 #include <string>
+#include <vector>
 
 class NFmiArea;
 class NFmiFastQueryInfo;
@@ -48,6 +49,9 @@ class LazyQueryData
   LazyQueryData();
 
   const std::string &Filename() const { return itsDataFile; }
+  const std::string &GridKey() const { return itsGridKey; }
+  long long FileTime() const { return itsFileTime; }
+  long long FileSize() const { return itsFileSize; }
   std::string GetParamName() const;
   unsigned long GetParamIdent() const;
   float GetLevelNumber() const;
@@ -55,6 +59,7 @@ class LazyQueryData
   // These do not require the data values
 
   void Read(const std::string &theDataFile);
+  std::shared_ptr<LazyQueryData> Clone() const;
 
   void ResetTime();
   void ResetLevel();
@@ -64,7 +69,12 @@ class LazyQueryData
   bool NextLevel();
   bool NextTime();
   bool PreviousTime();
+  unsigned long TimeIndex() const;
+  bool TimeIndex(unsigned long theIndex);
+  bool FindTimeAtOrAfter(const NFmiTime &theTime);
   const NFmiLevel *Level() const;
+  unsigned long LevelIndex() const;
+  bool LevelIndex(unsigned long theIndex);
 
   bool Param(FmiParameterName theParam);
 
@@ -77,6 +87,8 @@ class LazyQueryData
   std::shared_ptr<Fmi::CoordinateMatrix> Locations() const;
   std::shared_ptr<Fmi::CoordinateMatrix> LocationsWorldXY(const NFmiArea &theArea) const;
   std::shared_ptr<Fmi::CoordinateMatrix> LocationsXY(const NFmiArea &theArea) const;
+  std::shared_ptr<Fmi::CoordinateMatrix> LocationsAreaLatLon(const NFmiArea &theArea) const;
+  std::shared_ptr<Fmi::CoordinateMatrix> LocationsPixelXY(const NFmiArea &theArea) const;
 
   Fmi::CoordinateMatrix CoordinateMatrix() const;
   const Fmi::SpatialReference &SpatialReference() const;
@@ -102,19 +114,27 @@ class LazyQueryData
   NFmiDataMatrix<float> Values();
   NFmiDataMatrix<float> Values(const NFmiMetTime &theTime);
 
+  // These reuse the memory already allocated for the matrix
+
+  void Values(NFmiDataMatrix<float> &theValues);
+  void Values(NFmiDataMatrix<float> &theValues, const NFmiMetTime &theTime);
+
  private:
   LazyQueryData(const LazyQueryData &theQD);
   LazyQueryData &operator=(const LazyQueryData &theQD);
 
   std::string itsInputName;
   std::string itsDataFile;
+  long long itsFileTime = 0;  // modification time and size when read
+  long long itsFileSize = 0;
   std::shared_ptr<NFmiFastQueryInfo> itsInfo;
   std::shared_ptr<NFmiQueryData> itsData;
 
-  mutable std::shared_ptr<Fmi::CoordinateMatrix> itsLocations;
-  mutable std::shared_ptr<Fmi::CoordinateMatrix> itsLocationsWorldXY;
-  mutable std::shared_ptr<Fmi::CoordinateMatrix> itsLocationsXY;
-  mutable std::string itsLocationsArea;
+  // Identifies the grid in the process wide coordinate cache
+  std::string itsGridKey;
+
+  // Valid times in ascending order, shared by the clones
+  std::shared_ptr<const std::vector<NFmiMetTime> > itsTimes;
 
 };  // class LazyQueryData
 
@@ -0,0 +1,64 @@
+// ======================================================================
+/*!
+ * \file
+ * \brief Interface of class MetaExpression
+ */
+// ======================================================================
+/*!
+ * \class MetaExpression
+ * \brief A user defined meta parameter
+ *
+ * The expression is parsed and compiled once into a postfix program,
+ * which is then evaluated one grid column at a time for all the
+ * operations at once. Only gradients require their argument to be
+ * evaluated into a full grid first.
+ *
+ * Supported syntax:
+ *
+ *  - numbers and newbase parameter names such as Temperature
+ *  - other meta parameter names, including previously defined ones
+ *  - arithmetic + - * / ^ and unary minus
+ *  - comparisons < <= > >= == != and logical && || !, which yield 1 or 0
+ *  - min(a,b,...), max(a,b,...), abs, sqrt, exp, log, sin, cos, pow(a,b)
+ *  - if(condition,a,b)
+ *  - gradx(expr), grady(expr) and grad(expr) in units per meter
+ *
+ * A missing value in any operand makes the result missing.
+ */
+// ======================================================================
+
+#ifndef METAEXPRESSION_H
+#define METAEXPRESSION_H
+
+#include <newbase/NFmiDataMatrix.h>
+#include <memory>
+#include <string>
+
+class LazyQueryData;
+
+class MetaExpression
+{
+ public:
+  ~MetaExpression();
+  MetaExpression(const std::string& theExpression);
+
+  const std::string& expression() const;
+  void values(LazyQueryData& theQI,
+              NFmiDataMatrix<float>& theValues,
+              unsigned int theThreads) const;
+
+  struct Program;
+
+ private:
+  MetaExpression();
+  MetaExpression(const MetaExpression& theOther);
+  MetaExpression& operator=(const MetaExpression& theOther);
+
+  std::string itsExpression;
+  std::shared_ptr<Program> itsProgram;
+
+};  // class MetaExpression
+
+#endif  // METAEXPRESSION_H
+
+// ======================================================================
@@ -20,11 +20,26 @@
 
 #include "LazyQueryData.h"
 
+class UnitsConverter;
+
 namespace MetaFunctions
 {
+void define(const std::string &theName, const std::string &theExpression);
+void clear();
+void units(const UnitsConverter &theConverter);
+const UnitsConverter &units();
 bool isMeta(const std::string &theFunction);
 int id(const std::string &theFunction);
-NFmiDataMatrix<float> values(const std::string &theFunction, LazyQueryData &theQI);
+NFmiDataMatrix<float> values(const std::string &theFunction,
+                             LazyQueryData &theQI,
+                             unsigned int theThreads = 1);
+
+void nabla(const NFmiDataMatrix<float> &theF,
+           float theDX,
+           float theDY,
+           NFmiDataMatrix<float> &theNablaX,
+           NFmiDataMatrix<float> &theNablaY,
+           unsigned int theThreads = 1);
 
 }  // namespace MetaFunctions
 
@@ -18,7 +18,11 @@ void despeckle(NFmiDataMatrix<float>& theValues,
                float theHiLimit,
                int theRadius,
                float theWeight,
-               int theIterations);
+               int theIterations,
+               unsigned int theThreads = 1);
+
+// replace missing values by the mean of their neighbours
+void expand(NFmiDataMatrix<float>& theValues);
 
 }  // namespace NoiseTools
 
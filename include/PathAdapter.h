@@ -12,8 +12,8 @@
 class PathAdapter
 {
  public:
-  void moveto(float x, float y) { itsPath.MoveTo(x, y); }
-  void lineto(float x, float y) { itsPath.LineTo(x, y); }
+  void moveto(double x, double y) { itsPath.MoveTo(x, y); }
+  void lineto(double x, double y) { itsPath.LineTo(x, y); }
   void closepath() { itsPath.CloseLineTo(); }
   const Imagine::NFmiPath& path() const { return itsPath; }
 
@@ -0,0 +1,98 @@
+// ======================================================================
+/*!
+ * \file
+ * \brief Interface of namespace Profiler
+ */
+// ======================================================================
+/*!
+ * \namespace Profiler
+ * \brief Wall and CPU time spent in the phases of the rendering
+ *
+ * A Record collects the phases and counters of one unit of work, such
+ * as one parameter of one time step, and is written as a single JSON
+ * line when it ends. Records nest within each thread, and the phases
+ * and counters are added to the innermost record of the thread. Work
+ * done outside all records is reported in a "script" record when the
+ * profile is closed.
+ *
+ * A Helper adds the CPU time, phases and counters of a thread working
+ * on behalf of a record of another thread to that record, and to the
+ * phases of the record still running. The CPU time of a record may
+ * hence exceed its wall clock time.
+ *
+ * When profiling has not been enabled the records, phases and
+ * counters do nothing.
+ */
+// ======================================================================
+
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <string>
+
+namespace Profiler
+{
+void open(const std::string& theFile);
+void close();
+void flush();
+bool enabled();
+
+// Add to a counter of the innermost record
+void count(const std::string& theCounter, long long theValue = 1);
+
+struct RecordData;
+
+// The innermost record of the calling thread, null if none
+RecordData* current();
+
+class Record
+{
+ public:
+  Record(const char* theKind, const std::string& theTime, const std::string& theName);
+  ~Record();
+
+ private:
+  Record(const Record& theRecord);
+  Record& operator=(const Record& theRecord);
+
+  RecordData* itsData;    // null if profiling is disabled
+  RecordData* itsParent;  // the enclosing record of the thread
+};
+
+class Phase
+{
+ public:
+  explicit Phase(const char* theName);
+  ~Phase();
+
+ private:
+  Phase(const Phase& thePhase);
+  Phase& operator=(const Phase& thePhase);
+
+  const char* itsName;  // null if profiling is disabled
+  double itsWall;
+  double itsCpu;
+  double itsHelpers;  // CPU time of the helpers of the record at start
+};
+
+class Helper
+{
+ public:
+  explicit Helper(RecordData* theRecord);
+  ~Helper();
+
+ private:
+  Helper(const Helper& theHelper);
+  Helper& operator=(const Helper& theHelper);
+
+  RecordData* itsRecord;    // the record helped, null if none
+  RecordData* itsData;      // the work done meanwhile
+  RecordData* itsPrevious;  // the innermost record of the thread before
+  double itsCpu;
+};
+
+}  // namespace Profiler
+
+#endif  // PROFILER_H
+
+// ======================================================================
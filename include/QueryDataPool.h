@@ -0,0 +1,69 @@
+// ======================================================================
+/*!
+ * \file
+ * \brief Interface of class QueryDataPool
+ */
+// ======================================================================
+/*!
+ * \class QueryDataPool
+ * \brief Storage for read querydata files
+ *
+ * The pool remembers the querydata files read so far, so that
+ * switching between different combinations of files does not
+ * require reading them again. The files are identified by their
+ * names, modification times and sizes, hence changed files are
+ * read again automatically.
+ *
+ * The pool hands out clones of the stored data, each with their
+ * own iterator. The clones share the data itself, which stays in
+ * memory as long as any clone uses it even if the pool discards it.
+ *
+ * The size of the pool may be limited by setting the maximum number
+ * of bytes the files may use. When the limit is exceeded, the least
+ * recently used files are discarded.
+ */
+// ======================================================================
+
+#ifndef QUERYDATAPOOL_H
+#define QUERYDATAPOOL_H
+
+#include <cstddef>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+class LazyQueryData;
+
+class QueryDataPool
+{
+ public:
+  static std::string identity(const std::string& theFile);
+
+  std::vector<std::shared_ptr<LazyQueryData> > get(const std::vector<std::string>& theFiles);
+  void maxbytes(std::size_t theMaxBytes);
+  void clear();
+
+ private:
+  struct Entry
+  {
+    std::string identity;
+    std::size_t bytes = 0;
+    unsigned long lastuse = 0;
+    std::shared_ptr<LazyQueryData> data;
+  };
+
+  void evict(const std::vector<std::string>& theKeptFiles);
+
+  std::map<std::string, Entry> itsData;
+  std::size_t itsBytes = 0;
+  std::size_t itsMaxBytes = 0;
+  unsigned long itsCounter = 0;
+  std::mutex itsMutex;
+
+};  // class QueryDataPool
+
+#endif  // QUERYDATAPOOL_H
+
+// ======================================================================
@@ -0,0 +1,46 @@
+// ======================================================================
+/*!
+ * \file
+ * \brief Interface of namespace RangeTools
+ */
+// ======================================================================
+
+#ifndef RANGETOOLS_H
+#define RANGETOOLS_H
+
+#include <newbase/NFmiDataMatrix.h>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+namespace RangeTools
+{
+// lower and upper limit, kFloatMissing for an open limit
+typedef std::pair<float, float> Range;
+
+// the index of values in none of the ranges
+const std::uint16_t none = 0xffff;
+
+// test whether two ranges may contain the same value
+bool overlap(const Range& theRange1, const Range& theRange2);
+
+// test whether no two ranges may contain the same value
+bool disjoint(const std::vector<Range>& theRanges);
+
+// index of the first range containing each value
+void classify(const float* theValues,
+              std::size_t theCount,
+              const std::vector<Range>& theRanges,
+              std::vector<std::uint16_t>& theIndexes);
+
+// index of the first range containing each value, element (i,j) at i*NY+j
+void classify(const NFmiDataMatrix<float>& theValues,
+              const std::vector<Range>& theRanges,
+              std::vector<std::uint16_t>& theIndexes);
+
+}  // namespace RangeTools
+
+#endif  // RANGETOOLS_H
+
+// ======================================================================
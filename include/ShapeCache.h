@@ -0,0 +1,58 @@
+// ======================================================================
+/*!
+ * \file
+ * \brief Interface of class ShapeCache
+ */
+// ======================================================================
+/*!
+ * \class ShapeCache
+ * \brief Shapefiles projected onto the areas they are drawn on
+ *
+ * Overlay scripts draw the same coastlines and borders for every
+ * background size. The cache keeps each shapefile projected onto
+ * each area it has been drawn on, so that the file is read and
+ * projected only once per area. The shapes of a file are discarded
+ * once the modification time or the size of the file changes.
+ *
+ * The shapes are projected in place once read, hence a shape read for
+ * one area cannot be projected again onto another one. Instead each
+ * new area reads the file anew.
+ */
+// ======================================================================
+
+#ifndef SHAPECACHE_H
+#define SHAPECACHE_H
+
+#include <imagine2/NFmiGeoShape.h>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+class NFmiArea;
+
+class ShapeCache
+{
+ public:
+  std::shared_ptr<const Imagine::NFmiGeoShape> find(const std::string& theFile,
+                                                    const NFmiArea& theArea);
+  void clear();
+
+ private:
+  static std::string identity(const std::string& theFile);
+
+  struct Entry
+  {
+    std::string identity;  // file modification time and size
+    std::map<std::string, std::shared_ptr<const Imagine::NFmiGeoShape> > shapes;  // by area
+  };
+
+  typedef std::map<std::string, Entry> storage_type;
+  storage_type itsCache;
+  mutable std::mutex itsMutex;
+
+};  // class ShapeCache
+
+#endif  // SHAPECACHE_H
+
+// ======================================================================
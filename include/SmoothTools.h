@@ -0,0 +1,30 @@
+// ======================================================================
+/*!
+ * \file
+ * \brief Interface of namespace SmoothTools
+ */
+// ======================================================================
+
+#ifndef SMOOTHTOOLS_H
+#define SMOOTHTOOLS_H
+
+#include <gis/CoordinateMatrix.h>
+#include <newbase/NFmiDataMatrix.h>
+#include <memory>
+#include <string>
+
+namespace SmoothTools
+{
+// NFmiSmoother split into row blocks processed in parallel
+NFmiDataMatrix<float> smoothen(const std::string& theSmoother,
+                               int theFactor,
+                               float theRadius,
+                               const std::shared_ptr<Fmi::CoordinateMatrix>& thePoints,
+                               const NFmiDataMatrix<float>& theValues,
+                               unsigned int theThreads = 1);
+
+}  // namespace SmoothTools
+
+#endif  // SMOOTHTOOLS_H
+
+// ======================================================================
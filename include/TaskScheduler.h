@@ -0,0 +1,60 @@
+// ======================================================================
+/*!
+ * \file
+ * \brief Interface of namespace TaskScheduler
+ */
+// ======================================================================
+/*!
+ * \namespace TaskScheduler
+ * \brief The threads shared by all parallel work
+ *
+ * The time steps, the contour bands and stripes, the smoothers, the
+ * despeckling, the meta functions and the image writers all run their
+ * tasks on one pool of worker threads. Each worker has a deque of its
+ * own: new tasks are pushed to the deque of the submitting worker,
+ * which takes its newest tasks first, while idle workers steal the
+ * oldest tasks of the others. Nested parallel work is hence balanced
+ * over all the workers without the levels oversubscribing the cores,
+ * and no threads are started when rendering small products.
+ *
+ * run() is a fork-join loop: the calling thread runs the tasks too,
+ * and the tasks not yet started by others when the caller runs out
+ * of work are simply dropped. The caller never waits for queued
+ * tasks, which might else be stuck behind long running ones, and
+ * never runs unrelated tasks while waiting, so blocking inside the
+ * tasks cannot deadlock.
+ *
+ * The pool is started when first needed. It must not be resized or
+ * stopped while tasks are running.
+ */
+// ======================================================================
+
+#ifndef TASKSCHEDULER_H
+#define TASKSCHEDULER_H
+
+#include <cstddef>
+#include <functional>
+
+namespace TaskScheduler
+{
+// The total number of threads, including the calling thread
+void threads(unsigned int theThreads);
+unsigned int threads();
+
+// Join the workers, for example before forking
+void stop();
+
+// Call the task for indices 0...theCount-1 using at most the given
+// number of threads, and rethrow the first exception thrown
+void run(std::size_t theCount,
+         std::size_t theMaxThreads,
+         const std::function<void(std::size_t)>& theTask);
+
+// Execute the task in the background, it must not throw
+void submit(std::function<void()> theTask);
+
+}  // namespace TaskScheduler
+
+#endif  // TASKSCHEDULER_H
+
+// ======================================================================
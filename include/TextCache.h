@@ -0,0 +1,83 @@
+// ======================================================================
+/*!
+ * \file
+ * \brief Interface of class TextCache
+ */
+// ======================================================================
+/*!
+ * \class TextCache
+ * \brief Rendered texts of labels and contour symbols
+ *
+ * The same label texts, such as "-5", "0" and "5", are drawn thousands
+ * of times per run. The cache renders each distinct text once per
+ * face, colour and alignment into a small transparent bitmap, and
+ * records the offset of the bitmap from the anchor point. Drawing the
+ * text again merely composites the bitmap onto the image with the
+ * desired blending rule.
+ *
+ * Rendering is done without holding the lock, hence several threads
+ * may draw texts simultaneously.
+ */
+// ======================================================================
+
+#ifndef TEXTCACHE_H
+#define TEXTCACHE_H
+
+#include "NFmiColorTools.h"
+#include "NFmiImage.h"
+#include <cstddef>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+class TextCache
+{
+ public:
+  // The face and its optional background box
+  struct Style
+  {
+    std::string font;  // name:widthxheight
+    bool background = false;
+    Imagine::NFmiColorTools::Color backgroundcolor = Imagine::NFmiColorTools::Black;
+    int xmargin = 0;
+    int ymargin = 0;
+  };
+
+  void draw(Imagine::NFmiImage& theImage,
+            const Style& theStyle,
+            int theX,
+            int theY,
+            const std::string& theText,
+            Imagine::NFmiAlignment theAlignment,
+            Imagine::NFmiColorTools::Color theColor,
+            Imagine::NFmiColorTools::NFmiBlendRule theRule =
+                Imagine::NFmiColorTools::kFmiColorOver);
+
+  void clear();
+  std::size_t size() const;
+
+ private:
+  struct Entry
+  {
+    Imagine::NFmiImage bitmap;
+    int dx = 0;  // offset of the bitmap from the anchor
+    int dy = 0;
+    bool empty = false;   // nothing visible to draw
+    bool direct = false;  // too large for the bitmap, draw with the face
+  };
+
+  std::shared_ptr<const Entry> render(const Style& theStyle,
+                                      const std::string& theText,
+                                      Imagine::NFmiAlignment theAlignment,
+                                      Imagine::NFmiColorTools::Color theColor) const;
+
+  typedef std::map<std::string, std::shared_ptr<const Entry> > storage_type;
+  storage_type itsCache;
+  mutable std::mutex itsMutex;
+
+};  // class TextCache
+
+#endif  // TEXTCACHE_H
+
+// ======================================================================
@@ -24,6 +24,11 @@ class UnitsConverter
 
   float convert(FmiParameterName theParam, float theValue) const;
   void convert(FmiParameterName theParam, NFmiDataMatrix<float>& theValue) const;
+  void convert(FmiParameterName theParam,
+               NFmiDataMatrix<float>& theValues,
+               bool theReplaceFlag,
+               float theSourceValue,
+               float theTargetValue) const;
 
  private:
   typedef std::vector<int> storage_type;
@@ -10,11 +10,18 @@
 #include "ContourSpec.h"
 #include "ExtremaLocator.h"
 #include "Globals.h"
+#include "GeoJsonWriter.h"
 #include "GramTools.h"
 #include "LazyCoordinates.h"
 #include "LazyQueryData.h"
 #include "MeridianTools.h"
 #include "MetaFunctions.h"
+#include "NoiseTools.h"
+#include "Profiler.h"
+#include "QueryDataPool.h"
+#include "RangeTools.h"
+#include "SmoothTools.h"
+#include "TaskScheduler.h"
 #include "TimeTools.h"
 
 #ifdef IMAGINE_WITH_CAIRO
@@ -27,6 +34,7 @@ typedef ImagineXr ImagineXr_or_NFmiImage;
 typedef Imagine::NFmiImage ImagineXr_or_NFmiImage;
 #endif
 
+#include <boost/functional/hash.hpp>
 #include <boost/lexical_cast.hpp>
 #include <memory>
 #include <gis/CoordinateMatrix.h>
@@ -45,15 +53,37 @@ typedef Imagine::NFmiImage ImagineXr_or_NFmiImage;
 #include <newbase/NFmiLevel.h>
 #include <newbase/NFmiPreProcessor.h>
 #include <newbase/NFmiSettings.h>  // Configuration
-#include <newbase/NFmiSmoother.h>  // for smoothing data
 #include <newbase/NFmiStringTools.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <exception>
 #include <fstream>
+#include <functional>
 #include <iomanip>
+#include <limits>
 #include <list>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <set>
 #include <sstream>
 #include <stdexcept>
 #include <string>
+#include <thread>
+#include <tuple>
+#include <vector>
 
 using namespace std;
 using namespace boost;
@@ -91,8 +121,14 @@ void Usage(void)
        << "   -h\tDisplay this help information" << endl
        << "   -v\tVerbose mode" << endl
        << "   -f\tForce overwriting old images" << endl
+       << "   -j [threads]\tRender time steps in parallel using the given number of threads"
+       << endl
        << "   -q [querydata]\tSpecify querydata to be rendered" << endl
        << "   -c \"config line\"\tPrecede with config line (i.e. \"format pdf\")" << endl
+       << "   -S [socket]\tServe scripts from the given UNIX socket, or - for stdin" << endl
+       << "   -p [file]\tWrite a profile of the rendering phases as JSON lines" << endl
+       << "   -s [i/n]\tRender only slice i of n of the images" << endl
+       << "   -J [file]\tRender only images not yet claimed in the given job file" << endl
        << endl;
 }
 
@@ -135,6 +171,57 @@ bool IsMasked(const NFmiPoint &thePoint, const std::string &theMask)
   return (alpha != NFmiColorTools::Transparent);
 }
 
+// ----------------------------------------------------------------------
+/*!
+ * \brief Set the number of rendering threads
+ *
+ * Zero means the number of available cores.
+ */
+// ----------------------------------------------------------------------
+
+void set_threads(int theThreads)
+{
+  if (theThreads < 0)
+    throw runtime_error("threads cannot be negative");
+
+  if (theThreads == 0)
+    globals.threads = std::max(1u, std::thread::hardware_concurrency());
+  else
+    globals.threads = static_cast<unsigned int>(theThreads);
+
+  TaskScheduler::threads(globals.threads);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Set the slice of the images rendered by this process
+ *
+ * The slice is given as i/n with 0 <= i < n, or as "none".
+ */
+// ----------------------------------------------------------------------
+
+void set_shard(const string &theShard)
+{
+  if (theShard == "none")
+  {
+    globals.shards = 0;
+    return;
+  }
+
+  const string::size_type pos = theShard.find('/');
+  if (pos == string::npos)
+    throw runtime_error("Shard must be of the form i/n: '" + theShard + "'");
+
+  const int shard = NFmiStringTools::Convert<int>(theShard.substr(0, pos));
+  const int shards = NFmiStringTools::Convert<int>(theShard.substr(pos + 1));
+
+  if (shards < 1 || shard < 0 || shard >= shards)
+    throw runtime_error("Shard must be of the form i/n with 0 <= i < n: '" + theShard + "'");
+
+  globals.shard = static_cast<unsigned int>(shard);
+  globals.shards = static_cast<unsigned int>(shards);
+}
+
 // ----------------------------------------------------------------------
 /*!
  * \brief Parse the command line options
@@ -143,7 +230,7 @@ bool IsMasked(const NFmiPoint &thePoint, const std::string &theMask)
 
 void parse_command_line(int argc, const char *argv[])
 {
-  NFmiCmdLine cmdline(argc, argv, "hvfq!c!");
+  NFmiCmdLine cmdline(argc, argv, "hvfj!q!c!S!p!s!J!");
 
   // Check for parsing errors
 
@@ -168,6 +255,11 @@ void parse_command_line(int argc, const char *argv[])
   if (cmdline.isOption('f'))
     globals.force = true;
 
+  // Read -j option
+
+  if (cmdline.isOption('j'))
+    set_threads(NFmiStringTools::Convert<int>(cmdline.OptionValue('j')));
+
   if (cmdline.isOption('q'))
     globals.cmdline_querydata = cmdline.OptionValue('q');
 
@@ -177,9 +269,27 @@ void parse_command_line(int argc, const char *argv[])
   if (cmdline.isOption('c'))
     globals.cmdline_conf = cmdline.OptionValue('c');
 
+  // Read -S option
+
+  if (cmdline.isOption('S'))
+    globals.cmdline_serve = cmdline.OptionValue('S');
+
+  // Read -p option
+
+  if (cmdline.isOption('p'))
+    Profiler::open(cmdline.OptionValue('p'));
+
+  // Read -s and -J options
+
+  if (cmdline.isOption('s'))
+    set_shard(cmdline.OptionValue('s'));
+
+  if (cmdline.isOption('J'))
+    globals.jobfile = cmdline.OptionValue('J');
+
   // Read command filenames
 
-  if (cmdline.NumberofParameters() == 0)
+  if (cmdline.NumberofParameters() == 0 && globals.cmdline_serve.empty())
     throw runtime_error("Atleast one command line parameter is required");
 
   for (int i = 1; i <= cmdline.NumberofParameters(); i++)
@@ -358,15 +468,21 @@ void report_extrema(const string &theParam, float theMin, float theMax)
 // ----------------------------------------------------------------------
 /*!
  * \brief Write image to file with desired format
+ *
+ * Unless image caching is on, the images used in rendering are
+ * released unless the caller requests otherwise.
  */
 // ----------------------------------------------------------------------
 
 #ifdef IMAGINE_WITH_CAIRO
-static void write_image(const ImagineXr &xr)
+static void write_image(const ImagineXr &xr, bool theReleaseImages = true)
 {
   const string filename = xr.Filename();
   const string format = xr.Format();
 
+  Profiler::Record record("write", "", filename);
+  Profiler::Phase phase("write");
+
   if (globals.verbose)
     cout << "Writing '" << filename << "'" << endl;
 
@@ -407,12 +523,18 @@ static void write_image(const ImagineXr &xr)
     img.Write(filename, format);
   }
 
-  if (!globals.itsImageCacheOn)
-    globals.itsImageCache.clear();
+  if (theReleaseImages)
+    globals.releaseImages();
 }
 #else
-static void write_image(NFmiImage &theImage, const string &theName, const string &theFormat)
+static void write_image(NFmiImage &theImage,
+                        const string &theName,
+                        const string &theFormat,
+                        bool theReleaseImages = true)
 {
+  Profiler::Record record("write", "", theName);
+  Profiler::Phase phase("write");
+
   if (globals.verbose)
     cout << "Writing '" << theName << "'" << endl;
 
@@ -421,8 +543,8 @@ static void write_image(NFmiImage &theImage, const string &theName, const string
 
   theImage.Write(theName, theFormat);
 
-  if (!globals.itsImageCacheOn)
-    globals.itsImageCache.clear();
+  if (theReleaseImages)
+    globals.releaseImages();
 }
 #endif
 
@@ -441,6 +563,61 @@ Imagine::NFmiFace make_face(const string &theSpec)
 {
   return NFmiFace(theSpec);
 }
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief A face which draws from the text cache when it is enabled
+ *
+ * The FreeType face is created only if the text cache is disabled.
+ */
+// ----------------------------------------------------------------------
+
+class LabelFace
+{
+ public:
+  explicit LabelFace(const string &theSpec) { itsStyle.font = theSpec; }
+
+  LabelFace(const string &theSpec, NFmiColorTools::Color theColor, int theXMargin, int theYMargin)
+  {
+    itsStyle.font = theSpec;
+    itsStyle.background = true;
+    itsStyle.backgroundcolor = theColor;
+    itsStyle.xmargin = theXMargin;
+    itsStyle.ymargin = theYMargin;
+  }
+
+  void Draw(NFmiImage &theImage,
+            int theX,
+            int theY,
+            const string &theText,
+            NFmiAlignment theAlignment,
+            NFmiColorTools::Color theColor,
+            NFmiColorTools::NFmiBlendRule theRule = NFmiColorTools::kFmiColorOver)
+  {
+    if (globals.itsTextCacheOn)
+    {
+      globals.itsTextCache.draw(
+          theImage, itsStyle, theX, theY, theText, theAlignment, theColor, theRule);
+      return;
+    }
+
+    if (!itsFace)
+    {
+      itsFace.reset(new NFmiFace(make_face(itsStyle.font)));
+      itsFace->Background(itsStyle.background);
+      if (itsStyle.background)
+      {
+        itsFace->BackgroundColor(itsStyle.backgroundcolor);
+        itsFace->BackgroundMargin(itsStyle.xmargin, itsStyle.ymargin);
+      }
+    }
+    itsFace->Draw(theImage, theX, theY, theText, theAlignment, theColor, theRule);
+  }
+
+ private:
+  TextCache::Style itsStyle;
+  std::unique_ptr<NFmiFace> itsFace;
+};
 #endif
 
 // ----------------------------------------------------------------------
@@ -461,16 +638,50 @@ void do_comment(istream &theInput)
 // ----------------------------------------------------------------------
 /*!
  * \brief Handle the "cache" command
+ *
+ * Either "cache 0|1", "cache maxbytes N" or "cache directory path"
  */
 // ----------------------------------------------------------------------
 
 void do_cache(istream &theInput)
 {
-  int flag;
-  theInput >> flag;
+  string option;
+  theInput >> option;
 
   check_errors(theInput, "cache");
 
+  if (option == "maxbytes")
+  {
+    long maxbytes;
+    theInput >> maxbytes;
+
+    check_errors(theInput, "cache maxbytes");
+
+    if (maxbytes < 0)
+      throw runtime_error("cache maxbytes must be nonnegative");
+
+    globals.calculator.cacheMaxBytes(maxbytes);
+    globals.maskcalculator.cacheMaxBytes(maxbytes);
+    return;
+  }
+
+  if (option == "directory")
+  {
+    string directory;
+    theInput >> directory;
+
+    check_errors(theInput, "cache directory");
+
+    if (directory == "none")
+      directory.clear();
+
+    globals.calculator.cacheDirectory(directory);
+    globals.maskcalculator.cacheDirectory(directory);
+    return;
+  }
+
+  int flag = NFmiStringTools::Convert<int>(option);
+
   globals.calculator.cache(flag != 0);
   globals.maskcalculator.cache(flag != 0);
 }
@@ -478,21 +689,176 @@ void do_cache(istream &theInput)
 // ----------------------------------------------------------------------
 /*!
  * \brief Handle the "imagecache" command
+ *
+ * Either "imagecache 0|1" or "imagecache maxbytes N"
  */
 // ----------------------------------------------------------------------
 
 void do_imagecache(istream &theInput)
 {
-  int flag;
-  theInput >> flag;
+  string option;
+  theInput >> option;
 
   check_errors(theInput, "imagecache");
 
+  if (option == "maxbytes")
+  {
+    long maxbytes;
+    theInput >> maxbytes;
+
+    check_errors(theInput, "imagecache maxbytes");
+
+    if (maxbytes < 0)
+      throw runtime_error("imagecache maxbytes must be nonnegative");
+
+    globals.itsImageCache.maxbytes(maxbytes);
+    return;
+  }
+
 #ifdef USE_IMAGECACHE
-  globals.itsImageCacheOn = (flag != 0);
+  globals.itsImageCacheOn = (NFmiStringTools::Convert<int>(option) != 0);
 #endif
 }
 
+// ----------------------------------------------------------------------
+/*!
+ * \brief Handle the "textcache" command
+ */
+// ----------------------------------------------------------------------
+
+void do_textcache(istream &theInput)
+{
+  int flag;
+  theInput >> flag;
+
+  check_errors(theInput, "textcache");
+
+  globals.itsTextCacheOn = (flag != 0);
+  if (!globals.itsTextCacheOn)
+    globals.itsTextCache.clear();
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Handle the "threads" command
+ */
+// ----------------------------------------------------------------------
+
+void do_threads(istream &theInput)
+{
+  int threads;
+  theInput >> threads;
+
+  check_errors(theInput, "threads");
+
+  set_threads(threads);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Handle the "shard" command
+ */
+// ----------------------------------------------------------------------
+
+void do_shard(istream &theInput)
+{
+  string shard;
+  theInput >> shard;
+
+  check_errors(theInput, "shard");
+
+  set_shard(shard);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Handle the "scriptjobs" command
+ */
+// ----------------------------------------------------------------------
+
+void do_scriptjobs(istream &theInput)
+{
+  int jobs;
+  theInput >> jobs;
+
+  check_errors(theInput, "scriptjobs");
+
+  if (jobs < 1)
+    throw runtime_error("scriptjobs must be positive");
+
+  globals.scriptjobs = static_cast<unsigned int>(jobs);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Handle the "follow" command
+ */
+// ----------------------------------------------------------------------
+
+void do_follow(istream &theInput)
+{
+  string option;
+  theInput >> option;
+
+  check_errors(theInput, "follow");
+
+  if (option == "none")
+  {
+    globals.followinterval = 0;
+    globals.followtimeout = 0;
+    return;
+  }
+
+  int interval = NFmiStringTools::Convert<int>(option);
+  int timeout;
+  theInput >> timeout;
+
+  check_errors(theInput, "follow");
+
+  if (interval <= 0)
+    throw runtime_error("follow interval must be positive");
+  if (timeout < 0)
+    throw runtime_error("follow timeout must be nonnegative");
+
+  globals.followinterval = interval;
+  globals.followtimeout = timeout;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Handle the "jobfile" command
+ */
+// ----------------------------------------------------------------------
+
+void do_jobfile(istream &theInput)
+{
+  string file;
+  theInput >> file;
+
+  check_errors(theInput, "jobfile");
+
+  globals.jobfile = (file == "none" ? string() : file);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Handle the "writers" command
+ */
+// ----------------------------------------------------------------------
+
+void do_writers(istream &theInput)
+{
+  int writers;
+  theInput >> writers;
+
+  check_errors(theInput, "writers");
+
+  if (writers < 0)
+    throw runtime_error("writers must be nonnegative");
+
+  globals.writers = writers;
+}
+
 // ----------------------------------------------------------------------
 /*!
  * \brief Handle the "querydata" command
@@ -506,32 +872,76 @@ void do_querydata(istream &theInput)
 
   check_errors(theInput, "querydata");
 
-  if (globals.queryfilelist != newnames)
+  // Split the comma separated list into a real list
+
+  vector<string> qnames = NFmiStringTools::Split(newnames);
+
+  // Identify the files by their modification times and sizes so
+  // that changed files are read again even if the names are the same
+
+  vector<string> filenames;
+  string stamp;
+  for (const string &name : qnames)
   {
-    globals.queryfilelist = newnames;
+    string filename = NFmiFileSystem::FileComplete(name, globals.datapath);
+    stamp += QueryDataPool::identity(filename) + '\n';
+    filenames.push_back(filename);
+  }
 
-    // Delete possible old infos
+  if (globals.queryfilelist == newnames && globals.queryfilestamp == stamp)
+    return;
 
-    globals.querystreams.clear();
+  // Files read earlier are taken from the pool, new ones are read in parallel
 
-    // Split the comma separated list into a real list
+  globals.querystreams = globals.itsQueryDataPool.get(filenames);
+  globals.queryfilenames = filenames;
+  globals.queryfilelist = newnames;
+  globals.queryfilestamp = stamp;
+}
 
-    vector<string> qnames = NFmiStringTools::Split(globals.queryfilelist);
+// ----------------------------------------------------------------------
+/*!
+ * \brief Handle the "manifest" command
+ */
+// ----------------------------------------------------------------------
 
-    // Read the queryfiles
+void do_manifest(istream &theInput)
+{
+  int flag;
+  theInput >> flag;
 
-    {
-      vector<string>::const_iterator iter;
-      for (iter = qnames.begin(); iter != qnames.end(); ++iter)
-      {
-        std::shared_ptr<LazyQueryData> tmp(new LazyQueryData());
-        string filename = NFmiFileSystem::FileComplete(*iter, globals.datapath);
-        globals.queryfilenames.push_back(filename);
-        tmp->Read(filename);
-        globals.querystreams.push_back(tmp);
-      }
-    }
-  }
+  check_errors(theInput, "manifest");
+
+  globals.manifest = (flag != 0);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Handle the "querydatapool" command
+ *
+ * Currently only "querydatapool maxbytes N"
+ */
+// ----------------------------------------------------------------------
+
+void do_querydatapool(istream &theInput)
+{
+  string option;
+  theInput >> option;
+
+  check_errors(theInput, "querydatapool");
+
+  if (option != "maxbytes")
+    throw runtime_error("Unknown querydatapool option '" + option + "'");
+
+  long maxbytes;
+  theInput >> maxbytes;
+
+  check_errors(theInput, "querydatapool maxbytes");
+
+  if (maxbytes < 0)
+    throw runtime_error("querydatapool maxbytes must be nonnegative");
+
+  globals.itsQueryDataPool.maxbytes(maxbytes);
 }
 
 // ----------------------------------------------------------------------
@@ -860,6 +1270,38 @@ void do_fillrule(istream &theInput)
     globals.shapespecs.back().fillrule(globals.fillrule);
 }
 
+// ----------------------------------------------------------------------
+/*!
+ * \brief Handle "contourfillmode" command
+ */
+// ----------------------------------------------------------------------
+
+void do_contourfillmode(istream &theInput)
+{
+  theInput >> globals.contourfillmode;
+
+  check_errors(theInput, "contourfillmode");
+
+  if (globals.contourfillmode != "vector" && globals.contourfillmode != "raster")
+    throw runtime_error("Unknown contourfillmode '" + globals.contourfillmode + "'");
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Handle "contourengine" command
+ */
+// ----------------------------------------------------------------------
+
+void do_contourengine(istream &theInput)
+{
+  theInput >> globals.contourengine;
+
+  check_errors(theInput, "contourengine");
+
+  if (globals.contourengine != "tron" && globals.contourengine != "isobands")
+    throw runtime_error("Unknown contourengine '" + globals.contourengine + "'");
+}
+
 // ----------------------------------------------------------------------
 /*!
  * \brief Handle "strokerule" command
@@ -1369,6 +1811,34 @@ void do_savepath(istream &theInput)
     NFmiFileSystem::CreateDirectory(globals.savepath);
 }
 
+// ----------------------------------------------------------------------
+/*!
+ * \brief Handle "target" command
+ *
+ * Syntax: target <projection> <background|none> <savepath>
+ */
+// ----------------------------------------------------------------------
+
+void do_target(istream &theInput)
+{
+  using NFmiFileSystem::FileComplete;
+
+  RenderTarget target;
+  theInput >> target.projection >> target.background >> target.savepath;
+
+  check_errors(theInput, "target");
+
+  if (target.background == "none")
+    target.background = "";
+  else
+    target.background = FileComplete(target.background, globals.mapspath);
+
+  if (!NFmiFileSystem::DirectoryExists(target.savepath))
+    NFmiFileSystem::CreateDirectory(target.savepath);
+
+  globals.targets.push_back(target);
+}
+
 // ----------------------------------------------------------------------
 /*!
  * \brief Handle "prefix" command
@@ -2381,24 +2851,63 @@ void do_pressuremindistdifferent(istream &theInput)
 
 // ----------------------------------------------------------------------
 /*!
- * \brief Handle "labelmarker" command
+ * \brief Handle "labelcoherence" command
  */
 // ----------------------------------------------------------------------
 
-void do_labelmarker(istream &theInput)
+void do_labelcoherence(istream &theInput)
 {
-  string filename, rule;
-  float alpha;
+  float tolerance;
+  theInput >> tolerance;
+  check_errors(theInput, "labelcoherence");
 
-  theInput >> filename >> rule >> alpha;
+  if (tolerance < 0)
+    throw runtime_error("labelcoherence must be nonnegative");
 
-  check_errors(theInput, "labelmarker");
+  globals.labellocator.coherence(tolerance);
+  globals.symbollocator.coherence(tolerance);
+  globals.imagelocator.coherence(tolerance);
+  globals.pressurelocator.coherence(tolerance);
+}
 
-  if (!globals.specs.empty())
-  {
-    globals.specs.back().labelMarker(filename);
-    globals.specs.back().labelMarkerRule(rule);
-    globals.specs.back().labelMarkerAlphaFactor(alpha);
+// ----------------------------------------------------------------------
+/*!
+ * \brief Handle "pressureradius" command
+ */
+// ----------------------------------------------------------------------
+
+void do_pressureradius(istream &theInput)
+{
+  float radius;
+  theInput >> radius;
+  check_errors(theInput, "pressureradius");
+
+  if (radius < 0)
+    throw runtime_error("pressureradius must be nonnegative");
+
+  globals.pressureradius = radius;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Handle "labelmarker" command
+ */
+// ----------------------------------------------------------------------
+
+void do_labelmarker(istream &theInput)
+{
+  string filename, rule;
+  float alpha;
+
+  theInput >> filename >> rule >> alpha;
+
+  check_errors(theInput, "labelmarker");
+
+  if (!globals.specs.empty())
+  {
+    globals.specs.back().labelMarker(filename);
+    globals.specs.back().labelMarkerRule(rule);
+    globals.specs.back().labelMarkerAlphaFactor(alpha);
   }
 }
 
@@ -2693,6 +3202,42 @@ void do_units(istream &theInput)
   if (param == kFmiBadParameter)
     throw runtime_error("Unknown parametername '" + paramname + "'");
   globals.unitsconverter.setConversion(param, conversion);
+  MetaFunctions::units(globals.unitsconverter);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Handle "metaparam" command
+ *
+ * Syntax: metaparam name = expression
+ *
+ * The expression extends to the end of the line or to a comment.
+ */
+// ----------------------------------------------------------------------
+
+void do_metaparam(istream &theInput)
+{
+  string line;
+  getline(theInput, line);
+
+  check_errors(theInput, "metaparam");
+
+  const string::size_type comment = line.find('#');
+  if (comment != string::npos)
+    line.erase(comment);
+
+  const string::size_type pos = line.find('=');
+  if (pos == string::npos || line.compare(pos, 2, "==") == 0)
+    throw runtime_error("metaparam requires the syntax 'metaparam name = expression'");
+
+  string name;
+  istringstream namestream(line.substr(0, pos));
+  string extra;
+  namestream >> name >> extra;
+  if (!extra.empty())
+    throw runtime_error("metaparam name must be a single word");
+
+  MetaFunctions::define(name, line.substr(pos + 1));
 }
 
 // ----------------------------------------------------------------------
@@ -2731,6 +3276,10 @@ void do_clear(istream &theInput)
     globals.itsImageCache.clear();
 #endif
   }
+  else if (command == "textcache")
+    globals.itsTextCache.clear();
+  else if (command == "shapecache")
+    globals.itsShapeCache.clear();
   else if (command == "arrows")
   {
     globals.arrowpoints.clear();
@@ -2757,9 +3306,16 @@ void do_clear(istream &theInput)
     globals.lowpressureimage.clear();
   }
   else if (command == "units")
+  {
     globals.unitsconverter.clear();
+    MetaFunctions::units(globals.unitsconverter);
+  }
   else if (command == "graticule")
     globals.graticulecolor = "";
+  else if (command == "targets")
+    globals.targets.clear();
+  else if (command == "metaparams")
+    MetaFunctions::clear();
   else
     throw runtime_error("Unknown clear target: " + command);
 }
@@ -2804,8 +3360,7 @@ void do_draw_shapes(istream &theInput)
 
   for (iter = begin; iter != end; ++iter)
   {
-    NFmiGeoShape geo(iter->filename(), kFmiGeoShapeEsri);
-    geo.ProjectXY(*area);
+    const NFmiGeoShape &geo = *globals.itsShapeCache.find(iter->filename(), *area);
 
     if (iter->marker() == "")
     {
@@ -2864,24 +3419,31 @@ void do_draw_imagemap(istream &theInput)
 
   for (iter = begin; iter != end; ++iter)
   {
-    NFmiGeoShape geo(iter->filename(), kFmiGeoShapeEsri);
-    geo.ProjectXY(*area);
-    geo.WriteImageMap(out, fieldname);
+    globals.itsShapeCache.find(iter->filename(), *area)->WriteImageMap(out, fieldname);
   }
   out.close();
 }
 
 // ----------------------------------------------------------------------
 /*!
- * \brief Draw graticule
+ * \brief Projected graticules by area and graticule settings
+ *
+ * The graticule is identical in all the time steps, only stroking it
+ * needs to be repeated for each image.
  */
 // ----------------------------------------------------------------------
 
-void draw_graticule(ImagineXr_or_NFmiImage &img, const NFmiArea &theArea)
-{
-  if (globals.graticulecolor.empty())
-    return;
+std::mutex graticule_mutex;
+std::map<std::string, std::shared_ptr<const NFmiPath>> graticule_cache;
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Build the graticule projected to the given area
+ */
+// ----------------------------------------------------------------------
 
+NFmiPath build_graticule(const NFmiArea &theArea)
+{
   NFmiPath path;
 
   for (double lon = globals.graticulelon1; lon <= globals.graticulelon2; lon += globals.graticuledx)
@@ -2903,8 +3465,43 @@ void draw_graticule(ImagineXr_or_NFmiImage &img, const NFmiArea &theArea)
   // MeridianTools::Relocate(path,theArea);
   path.Project(&theArea);
 
+  return path;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Draw graticule
+ */
+// ----------------------------------------------------------------------
+
+void draw_graticule(ImagineXr_or_NFmiImage &img, const NFmiArea &theArea)
+{
+  if (globals.graticulecolor.empty())
+    return;
+
+  ostringstream os;
+  os << std::setprecision(12) << globals.graticulelon1 << ' ' << globals.graticulelat1 << ' '
+     << globals.graticulelon2 << ' ' << globals.graticulelat2 << ' ' << globals.graticuledx << ' '
+     << globals.graticuledy << ' ' << theArea;
+  const std::string key = os.str();
+
+  std::shared_ptr<const NFmiPath> path;
+  {
+    std::lock_guard<std::mutex> lock(graticule_mutex);
+    auto it = graticule_cache.find(key);
+    if (it != graticule_cache.end())
+      path = it->second;
+  }
+
+  if (!path)
+  {
+    path = std::make_shared<const NFmiPath>(build_graticule(theArea));
+    std::lock_guard<std::mutex> lock(graticule_mutex);
+    graticule_cache.emplace(key, path);
+  }
+
   NFmiColorTools::Color color = ColorTools::checkcolor(globals.graticulecolor);
-  path.Stroke(img, color, NFmiColorTools::kFmiColorCopy);
+  path->Stroke(img, color, NFmiColorTools::kFmiColorCopy);
 }
 
 // ----------------------------------------------------------------------
@@ -2926,6 +3523,182 @@ int paramid(const string &theParam)
     return toparam(theParam);
 }
 
+// ----------------------------------------------------------------------
+/*!
+ * \brief A label locator candidate coordinate
+ */
+// ----------------------------------------------------------------------
+
+struct LabelCandidate
+{
+  int param;
+  float value;
+  int x;
+  int y;
+};
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief A pressure locator candidate coordinate
+ */
+// ----------------------------------------------------------------------
+
+struct PressureCandidate
+{
+  ExtremaLocator::Extremum type;
+  double x;
+  double y;
+};
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Return the time as a YYYYMMDDHHMM number
+ */
+// ----------------------------------------------------------------------
+
+long long time_key(const NFmiTime &theTime)
+{
+  return ((((theTime.GetYear() * 100LL + theTime.GetMonth()) * 100 + theTime.GetDay()) * 100 +
+           theTime.GetHour()) *
+              100 +
+          theTime.GetMin());
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Identity of a processed data slice used by the time filters
+ */
+// ----------------------------------------------------------------------
+
+struct FilterSliceKey
+{
+  std::string file;
+  unsigned long param;
+  float level;
+  long long time;  // YYYYMMDDHHMM
+  bool replace;
+  float replacesource;
+  float replacetarget;
+
+  bool operator<(const FilterSliceKey &theOther) const
+  {
+    return (std::tie(time, file, param, level, replace, replacesource, replacetarget) <
+            std::tie(theOther.time,
+                     theOther.file,
+                     theOther.param,
+                     theOther.level,
+                     theOther.replace,
+                     theOther.replacesource,
+                     theOther.replacetarget));
+  }
+};
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief The state needed to render a single image
+ *
+ * "draw contours" may render several time steps in parallel. Each
+ * rendering thread needs its own data iterators, contour calculator
+ * and contour specifications. The label candidates are saved instead
+ * of being fed directly to the label locators, since the locators
+ * must see the images in time order.
+ */
+// ----------------------------------------------------------------------
+
+struct RenderState
+{
+  // The resolved data source of a contour specification
+
+  struct SpecPlan
+  {
+    unsigned int stream = 0;  // index of the query stream
+    bool meta = false;        // meta parameters need no activation
+    FmiParameterName param = kFmiBadParameter;
+    unsigned long levelindex = 0;
+    ContourInterpolation interpolation = Missing;
+    std::string valuekey;  // identity of the processing settings
+  };
+
+  std::vector<std::shared_ptr<LazyQueryData> > querystreams;
+  std::shared_ptr<LazyQueryData> queryinfo;  // active data, does not own pointer
+  ContourCalculator calculator;
+  std::list<ContourSpec> specs;
+  bool labeldxdydone = false;  // label grid points extracted into specs
+  std::string projection;      // projection of the contours being rendered
+
+  // The area onto which the contours are projected, if not the image
+  // itself, and the position of the image within the area
+
+  const NFmiArea *contourarea = nullptr;
+  double contourx = 0;
+  double contoury = 0;
+  bool planned = false;        // specs resolved into the plan
+  std::vector<SpecPlan> plan;  // one entry for each spec
+  long lastframe = -1;         // last frame rendered with this state
+  unsigned int threads = 1;    // threads available within a frame
+
+  std::vector<LabelCandidate> labelcandidates;
+  std::vector<LabelCandidate> symbolcandidates;
+  std::vector<LabelCandidate> imagecandidates;
+  std::vector<PressureCandidate> pressurecandidates;
+
+  // The label points and candidates depend on the projection. When
+  // rendering several targets, the state of each target but the first
+  // is kept here and swapped in while the target is being rendered.
+
+  struct TargetState
+  {
+    std::list<ContourSpec> specs;
+    bool labeldxdydone = false;
+    std::vector<LabelCandidate> labelcandidates;
+    std::vector<LabelCandidate> symbolcandidates;
+    std::vector<LabelCandidate> imagecandidates;
+    std::vector<PressureCandidate> pressurecandidates;
+  };
+  std::vector<TargetState> targetstates;
+
+  // Processed values for each distinct set of processing settings.
+  // Specs with identical settings share the values of the current
+  // time step, and the buffers are reused for the next time step.
+
+  struct ProcessedValues
+  {
+    long long time = -1;
+    NFmiDataMatrix<float> values;
+  };
+  std::map<std::string, ProcessedValues> processedvalues;
+  std::string calculatorkey;  // the values currently set to the calculator
+
+  NFmiDataMatrix<float> filtervalues;
+
+  // Converted data slices for the min/max/mean/sum time filters, so
+  // that each slice is read only once when rendering consecutive times
+
+  std::map<FilterSliceKey, NFmiDataMatrix<float> > filterslices;
+
+  // The visible grid window of each projection and grid
+  std::map<std::string, std::array<std::size_t, 4> > gridwindows;
+
+  // Reduced resolution copies of the processed values for each
+  // window and reduction step
+  std::map<std::string, ProcessedValues> coarsevalues;
+
+  // Grid coordinates of the image pixels for raster fills, for
+  // each projection, grid and image placement. Pixels outside the
+  // grid have NaN coordinates.
+
+  struct PixelGrid
+  {
+    std::vector<float> x;
+    std::vector<float> y;
+  };
+  std::map<std::string, PixelGrid> pixelgrids;
+};
+
+// The state used by the current rendering thread
+
+thread_local RenderState *renderstate = nullptr;
+
 // ----------------------------------------------------------------------
 /*!
  * \brief Choose the queryinfo from the set of available datas
@@ -2934,12 +3707,12 @@ int paramid(const string &theParam)
 
 unsigned int choose_queryinfo(const string &theName, int theLevel)
 {
-  if (globals.querystreams.size() == 0)
+  if (renderstate->querystreams.size() == 0)
     throw runtime_error("No querydata has been specified");
 
   if (MetaFunctions::isMeta(theName))
   {
-    globals.queryinfo = globals.querystreams[0];
+    renderstate->queryinfo = renderstate->querystreams[0];
     return 0;
   }
   else
@@ -2948,13 +3721,13 @@ unsigned int choose_queryinfo(const string &theName, int theLevel)
 
     FmiParameterName param = toparam(theName);
 
-    for (unsigned int qi = 0; qi < globals.querystreams.size(); qi++)
+    for (unsigned int qi = 0; qi < renderstate->querystreams.size(); qi++)
     {
-      globals.queryinfo = globals.querystreams[qi];
-      globals.queryinfo->Param(param);
-      if (globals.queryinfo->IsParamUsable())
+      renderstate->queryinfo = renderstate->querystreams[qi];
+      renderstate->queryinfo->Param(param);
+      if (renderstate->queryinfo->IsParamUsable())
       {
-        if (set_level(*globals.queryinfo, theLevel))
+        if (set_level(*renderstate->queryinfo, theLevel))
           return qi;
       }
     }
@@ -2969,158 +3742,607 @@ unsigned int choose_queryinfo(const string &theName, int theLevel)
 
 // ----------------------------------------------------------------------
 /*!
- * \brief Expand the data values
+ * \brief Resolve the contour specifications of the current state
  *
- * First we try to calculate the mean from adjacent values.
- * If that fails, we try to calculate the mean from diagonal values.
+ * The query streams, parameters, levels and interpolation methods
+ * do not change during "draw contours", hence they are resolved
+ * only once when the first image is rendered.
  */
 // ----------------------------------------------------------------------
 
-void expand_data(NFmiDataMatrix<float> &theValues)
+void plan_specs()
 {
-  NFmiDataModifierAvg calculator;
-
-  NFmiDataMatrix<float> tmp(theValues);
+  RenderState &state = *renderstate;
 
-  for (unsigned int j = 0; j < theValues.NY(); j++)
-    for (unsigned int i = 0; i < theValues.NX(); i++)
+  state.plan.clear();
+  for (const ContourSpec &spec : state.specs)
+  {
+    RenderState::SpecPlan entry;
+    entry.stream = choose_queryinfo(spec.param(), spec.level());
+    entry.meta = MetaFunctions::isMeta(spec.param());
+    if (!entry.meta)
     {
-      if (theValues[i][j] == kFloatMissing)
-      {
-        calculator.Clear();
-        calculator.Calculate(tmp.At(i - 1, j, kFloatMissing));
-        calculator.Calculate(tmp.At(i + 1, j, kFloatMissing));
-        calculator.Calculate(tmp.At(i, j - 1, kFloatMissing));
-        calculator.Calculate(tmp.At(i, j + 1, kFloatMissing));
-        if (calculator.CalculationResult() == kFloatMissing)
-        {
-          calculator.Calculate(tmp.At(i - 1, j - 1, kFloatMissing));
-          calculator.Calculate(tmp.At(i - 1, j + 1, kFloatMissing));
-          calculator.Calculate(tmp.At(i + 1, j - 1, kFloatMissing));
-          calculator.Calculate(tmp.At(i + 1, j + 1, kFloatMissing));
-        }
-        theValues[i][j] = calculator.CalculationResult();
-      }
+      entry.param = toparam(spec.param());
+      entry.levelindex = state.queryinfo->LevelIndex();
     }
+
+    const string &interpname = spec.contourInterpolation();
+    entry.interpolation = ContourInterpolationValue(interpname);
+    if (entry.interpolation == Missing)
+      throw runtime_error("Unknown contour interpolation method " + interpname);
+
+    entry.valuekey = NFmiStringTools::Convert(entry.stream) + ' ' + spec.processingKey();
+    state.plan.push_back(entry);
+  }
+  state.planned = true;
 }
 
 // ----------------------------------------------------------------------
 /*!
- * \brief Filter the data values
+ * \brief Activate the data of a resolved contour specification
  */
 // ----------------------------------------------------------------------
 
-void filter_values(NFmiDataMatrix<float> &theValues,
-                   const NFmiTime &theTime,
-                   const ContourSpec &theSpec)
+void activate_plan(const RenderState::SpecPlan &thePlan)
 {
-  if (globals.filter == "none")
+  renderstate->queryinfo = renderstate->querystreams[thePlan.stream];
+  if (!thePlan.meta)
   {
-    // The time is known to be exact
+    renderstate->queryinfo->Param(thePlan.param);
+    renderstate->queryinfo->LevelIndex(thePlan.levelindex);
   }
-  else if (globals.filter == "linear")
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Identity of a data slice read ahead of rendering
+ *
+ * Slices at the active time of the stream are identified by the time
+ * index, slices interpolated in time by the time itself.
+ */
+// ----------------------------------------------------------------------
+
+struct PrefetchKey
+{
+  unsigned int stream;
+  unsigned long param;
+  unsigned long levelindex;
+  bool interpolated;
+  long long time;  // time index or YYYYMMDDHHMM
+  bool replace;
+  float replacesource;
+  float replacetarget;
+
+  bool operator<(const PrefetchKey &theOther) const
   {
-    NFmiTime tnow = globals.queryinfo->ValidTime();
-    bool isexact = theTime.IsEqual(tnow);
+    return (std::tie(time,
+                     interpolated,
+                     stream,
+                     param,
+                     levelindex,
+                     replace,
+                     replacesource,
+                     replacetarget) <
+            std::tie(theOther.time,
+                     theOther.interpolated,
+                     theOther.stream,
+                     theOther.param,
+                     theOther.levelindex,
+                     theOther.replace,
+                     theOther.replacesource,
+                     theOther.replacetarget));
+  }
+};
 
-    if (!isexact)
-    {
-      NFmiDataMatrix<float> tmpvals;
-      NFmiTime t2 = globals.queryinfo->ValidTime();
-      globals.queryinfo->PreviousTime();
-      NFmiTime t1 = globals.queryinfo->ValidTime();
-      if (!MetaFunctions::isMeta(theSpec.param()))
-      {
-        tmpvals = globals.queryinfo->Values();
-        globals.unitsconverter.convert(FmiParameterName(globals.queryinfo->GetParamIdent()),
-                                       tmpvals);
-      }
-      else
-        tmpvals = MetaFunctions::values(theSpec.param(), *globals.queryinfo);
-      if (theSpec.replace())
-        tmpvals.Replace(theSpec.replaceSourceValue(), theSpec.replaceTargetValue());
+// ----------------------------------------------------------------------
+/*!
+ * \brief Read the data slices of upcoming time steps in the background
+ *
+ * Reading a slice from memory mapped querydata mostly waits for page
+ * faults. While one time step is being rendered, a background thread
+ * reads and converts the slices the next time steps will need: the
+ * slices of the parameters at the time of the step, and for the
+ * min/max/mean/sum filters the slices of the filter window. The
+ * thread uses its own iterators, hence the taken slices are exactly
+ * what rendering would have read itself.
+ *
+ * Each requested time step is a job. The slices of a job are kept
+ * until taken or until the time step has been rendered and the job
+ * released, hence the memory used is bounded by the number of time
+ * steps requested ahead.
+ */
+// ----------------------------------------------------------------------
 
-      // Data from t1,t2, we want t
+class Prefetcher
+{
+ public:
+  explicit Prefetcher(const RenderState &theState);
+  ~Prefetcher();
 
-      long offset = theTime.DifferenceInMinutes(t1);
-      long range = t2.DifferenceInMinutes(t1);
+  void request(const std::vector<unsigned long> &theTimeIndexes, const NFmiTime &theTime);
+  void release();
+  bool take(const PrefetchKey &theKey, NFmiDataMatrix<float> &theValues);
 
-      float weight = (static_cast<float>(offset)) / range;
+ private:
+  Prefetcher(const Prefetcher &theOther);
+  Prefetcher &operator=(const Prefetcher &theOther);
 
-      theValues.LinearCombination(tmpvals, weight, 1 - weight);
-    }
-  }
-  else
+  struct Request
   {
-    NFmiTime tprev = theTime;
-    tprev.ChangeByMinutes(-globals.timeinterval);
+    PrefetchKey key;
+    NFmiMetTime time;  // for interpolated slices
+  };
 
-    if (MetaFunctions::isMeta(theSpec.param()))
-      throw runtime_error("Unable to filter metafunctions - use newbase parameters only");
+  struct Slice
+  {
+    std::size_t job = 0;
+    bool ready = false;
+    bool ok = false;
+    NFmiDataMatrix<float> values;
+  };
 
-    NFmiMetTime tnow(theTime, 60);
-    NFmiDataMatrix<float> tmpvals;
-    int steps = 1;
-    for (;;)
-    {
-      tmpvals = globals.queryinfo->Values(tnow);
-      globals.unitsconverter.convert(FmiParameterName(globals.queryinfo->GetParamIdent()), tmpvals);
+  void run();
+  void load(const Request &theRequest, NFmiDataMatrix<float> &theValues);
 
-      if (theSpec.replace())
-        tmpvals.Replace(theSpec.replaceSourceValue(), theSpec.replaceTargetValue());
+  std::vector<PrefetchKey> itsSources;  // key templates of the planned specs
+  std::vector<std::shared_ptr<LazyQueryData> > itsStreams;
 
-      if (globals.filter == "min")
-        theValues.Min(tmpvals);
-      else if (globals.filter == "max")
-        theValues.Max(tmpvals);
-      else if (globals.filter == "mean")
-        theValues += tmpvals;
-      else if (globals.filter == "sum")
-        theValues += tmpvals;
+  std::mutex itsMutex;
+  std::condition_variable itsJobAvailable;
+  std::condition_variable itsSliceReady;
+  std::deque<std::vector<Request> > itsJobs;
+  std::map<PrefetchKey, Slice> itsSlices;
+  std::set<PrefetchKey> itsRequested;  // slices requested so far
+  std::size_t itsJobCount = 0;         // jobs requested so far
+  std::size_t itsReleased = 0;         // jobs released so far
+  bool itsDone = false;
+  std::thread itsThread;
+};
 
-      ++steps;
-      --tnow;
+// The active prefetcher during "draw contours", if any
+Prefetcher *prefetcher = nullptr;
 
-      if (tnow.IsLessThan(tprev))
-        break;
-    }
+// Activates a prefetcher for the lifetime of the object
+struct PrefetcherScope
+{
+  explicit PrefetcherScope(Prefetcher *thePrefetcher) { prefetcher = thePrefetcher; }
+  ~PrefetcherScope() { prefetcher = nullptr; }
+};
 
-    if (globals.filter == "mean")
-      theValues /= static_cast<float>(steps);
+// ----------------------------------------------------------------------
+/*!
+ * \brief Start prefetching the data of the planned specs
+ */
+// ----------------------------------------------------------------------
+
+Prefetcher::Prefetcher(const RenderState &theState)
+{
+  auto spec = theState.specs.begin();
+  for (const RenderState::SpecPlan &plan : theState.plan)
+  {
+    const ContourSpec &s = *spec++;
+    if (plan.meta)
+      continue;
+
+    PrefetchKey key;
+    key.stream = plan.stream;
+    key.param = plan.param;
+    key.levelindex = plan.levelindex;
+    key.interpolated = false;
+    key.time = 0;
+    key.replace = s.replace();
+    key.replacesource = (key.replace ? s.replaceSourceValue() : 0);
+    key.replacetarget = (key.replace ? s.replaceTargetValue() : 0);
+    itsSources.push_back(key);
   }
 
-  // Noise reduction
+  for (const auto &q : theState.querystreams)
+    itsStreams.push_back(q->Clone());
 
-  theSpec.despeckle(theValues);
+  itsThread = std::thread(&Prefetcher::run, this);
 }
 
 // ----------------------------------------------------------------------
 /*!
- * \brief Save grid values for later labelling
+ * \brief Stop the background thread
  */
 // ----------------------------------------------------------------------
 
-void add_label_grid_values(ContourSpec &theSpec,
-                           const NFmiArea &theArea,
-                           const LazyCoordinates &thePoints)
+Prefetcher::~Prefetcher()
 {
-  const float dx = theSpec.labelDX();
-  const float dy = theSpec.labelDY();
+  {
+    std::lock_guard<std::mutex> lock(itsMutex);
+    itsDone = true;
+  }
+  itsJobAvailable.notify_all();
+  itsSliceReady.notify_all();
+  itsThread.join();
+}
 
-  if (dx > 0 && dy > 0)
+// ----------------------------------------------------------------------
+/*!
+ * \brief Request the slices of a time step
+ *
+ * Slices already requested for earlier time steps are not read again,
+ * the time filters keep the slices they have used.
+ */
+// ----------------------------------------------------------------------
+
+void Prefetcher::request(const std::vector<unsigned long> &theTimeIndexes, const NFmiTime &theTime)
+{
+  const bool windowed = (globals.filter != "none" && globals.filter != "linear");
+
+  NFmiTime tprev = theTime;
+  tprev.ChangeByMinutes(-globals.timeinterval);
+
+  std::vector<Request> job;
+  for (const PrefetchKey &source : itsSources)
   {
-    // Fast code for lattice coordinates
-    if (dx == static_cast<int>(dx) && dy == static_cast<int>(dy))
+    Request r;
+    r.key = source;
+    r.key.time = theTimeIndexes[source.stream];
+    job.push_back(r);
+
+    // The same hourly steps as in filter_values
+
+    if (windowed)
     {
-      const int dj = static_cast<int>(dy);
-      const int di = static_cast<int>(dx);
-      for (unsigned int j = 0; j < thePoints.NY(); j += dj)
-        for (unsigned int i = 0; i < thePoints.NX(); i += di)
-          theSpec.add(theArea.WorldXYToLatLon(thePoints(i, j)));
+      r.key.interpolated = true;
+      for (NFmiMetTime tnow(theTime, 60); !tnow.IsLessThan(tprev); --tnow)
+      {
+        r.key.time = time_key(tnow);
+        r.time = tnow;
+        job.push_back(r);
+      }
     }
-    else
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(itsMutex);
+    std::vector<Request> newslices;
+    for (const Request &r : job)
     {
-      for (float y = 0; y <= thePoints.NY() - 1; y += dy)
+      if (!itsRequested.insert(r.key).second)
+        continue;
+      itsSlices[r.key].job = itsJobCount;
+      newslices.push_back(r);
+    }
+    ++itsJobCount;
+    if (newslices.empty())
+      return;
+    itsJobs.push_back(std::move(newslices));
+  }
+  itsJobAvailable.notify_one();
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Discard the untaken slices of the oldest time step
+ */
+// ----------------------------------------------------------------------
+
+void Prefetcher::release()
+{
+  std::lock_guard<std::mutex> lock(itsMutex);
+  ++itsReleased;
+  for (auto it = itsSlices.begin(); it != itsSlices.end();)
+  {
+    if (it->second.job < itsReleased)
+      it = itsSlices.erase(it);
+    else
+      ++it;
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Take a prefetched slice, waiting for it if necessary
+ *
+ * \return False if the slice was not requested or could not be read,
+ *         in which case the caller reads the slice itself
+ */
+// ----------------------------------------------------------------------
+
+bool Prefetcher::take(const PrefetchKey &theKey, NFmiDataMatrix<float> &theValues)
+{
+  std::unique_lock<std::mutex> lock(itsMutex);
+  auto it = itsSlices.find(theKey);
+  if (it == itsSlices.end())
+    return false;
+
+  {
+    Profiler::Phase phase("prefetch_wait");
+    itsSliceReady.wait(lock,
+                       [&]
+                       {
+                         it = itsSlices.find(theKey);
+                         return itsDone || it == itsSlices.end() || it->second.ready;
+                       });
+  }
+  if (it == itsSlices.end() || !it->second.ready)
+    return false;
+
+  const bool ok = it->second.ok;
+  if (ok)
+    theValues.swap(it->second.values);
+  itsSlices.erase(it);
+  Profiler::count(ok ? "prefetch_hits" : "prefetch_failures");
+  return ok;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Read and convert one slice
+ */
+// ----------------------------------------------------------------------
+
+void Prefetcher::load(const Request &theRequest, NFmiDataMatrix<float> &theValues)
+{
+  const PrefetchKey &key = theRequest.key;
+  LazyQueryData &q = *itsStreams[key.stream];
+  q.Param(FmiParameterName(key.param));
+  q.LevelIndex(key.levelindex);
+  if (key.interpolated)
+    q.Values(theValues, theRequest.time);
+  else
+  {
+    q.TimeIndex(static_cast<unsigned long>(key.time));
+    q.Values(theValues);
+  }
+  globals.unitsconverter.convert(FmiParameterName(key.param),
+                                 theValues,
+                                 key.replace,
+                                 key.replacesource,
+                                 key.replacetarget);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Read the requested slices until stopped
+ *
+ * Slices released before they are read are skipped. Errors are left
+ * for rendering to report when it reads the slice itself.
+ */
+// ----------------------------------------------------------------------
+
+void Prefetcher::run()
+{
+  for (;;)
+  {
+    std::vector<Request> job;
+    {
+      std::unique_lock<std::mutex> lock(itsMutex);
+      itsJobAvailable.wait(lock, [&] { return itsDone || !itsJobs.empty(); });
+      if (itsDone)
+        return;
+      job = std::move(itsJobs.front());
+      itsJobs.pop_front();
+    }
+
+    for (const Request &r : job)
+    {
+      {
+        std::lock_guard<std::mutex> lock(itsMutex);
+        if (itsDone)
+          return;
+        if (itsSlices.find(r.key) == itsSlices.end())
+          continue;
+      }
+
+      NFmiDataMatrix<float> values;
+      bool ok = true;
+      try
+      {
+        load(r, values);
+      }
+      catch (...)
+      {
+        ok = false;
+      }
+
+      {
+        std::lock_guard<std::mutex> lock(itsMutex);
+        auto it = itsSlices.find(r.key);
+        if (it != itsSlices.end())
+        {
+          it->second.ready = true;
+          it->second.ok = ok;
+          it->second.values.swap(values);
+        }
+      }
+      itsSliceReady.notify_all();
+    }
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Take a prefetched slice of the active data, if any
+ */
+// ----------------------------------------------------------------------
+
+bool take_prefetched(const ContourSpec &theSpec,
+                     bool theInterpolated,
+                     long long theTime,
+                     NFmiDataMatrix<float> &theValues)
+{
+  if (prefetcher == nullptr)
+    return false;
+
+  const auto &streams = renderstate->querystreams;
+  const auto pos = std::find(streams.begin(), streams.end(), renderstate->queryinfo);
+  if (pos == streams.end())
+    return false;
+
+  PrefetchKey key;
+  key.stream = static_cast<unsigned int>(pos - streams.begin());
+  key.param = renderstate->queryinfo->GetParamIdent();
+  key.levelindex = renderstate->queryinfo->LevelIndex();
+  key.interpolated = theInterpolated;
+  key.time = theTime;
+  key.replace = theSpec.replace();
+  key.replacesource = (key.replace ? theSpec.replaceSourceValue() : 0);
+  key.replacetarget = (key.replace ? theSpec.replaceTargetValue() : 0);
+  return prefetcher->take(key, theValues);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Filter the data values
+ */
+// ----------------------------------------------------------------------
+
+void filter_values(NFmiDataMatrix<float> &theValues,
+                   const NFmiTime &theTime,
+                   const ContourSpec &theSpec)
+{
+  if (globals.filter == "none")
+  {
+    // The time is known to be exact
+  }
+  else if (globals.filter == "linear")
+  {
+    NFmiTime tnow = renderstate->queryinfo->ValidTime();
+    bool isexact = theTime.IsEqual(tnow);
+
+    if (!isexact)
+    {
+      NFmiDataMatrix<float> &tmpvals = renderstate->filtervalues;
+      NFmiTime t2 = renderstate->queryinfo->ValidTime();
+      renderstate->queryinfo->PreviousTime();
+      NFmiTime t1 = renderstate->queryinfo->ValidTime();
+      if (!MetaFunctions::isMeta(theSpec.param()))
+      {
+        renderstate->queryinfo->Values(tmpvals);
+        globals.unitsconverter.convert(FmiParameterName(renderstate->queryinfo->GetParamIdent()),
+                                       tmpvals,
+                                       theSpec.replace(),
+                                       theSpec.replaceSourceValue(),
+                                       theSpec.replaceTargetValue());
+      }
+      else
+      {
+        tmpvals = MetaFunctions::values(
+            theSpec.param(), *renderstate->queryinfo, renderstate->threads);
+        if (theSpec.replace())
+          tmpvals.Replace(theSpec.replaceSourceValue(), theSpec.replaceTargetValue());
+      }
+
+      // Data from t1,t2, we want t
+
+      long offset = theTime.DifferenceInMinutes(t1);
+      long range = t2.DifferenceInMinutes(t1);
+
+      float weight = (static_cast<float>(offset)) / range;
+
+      theValues.LinearCombination(tmpvals, weight, 1 - weight);
+    }
+  }
+  else
+  {
+    NFmiTime tprev = theTime;
+    tprev.ChangeByMinutes(-globals.timeinterval);
+
+    if (MetaFunctions::isMeta(theSpec.param()))
+      throw runtime_error("Unable to filter metafunctions - use newbase parameters only");
+
+    // Processed slices are kept until they fall out of the time window,
+    // hence consecutive time steps read only one new slice each
+
+    auto &slices = renderstate->filterslices;
+
+    FilterSliceKey key;
+    key.file = renderstate->queryinfo->Filename();
+    key.param = renderstate->queryinfo->GetParamIdent();
+    key.level = renderstate->queryinfo->GetLevelNumber();
+    key.replace = theSpec.replace();
+    key.replacesource = (key.replace ? theSpec.replaceSourceValue() : 0);
+    key.replacetarget = (key.replace ? theSpec.replaceTargetValue() : 0);
+
+    NFmiMetTime tnow(theTime, 60);
+    long long oldest = time_key(tnow);
+    int steps = 1;
+    for (;;)
+    {
+      key.time = time_key(tnow);
+      oldest = key.time;
+
+      auto pos = slices.find(key);
+      if (pos == slices.end())
+      {
+        NFmiDataMatrix<float> slice;
+        if (!take_prefetched(theSpec, true, key.time, slice))
+        {
+          renderstate->queryinfo->Values(slice, tnow);
+          globals.unitsconverter.convert(FmiParameterName(key.param),
+                                         slice,
+                                         theSpec.replace(),
+                                         theSpec.replaceSourceValue(),
+                                         theSpec.replaceTargetValue());
+        }
+        pos = slices.insert(make_pair(key, std::move(slice))).first;
+      }
+      const NFmiDataMatrix<float> &tmpvals = pos->second;
+
+      if (globals.filter == "min")
+        theValues.Min(tmpvals);
+      else if (globals.filter == "max")
+        theValues.Max(tmpvals);
+      else if (globals.filter == "mean")
+        theValues += tmpvals;
+      else if (globals.filter == "sum")
+        theValues += tmpvals;
+
+      ++steps;
+      --tnow;
+
+      if (tnow.IsLessThan(tprev))
+        break;
+    }
+
+    if (globals.filter == "mean")
+      theValues /= static_cast<float>(steps);
+
+    // Forget the slices no longer needed by later time steps
+
+    while (!slices.empty() && slices.begin()->first.time < oldest)
+      slices.erase(slices.begin());
+  }
+
+  // Noise reduction
+
+  Profiler::Phase phase("despeckle");
+  theSpec.despeckle(theValues, renderstate->threads);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Save grid values for later labelling
+ */
+// ----------------------------------------------------------------------
+
+void add_label_grid_values(ContourSpec &theSpec,
+                           const NFmiArea &theArea,
+                           const LazyCoordinates &thePoints)
+{
+  const float dx = theSpec.labelDX();
+  const float dy = theSpec.labelDY();
+
+  if (dx > 0 && dy > 0)
+  {
+    // Fast code for lattice coordinates
+    if (dx == static_cast<int>(dx) && dy == static_cast<int>(dy))
+    {
+      const int dj = static_cast<int>(dy);
+      const int di = static_cast<int>(dx);
+      auto latlons = renderstate->queryinfo->LocationsAreaLatLon(theArea);
+      for (unsigned int j = 0; j < latlons->height(); j += dj)
+        for (unsigned int i = 0; i < latlons->width(); i += di)
+          theSpec.add((*latlons)(i, j));
+    }
+    else
+    {
+      for (float y = 0; y <= thePoints.NY() - 1; y += dy)
       {
         const int j = static_cast<int>(floor(y));
         const float dj = y - j;
@@ -3166,7 +4388,7 @@ void add_label_pixelgrid_values(ContourSpec &theSpec,
       for (float x = x0; x <= img.Width(); x += dx)
       {
         NFmiPoint latlon = theArea.ToLatLon(NFmiPoint(x, y));
-        NFmiPoint ij = globals.queryinfo->LatLonToGrid(latlon);
+        NFmiPoint ij = renderstate->queryinfo->LatLonToGrid(latlon);
 
         int i = static_cast<int>(ij.X());  // rounds down
         int j = static_cast<int>(ij.Y());
@@ -3201,7 +4423,7 @@ void add_label_point_values(ContourSpec &theSpec,
     for (it = theSpec.labelPoints().begin(); it != theSpec.labelPoints().end(); ++it)
     {
       NFmiPoint latlon = it->first;
-      NFmiPoint ij = globals.queryinfo->LatLonToGrid(latlon);
+      NFmiPoint ij = renderstate->queryinfo->LatLonToGrid(latlon);
 
       int i = static_cast<int>(ij.X());  // rounds down
       int j = static_cast<int>(ij.Y());
@@ -3335,8 +4557,7 @@ void draw_label_texts(ImagineXr_or_NFmiImage &img,
 #ifdef IMAGINE_WITH_CAIRO
   img.MakeFace(theSpec.labelFont());
 #else
-  Imagine::NFmiFace face = make_face(theSpec.labelFont());
-  face.Background(false);
+  LabelFace face(theSpec.labelFont());
 #endif
 
   // Draw labels at specifing latlon points if requested
@@ -3633,13 +4854,130 @@ void draw_roundarrow(ImagineXr_or_NFmiImage &img, const NFmiPoint &xy, float spe
   circle.Stroke(img, strokecolor.circlecolor, NFmiColorTools::kFmiColorOver);
 }
 
+// ----------------------------------------------------------------------
+/*!
+ * \brief Wind arrow position which does not depend on the data values
+ *
+ * The image coordinate, the geographic coordinate and the north
+ * correction of an arrow depend only on the grid, the area and the
+ * arrow placement settings. They are calculated once and shared by
+ * all the time steps and threads.
+ */
+// ----------------------------------------------------------------------
+
+struct ArrowSite
+{
+  NFmiPoint xy0;     // image coordinate
+  NFmiPoint latlon;  // geographic coordinate
+  double north;      // north correction for the rotation
+  float x;           // grid coordinate for sampling the data
+  float y;
+};
+
+using ArrowSites = std::vector<ArrowSite>;
+
+std::mutex arrowsite_mutex;
+std::map<std::string, std::shared_ptr<const ArrowSites>> arrowsite_cache;
+std::map<std::string, std::shared_ptr<const NFmiDataMatrix<double>>> gridnorth_cache;
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Return cached wind arrow data, calculating it if necessary
+ *
+ * The calculation is done without holding the lock, two threads may
+ * occasionally calculate the same data but only the first is kept.
+ */
+// ----------------------------------------------------------------------
+
+template <typename T, typename Calculator>
+std::shared_ptr<const T> cached_arrow_data(
+    std::map<std::string, std::shared_ptr<const T>> &theCache,
+    const std::string &theKey,
+    Calculator theCalculator)
+{
+  {
+    std::lock_guard<std::mutex> lock(arrowsite_mutex);
+    auto it = theCache.find(theKey);
+    if (it != theCache.end())
+      return it->second;
+  }
+
+  auto value = std::make_shared<const T>(theCalculator());
+
+  std::lock_guard<std::mutex> lock(arrowsite_mutex);
+  return theCache.emplace(theKey, value).first->second;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Return the part of an arrow site key shared by all arrow kinds
+ */
+// ----------------------------------------------------------------------
+
+std::string arrowsite_key(const char *theKind,
+                          const ImagineXr_or_NFmiImage &img,
+                          const NFmiArea &theArea)
+{
+  ostringstream os;
+  os << std::setprecision(9) << theKind << ' ' << img.Width() << 'x' << img.Height() << ' '
+     << globals.mask << ' ' << globals.uvorientation << ' ' << theArea;
+  return os.str();
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Return the north correction for an arrow at the given point
+ */
+// ----------------------------------------------------------------------
+
+std::optional<double> arrow_north(const Fmi::CoordinateTransformation &transformation,
+                                  const NFmiPoint &latlon)
+{
+  if (globals.uvorientation)
+    return Fmi::OGR::gridNorth(transformation, latlon.X(), latlon.Y());
+  return 0.0;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Return grid north at the data grid points in the given area
+ *
+ * Missing values are marked with NaN.
+ */
+// ----------------------------------------------------------------------
+
+std::shared_ptr<const NFmiDataMatrix<double>> grid_norths(const NFmiArea &theArea)
+{
+  ostringstream key;
+  key << "gridnorth " << renderstate->queryinfo->GridKey() << ' ' << theArea;
+
+  return cached_arrow_data(
+      gridnorth_cache,
+      key.str(),
+      [&]()
+      {
+        Fmi::CoordinateTransformation transformation("WGS84", theArea.SpatialReference());
+        auto latlon = renderstate->queryinfo->Locations();
+
+        NFmiDataMatrix<double> norths(latlon->width(), latlon->height(), std::nan(""));
+        for (std::size_t j = 0; j < latlon->height(); j++)
+          for (std::size_t i = 0; i < latlon->width(); i++)
+          {
+            auto north = Fmi::OGR::gridNorth(transformation, latlon->x(i, j), latlon->y(i, j));
+            if (north)
+              norths[i][j] = *north;
+          }
+        return norths;
+      });
+}
+
 // ----------------------------------------------------------------------
 /*!
  * \brief Establish speed and direction in a grid
  */
 // ----------------------------------------------------------------------
 
-void get_speed_direction(const Fmi::CoordinateTransformation &transformation,
+void get_speed_direction(const NFmiArea &theArea,
                          float speed_src,
                          float speed_dst,
                          float direction_src,
@@ -3649,18 +4987,19 @@ void get_speed_direction(const Fmi::CoordinateTransformation &transformation,
 {
   if (!globals.directionparam.empty())
   {
-    if (globals.queryinfo->Param(toparam(globals.speedparam)))
+    if (renderstate->queryinfo->Param(toparam(globals.speedparam)))
     {
-      speed = globals.queryinfo->Values();
+      speed = renderstate->queryinfo->Values();
       speed.Replace(speed_src, speed_dst);
-      globals.unitsconverter.convert(FmiParameterName(globals.queryinfo->GetParamIdent()), speed);
+      globals.unitsconverter.convert(FmiParameterName(renderstate->queryinfo->GetParamIdent()),
+                                     speed);
     }
 
-    if (globals.queryinfo->Param(toparam(globals.directionparam)))
+    if (renderstate->queryinfo->Param(toparam(globals.directionparam)))
     {
-      direction = globals.queryinfo->Values();
+      direction = renderstate->queryinfo->Values();
       direction.Replace(direction_src, direction_dst);
-      globals.unitsconverter.convert(FmiParameterName(globals.queryinfo->GetParamIdent()),
+      globals.unitsconverter.convert(FmiParameterName(renderstate->queryinfo->GetParamIdent()),
                                      direction);
     }
   }
@@ -3669,15 +5008,15 @@ void get_speed_direction(const Fmi::CoordinateTransformation &transformation,
     NFmiDataMatrix<float> dx;
     NFmiDataMatrix<float> dy;
 
-    if (globals.queryinfo->Param(toparam(globals.speedxcomponent)))
-      dx = globals.queryinfo->Values();
-    if (globals.queryinfo->Param(toparam(globals.speedycomponent)))
-      dy = globals.queryinfo->Values();
-
-    auto latlon = globals.queryinfo->Locations();
+    if (renderstate->queryinfo->Param(toparam(globals.speedxcomponent)))
+      dx = renderstate->queryinfo->Values();
+    if (renderstate->queryinfo->Param(toparam(globals.speedycomponent)))
+      dy = renderstate->queryinfo->Values();
 
     if (dx.NX() != 0 && dx.NY() != 0 && dy.NX() != 0 && dy.NY() != 0)
     {
+      auto norths = grid_norths(theArea);
+
       speed.Resize(dx.NX(), dx.NY(), kFloatMissing);
       direction.Resize(dx.NX(), dy.NY(), kFloatMissing);
       for (size_t j = 0; j < dx.NY(); j++)
@@ -3691,9 +5030,9 @@ void get_speed_direction(const Fmi::CoordinateTransformation &transformation,
               if (!globals.uvorientation)
                 direction[i][j] = fmod(180 + FmiDeg(atan2(dx[i][j], dy[i][j])), 360.0);
               {
-                auto north = Fmi::OGR::gridNorth(transformation, latlon->x(i, j), latlon->y(i, j));
-                if (north)
-                  direction[i][j] = fmod(180 + *north + FmiDeg(atan2(dx[i][j], dy[i][j])), 360.0);
+                const double north = (*norths)[i][j];
+                if (!std::isnan(north))
+                  direction[i][j] = fmod(180 + north + FmiDeg(atan2(dx[i][j], dy[i][j])), 360.0);
                 else
                   direction[i][j] = kFloatMissing;
               }
@@ -3707,10 +5046,12 @@ void get_speed_direction(const Fmi::CoordinateTransformation &transformation,
 // ----------------------------------------------------------------------
 /*!
  * \brief Establish speed & direction at the given point
+ *
+ * \param theNorth The grid north at the point, used only for grid oriented U/V components
  */
 // ----------------------------------------------------------------------
 
-void get_speed_direction(const Fmi::CoordinateTransformation &transformation,
+void get_speed_direction(double theNorth,
                          const NFmiPoint &latlon,
                          float speed_src,
                          float speed_dst,
@@ -3723,25 +5064,25 @@ void get_speed_direction(const Fmi::CoordinateTransformation &transformation,
 
   if (!globals.directionparam.empty())
   {
-    if (globals.queryinfo->Param(toparam(globals.directionparam)))
+    if (renderstate->queryinfo->Param(toparam(globals.directionparam)))
     {
-      direction = globals.queryinfo->InterpolatedValue(latlon);
+      direction = renderstate->queryinfo->InterpolatedValue(latlon);
       if (direction == direction_src)
         direction = direction_dst;
 
       direction = globals.unitsconverter.convert(
-          FmiParameterName(globals.queryinfo->GetParamIdent()), direction);
+          FmiParameterName(renderstate->queryinfo->GetParamIdent()), direction);
     }
 
-    if (globals.queryinfo->Param(toparam(globals.speedparam)))
+    if (renderstate->queryinfo->Param(toparam(globals.speedparam)))
     {
-      speed = globals.queryinfo->InterpolatedValue(latlon);
+      speed = renderstate->queryinfo->InterpolatedValue(latlon);
       if (speed == speed_src)
         speed = speed_dst;
-      speed = globals.unitsconverter.convert(FmiParameterName(globals.queryinfo->GetParamIdent()),
-                                             speed);
+      speed = globals.unitsconverter.convert(
+          FmiParameterName(renderstate->queryinfo->GetParamIdent()), speed);
     }
-    globals.queryinfo->Param(toparam(globals.directionparam));
+    renderstate->queryinfo->Param(toparam(globals.directionparam));
   }
 
   else
@@ -3749,10 +5090,10 @@ void get_speed_direction(const Fmi::CoordinateTransformation &transformation,
     float dx = kFloatMissing;
     float dy = kFloatMissing;
 
-    if (globals.queryinfo->Param(toparam(globals.speedxcomponent)))
-      dx = globals.queryinfo->InterpolatedValue(latlon);
-    if (globals.queryinfo->Param(toparam(globals.speedycomponent)))
-      dy = globals.queryinfo->InterpolatedValue(latlon);
+    if (renderstate->queryinfo->Param(toparam(globals.speedxcomponent)))
+      dx = renderstate->queryinfo->InterpolatedValue(latlon);
+    if (renderstate->queryinfo->Param(toparam(globals.speedycomponent)))
+      dy = renderstate->queryinfo->InterpolatedValue(latlon);
 
     if (dx != kFloatMissing && dy != kFloatMissing)
     {
@@ -3762,13 +5103,7 @@ void get_speed_direction(const Fmi::CoordinateTransformation &transformation,
         if (!globals.uvorientation)
           direction = fmod(180 + FmiDeg(atan2f(dx, dy)), 360.0);
         else
-        {
-          auto north = Fmi::OGR::gridNorth(transformation, latlon.X(), latlon.Y());
-          if (north)
-            direction = fmod(180 + *north + FmiDeg(atan2f(dx, dy)), 360.0);
-          else
-            direction = kFloatMissing;
-        }
+          direction = fmod(180 + theNorth + FmiDeg(atan2f(dx, dy)), 360.0);
       }
     }
   }
@@ -3776,114 +5111,164 @@ void get_speed_direction(const Fmi::CoordinateTransformation &transformation,
 
 // ----------------------------------------------------------------------
 /*!
- * \brief Draw the listed wind arrow points
+ * \brief Render a single wind arrow
+ *
+ * The value type is a template parameter so that the arithmetic
+ * stays the same as it was in each of the arrow placement modes.
  */
 // ----------------------------------------------------------------------
 
-void draw_wind_arrows_points(ImagineXr_or_NFmiImage &img,
-                             const NFmiArea &theArea,
-                             const NFmiPath &theArrow,
-                             float direction_src,
-                             float direction_dst,
-                             float speed_src,
-                             float speed_dst)
+template <typename T>
+void draw_wind_arrow(ImagineXr_or_NFmiImage &img,
+                     const NFmiPath &theArrow,
+                     const ArrowSite &theSite,
+                     T speed,
+                     T dir)
 {
-  // Handle all given coordinates
+  const NFmiPoint &xy0 = theSite.xy0;
+
+  if (globals.arrowfile == "roundarrow")
+  {
+    draw_roundarrow(img, xy0, speed, -dir - theSite.north + 180);
+  }
+  else
+  {
+    if (globals.arrowfile == "meteorological")
+    {
+      NFmiPath strokes;
+      NFmiPath flags;
 
-  list<NFmiPoint>::const_iterator iter;
+      strokes.Add(GramTools::metarrowlines(speed, theSite.latlon));
+      flags.Add(GramTools::metarrowflags(speed, theSite.latlon));
 
-  Fmi::CoordinateTransformation transformation("WGS84", theArea.SpatialReference());
+      if (speed > 0 && speed != kFloatMissing)
+      {
+        strokes.Scale(globals.windarrowscaleA * log10(globals.windarrowscaleB * speed + 1) +
+                      globals.windarrowscaleC);
+        flags.Scale(globals.windarrowscaleA * log10(globals.windarrowscaleB * speed + 1) +
+                    globals.windarrowscaleC);
+      }
 
-  for (iter = globals.arrowpoints.begin(); iter != globals.arrowpoints.end(); ++iter)
-  {
-    // The start point
-    // NFmiPoint latlon = MeridianTools::Relocate(*iter,theArea);
-    NFmiPoint latlon = *iter;
-    NFmiPoint xy0 = theArea.ToXY(latlon);
+      strokes.Scale(globals.arrowscale);
+      strokes.Rotate(-dir - theSite.north + 180);
+      strokes.Translate(static_cast<float>(xy0.X()), static_cast<float>(xy0.Y()));
 
-    // Skip rendering if the start point is masked
+      flags.Scale(globals.arrowscale);
+      flags.Rotate(-dir - theSite.north + 180);
+      flags.Translate(static_cast<float>(xy0.X()), static_cast<float>(xy0.Y()));
 
-    if (IsMasked(xy0, globals.mask))
-      continue;
+      ArrowStyle style = globals.getArrowStroke(speed);
+      strokes.Stroke(img, style.width, style.color, style.rule);
+      flags.Fill(img, style.color, style.rule);
+    }
+    else
+    {
+      NFmiPath arrowpath;
+      arrowpath.Add(theArrow);
+
+      if (speed > 0 && speed != kFloatMissing)
+        arrowpath.Scale(globals.windarrowscaleA * log10(globals.windarrowscaleB * speed + 1) +
+                        globals.windarrowscaleC);
+      arrowpath.Scale(globals.arrowscale);
+      arrowpath.Rotate(-dir - theSite.north + 180);
+      arrowpath.Translate(static_cast<float>(xy0.X()), static_cast<float>(xy0.Y()));
+
+      // And render it
+
+      ArrowStyle fillstyle = globals.getArrowFill(speed);
+      arrowpath.Fill(img, fillstyle.color, fillstyle.rule);
+
+      ArrowStyle strokestyle = globals.getArrowStroke(speed);
+      arrowpath.Stroke(img, strokestyle.width, strokestyle.color, strokestyle.rule);
+    }
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Draw the arrows at the given sites in image coordinates
+ *
+ * Used for both the listed points and the pixel grid, which sample
+ * the data by interpolating at the latlon coordinates.
+ */
+// ----------------------------------------------------------------------
 
+void draw_wind_arrows_at(ImagineXr_or_NFmiImage &img,
+                         const ArrowSites &theSites,
+                         const NFmiPath &theArrow,
+                         float direction_src,
+                         float direction_dst,
+                         float speed_src,
+                         float speed_dst)
+{
+  for (const auto &site : theSites)
+  {
     float dir, speed;
 
     get_speed_direction(
-        transformation, latlon, speed_src, speed_dst, direction_src, direction_dst, speed, dir);
+        site.north, site.latlon, speed_src, speed_dst, direction_src, direction_dst, speed, dir);
 
     // Ignore missing values
     if (dir == kFloatMissing || speed == kFloatMissing)
       continue;
 
-    // Direction calculations
+    draw_wind_arrow(img, theArrow, site, speed, dir);
+  }
+}
 
-    std::optional<double> north;
-    if (globals.uvorientation)
-      north = Fmi::OGR::gridNorth(transformation, latlon.X(), latlon.Y());
-    else
-      north = 0.0;
+// ----------------------------------------------------------------------
+/*!
+ * \brief Draw the listed wind arrow points
+ */
+// ----------------------------------------------------------------------
 
-    if (!north)
-      continue;
+void draw_wind_arrows_points(ImagineXr_or_NFmiImage &img,
+                             const NFmiArea &theArea,
+                             const NFmiPath &theArrow,
+                             float direction_src,
+                             float direction_dst,
+                             float speed_src,
+                             float speed_dst)
+{
+  if (globals.arrowpoints.empty())
+    return;
 
-    // Render the arrow
+  ostringstream key;
+  key << std::setprecision(12) << arrowsite_key("points", img, theArea);
+  for (const auto &latlon : globals.arrowpoints)
+    key << ' ' << latlon.X() << ',' << latlon.Y();
 
-    if (globals.arrowfile == "roundarrow")
-    {
-      draw_roundarrow(img, xy0, speed, -dir - *north + 180);
-    }
-    else
-    {
-      if (globals.arrowfile == "meteorological")
+  auto sites = cached_arrow_data(
+      arrowsite_cache,
+      key.str(),
+      [&]()
       {
-        NFmiPath strokes;
-        NFmiPath flags;
-
-        strokes.Add(GramTools::metarrowlines(speed, latlon));
-        flags.Add(GramTools::metarrowflags(speed, latlon));
+        Fmi::CoordinateTransformation transformation("WGS84", theArea.SpatialReference());
 
-        if (speed > 0 && speed != kFloatMissing)
+        ArrowSites ret;
+        for (const auto &latlon : globals.arrowpoints)
         {
-          strokes.Scale(globals.windarrowscaleA * log10(globals.windarrowscaleB * speed + 1) +
-                        globals.windarrowscaleC);
-          flags.Scale(globals.windarrowscaleA * log10(globals.windarrowscaleB * speed + 1) +
-                      globals.windarrowscaleC);
-        }
-
-        strokes.Scale(globals.arrowscale);
-        strokes.Rotate(-dir - *north + 180);
-        strokes.Translate(static_cast<float>(xy0.X()), static_cast<float>(xy0.Y()));
+          // The start point
+          // NFmiPoint latlon = MeridianTools::Relocate(*iter,theArea);
+          NFmiPoint xy0 = theArea.ToXY(latlon);
 
-        flags.Scale(globals.arrowscale);
-        flags.Rotate(-dir - *north + 180);
-        flags.Translate(static_cast<float>(xy0.X()), static_cast<float>(xy0.Y()));
+          // Skip rendering if the start point is masked
 
-        ArrowStyle style = globals.getArrowStroke(speed);
-        strokes.Stroke(img, style.width, style.color, style.rule);
-        flags.Fill(img, style.color, style.rule);
-      }
-      else
-      {
-        NFmiPath arrowpath;
-        arrowpath.Add(theArrow);
+          if (IsMasked(xy0, globals.mask))
+            continue;
 
-        if (speed > 0 && speed != kFloatMissing)
-          arrowpath.Scale(globals.windarrowscaleA * log10(globals.windarrowscaleB * speed + 1) +
-                          globals.windarrowscaleC);
-        arrowpath.Scale(globals.arrowscale);
-        arrowpath.Rotate(-dir - *north + 180);
-        arrowpath.Translate(static_cast<float>(xy0.X()), static_cast<float>(xy0.Y()));
+          // Direction calculations
 
-        // And render it
+          auto north = arrow_north(transformation, latlon);
+          if (!north)
+            continue;
 
-        ArrowStyle fillstyle = globals.getArrowFill(speed);
-        arrowpath.Fill(img, fillstyle.color, fillstyle.rule);
+          ret.push_back(ArrowSite{xy0, latlon, *north, 0, 0});
+        }
+        return ret;
+      });
 
-        ArrowStyle strokestyle = globals.getArrowStroke(speed);
-        arrowpath.Stroke(img, strokestyle.width, strokestyle.color, strokestyle.rule);
-      }
-    }
-  }
+  draw_wind_arrows_at(img, *sites, theArrow, direction_src, direction_dst, speed_src, speed_dst);
 }
 
 // ----------------------------------------------------------------------
@@ -3907,158 +5292,114 @@ void draw_wind_arrows_grid(ImagineXr_or_NFmiImage &img,
 
   NFmiDataMatrix<float> speedvalues, dirvalues;
 
-  Fmi::CoordinateTransformation wgs84transformation("WGS84", theArea.SpatialReference());
-
-  get_speed_direction(wgs84transformation,
-                      speed_src,
-                      speed_dst,
-                      direction_src,
-                      direction_dst,
-                      speedvalues,
-                      dirvalues);
+  get_speed_direction(
+      theArea, speed_src, speed_dst, direction_src, direction_dst, speedvalues, dirvalues);
 
   if (dirvalues.NX() == 0 || dirvalues.NY() == 0)
     return;
 
   bool speedok = (speedvalues.NX() != 0 && speedvalues.NY() != 0);
 
-  // Data coordinates to target area worldxy coordinates
-
-  auto coordinates = globals.queryinfo->CoordinateMatrix();
-
-  Fmi::CoordinateTransformation transformation(globals.queryinfo->SpatialReference(),
-                                               theArea.SpatialReference());
-
-  auto ocoordinates = coordinates;
-
-  if (!coordinates.transform(transformation))
-    return;
-
-  // Needed for grid to latlon conversions
-  const auto *grid = globals.queryinfo->Grid();
-
-  for (float y = 0; y <= coordinates.height() - 1; y += globals.windarrowdy)
-    for (float x = 0; x <= coordinates.width() - 1; x += globals.windarrowdx)
-    {
-      // The start point
-
-      const int i = static_cast<int>(floor(x));
-      const int j = static_cast<int>(floor(y));
+  ostringstream key;
+  key << std::setprecision(9) << arrowsite_key("grid", img, theArea) << ' '
+      << globals.windarrowdx << ' ' << globals.windarrowdy << ' '
+      << renderstate->queryinfo->GridKey();
 
-      NFmiPoint xy = NFmiInterpolation::BiLinear(x - i,
-                                                 y - j,
-                                                 coordinates(i, j + 1),
-                                                 coordinates(i + 1, j + 1),
-                                                 coordinates(i, j),
-                                                 coordinates(i + 1, j));
+  auto sites = cached_arrow_data(
+      arrowsite_cache,
+      key.str(),
+      [&]()
+      {
+        ArrowSites ret;
 
-      NFmiPoint xy0 = theArea.WorldXYToXY(xy);
+        // Data coordinates to target area worldxy coordinates
 
-      // Skip rendering if the start point is masked
-      if (IsMasked(xy0, globals.mask))
-        continue;
+        auto coordinates = renderstate->queryinfo->CoordinateMatrix();
 
-      // Skip rendering if the start point is way outside the image
+        Fmi::CoordinateTransformation transformation(renderstate->queryinfo->SpatialReference(),
+                                                     theArea.SpatialReference());
 
-      const int safetymargin = 50;
-      if (xy0.X() < -safetymargin || xy0.Y() < -safetymargin ||
-          xy0.X() > img.Width() + safetymargin || xy0.Y() > img.Height() + safetymargin)
-        continue;
+        if (!coordinates.transform(transformation))
+          return ret;
 
-      // Render the arrow
+        Fmi::CoordinateTransformation wgs84transformation("WGS84", theArea.SpatialReference());
 
-      double dir = NFmiInterpolation::ModBiLinear(x - i,
-                                                  y - j,
-                                                  dirvalues.At(i, j + 1, kFloatMissing),
-                                                  dirvalues.At(i + 1, j + 1, kFloatMissing),
-                                                  dirvalues.At(i, j, kFloatMissing),
-                                                  dirvalues.At(i + 1, j, kFloatMissing),
-                                                  360);
+        // Needed for grid to latlon conversions
+        const auto *grid = renderstate->queryinfo->Grid();
 
-      if (dir == kFloatMissing)  // ignore missing
-        continue;
+        for (float y = 0; y <= coordinates.height() - 1; y += globals.windarrowdy)
+          for (float x = 0; x <= coordinates.width() - 1; x += globals.windarrowdx)
+          {
+            // The start point
 
-      double speed = NFmiInterpolation::BiLinear(x - i,
-                                                 y - j,
-                                                 speedvalues.At(i, j + 1, kFloatMissing),
-                                                 speedvalues.At(i + 1, j + 1, kFloatMissing),
-                                                 speedvalues.At(i, j, kFloatMissing),
-                                                 speedvalues.At(i + 1, j, kFloatMissing));
+            const int i = static_cast<int>(floor(x));
+            const int j = static_cast<int>(floor(y));
 
-      if (speedok && speed == kFloatMissing)  // ignore missing
-        continue;
+            NFmiPoint xy = NFmiInterpolation::BiLinear(x - i,
+                                                       y - j,
+                                                       coordinates(i, j + 1),
+                                                       coordinates(i + 1, j + 1),
+                                                       coordinates(i, j),
+                                                       coordinates(i + 1, j));
 
-      // Direction calculations
+            NFmiPoint xy0 = theArea.WorldXYToXY(xy);
 
-      const auto latlon = grid->GridToLatLon(x, y);
+            // Skip rendering if the start point is masked
+            if (IsMasked(xy0, globals.mask))
+              continue;
 
-      std::optional<double> north;
-      if (globals.uvorientation)
-        north = Fmi::OGR::gridNorth(wgs84transformation, latlon.X(), latlon.Y());
-      else
-        north = 0.0;
+            // Skip rendering if the start point is way outside the image
 
-      if (!north)
-        continue;
+            const int safetymargin = 50;
+            if (xy0.X() < -safetymargin || xy0.Y() < -safetymargin ||
+                xy0.X() > img.Width() + safetymargin || xy0.Y() > img.Height() + safetymargin)
+              continue;
 
-      // Render the arrow
+            // Direction calculations
 
-      if (globals.arrowfile == "roundarrow")
-      {
-        draw_roundarrow(img, xy0, speed, -dir - *north + 180);
-      }
-      else
-      {
-        if (globals.arrowfile == "meteorological")
-        {
-          NFmiPath strokes;
-          NFmiPath flags;
+            const auto latlon = grid->GridToLatLon(x, y);
 
-          strokes.Add(GramTools::metarrowlines(speed, latlon));
-          flags.Add(GramTools::metarrowflags(speed, latlon));
+            auto north = arrow_north(wgs84transformation, latlon);
+            if (!north)
+              continue;
 
-          if (speed > 0 && speed != kFloatMissing)
-          {
-            strokes.Scale(globals.windarrowscaleA * log10(globals.windarrowscaleB * speed + 1) +
-                          globals.windarrowscaleC);
-            flags.Scale(globals.windarrowscaleA * log10(globals.windarrowscaleB * speed + 1) +
-                        globals.windarrowscaleC);
+            ret.push_back(ArrowSite{xy0, latlon, *north, x, y});
           }
+        return ret;
+      });
 
-          strokes.Scale(globals.arrowscale);
-          strokes.Rotate(-dir - *north + 180);
-          strokes.Translate(static_cast<float>(xy0.X()), static_cast<float>(xy0.Y()));
-
-          flags.Scale(globals.arrowscale);
-          flags.Rotate(-dir - *north + 180);
-          flags.Translate(static_cast<float>(xy0.X()), static_cast<float>(xy0.Y()));
-
-          ArrowStyle style = globals.getArrowStroke(speed);
-          strokes.Stroke(img, style.width, style.color, style.rule);
-          flags.Fill(img, style.color, style.rule);
-        }
-        else
-        {
-          NFmiPath arrowpath;
-          arrowpath.Add(theArrow);
+  // Only the data values need to be sampled for each time step
 
-          if (speed > 0 && speed != kFloatMissing)
-            arrowpath.Scale(globals.windarrowscaleA * log10(globals.windarrowscaleB * speed + 1) +
-                            globals.windarrowscaleC);
-          arrowpath.Scale(globals.arrowscale);
-          arrowpath.Rotate(-dir - *north + 180);
-          arrowpath.Translate(static_cast<float>(xy0.X()), static_cast<float>(xy0.Y()));
+  for (const auto &site : *sites)
+  {
+    const float x = site.x;
+    const float y = site.y;
+    const int i = static_cast<int>(floor(x));
+    const int j = static_cast<int>(floor(y));
+
+    double dir = NFmiInterpolation::ModBiLinear(x - i,
+                                                y - j,
+                                                dirvalues.At(i, j + 1, kFloatMissing),
+                                                dirvalues.At(i + 1, j + 1, kFloatMissing),
+                                                dirvalues.At(i, j, kFloatMissing),
+                                                dirvalues.At(i + 1, j, kFloatMissing),
+                                                360);
+
+    if (dir == kFloatMissing)  // ignore missing
+      continue;
 
-          // And render it
+    double speed = NFmiInterpolation::BiLinear(x - i,
+                                               y - j,
+                                               speedvalues.At(i, j + 1, kFloatMissing),
+                                               speedvalues.At(i + 1, j + 1, kFloatMissing),
+                                               speedvalues.At(i, j, kFloatMissing),
+                                               speedvalues.At(i + 1, j, kFloatMissing));
 
-          ArrowStyle fillstyle = globals.getArrowFill(speed);
-          arrowpath.Fill(img, fillstyle.color, fillstyle.rule);
+    if (speedok && speed == kFloatMissing)  // ignore missing
+      continue;
 
-          ArrowStyle strokestyle = globals.getArrowStroke(speed);
-          arrowpath.Stroke(img, strokestyle.width, strokestyle.color, strokestyle.rule);
-        }
-      }
-    }
+    draw_wind_arrow(img, theArrow, site, speed, dir);
+  }
 }
 
 // ----------------------------------------------------------------------
@@ -4080,102 +5421,44 @@ void draw_wind_arrows_pixelgrid(ImagineXr_or_NFmiImage &img,
   if (globals.windarrowsxydx <= 0 || globals.windarrowsxydy <= 0)
     return;
 
-  Fmi::CoordinateTransformation transformation("WGS84", theArea.SpatialReference());
-
-  for (float y = globals.windarrowsxyy0; y <= img.Height(); y += globals.windarrowsxydy)
-    for (float x = globals.windarrowsxyx0; x <= img.Width(); x += globals.windarrowsxydx)
-    {
-      NFmiPoint xy0(x, y);
-
-      // Skip the point if it is masked
-      if (IsMasked(xy0, globals.mask))
-        continue;
-
-      // Calculate the latlon value
-
-      NFmiPoint latlon = theArea.ToLatLon(xy0);
-
-      // Calculate the speed & direction values
-
-      float dir, speed;
-
-      get_speed_direction(
-          transformation, latlon, speed_src, speed_dst, direction_src, direction_dst, speed, dir);
-
-      // Ignore missing values
-
-      if (dir == kFloatMissing || speed == kFloatMissing)
-        continue;
-
-      // Direction calculations
-
-      std::optional<double> north;
-      if (globals.uvorientation)
-        north = Fmi::OGR::gridNorth(transformation, latlon.X(), latlon.Y());
-      else
-        north = 0.0;
-
-      if (!north)
-        continue;
-
-      // Render the arrow
+  ostringstream key;
+  key << std::setprecision(9) << arrowsite_key("pixelgrid", img, theArea) << ' '
+      << globals.windarrowsxyx0 << ' ' << globals.windarrowsxyy0 << ' ' << globals.windarrowsxydx
+      << ' ' << globals.windarrowsxydy;
 
-      if (globals.arrowfile == "roundarrow")
+  auto sites = cached_arrow_data(
+      arrowsite_cache,
+      key.str(),
+      [&]()
       {
-        draw_roundarrow(img, xy0, speed, -dir - *north + 180);
-      }
-      else
-      {
-        if (globals.arrowfile == "meteorological")
-        {
-          NFmiPath strokes;
-          NFmiPath flags;
+        Fmi::CoordinateTransformation transformation("WGS84", theArea.SpatialReference());
 
-          strokes.Add(GramTools::metarrowlines(speed, latlon));
-          flags.Add(GramTools::metarrowflags(speed, latlon));
-
-          if (speed > 0 && speed != kFloatMissing)
+        ArrowSites ret;
+        for (float y = globals.windarrowsxyy0; y <= img.Height(); y += globals.windarrowsxydy)
+          for (float x = globals.windarrowsxyx0; x <= img.Width(); x += globals.windarrowsxydx)
           {
-            strokes.Scale(globals.windarrowscaleA * log10(globals.windarrowscaleB * speed + 1) +
-                          globals.windarrowscaleC);
-            flags.Scale(globals.windarrowscaleA * log10(globals.windarrowscaleB * speed + 1) +
-                        globals.windarrowscaleC);
-          }
+            NFmiPoint xy0(x, y);
 
-          strokes.Scale(globals.arrowscale);
-          strokes.Rotate(-dir - *north + 180);
-          strokes.Translate(static_cast<float>(xy0.X()), static_cast<float>(xy0.Y()));
+            // Skip the point if it is masked
+            if (IsMasked(xy0, globals.mask))
+              continue;
 
-          flags.Scale(globals.arrowscale);
-          flags.Rotate(-dir - *north + 180);
-          flags.Translate(static_cast<float>(xy0.X()), static_cast<float>(xy0.Y()));
+            // Calculate the latlon value
 
-          ArrowStyle style = globals.getArrowStroke(speed);
-          strokes.Stroke(img, style.width, style.color, style.rule);
-          flags.Fill(img, style.color, style.rule);
-        }
-        else
-        {
-          NFmiPath arrowpath;
-          arrowpath.Add(theArrow);
+            NFmiPoint latlon = theArea.ToLatLon(xy0);
 
-          if (speed > 0 && speed != kFloatMissing)
-            arrowpath.Scale(globals.windarrowscaleA * log10(globals.windarrowscaleB * speed + 1) +
-                            globals.windarrowscaleC);
-          arrowpath.Scale(globals.arrowscale);
-          arrowpath.Rotate(-dir - *north + 180);
-          arrowpath.Translate(static_cast<float>(xy0.X()), static_cast<float>(xy0.Y()));
+            // Direction calculations
 
-          // And render it
+            auto north = arrow_north(transformation, latlon);
+            if (!north)
+              continue;
 
-          ArrowStyle fillstyle = globals.getArrowFill(speed);
-          arrowpath.Fill(img, fillstyle.color, fillstyle.rule);
+            ret.push_back(ArrowSite{xy0, latlon, *north, x, y});
+          }
+        return ret;
+      });
 
-          ArrowStyle strokestyle = globals.getArrowStroke(speed);
-          arrowpath.Stroke(img, strokestyle.width, strokestyle.color, strokestyle.rule);
-        }
-      }
-    }
+  draw_wind_arrows_at(img, *sites, theArrow, direction_src, direction_dst, speed_src, speed_dst);
 }
 
 // ----------------------------------------------------------------------
@@ -4209,11 +5492,11 @@ void draw_wind_arrows(ImagineXr_or_NFmiImage &img, const NFmiArea &theArea)
     // Find the proper queryinfo to be used
 
     bool ok = false;
-    for (unsigned int qi = 0; qi < globals.querystreams.size(); qi++)
+    for (unsigned int qi = 0; qi < renderstate->querystreams.size(); qi++)
     {
-      globals.queryinfo = globals.querystreams[qi];
-      globals.queryinfo->Param(param);
-      ok = globals.queryinfo->IsParamUsable();
+      renderstate->queryinfo = renderstate->querystreams[qi];
+      renderstate->queryinfo->Param(param);
+      ok = renderstate->queryinfo->IsParamUsable();
       if (ok)
         break;
     }
@@ -4225,16 +5508,13 @@ void draw_wind_arrows(ImagineXr_or_NFmiImage &img, const NFmiArea &theArea)
 
     NFmiPath arrowpath;
     if (globals.arrowfile != "meteorological" && globals.arrowfile != "roundarrow")
-    {
-      const string &arr = globals.itsArrowCache.find(globals.arrowfile);
-      arrowpath.Add(arr);
-    }
+      arrowpath = globals.itsArrowCache.findPath(globals.arrowfile);
 
     // Establish data replacement values
 
     list<ContourSpec>::iterator piter;
-    list<ContourSpec>::iterator pbegin = globals.specs.begin();
-    list<ContourSpec>::iterator pend = globals.specs.end();
+    list<ContourSpec>::iterator pbegin = renderstate->specs.begin();
+    list<ContourSpec>::iterator pend = renderstate->specs.end();
 
     float direction_src = kFloatMissing;
     float direction_dst = kFloatMissing;
@@ -4266,171 +5546,550 @@ void draw_wind_arrows(ImagineXr_or_NFmiImage &img, const NFmiArea &theArea)
 
 // ----------------------------------------------------------------------
 /*!
- * \brief Draw contour fills
+ * \brief Return the contours projected onto the image being rendered
+ *
+ * Map tiles are cut from the contours projected onto the whole zoom
+ * level, so that the projection is calculated and cached only once
+ * for all tiles. The parts outside the tile are clipped away so that
+ * the rendering work is proportional to what the tile shows.
  */
 // ----------------------------------------------------------------------
 
-void draw_contour_fills(ImagineXr_or_NFmiImage &img,
-                        const NFmiArea &theArea,
-                        const ContourSpec &theSpec,
-                        const NFmiTime &theTime,
-                        ContourInterpolation theInterpolation)
+template <typename Calculate>
+vector<NFmiPath> image_contours(const NFmiArea &theArea,
+                                const ImagineXr_or_NFmiImage &img,
+                                double theMargin,
+                                Calculate theCalculate)
 {
-  list<ContourRange>::const_iterator it;
-  list<ContourRange>::const_iterator begin;
-  list<ContourRange>::const_iterator end;
-
-  begin = theSpec.contourFills().begin();
-  end = theSpec.contourFills().end();
+  const RenderState &state = *renderstate;
+  if (state.contourarea == nullptr)
+    return theCalculate(theArea);
 
-  for (it = begin; it != end; ++it)
+  vector<NFmiPath> paths = theCalculate(*state.contourarea);
+  for (NFmiPath &path : paths)
   {
-    // Contour the actual data
-
-    NFmiPath path = globals.calculator.contour(
-        *globals.queryinfo, it->lolimit(), it->hilimit(), theTime, theInterpolation);
-
-    if (globals.verbose && globals.calculator.wasCached())
-      cout << "Using cached " << it->lolimit() << " - " << it->hilimit() << endl;
-
-    // Avoid unnecessary work if the path is empty
-    if (path.Empty() && it->lolimit() != kFloatMissing && it->hilimit() != kFloatMissing)
+    if (path.Empty())
       continue;
-
-    // MeridianTools::Relocate(path,theArea);
-    path.Project(&theArea);
-    invert_if_missing(path, it->lolimit(), it->hilimit());
-
-    NFmiColorTools::NFmiBlendRule rule = ColorTools::checkrule(it->rule());
-
-    path.Fill(img, it->color(), rule);
+    path.Translate(-state.contourx, -state.contoury);
+    path = path.Clip(0, 0, img.Width(), img.Height(), theMargin);
   }
+  return paths;
 }
 
 // ----------------------------------------------------------------------
 /*!
- *\brief Draw contour patterns
+ * \brief Interpolate the value at the given grid coordinates
+ *
+ * Cells with missing corners use the nearest value.
  */
 // ----------------------------------------------------------------------
 
-void draw_contour_patterns(ImagineXr_or_NFmiImage &img,
-                           const NFmiArea &theArea,
-                           const ContourSpec &theSpec,
-                           const NFmiTime &theTime,
-                           ContourInterpolation theInterpolation)
+float raster_value(const NFmiDataMatrix<float> &theValues,
+                   float theX,
+                   float theY,
+                   ContourInterpolation theInterpolation)
 {
-  list<ContourPattern>::const_iterator it;
-  list<ContourPattern>::const_iterator begin;
-  list<ContourPattern>::const_iterator end;
+  const std::size_t nx = theValues.NX();
+  const std::size_t ny = theValues.NY();
 
-  begin = theSpec.contourPatterns().begin();
-  end = theSpec.contourPatterns().end();
+  // NaN coordinates fail the tests too
 
-  for (it = begin; it != end; ++it)
-  {
-    NFmiPath path = globals.calculator.contour(
-        *globals.queryinfo, it->lolimit(), it->hilimit(), theTime, theInterpolation);
+  if (!(theX >= 0 && theY >= 0 && theX <= nx - 1 && theY <= ny - 1))
+    return kFloatMissing;
 
-    if (globals.verbose && globals.calculator.wasCached())
-      cout << "Using cached " << it->lolimit() << " - " << it->hilimit() << endl;
+  const float nearest = theValues[lround(theX)][lround(theY)];
+  if (theInterpolation == Nearest || theInterpolation == Discrete || nx < 2 || ny < 2)
+    return nearest;
 
-    NFmiColorTools::NFmiBlendRule rule = ColorTools::checkrule(it->rule());
-    const ImagineXr_or_NFmiImage &pattern = globals.getImage(it->pattern());
+  const std::size_t i = std::min(static_cast<std::size_t>(theX), nx - 2);
+  const std::size_t j = std::min(static_cast<std::size_t>(theY), ny - 2);
+  const float dx = theX - i;
+  const float dy = theY - j;
 
-    // MeridianTools::Relocate(path,theArea);
-    path.Project(&theArea);
-    invert_if_missing(path, it->lolimit(), it->hilimit());
+  float v1 = theValues[i][j];
+  float v2 = theValues[i + 1][j];
+  float v3 = theValues[i][j + 1];
+  float v4 = theValues[i + 1][j + 1];
+  if (v1 == kFloatMissing || v2 == kFloatMissing || v3 == kFloatMissing || v4 == kFloatMissing)
+    return nearest;
 
-    path.Fill(img, pattern, rule, it->factor());
+  const bool logarithmic = (theInterpolation == LogLinear && v1 > 0 && v2 > 0 && v3 > 0 && v4 > 0);
+  if (logarithmic)
+  {
+    v1 = log(v1);
+    v2 = log(v2);
+    v3 = log(v3);
+    v4 = log(v4);
   }
+
+  const float value = (1 - dy) * ((1 - dx) * v1 + dx * v2) + dy * ((1 - dx) * v3 + dx * v4);
+  return (logarithmic ? exp(value) : value);
 }
 
 // ----------------------------------------------------------------------
 /*!
- *\brief Draw contour strokes
+ * \brief Return the grid coordinates of the image pixels
+ *
+ * The lookup table is calculated once for each projection, grid and
+ * position of the image within the area.
  */
 // ----------------------------------------------------------------------
 
-void draw_contour_strokes(ImagineXr_or_NFmiImage &img,
-                          const NFmiArea &theArea,
-                          const ContourSpec &theSpec,
-                          const NFmiTime &theTime,
-                          ContourInterpolation theInterpolation)
+const RenderState::PixelGrid &pixel_grid(const ImagineXr_or_NFmiImage &img,
+                                         const NFmiArea &theArea)
 {
-  list<ContourValue>::const_iterator it;
-  list<ContourValue>::const_iterator begin;
-  list<ContourValue>::const_iterator end;
+  RenderState &state = *renderstate;
+  const NFmiArea &area = (state.contourarea ? *state.contourarea : theArea);
+  const double x0 = (state.contourarea ? state.contourx : 0);
+  const double y0 = (state.contourarea ? state.contoury : 0);
 
-  begin = theSpec.contourValues().begin();
-  end = theSpec.contourValues().end();
+  ostringstream key;
+  key << state.projection << ' ' << state.queryinfo->GridKey() << ' ' << x0 << ' ' << y0 << ' '
+      << img.Width() << 'x' << img.Height();
 
-  for (it = begin; it != end; ++it)
-  {
-    NFmiPath path =
-        globals.calculator.contour(*globals.queryinfo, it->value(), theTime, theInterpolation);
+  auto it = state.pixelgrids.find(key.str());
+  if (it != state.pixelgrids.end())
+    return it->second;
 
-    if (globals.verbose && globals.calculator.wasCached())
-      cout << "Using cached " << it->value() << endl;
+  Profiler::Phase phase("pixelgrid");
 
-    NFmiColorTools::NFmiBlendRule rule = ColorTools::checkrule(it->rule());
-    // MeridianTools::Relocate(path,theArea);
-    path.Project(&theArea);
-    path.SimplifyLines(10);
-    float width = it->linewidth();
-    if (width == 1)
-      path.Stroke(img, it->color(), rule);
-    else
-      path.Stroke(img, width, it->color(), rule);
+  RenderState::PixelGrid pixels;
+  const std::size_t n = static_cast<std::size_t>(img.Width()) * img.Height();
+  pixels.x.resize(n, std::numeric_limits<float>::quiet_NaN());
+  pixels.y.resize(n, std::numeric_limits<float>::quiet_NaN());
+
+  const NFmiGrid *grid = state.queryinfo->Grid();
+  if (grid != nullptr)
+  {
+    std::size_t k = 0;
+    for (int j = 0; j < img.Height(); j++)
+      for (int i = 0; i < img.Width(); i++, k++)
+      {
+        const NFmiPoint latlon = area.ToLatLon(NFmiPoint(x0 + i, y0 + j));
+        const NFmiPoint xy = grid->LatLonToGrid(latlon);
+        if (std::isfinite(xy.X()) && std::isfinite(xy.Y()))
+        {
+          pixels.x[k] = static_cast<float>(xy.X());
+          pixels.y[k] = static_cast<float>(xy.Y());
+        }
+      }
   }
+
+  return state.pixelgrids.insert(make_pair(key.str(), std::move(pixels))).first->second;
 }
 
 // ----------------------------------------------------------------------
 /*!
- * \brief Collect contour label candidate coordinates
+ * \brief Draw contour fills by classifying the pixels directly
+ *
+ * The interpolated value of each pixel is calculated once and then
+ * classified against the fills of each layer. Consecutive fills with the same
+ * rule and disjoint limits are combined into a single layer, which is
+ * composited onto the image with the rule. Only rules for which
+ * transparent pixels leave the image intact can be used.
+ *
+ * \return False if the fills must be drawn as polygons
  */
 // ----------------------------------------------------------------------
 
-void save_contour_labels(ImagineXr_or_NFmiImage &img,
-                         const NFmiArea &theArea,
-                         const ContourSpec &theSpec,
-                         const NFmiTime &theTime,
-                         ContourInterpolation theInterpolation)
+bool draw_raster_fills(ImagineXr_or_NFmiImage &img,
+                       const NFmiArea &theArea,
+                       const ContourSpec &theSpec,
+                       const NFmiDataMatrix<float> &theValues,
+                       ContourInterpolation theInterpolation)
 {
-  // The ID under which the coordinates will be stored
+#ifdef IMAGINE_WITH_CAIRO
+  return false;
+#else
+  const list<ContourRange> &fills = theSpec.contourFills();
 
-  int id = paramid(theSpec.param());
-  globals.labellocator.parameter(id);
+  for (const ContourRange &range : fills)
+  {
+    const NFmiColorTools::NFmiBlendRule rule = ColorTools::checkrule(range.rule());
+    if (rule != NFmiColorTools::kFmiColorOver && rule != NFmiColorTools::kFmiColorAtop)
+    {
+      if (globals.verbose)
+        cout << "Using vector fills for rule " << range.rule() << endl;
+      return false;
+    }
+  }
 
-  // Start saving candindate coordinates
+  if (fills.empty() || theValues.NX() == 0 || theValues.NY() == 0)
+    return true;
 
-  list<ContourLabel>::const_iterator it;
-  list<ContourLabel>::const_iterator begin;
-  list<ContourLabel>::const_iterator end;
+  const RenderState::PixelGrid &pixels = pixel_grid(img, theArea);
 
-  begin = theSpec.contourLabels().begin();
-  end = theSpec.contourLabels().end();
+  Profiler::Phase phase("rasterfill");
 
-  for (it = begin; it != end; ++it)
-  {
-    NFmiPath path =
-        globals.calculator.contour(*globals.queryinfo, it->value(), theTime, theInterpolation);
+  const std::size_t n = pixels.x.size();
+  std::vector<float> values(n);
+  for (std::size_t k = 0; k < n; k++)
+    values[k] = raster_value(theValues, pixels.x[k], pixels.y[k], theInterpolation);
 
-    // MeridianTools::Relocate(path,theArea);
-    path.Project(&theArea);
+  auto limits = [](const ContourRange &theRange)
+  { return RangeTools::Range(theRange.lolimit(), theRange.hilimit()); };
 
-    for (NFmiPathData::const_iterator pit = path.Elements().begin(); pit != path.Elements().end();
-         ++pit)
+  const NFmiColorTools::Color transparent =
+      NFmiColorTools::MakeColor(0, 0, 0, NFmiColorTools::Transparent);
+
+  auto begin = fills.begin();
+  while (begin != fills.end())
+  {
+    // Collect the fills of the layer
+
+    std::vector<const ContourRange *> layer(1, &*begin);
+    std::vector<RangeTools::Range> ranges(1, limits(*begin));
+    auto end = std::next(begin);
+    for (; end != fills.end() && end->rule() == begin->rule(); ++end)
     {
-      if (pit->op == kFmiLineTo)
-      {
-        globals.labellocator.add(
-            it->value(), static_cast<int>(round(pit->x)), static_cast<int>(round(pit->y)));
-      }
+      bool overlaps = false;
+      for (const RangeTools::Range &range : ranges)
+        overlaps |= RangeTools::overlap(limits(*end), range);
+      if (overlaps)
+        break;
+      layer.push_back(&*end);
+      ranges.push_back(limits(*end));
     }
-  }
-}
 
-// ----------------------------------------------------------------------
+    std::vector<std::uint16_t> indexes;
+    RangeTools::classify(values.data(), n, ranges, indexes);
+
+    NFmiImage colors(img.Width(), img.Height(), transparent);
+    bool empty = true;
+    std::size_t k = 0;
+    for (int j = 0; j < img.Height(); j++)
+      for (int i = 0; i < img.Width(); i++, k++)
+        if (indexes[k] != RangeTools::none)
+        {
+          colors(i, j) = layer[indexes[k]]->color();
+          empty = false;
+        }
+
+    if (!empty)
+      img.Composite(colors, ColorTools::checkrule(begin->rule()), kFmiAlignNorthWest, 0, 0, 1);
+
+    begin = end;
+  }
+  return true;
+#endif
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief A path to be filled by fill_paths
+ */
+// ----------------------------------------------------------------------
+
+struct PathFill
+{
+  const NFmiPath *path;
+  std::function<void(ImagineXr_or_NFmiImage &, const NFmiPath &)> fill;
+};
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Fill the paths in order
+ *
+ * With "filltiles" a large image is split into horizontal tiles which
+ * are filled in parallel. Each tile gets a copy of its rows, and the
+ * paths clipped to the tile and translated onto it are filled in the
+ * original order, hence the blending order of each pixel is kept.
+ * Pattern fills are not tiled, since the patterns are aligned with
+ * the image origin.
+ */
+// ----------------------------------------------------------------------
+
+void fill_paths(ImagineXr_or_NFmiImage &img, const std::vector<PathFill> &theFills)
+{
+#ifndef IMAGINE_WITH_CAIRO
+  const int width = img.Width();
+  const int height = img.Height();
+
+  std::size_t tiles = 1;
+  if (globals.filltiles > 0 && theFills.size() > 0)
+    tiles = std::min<std::size_t>(renderstate->threads, height / globals.filltiles);
+
+  if (tiles > 1)
+  {
+    TaskScheduler::run(tiles,
+                       tiles,
+                       [&](std::size_t t)
+                       {
+                         const int y1 = static_cast<int>(t * height / tiles);
+                         const int y2 = static_cast<int>((t + 1) * height / tiles);
+
+                         NFmiImage tile(width, y2 - y1);
+                         for (int j = y1; j < y2; j++)
+                           for (int i = 0; i < width; i++)
+                             tile(i, j - y1) = img(i, j);
+
+                         for (const PathFill &fill : theFills)
+                         {
+                           NFmiPath path = fill.path->Clip(0, y1, width, y2, 2);
+                           if (path.Empty())
+                             continue;
+                           path.Translate(0, -y1);
+                           fill.fill(tile, path);
+                         }
+
+                         for (int j = y1; j < y2; j++)
+                           for (int i = 0; i < width; i++)
+                             img(i, j) = tile(i, j - y1);
+                       });
+    return;
+  }
+#endif
+
+  for (const PathFill &fill : theFills)
+    fill.fill(img, *fill.path);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Draw contour fills
+ */
+// ----------------------------------------------------------------------
+
+void draw_contour_fills(ImagineXr_or_NFmiImage &img,
+                        const NFmiArea &theArea,
+                        const ContourSpec &theSpec,
+                        const NFmiTime &theTime,
+                        ContourInterpolation theInterpolation,
+                        const NFmiDataMatrix<float> &theValues)
+{
+  if (globals.contourfillmode == "raster" &&
+      draw_raster_fills(img, theArea, theSpec, theValues, theInterpolation))
+    return;
+
+  list<ContourRange>::const_iterator it;
+  list<ContourRange>::const_iterator begin;
+  list<ContourRange>::const_iterator end;
+
+  begin = theSpec.contourFills().begin();
+  end = theSpec.contourFills().end();
+
+  // Contour the actual data, all bands at once
+
+  vector<pair<float, float> > limits;
+  for (it = begin; it != end; ++it)
+    limits.push_back(make_pair(it->lolimit(), it->hilimit()));
+
+  vector<NFmiPath> paths = image_contours(theArea,
+                                          img,
+                                          0,
+                                          [&](const NFmiArea &area)
+                                          {
+                                            return renderstate->calculator.contours(
+                                                *renderstate->queryinfo,
+                                                limits,
+                                                theTime,
+                                                theInterpolation,
+                                                area,
+                                                renderstate->projection);
+                                          });
+
+  // Render in the original order
+
+  Profiler::Phase phase("fill");
+  std::vector<PathFill> fills;
+  size_t i = 0;
+  for (it = begin; it != end; ++it, ++i)
+  {
+    NFmiPath &path = paths[i];
+
+    if (globals.verbose && renderstate->calculator.wasCached(i))
+      cout << "Using cached " << it->lolimit() << " - " << it->hilimit() << endl;
+
+    // Avoid unnecessary work if the path is empty
+    if (path.Empty() && it->lolimit() != kFloatMissing && it->hilimit() != kFloatMissing)
+      continue;
+
+    invert_if_missing(path, it->lolimit(), it->hilimit());
+
+    const NFmiColorTools::Color color = it->color();
+    const NFmiColorTools::NFmiBlendRule rule = ColorTools::checkrule(it->rule());
+
+    fills.push_back(
+        PathFill{&path,
+                 [color, rule](ImagineXr_or_NFmiImage &theImage, const NFmiPath &thePath)
+                 { thePath.Fill(theImage, color, rule); }});
+  }
+  fill_paths(img, fills);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ *\brief Draw contour patterns
+ */
+// ----------------------------------------------------------------------
+
+void draw_contour_patterns(ImagineXr_or_NFmiImage &img,
+                           const NFmiArea &theArea,
+                           const ContourSpec &theSpec,
+                           const NFmiTime &theTime,
+                           ContourInterpolation theInterpolation)
+{
+  list<ContourPattern>::const_iterator it;
+  list<ContourPattern>::const_iterator begin;
+  list<ContourPattern>::const_iterator end;
+
+  begin = theSpec.contourPatterns().begin();
+  end = theSpec.contourPatterns().end();
+
+  vector<pair<float, float> > limits;
+  for (it = begin; it != end; ++it)
+    limits.push_back(make_pair(it->lolimit(), it->hilimit()));
+
+  vector<NFmiPath> paths = image_contours(theArea,
+                                          img,
+                                          0,
+                                          [&](const NFmiArea &area)
+                                          {
+                                            return renderstate->calculator.contours(
+                                                *renderstate->queryinfo,
+                                                limits,
+                                                theTime,
+                                                theInterpolation,
+                                                area,
+                                                renderstate->projection);
+                                          });
+
+  Profiler::Phase phase("pattern");
+  size_t i = 0;
+  for (it = begin; it != end; ++it, ++i)
+  {
+    NFmiPath &path = paths[i];
+
+    if (globals.verbose && renderstate->calculator.wasCached(i))
+      cout << "Using cached " << it->lolimit() << " - " << it->hilimit() << endl;
+
+    NFmiColorTools::NFmiBlendRule rule = ColorTools::checkrule(it->rule());
+    const ImagineXr_or_NFmiImage &pattern = globals.getImage(it->pattern());
+
+    invert_if_missing(path, it->lolimit(), it->hilimit());
+
+    path.Fill(img, pattern, rule, it->factor());
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ *\brief Draw contour strokes
+ */
+// ----------------------------------------------------------------------
+
+void draw_contour_strokes(ImagineXr_or_NFmiImage &img,
+                          const NFmiArea &theArea,
+                          const ContourSpec &theSpec,
+                          const NFmiTime &theTime,
+                          ContourInterpolation theInterpolation)
+{
+  list<ContourValue>::const_iterator it;
+  list<ContourValue>::const_iterator begin;
+  list<ContourValue>::const_iterator end;
+
+  begin = theSpec.contourValues().begin();
+  end = theSpec.contourValues().end();
+
+  vector<float> values;
+  for (it = begin; it != end; ++it)
+    values.push_back(it->value());
+
+  vector<NFmiPath> paths = image_contours(theArea,
+                                          img,
+                                          10,
+                                          [&](const NFmiArea &area)
+                                          {
+                                            return renderstate->calculator.contours(
+                                                *renderstate->queryinfo,
+                                                values,
+                                                theTime,
+                                                theInterpolation,
+                                                area,
+                                                renderstate->projection,
+                                                10);
+                                          });
+
+  Profiler::Phase phase("stroke");
+  size_t i = 0;
+  for (it = begin; it != end; ++it, ++i)
+  {
+    NFmiPath &path = paths[i];
+
+    if (globals.verbose && renderstate->calculator.wasCached(i))
+      cout << "Using cached " << it->value() << endl;
+
+    NFmiColorTools::NFmiBlendRule rule = ColorTools::checkrule(it->rule());
+    float width = it->linewidth();
+    if (width == 1)
+      path.Stroke(img, it->color(), rule);
+    else
+      path.Stroke(img, width, it->color(), rule);
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Collect contour label candidate coordinates
+ */
+// ----------------------------------------------------------------------
+
+void save_contour_labels(ImagineXr_or_NFmiImage &img,
+                         const NFmiArea &theArea,
+                         const ContourSpec &theSpec,
+                         const NFmiTime &theTime,
+                         ContourInterpolation theInterpolation)
+{
+  // The ID under which the coordinates will be stored
+
+  int id = paramid(theSpec.param());
+
+  // Start saving candindate coordinates
+
+  list<ContourLabel>::const_iterator it;
+  list<ContourLabel>::const_iterator begin;
+  list<ContourLabel>::const_iterator end;
+
+  begin = theSpec.contourLabels().begin();
+  end = theSpec.contourLabels().end();
+
+  vector<float> values;
+  for (it = begin; it != end; ++it)
+    values.push_back(it->value());
+
+  vector<NFmiPath> paths = image_contours(theArea,
+                                          img,
+                                          0,
+                                          [&](const NFmiArea &area)
+                                          {
+                                            return renderstate->calculator.contours(
+                                                *renderstate->queryinfo,
+                                                values,
+                                                theTime,
+                                                theInterpolation,
+                                                area,
+                                                renderstate->projection,
+                                                0);
+                                          });
+
+  size_t i = 0;
+  for (it = begin; it != end; ++it, ++i)
+  {
+    const NFmiPath &path = paths[i];
+
+    for (NFmiPathData::const_iterator pit = path.Elements().begin(); pit != path.Elements().end();
+         ++pit)
+    {
+      if (pit->op == kFmiLineTo)
+      {
+        renderstate->labelcandidates.push_back(LabelCandidate{
+            id, it->value(), static_cast<int>(round(pit->x)), static_cast<int>(round(pit->y))});
+      }
+    }
+  }
+}
+
+// ----------------------------------------------------------------------
 /*!
  *\brief Draw contour labels
  */
@@ -4446,8 +6105,8 @@ void draw_contour_labels(ImagineXr_or_NFmiImage &img)
   // Iterate through all parameters
 
   list<ContourSpec>::iterator piter;
-  list<ContourSpec>::iterator pbegin = globals.specs.begin();
-  list<ContourSpec>::iterator pend = globals.specs.end();
+  list<ContourSpec>::iterator pbegin = renderstate->specs.begin();
+  list<ContourSpec>::iterator pend = renderstate->specs.end();
 
   for (piter = pbegin; piter != pend; ++piter)
   {
@@ -4470,10 +6129,7 @@ void draw_contour_labels(ImagineXr_or_NFmiImage &img)
 #ifdef IMAGINE_WITH_CAIRO
     img.MakeFace(fontspec, backcolor, xmargin, ymargin);
 #else
-    Imagine::NFmiFace face = make_face(fontspec);
-    face.Background(true);
-    face.BackgroundColor(backcolor);
-    face.BackgroundMargin(xmargin, ymargin);
+    LabelFace face(fontspec, backcolor, xmargin, ymargin);
 #endif
 
     for (LabelLocator::ContourCoordinates::const_iterator cit = pit->second.begin();
@@ -4515,51 +6171,51 @@ void draw_contour_labels(ImagineXr_or_NFmiImage &img)
 void save_contour_symbols(ImagineXr_or_NFmiImage &img,
                           const NFmiArea &theArea,
                           const ContourSpec &theSpec,
-                          const LazyCoordinates &thePoints,
                           const NFmiDataMatrix<float> &theValues)
 {
+  if (theSpec.contourSymbols().empty())
+    return;
+
   // The ID under which the coordinates will be stored
 
   int id = paramid(theSpec.param());
-  globals.imagelocator.parameter(id);
 
-  list<ContourSymbol>::const_iterator it;
-  list<ContourSymbol>::const_iterator begin;
-  list<ContourSymbol>::const_iterator end;
+  // Pixel coordinates are calculated once per grid and area
 
-  begin = theSpec.contourSymbols().begin();
-  end = theSpec.contourSymbols().end();
+  auto pixels = renderstate->queryinfo->LocationsPixelXY(theArea);
 
-  for (it = begin; it != end; ++it)
+  // Disjoint ranges are classified in a single pass, overlapping
+  // ones each give candidates of their own
+
+  std::vector<RangeTools::Range> ranges;
+  for (const ContourSymbol &symbol : theSpec.contourSymbols())
+    ranges.push_back(RangeTools::Range(symbol.lolimit(), symbol.hilimit()));
+
+  std::vector<std::vector<RangeTools::Range> > passes;
+  if (RangeTools::disjoint(ranges))
+    passes.push_back(ranges);
+  else
+    for (const RangeTools::Range &range : ranges)
+      passes.push_back(std::vector<RangeTools::Range>(1, range));
+
+  const std::size_t ny = theValues.NY();
+  std::vector<std::uint16_t> indexes;
+
+  for (const std::vector<RangeTools::Range> &pass : passes)
   {
-    const float lo = it->lolimit();
-    const float hi = it->hilimit();
+    RangeTools::classify(theValues, pass, indexes);
 
-    for (unsigned int j = 0; j < theValues.NY(); j++)
+    for (unsigned int j = 0; j < ny; j++)
       for (unsigned int i = 0; i < theValues.NX(); i++)
       {
-        const float z = theValues[i][j];
-        bool inside = false;
-        if (z == kFloatMissing)
-          inside = (lo == kFloatMissing && hi == kFloatMissing);
-        else if (lo != kFloatMissing && z < lo)
-          inside = false;
-        else if (hi != kFloatMissing && z >= hi)
-          inside = false;
-        else if (lo == kFloatMissing && hi == kFloatMissing)
-          inside = false;
-        else
-          inside = true;
-
-        if (inside)
-        {
-          NFmiPoint latlon = theArea.WorldXYToLatLon(thePoints(i, j));
-          // latlon = MeridianTools::Relocate(latlon,theArea);
-          NFmiPoint xy = theArea.ToXY(latlon);
+        if (indexes[i * ny + j] == RangeTools::none)
+          continue;
 
-          globals.imagelocator.add(
-              z, static_cast<int>(round(xy.X())), static_cast<int>(round(xy.Y())));
-        }
+        renderstate->imagecandidates.push_back(
+            LabelCandidate{id,
+                           theValues[i][j],
+                           static_cast<int>(round(pixels->x(i, j))),
+                           static_cast<int>(round(pixels->y(i, j)))});
       }
   }
 }
@@ -4580,8 +6236,8 @@ void draw_contour_symbols(ImagineXr_or_NFmiImage &img)
   // Iterate through all parameters
 
   list<ContourSpec>::iterator piter;
-  list<ContourSpec>::iterator pbegin = globals.specs.begin();
-  list<ContourSpec>::iterator pend = globals.specs.end();
+  list<ContourSpec>::iterator pbegin = renderstate->specs.begin();
+  list<ContourSpec>::iterator pend = renderstate->specs.end();
 
   for (piter = pbegin; piter != pend; ++piter)
   {
@@ -4660,8 +6316,8 @@ void draw_contour_fonts(ImagineXr_or_NFmiImage &img)
   // Iterate through all parameters
 
   list<ContourSpec>::iterator piter;
-  list<ContourSpec>::iterator pbegin = globals.specs.begin();
-  list<ContourSpec>::iterator pend = globals.specs.end();
+  list<ContourSpec>::iterator pbegin = renderstate->specs.begin();
+  list<ContourSpec>::iterator pend = renderstate->specs.end();
 
   for (piter = pbegin; piter != pend; ++piter)
   {
@@ -4718,8 +6374,7 @@ void draw_contour_fonts(ImagineXr_or_NFmiImage &img)
 #ifdef IMAGINE_WITH_CAIRO
       img.MakeFace(fontspec);
 #else
-      Imagine::NFmiFace face = make_face(fontspec);
-      face.Background(false);
+      LabelFace face(fontspec);
 #endif
       for (LabelLocator::Coordinates::const_iterator it = cit->second.begin();
            it != cit->second.end();
@@ -4748,13 +6403,13 @@ void draw_contour_fonts(ImagineXr_or_NFmiImage &img)
 void save_contour_fonts(ImagineXr_or_NFmiImage &img,
                         const NFmiArea &theArea,
                         const ContourSpec &theSpec,
-                        const LazyCoordinates &thePoints,
                         const NFmiDataMatrix<float> &theValues)
 {
+  if (theSpec.contourFonts().empty())
+    return;
   // The ID under which the coordinates will be stored
 
   int id = paramid(theSpec.param());
-  globals.symbollocator.parameter(id);
 
   // For speed we prefer to iterate only once through the data, and
   // instead use a fast way to test if a given value is to be contoured
@@ -4775,17 +6430,18 @@ void save_contour_fonts(ImagineXr_or_NFmiImage &img,
 
   // Now iterate through the data once, saving candidate points
 
+  auto pixels = renderstate->queryinfo->LocationsPixelXY(theArea);
+
   for (unsigned int j = 0; j < theValues.NY(); j++)
     for (unsigned int i = 0; i < theValues.NX(); i++)
     {
       if (okvalues.find(theValues[i][j]) != okvalues.end())
       {
-        NFmiPoint latlon = theArea.WorldXYToLatLon(thePoints(i, j));
-        // latlon = MeridianTools::Relocate(latlon,theArea);
-        NFmiPoint xy = theArea.ToXY(latlon);
-
-        globals.symbollocator.add(
-            theValues[i][j], static_cast<int>(round(xy.X())), static_cast<int>(round(xy.Y())));
+        renderstate->symbolcandidates.push_back(
+            LabelCandidate{id,
+                           theValues[i][j],
+                           static_cast<int>(round(pixels->x(i, j))),
+                           static_cast<int>(round(pixels->y(i, j)))});
       }
     }
 }
@@ -4811,203 +6467,1926 @@ void draw_overlay(ImagineXr_or_NFmiImage &img, const ContourSpec &theSpec)
 
 // ----------------------------------------------------------------------
 /*!
- * \brief Establish the type of extremum at the given point
+ * \brief Sliding window minimum or maximum of a sequence
  *
- * \param theValues The matrix of values
- * \param i The i-coordinate of the value
- * \param j The j-coordinate of the value
- * \param DX The search region in X-direction
- * \param DY The search region in Y-direction
- * \param mingradient Minimum required difference in area
- * \return -2/2 for absolute minima/maxima, -1/1 for minima/maxima, 0 for none
+ * The van Herk/Gil-Werman algorithm needs three comparisons per
+ * element regardless of the window width. Element k of the result is
+ * the extremum of the input elements [k,k+width).
+ *
+ * \param theInput The input sequence
+ * \param theWidth The window width
+ * \param theOutput The extrema, resized to size - width + 1
+ * \param theOp Either min or max
  */
 // ----------------------------------------------------------------------
 
-int extrematype(
-    const NFmiDataMatrix<float> &theValues, int i, int j, int DX, int DY, float mingradient)
+template <typename Op>
+void sliding_extremum(const std::vector<float> &theInput,
+                      std::size_t theWidth,
+                      std::vector<float> &theOutput,
+                      Op theOp)
 {
-  int smaller = 0;
-  int bigger = 0;
-
-  // minimum/maximum on the frame
-  float minimum = theValues[i - DX][j - DY];
-  float maximum = theValues[i - DX][j - DY];
+  const std::size_t n = theInput.size();
+  theOutput.clear();
+  if (theWidth == 0 || theWidth > n)
+    return;
 
-  for (int dy = -DY; dy <= DY; dy++)
-    for (int dx = -DX; dx <= DX; dx++)
-    {
-      // quick exit for missing values
-      if (theValues[i + dx][j + dy] == kFloatMissing)
-        return 0;
+  std::vector<float> prefix(n), suffix(n);
 
-      if (dx != 0 && dy != 0)
-      {
-        if (theValues[i + dx][j + dy] < theValues[i][j])
-          ++smaller;
-        else if (theValues[i + dx][j + dy] > theValues[i][j])
-          ++bigger;
-      }
+  for (std::size_t k = 0; k < n; k++)
+    prefix[k] = (k % theWidth == 0 ? theInput[k] : theOp(prefix[k - 1], theInput[k]));
 
-      // quick exit for non-extrema
-      if (smaller > 0 && bigger > 0)
-        return 0;
+  for (std::size_t k = n; k-- > 0;)
+    suffix[k] = (k == n - 1 || (k + 1) % theWidth == 0 ? theInput[k]
+                                                       : theOp(suffix[k + 1], theInput[k]));
 
-      // update extrema values
+  theOutput.resize(n - theWidth + 1);
+  for (std::size_t k = 0; k + theWidth <= n; k++)
+    theOutput[k] = theOp(suffix[k], prefix[k + theWidth - 1]);
+}
 
-      if (dx == -DX || dx == DX || dy == -DY || dy == DY)
-      {
-        minimum = min(minimum, theValues[i + dx][j + dy]);
-        maximum = max(maximum, theValues[i + dx][j + dy]);
-      }
-    }
+// ----------------------------------------------------------------------
+/*!
+ * \brief Sliding window extrema of a matrix
+ *
+ * Element (i,j) of the result is the extremum of the box of the given
+ * size whose lower left corner is at (i,j). Either dimension may be 1.
+ */
+// ----------------------------------------------------------------------
 
-  // minimum change from center to rim
+template <typename Op>
+void box_extremum(const NFmiDataMatrix<float> &theValues,
+                  std::size_t theWidth,
+                  std::size_t theHeight,
+                  NFmiDataMatrix<float> &theResult,
+                  Op theOp)
+{
+  const std::size_t nx = theValues.NX();
+  const std::size_t ny = theValues.NY();
 
-  float change = min(abs(theValues[i][j] - minimum), abs(theValues[i][j] - maximum));
+  // Columns are contiguous, hence the vertical pass first
 
-#if 0
-  if(change >= mingradient)
-	cout << "Change = " << change << " at " << i << ' ' << j << endl;
-#endif
+  std::vector<std::vector<float> > columns(nx);
+  for (std::size_t i = 0; i < nx; i++)
+    sliding_extremum(theValues[i], theHeight, columns[i], theOp);
 
-  if (change < mingradient)
-    return 0;
+  const std::size_t rows = (ny >= theHeight ? ny - theHeight + 1 : 0);
+  const std::size_t cols = (nx >= theWidth ? nx - theWidth + 1 : 0);
+  theResult = NFmiDataMatrix<float>(cols, rows);
 
-  else if (smaller == (DX * 2 + 1) * (DY * 2 + 1) - 1)
-    return 2;
-  else if (bigger == (DX * 2 + 1) * (DY * 2 + 1) - 1)
-    return -2;
-  else if (smaller > 0)
-    return 1;
-  else if (bigger > 0)
-    return -1;
-  else
-    return 0;  // should never happen due to quick exit in the loop
+  std::vector<float> row(nx), out;
+  for (std::size_t j = 0; j < rows; j++)
+  {
+    for (std::size_t i = 0; i < nx; i++)
+      row[i] = columns[i][j];
+    sliding_extremum(row, theWidth, out, theOp);
+    for (std::size_t i = 0; i < cols; i++)
+      theResult[i][j] = out[i];
+  }
 }
 
 // ----------------------------------------------------------------------
 /*!
- * \brief Draw high/low pressure markers
+ * \brief Establish the type of extremum at all grid points
+ *
+ * A point is an extremum candidate if the search region around it has
+ * no missing values, if all values outside the row and the column of
+ * the point are on the same side of it, and if the change from the
+ * point to the rim of the region is at least the required gradient.
+ * The extrema of the region parts are calculated with sliding window
+ * filters, hence the cost does not depend on the size of the region.
+ *
+ * \param theValues The matrix of values
+ * \param DX The search region in X-direction
+ * \param DY The search region in Y-direction
+ * \param mingradient Minimum required difference in area
+ * \param theTypes -1/1 for minima/maxima, 0 for none
  */
 // ----------------------------------------------------------------------
 
-void draw_pressure_markers(ImagineXr_or_NFmiImage &img, const NFmiArea &theArea)
+void extrema_types(const NFmiDataMatrix<float> &theValues,
+                   int DX,
+                   int DY,
+                   float mingradient,
+                   NFmiDataMatrix<int> &theTypes)
 {
-  // Establish which markers are to be drawn
-
-  bool dohigh = !globals.highpressureimage.empty();
-  bool dolow = !globals.lowpressureimage.empty();
-
-  // Exit if none
+  const std::size_t nx = theValues.NX();
+  const std::size_t ny = theValues.NY();
+  theTypes = NFmiDataMatrix<int>(nx, ny, 0);
 
-  if (!dohigh && !dolow)
+  if (nx < static_cast<std::size_t>(2 * DX + 1) || ny < static_cast<std::size_t>(2 * DY + 1))
     return;
 
-  // Get the data to be analyzed
+  auto minop = [](float a, float b) { return std::min(a, b); };
+  auto maxop = [](float a, float b) { return std::max(a, b); };
 
-  choose_queryinfo("Pressure", 0);
+  // Quadrants excluding the row and the column of the point
 
-  auto worldpts = globals.queryinfo->LocationsWorldXY(theArea);
+  NFmiDataMatrix<float> quadmin, quadmax;
+  box_extremum(theValues, DX, DY, quadmin, minop);
+  box_extremum(theValues, DX, DY, quadmax, maxop);
 
-  auto vals = globals.queryinfo->Values();
-  globals.unitsconverter.convert(FmiParameterName(globals.queryinfo->GetParamIdent()), vals);
+  // Rows and columns of the rim
 
-  // Insert candidate coordinates into the system
+  NFmiDataMatrix<float> rowmin, rowmax, colmin, colmax;
+  box_extremum(theValues, 2 * DX + 1, 1, rowmin, minop);
+  box_extremum(theValues, 2 * DX + 1, 1, rowmax, maxop);
+  box_extremum(theValues, 1, 2 * DY + 1, colmin, minop);
+  box_extremum(theValues, 1, 2 * DY + 1, colmax, maxop);
 
-  // const double dx = theArea.WorldXYWidth()/theArea.Grid()->XNumber();
-  // const double dy = theArea.WorldXYHeight()/theArea.Grid()->YNumber();
+  // Summed area table of missing values
 
-  const int DX = 7;  // ceil(500*1000/dx/2);	// 500km radius required
-  const int DY = 7;  // ceil(500*1000/dx/2);
-  const float required_gradient = 1.0;
+  NFmiDataMatrix<int> missing(nx + 1, ny + 1, 0);
+  for (std::size_t i = 0; i < nx; i++)
+    for (std::size_t j = 0; j < ny; j++)
+      missing[i + 1][j + 1] = missing[i][j + 1] + missing[i + 1][j] - missing[i][j] +
+                              (theValues[i][j] == kFloatMissing ? 1 : 0);
 
-  for (unsigned int j = DY; j < vals.NY() - DY; j++)
-    for (unsigned int i = DX; i < vals.NX() - DX; i++)
+  for (std::size_t i = DX; i < nx - DX; i++)
+    for (std::size_t j = DY; j < ny - DY; j++)
     {
-      int extrem = extrematype(vals, i, j, DX, DY, required_gradient);
-      if (extrem != 0)
-      {
-        NFmiPoint point(worldpts->x(i, j) / 1000, worldpts->y(i, j) / 1000);
+      const std::size_t i1 = i - DX, i2 = i + DX + 1;
+      const std::size_t j1 = j - DY, j2 = j + DY + 1;
+      if (missing[i2][j2] - missing[i1][j2] - missing[i2][j1] + missing[i1][j1] > 0)
+        continue;
 
-        if (extrem < 0)
-        {
-          if (dolow)
-            globals.pressurelocator.add(ExtremaLocator::Minimum, point.X(), point.Y());
-        }
+      const float value = theValues[i][j];
+
+      const float lo =
+          std::min(std::min(quadmin[i1][j1], quadmin[i + 1][j1]),
+                   std::min(quadmin[i1][j + 1], quadmin[i + 1][j + 1]));
+      const float hi =
+          std::max(std::max(quadmax[i1][j1], quadmax[i + 1][j1]),
+                   std::max(quadmax[i1][j + 1], quadmax[i + 1][j + 1]));
+
+      const bool smaller = (lo < value);
+      const bool bigger = (hi > value);
+
+      if (smaller == bigger)
+        continue;
+
+      // minimum change from center to rim
+
+      const float minimum = std::min(std::min(rowmin[i1][j1], rowmin[i1][j + DY]),
+                                     std::min(colmin[i1][j1], colmin[i + DX][j1]));
+      const float maximum = std::max(std::max(rowmax[i1][j1], rowmax[i1][j + DY]),
+                                     std::max(colmax[i1][j1], colmax[i + DX][j1]));
+
+      const float change = min(abs(value - minimum), abs(value - maximum));
+
+      if (change < mingradient)
+        continue;
+
+      theTypes[i][j] = (smaller ? 1 : -1);
+    }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Collect high/low pressure marker candidate coordinates
+ */
+// ----------------------------------------------------------------------
+
+void save_pressure_markers(const NFmiArea &theArea)
+{
+  // Establish which markers are to be drawn
+
+  bool dohigh = !globals.highpressureimage.empty();
+  bool dolow = !globals.lowpressureimage.empty();
+
+  // Exit if none
+
+  if (!dohigh && !dolow)
+    return;
+
+  // Get the data to be analyzed
+
+  choose_queryinfo("Pressure", 0);
+
+  auto worldpts = renderstate->queryinfo->LocationsWorldXY(theArea);
+
+  auto vals = renderstate->queryinfo->Values();
+  globals.unitsconverter.convert(FmiParameterName(renderstate->queryinfo->GetParamIdent()), vals);
+
+  // Insert candidate coordinates into the system
+
+  // The search region is 7 grid points unless a radius is given
+
+  int DX = 7;
+  int DY = 7;
+
+  if (globals.pressureradius > 0)
+  {
+    const double dx = renderstate->queryinfo->Area()->WorldXYWidth() /
+                      (renderstate->queryinfo->Grid()->XNumber() - 1);
+    const double dy = renderstate->queryinfo->Area()->WorldXYHeight() /
+                      (renderstate->queryinfo->Grid()->YNumber() - 1);
+    DX = max(1, static_cast<int>(ceil(globals.pressureradius * 1000 / dx)));
+    DY = max(1, static_cast<int>(ceil(globals.pressureradius * 1000 / dy)));
+  }
+
+  const float required_gradient = 1.0;
+
+  NFmiDataMatrix<int> types;
+  extrema_types(vals, DX, DY, required_gradient, types);
+
+  for (unsigned int j = 0; j < vals.NY(); j++)
+    for (unsigned int i = 0; i < vals.NX(); i++)
+    {
+      int extrem = types[i][j];
+      if (extrem != 0)
+      {
+        NFmiPoint point(worldpts->x(i, j) / 1000, worldpts->y(i, j) / 1000);
+
+        if (extrem < 0)
+        {
+          if (dolow)
+            renderstate->pressurecandidates.push_back(
+                PressureCandidate{ExtremaLocator::Minimum, point.X(), point.Y()});
+        }
         else
         {
           if (dohigh)
-            globals.pressurelocator.add(ExtremaLocator::Maximum, point.X(), point.Y());
+            renderstate->pressurecandidates.push_back(
+                PressureCandidate{ExtremaLocator::Maximum, point.X(), point.Y()});
         }
       }
     }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Draw high/low pressure markers
+ */
+// ----------------------------------------------------------------------
+
+void draw_pressure_markers(ImagineXr_or_NFmiImage &img, const NFmiArea &theArea)
+{
+  // Exit if there is nothing to be drawn
+
+  if (globals.highpressureimage.empty() && globals.lowpressureimage.empty())
+    return;
+
+  // Now choose the marker positions and draw them
+
+  const ExtremaLocator::ExtremaCoordinates &extrema = globals.pressurelocator.chooseCoordinates();
+
+  NFmiColorTools::NFmiBlendRule lowrule = ColorTools::checkrule(globals.lowpressurerule);
+  NFmiColorTools::NFmiBlendRule highrule = ColorTools::checkrule(globals.highpressurerule);
+
+  for (ExtremaLocator::ExtremaCoordinates::const_iterator eit = extrema.begin();
+       eit != extrema.end();
+       ++eit)
+  {
+    for (ExtremaLocator::Coordinates::const_iterator it = eit->second.begin();
+         it != eit->second.end();
+         ++it)
+    {
+      NFmiPoint wxy(it->first * 1000, it->second * 1000);
+      NFmiPoint latlon = theArea.WorldXYToLatLon(wxy);
+      /// latlon = MeridianTools::Relocate(latlon,theArea);
+      NFmiPoint xy = theArea.ToXY(latlon);
+
+      switch (eit->first)
+      {
+        case ExtremaLocator::Minimum:
+          img.Composite(globals.lowpressureimage,
+                        lowrule,
+                        kFmiAlignCenter,
+                        static_cast<int>(round(xy.X())),
+                        static_cast<int>(round(xy.Y())),
+                        globals.lowpressurefactor);
+          break;
+        case ExtremaLocator::Maximum:
+          img.Composite(globals.highpressureimage,
+                        highrule,
+                        kFmiAlignCenter,
+                        static_cast<int>(round(xy.X())),
+                        static_cast<int>(round(xy.Y())),
+                        globals.highpressurefactor);
+          break;
+      }
+    }
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Draw the foreground onto the image
+ */
+// ----------------------------------------------------------------------
+
+void draw_foreground(ImagineXr_or_NFmiImage &img)
+{
+  if (globals.foreground.empty())
+    return;
+
+  NFmiColorTools::NFmiBlendRule rule = ColorTools::checkrule(globals.foregroundrule);
+
+  img.Composite(globals.getImage(globals.foreground), rule, kFmiAlignNorthWest, 0, 0, 1);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Return the manifest file of the given image
+ *
+ * The manifest is a hidden file in the same directory as the image.
+ */
+// ----------------------------------------------------------------------
+
+string manifest_file(const string &theImage)
+{
+  const std::size_t pos = theImage.rfind('/');
+  if (pos == string::npos)
+    return '.' + theImage + ".manifest";
+  return theImage.substr(0, pos + 1) + '.' + theImage.substr(pos + 1) + ".manifest";
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Describe the inputs of the image for the given time
+ *
+ * The description consists of a hash of all the commands processed
+ * so far, the time and the identities of the querydata files and the
+ * images used. If a later run produces the same description, the
+ * image would be identical and need not be drawn again.
+ */
+// ----------------------------------------------------------------------
+
+string product_manifest(const NFmiTime &theTime, const string &theBackground)
+{
+  ostringstream out;
+  out << "qdcontour manifest 1\n"
+      << "script " << std::hex << globals.scripthash << std::dec << '\n'
+      << "time " << time_key(theTime) << '\n';
+
+  for (const string &file : globals.queryfilenames)
+    out << "querydata " << QueryDataPool::identity(file) << '\n';
+
+  std::set<string> images{theBackground, globals.foreground, globals.combine, globals.mask};
+
+  for (const ContourSpec &spec : globals.specs)
+  {
+    images.insert(spec.overlay());
+    images.insert(spec.labelMarker());
+    for (const ContourPattern &pattern : spec.contourPatterns())
+      images.insert(pattern.pattern());
+  }
+
+  for (const string &image : images)
+    if (!image.empty())
+      out << "image " << QueryDataPool::identity(image) << '\n';
+
+  return out.str();
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Test whether the manifest of the image matches the given one
+ */
+// ----------------------------------------------------------------------
+
+bool manifest_matches(const string &theImage, const string &theManifest)
+{
+  ifstream in(manifest_file(theImage).c_str(), ios::in | ios::binary);
+  if (!in)
+    return false;
+  return NFmiStringTools::ReadFile(in) == theManifest;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Write the manifest of a saved image
+ *
+ * The file is written under a temporary name and then renamed, so
+ * that concurrent processes never see partially written manifests.
+ */
+// ----------------------------------------------------------------------
+
+void write_manifest(const string &theImage, const string &theManifest)
+{
+  if (theManifest.empty())
+    return;
+
+  const string file = manifest_file(theImage);
+
+  ostringstream tmpname;
+  tmpname << file << '.' << getpid() << '.' << std::this_thread::get_id() << ".tmp";
+  const string tmpfile = tmpname.str();
+
+  {
+    ofstream out(tmpfile.c_str(), ios::out | ios::binary | ios::trunc);
+    if (!out)
+      throw runtime_error("Failed to open '" + tmpfile + "' for writing");
+    out << theManifest;
+    if (!out)
+      throw runtime_error("Failed to write '" + tmpfile + "'");
+  }
+
+  if (!NFmiFileSystem::RenameFile(tmpfile, file))
+  {
+    NFmiFileSystem::RemoveFile(tmpfile);
+    throw runtime_error("Failed to rename '" + tmpfile + "' to '" + file + "'");
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Test whether the next image belongs to the slice of this process
+ *
+ * The images are enumerated in the order in which the script would
+ * render them, regardless of whether they are up to date. Hence all
+ * processes running the same script with the same data agree on the
+ * slices, and image k is rendered by process k mod n.
+ */
+// ----------------------------------------------------------------------
+
+bool assigned_to_shard()
+{
+  const unsigned long image = globals.shardimages++;
+  return (globals.shards == 0 || image % globals.shards == globals.shard);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Claim an image in the shared job file
+ *
+ * The job file lists the claimed images, one per line, followed by
+ * the host and the process which claimed it. The file is locked while
+ * it is being read and appended to, hence of several processes trying
+ * to claim the same image only the first one succeeds.
+ *
+ * \return True if the image was claimed by this process
+ */
+// ----------------------------------------------------------------------
+
+bool claim_image(const string &theFile)
+{
+  if (globals.jobfile.empty())
+    return true;
+
+  const int fd = open(globals.jobfile.c_str(), O_RDWR | O_CREAT | O_APPEND, 0666);
+  if (fd < 0)
+    throw runtime_error("Failed to open job file '" + globals.jobfile + "': " + strerror(errno));
+
+  struct flock lock;
+  memset(&lock, 0, sizeof(lock));
+  lock.l_type = F_WRLCK;
+  lock.l_whence = SEEK_SET;
+
+  while (fcntl(fd, F_SETLKW, &lock) != 0)
+  {
+    if (errno == EINTR)
+      continue;
+    const string error = strerror(errno);
+    close(fd);
+    throw runtime_error("Failed to lock job file '" + globals.jobfile + "': " + error);
+  }
+
+  // Closing the file releases the lock
+
+  string contents;
+  char buffer[65536];
+  ssize_t n;
+  while ((n = read(fd, buffer, sizeof(buffer))) > 0)
+    contents.append(buffer, n);
+
+  const string key = theFile + '\t';
+  bool claimed = (contents.compare(0, key.size(), key) == 0 ||
+                  contents.find('\n' + key) != string::npos);
+
+  if (!claimed)
+  {
+    char host[256] = "";
+    gethostname(host, sizeof(host) - 1);
+    const string line = key + host + '\t' + std::to_string(getpid()) + '\n';
+    if (write(fd, line.data(), line.size()) != static_cast<ssize_t>(line.size()))
+    {
+      const string error = strerror(errno);
+      close(fd);
+      throw runtime_error("Failed to write job file '" + globals.jobfile + "': " + error);
+    }
+  }
+
+  close(fd);
+  return !claimed;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief A time step accepted for rendering
+ */
+// ----------------------------------------------------------------------
+
+struct RenderFrame
+{
+  NFmiTime time;
+  std::vector<std::string> filenames;  // image of each target, empty if up to date
+  std::vector<std::string> manifests;  // inputs of each image, if manifests are used
+  std::vector<unsigned long> timeindexes;  // active time of each query stream
+};
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Synchronization of parallel rendering threads
+ *
+ * The label locators choose the label positions based on the
+ * positions chosen for the previous image. Hence the images
+ * must be labelled in time order, even if they are otherwise
+ * rendered in parallel.
+ */
+// ----------------------------------------------------------------------
+
+struct RenderQueue
+{
+  std::atomic<std::size_t> next{0};  // next frame to be rendered
+  std::mutex mutex;
+  std::condition_variable turnchanged;
+  std::size_t turn = 0;  // frame allowed to use the locators
+  bool failed = false;
+  std::exception_ptr error;
+};
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Queue of finished images waiting to be saved
+ *
+ * Encoding a large image may take as long as rendering it. The
+ * images are saved by background tasks of the task scheduler while
+ * rendering continues with the next time step. At most two images per
+ * writer may be waiting or being saved, after which the rendering
+ * thread saves the image itself. This limits the memory used, and
+ * cannot deadlock even if all the workers are busy rendering. The
+ * first error is rethrown by the next push or by finish().
+ */
+// ----------------------------------------------------------------------
+
+class WriteQueue
+{
+ public:
+  typedef std::function<void()> job_type;
+
+  explicit WriteQueue(unsigned int theWriters) : itsCapacity(2 * theWriters) {}
+  ~WriteQueue() { wait(); }
+
+  void push(job_type theJob)
+  {
+    bool queued = false;
+    {
+      std::lock_guard<std::mutex> lock(itsMutex);
+      if (itsError)
+        std::rethrow_exception(itsError);
+      if (itsPending < itsCapacity)
+      {
+        ++itsPending;
+        queued = true;
+      }
+    }
+
+    if (queued)
+      TaskScheduler::submit([this, theJob]() { execute(theJob); });
+    else
+      theJob();
+  }
+
+  void finish()
+  {
+    wait();
+    if (itsError)
+      std::rethrow_exception(itsError);
+  }
+
+ private:
+  void execute(const job_type &theJob)
+  {
+    try
+    {
+      // Remaining jobs are discarded after an error
+      if (!failed())
+        theJob();
+    }
+    catch (...)
+    {
+      std::lock_guard<std::mutex> lock(itsMutex);
+      if (!itsError)
+        itsError = std::current_exception();
+    }
+
+    // The queue may be destroyed as soon as the lock is released
+
+    std::lock_guard<std::mutex> lock(itsMutex);
+    --itsPending;
+    itsFinished.notify_all();
+  }
+
+  void wait()
+  {
+    std::unique_lock<std::mutex> lock(itsMutex);
+    itsFinished.wait(lock, [&] { return itsPending == 0; });
+  }
+
+  bool failed()
+  {
+    std::lock_guard<std::mutex> lock(itsMutex);
+    return static_cast<bool>(itsError);
+  }
+
+  const std::size_t itsCapacity;
+  std::size_t itsPending = 0;  // jobs submitted but not finished
+  std::mutex itsMutex;
+  std::condition_variable itsFinished;
+  std::exception_ptr itsError;
+};
+
+// The active write queue during "draw contours", if any
+WriteQueue *writequeue = nullptr;
+
+// Activates a write queue for the lifetime of the object
+struct WriteQueueScope
+{
+  explicit WriteQueueScope(WriteQueue *theQueue) { writequeue = theQueue; }
+  ~WriteQueueScope() { writequeue = nullptr; }
+};
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Feed saved label candidates into a label locator
+ */
+// ----------------------------------------------------------------------
+
+void add_label_candidates(LabelLocator &theLocator, std::vector<LabelCandidate> &theCandidates)
+{
+  for (const LabelCandidate &candidate : theCandidates)
+  {
+    theLocator.parameter(candidate.param);
+    theLocator.add(candidate.value, candidate.x, candidate.y);
+  }
+  theCandidates.clear();
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Feed the saved candidates of the current image into the locators
+ */
+// ----------------------------------------------------------------------
+
+void locate_labels(int theWidth, int theHeight)
+{
+  // Initialize label locator bounding box
+
+  globals.labellocator.boundingBox(globals.contourlabelimagexmargin,
+                                   globals.contourlabelimageymargin,
+                                   theWidth - globals.contourlabelimagexmargin,
+                                   theHeight - globals.contourlabelimageymargin);
+
+  // Initialize symbol locator bounding box with reasonably safety
+  // for large symbols
+
+  globals.symbollocator.boundingBox(-30, -30, theWidth + 30, theHeight + 30);
+  globals.imagelocator.boundingBox(-30, -30, theWidth + 30, theHeight + 30);
+
+  add_label_candidates(globals.labellocator, renderstate->labelcandidates);
+  add_label_candidates(globals.symbollocator, renderstate->symbolcandidates);
+  add_label_candidates(globals.imagelocator, renderstate->imagecandidates);
+
+  for (const PressureCandidate &candidate : renderstate->pressurecandidates)
+    globals.pressurelocator.add(candidate.type, candidate.x, candidate.y);
+  renderstate->pressurecandidates.clear();
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Find the part of the grid which is visible in the area
+ *
+ * The edges of the area are traced pixel by pixel in grid coordinates.
+ * The only interior points which may extend the window are the poles,
+ * which are checked separately. A margin of a few grid cells keeps
+ * the contours continuous over the edges of the image. If the area
+ * extends over the edges of the grid, for example over the seam of
+ * world data, the window covers the grid fully in that direction.
+ *
+ * \return The window as i1, j1, i2, j2 with exclusive upper indices
+ */
+// ----------------------------------------------------------------------
+
+std::array<std::size_t, 4> grid_window(const NFmiGrid &theGrid, const NFmiArea &theArea)
+{
+  const double nx = theGrid.XNumber();
+  const double ny = theGrid.YNumber();
+  const double margin = 2;
+
+  double imin = nx;
+  double imax = -1;
+  double jmin = ny;
+  double jmax = -1;
+  bool fullx = false;
+  bool fully = false;
+
+  auto add = [&](const NFmiPoint &theLatLon)
+  {
+    const NFmiPoint gp = theGrid.LatLonToGrid(theLatLon);
+    if (!std::isfinite(gp.X()) || gp.X() < -margin || gp.X() > nx - 1 + margin)
+      fullx = true;
+    if (!std::isfinite(gp.Y()) || gp.Y() < -margin || gp.Y() > ny - 1 + margin)
+      fully = true;
+    if (std::isfinite(gp.X()) && std::isfinite(gp.Y()))
+    {
+      imin = std::min(imin, gp.X());
+      imax = std::max(imax, gp.X());
+      jmin = std::min(jmin, gp.Y());
+      jmax = std::max(jmax, gp.Y());
+    }
+  };
+
+  const double x1 = theArea.Left();
+  const double x2 = theArea.Right();
+  const double y1 = theArea.Top();
+  const double y2 = theArea.Bottom();
+
+  const int xsteps = std::max(1, static_cast<int>(ceil(fabs(x2 - x1))));
+  const int ysteps = std::max(1, static_cast<int>(ceil(fabs(y2 - y1))));
+
+  for (int i = 0; i <= xsteps; i++)
+  {
+    const double x = x1 + (x2 - x1) * i / xsteps;
+    add(theArea.ToLatLon(NFmiPoint(x, y1)));
+    add(theArea.ToLatLon(NFmiPoint(x, y2)));
+  }
+  for (int j = 0; j <= ysteps; j++)
+  {
+    const double y = y1 + (y2 - y1) * j / ysteps;
+    add(theArea.ToLatLon(NFmiPoint(x1, y)));
+    add(theArea.ToLatLon(NFmiPoint(x2, y)));
+  }
+
+  // All longitudes meet at a pole inside the area
+
+  for (double lat : {90.0, -90.0})
+  {
+    const NFmiPoint xy = theArea.ToXY(NFmiPoint(0, lat));
+    if (xy.X() >= std::min(x1, x2) && xy.X() <= std::max(x1, x2) && xy.Y() >= std::min(y1, y2) &&
+        xy.Y() <= std::max(y1, y2))
+    {
+      fullx = true;
+      add(NFmiPoint(0, lat));
+    }
+  }
+
+  std::array<std::size_t, 4> window{
+      {0, 0, static_cast<std::size_t>(nx), static_cast<std::size_t>(ny)}};
+
+  if (imax < imin)
+    return window;
+
+  if (!fullx)
+  {
+    window[0] = static_cast<std::size_t>(std::max(0.0, floor(imin - margin)));
+    window[2] = static_cast<std::size_t>(std::min(nx, ceil(imax + margin) + 1));
+  }
+  if (!fully)
+  {
+    window[1] = static_cast<std::size_t>(std::max(0.0, floor(jmin - margin)));
+    window[3] = static_cast<std::size_t>(std::min(ny, ceil(jmax + margin) + 1));
+  }
+
+  if (window[0] >= window[2] || window[1] >= window[3])
+    return {{0, 0, static_cast<std::size_t>(nx), static_cast<std::size_t>(ny)}};
+
+  return window;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Reduce the resolution of a grid window
+ *
+ * Each block of theStep x theStep values is replaced by the mean of its
+ * valid values. If averaging would create values which do not exist
+ * in the data, the value nearest to the center of the block is used
+ * instead. The blocks on the right and top edges may be partial.
+ */
+// ----------------------------------------------------------------------
+
+void coarsen_values(const NFmiDataMatrix<float> &theValues,
+                    const std::array<std::size_t, 4> &theWindow,
+                    std::size_t theStep,
+                    bool theAverage,
+                    NFmiDataMatrix<float> &theResult)
+{
+  const std::size_t nx = (theWindow[2] - theWindow[0] + theStep - 1) / theStep;
+  const std::size_t ny = (theWindow[3] - theWindow[1] + theStep - 1) / theStep;
+  theResult.Resize(nx, ny, kFloatMissing);
+
+  for (std::size_t i = 0; i < nx; i++)
+  {
+    const std::size_t i1 = theWindow[0] + i * theStep;
+    const std::size_t i2 = std::min(i1 + theStep, theWindow[2]);
+    for (std::size_t j = 0; j < ny; j++)
+    {
+      const std::size_t j1 = theWindow[1] + j * theStep;
+      const std::size_t j2 = std::min(j1 + theStep, theWindow[3]);
+
+      if (!theAverage)
+      {
+        const std::size_t ic = std::min(i1 + (theStep - 1) / 2, i2 - 1);
+        const std::size_t jc = std::min(j1 + (theStep - 1) / 2, j2 - 1);
+        theResult[i][j] = theValues[ic][jc];
+        continue;
+      }
+
+      double sum = 0;
+      std::size_t count = 0;
+      for (std::size_t ii = i1; ii < i2; ii++)
+        for (std::size_t jj = j1; jj < j2; jj++)
+        {
+          const float value = theValues[ii][jj];
+          if (value != kFloatMissing)
+          {
+            sum += value;
+            ++count;
+          }
+        }
+      theResult[i][j] = (count > 0 ? static_cast<float>(sum / count) : kFloatMissing);
+    }
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Return the processed values of a contour specification
+ *
+ * The values are also set to the contour calculator. Specs with
+ * identical processing settings share the values of the current
+ * time step.
+ *
+ * \param theVisibleArea If given, only the part of the grid visible
+ *        in the area is contoured, and with "autoresolution" the
+ *        grid is contoured at a resolution matching the area
+ */
+// ----------------------------------------------------------------------
+
+const NFmiDataMatrix<float> &prepare_values(const ContourSpec &theSpec,
+                                            const RenderState::SpecPlan &thePlan,
+                                            const LazyCoordinates &theWorldPts,
+                                            const NFmiTime &theTime,
+                                            const NFmiArea *theVisibleArea)
+{
+  RenderState &state = *renderstate;
+  const string &name = theSpec.param();
+  const long long timekey = time_key(theTime);
+
+  // Specs with identical processing settings share the values,
+  // also between targets unless smoothing in world coordinates
+  // makes the values depend on the projection
+
+  const bool smoothed = (theSpec.smoother() != "None");
+  const string valuekey = (smoothed ? thePlan.valuekey + ' ' + state.projection : thePlan.valuekey);
+  RenderState::ProcessedValues &processed = state.processedvalues[valuekey];
+  NFmiDataMatrix<float> &vals = processed.values;
+
+  if (processed.time == timekey)
+  {
+    if (globals.verbose)
+      cout << "Using processed values of " << name << endl;
+  }
+  else
+  {
+    // Get the values.
+
+    Profiler::count("value_bytes", static_cast<long long>(vals.NX() * vals.NY() * sizeof(float)));
+
+    if (!MetaFunctions::isMeta(name))
+    {
+      // Units conversion and replacement are done in a single pass
+
+      Profiler::Phase phase("values");
+      if (!take_prefetched(theSpec, false, state.queryinfo->TimeIndex(), vals))
+      {
+        state.queryinfo->Values(vals);
+        globals.unitsconverter.convert(FmiParameterName(state.queryinfo->GetParamIdent()),
+                                       vals,
+                                       theSpec.replace(),
+                                       theSpec.replaceSourceValue(),
+                                       theSpec.replaceTargetValue());
+      }
+    }
+    else
+    {
+      Profiler::Phase phase("metavalues");
+      vals = MetaFunctions::values(theSpec.param(), *state.queryinfo, state.threads);
+
+      // Replace values if so requested
+
+      if (theSpec.replace())
+        vals.Replace(theSpec.replaceSourceValue(), theSpec.replaceTargetValue());
+    }
+
+    // Filter the values if so requested
+
+    {
+      Profiler::Phase phase("filter");
+      filter_values(vals, theTime, theSpec);
+    }
+
+    // Expand the data if so requested
+
+    if (globals.expanddata)
+    {
+      Profiler::Phase phase("expand");
+      NoiseTools::expand(vals);
+    }
+
+    // Call smoother only if necessary to avoid LazyCoordinates dereferencing
+
+    if (smoothed)
+    {
+      Profiler::Phase phase("smooth");
+      vals = SmoothTools::smoothen(theSpec.smoother(),
+                                   theSpec.smootherFactor(),
+                                   theSpec.smootherRadius(),
+                                   theWorldPts.shared(),
+                                   vals,
+                                   state.threads);
+    }
+
+    processed.time = timekey;
+  }
+
+  // Contour only the part of the grid which is visible in the area
+
+  std::array<std::size_t, 4> window{{0, 0, vals.NX(), vals.NY()}};
+  const NFmiGrid *grid = state.queryinfo->Grid();
+  if (theVisibleArea != nullptr && grid != nullptr && grid->XNumber() == vals.NX() &&
+      grid->YNumber() == vals.NY())
+  {
+    const string windowkey = state.projection + ' ' + state.queryinfo->GridKey();
+    auto it = state.gridwindows.find(windowkey);
+    if (it == state.gridwindows.end())
+      it = state.gridwindows
+               .insert(make_pair(windowkey, grid_window(*grid, *theVisibleArea)))
+               .first;
+    window = it->second;
+  }
+
+  // Contour a reduced copy of the grid if several grid cells
+  // fall into each pixel of the area
+
+  std::size_t step = 1;
+  if (globals.autoresolution > 0 && theVisibleArea != nullptr)
+  {
+    const double cellsx = (window[2] - window[0]) / std::max(1.0, theVisibleArea->Width());
+    const double cellsy = (window[3] - window[1]) / std::max(1.0, theVisibleArea->Height());
+    const double cells = std::min(cellsx, cellsy) / globals.autoresolution;
+    if (cells >= 2)
+      step = static_cast<std::size_t>(cells);
+    while (step > 1 && (window[2] - window[0] <= step || window[3] - window[1] <= step))
+      --step;
+  }
+
+  // Setup the contourer with the values. The contouring hints
+  // are kept if the previous spec used the same values.
+
+  ostringstream key;
+  key << valuekey << ' ' << window[0] << ' ' << window[1] << ' ' << window[2] << ' ' << window[3]
+      << ' ' << step;
+  const string windowkey = key.str();
+  const string calculatorkey = windowkey + ' ' + std::to_string(timekey);
+  if (state.calculatorkey != calculatorkey)
+  {
+    if (step > 1)
+    {
+      // Discrete data must not be averaged into new classes
+
+      const bool average = (thePlan.interpolation == Linear || thePlan.interpolation == LogLinear);
+      RenderState::ProcessedValues &coarse = state.coarsevalues[windowkey];
+      if (coarse.time != timekey)
+      {
+        if (globals.verbose)
+          cout << "Reducing grid window " << window[0] << ',' << window[1] << " - " << window[2]
+               << ',' << window[3] << " by " << step << endl;
+        Profiler::Phase phase("coarsen");
+        coarsen_values(vals, window, step, average, coarse.values);
+        coarse.time = timekey;
+      }
+      const float offset = (average ? (step - 1) / 2.0f : static_cast<float>((step - 1) / 2));
+      state.calculator.data(coarse.values,
+                            window[0] + offset,
+                            window[1] + offset,
+                            static_cast<float>(step));
+    }
+    else if (window[0] == 0 && window[1] == 0 && window[2] == vals.NX() && window[3] == vals.NY())
+      state.calculator.data(vals);
+    else
+    {
+      if (globals.verbose)
+        cout << "Contouring grid window " << window[0] << ',' << window[1] << " - " << window[2]
+             << ',' << window[3] << endl;
+      state.calculator.data(vals, window[0], window[1], window[2], window[3]);
+    }
+    state.calculatorkey = calculatorkey;
+  }
+
+  return vals;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief A saved image to which identical later images are linked
+ *
+ * The links requested before the image has been written are made
+ * by the writer once it is done.
+ */
+// ----------------------------------------------------------------------
+
+struct SavedImage
+{
+  struct Link
+  {
+    std::shared_ptr<ImagineXr_or_NFmiImage> image;  // saved instead if linking fails
+    std::string filename;
+    std::string manifest;
+  };
+
+  std::string filename;
+  int width = 0;
+  int height = 0;
+  std::vector<NFmiColorTools::Color> pixels;  // for verifying matching hashes
+  std::mutex mutex;
+  bool written = false;
+  std::vector<Link> links;
+};
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief An image rendered by "draw contours" for each time step
+ *
+ * Each target has its own projection and background. The label
+ * locators choose the label positions based on the previous image,
+ * hence each target keeps the earlier label positions of its own
+ * images. The locations are swapped into the global locators
+ * while the target is being labelled.
+ */
+// ----------------------------------------------------------------------
+
+struct DrawTarget
+{
+  std::string projection;
+  std::string background;
+  std::string savepath;
+  std::shared_ptr<NFmiArea> area;
+
+  // Map tiles are cut from the contours projected onto the whole
+  // zoom level, which is then shared by all tiles of the level
+
+  bool vectors = false;  // write the contours as GeoJSON instead of an image
+  std::string tilename;  // "/z/x/y" of a map tile, empty otherwise
+  std::string contourprojection;
+  std::shared_ptr<NFmiArea> contourarea;
+  double contourx = 0;  // position of the tile in the zoom level
+  double contoury = 0;
+
+  LabelLocator labellocator;
+  ExtremaLocator pressurelocator;
+  LabelLocator symbollocator;
+  LabelLocator imagelocator;
+
+  // The last image saved, for "reuseframes"
+
+  std::size_t lasthash = 0;
+  std::shared_ptr<SavedImage> lastsave;
+};
+
+typedef std::vector<std::unique_ptr<DrawTarget> > DrawTargets;
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Activates the state of a target for the lifetime of the object
+ *
+ * The first target uses the state of the rendering thread and the
+ * global locators directly, the others are swapped in and out.
+ */
+// ----------------------------------------------------------------------
+
+class TargetScope
+{
+ public:
+  TargetScope(std::size_t theIndex, DrawTarget &theTarget, bool theLocators)
+      : itsIndex(theIndex), itsTarget(theTarget), itsLocators(theLocators)
+  {
+    RenderState &state = *renderstate;
+    state.contourarea = theTarget.contourarea.get();
+    state.projection = (state.contourarea ? theTarget.contourprojection : theTarget.projection);
+    state.contourx = theTarget.contourx;
+    state.contoury = theTarget.contoury;
+    swap();
+  }
+
+  ~TargetScope() { swap(); }
+
+ private:
+  void swap()
+  {
+    if (itsIndex == 0)
+      return;
+
+    RenderState &state = *renderstate;
+    RenderState::TargetState &target = state.targetstates[itsIndex - 1];
+    state.specs.swap(target.specs);
+    std::swap(state.labeldxdydone, target.labeldxdydone);
+    state.labelcandidates.swap(target.labelcandidates);
+    state.symbolcandidates.swap(target.symbolcandidates);
+    state.imagecandidates.swap(target.imagecandidates);
+    state.pressurecandidates.swap(target.pressurecandidates);
+
+    if (itsLocators)
+    {
+      globals.labellocator.swapHistory(itsTarget.labellocator);
+      globals.pressurelocator.swapHistory(itsTarget.pressurelocator);
+      globals.symbollocator.swapHistory(itsTarget.symbollocator);
+      globals.imagelocator.swapHistory(itsTarget.imagelocator);
+    }
+  }
+
+  TargetScope(const TargetScope &theScope);
+  TargetScope &operator=(const TargetScope &theScope);
+
+  const std::size_t itsIndex;
+  DrawTarget &itsTarget;
+  const bool itsLocators;
+};
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Render the contours of a single target
+ *
+ * The labels are only saved as candidates, they are placed and
+ * rendered later by label_target.
+ */
+// ----------------------------------------------------------------------
+
+std::shared_ptr<ImagineXr_or_NFmiImage> render_target(const RenderFrame &theFrame,
+                                                      const DrawTarget &theTarget,
+                                                      const std::string &theFilename)
+{
+  RenderState &state = *renderstate;
+  const NFmiTime &t = theFrame.time;
+  const NFmiArea &theArea = *theTarget.area;
+
+  // Initialize the background
+
+  int imgwidth = static_cast<int>(theArea.Width() + 0.5);
+  int imgheight = static_cast<int>(theArea.Height() + 0.5);
+
+  NFmiColorTools::Color erasecolor = ColorTools::checkcolor(globals.erase);
+
+#ifdef IMAGINE_WITH_CAIRO
+  std::shared_ptr<ImagineXr> xr(new ImagineXr(imgwidth, imgheight, theFilename, globals.format));
+
+  if (theTarget.background.empty())
+  {
+    xr->Erase(erasecolor);
+  }
+  else
+  {
+    const ImagineXr &xr2 = globals.getImage(theTarget.background);
+
+    if ((xr2.Width() != xr->Width()) || (xr2.Height() != xr->Height()))
+      throw runtime_error("Background image size does not match area size");
+
+    xr->Composite(xr2);
+  }
+#else
+  std::shared_ptr<Imagine::NFmiImage> xr;
+  if (theTarget.background.empty())
+  {
+    xr.reset(new Imagine::NFmiImage(imgwidth, imgheight, erasecolor));
+  }
+  else
+  {
+    xr.reset(new Imagine::NFmiImage(globals.getImage(theTarget.background)));
+    if (imgwidth != xr->Width() || imgheight != xr->Height())
+    {
+      throw runtime_error("Background image size does not match area size");
+    }
+  }
+  if (xr.get() == 0)
+    throw runtime_error("Failed to allocate a new image for rendering");
+
+  globals.setImageModes(*xr);
+#endif
+
+  Profiler::count("image_bytes", 4LL * imgwidth * imgheight);
+
+  // Loop over all parameters
+  // The loop collects all contour label information, but
+  // does not render it yet
+
+  list<ContourSpec>::iterator piter;
+  list<ContourSpec>::iterator pbegin = state.specs.begin();
+  list<ContourSpec>::iterator pend = state.specs.end();
+
+  auto plan = state.plan.cbegin();
+  for (piter = pbegin; piter != pend; ++piter, ++plan)
+  {
+    // Activate the parameter
+
+    const string &name = piter->param();
+    Profiler::Record record("spec", std::to_string(time_key(t)), name);
+    activate_plan(*plan);
+
+    if (globals.verbose)
+      report_queryinfo(name, plan->stream);
+
+    const ContourInterpolation interp = plan->interpolation;
+
+    LazyCoordinates worldpts(theArea, *state.queryinfo);
+    const NFmiArea &visiblearea = (state.contourarea ? *state.contourarea : theArea);
+    const NFmiDataMatrix<float> &vals = prepare_values(*piter, *plan, worldpts, t, &visiblearea);
+
+    // Save the data values at desired points for later
+    // use, this lets us avoid using InterpolatedValue()
+    // which does not use smoothened values.
+
+    // First, however, if this is the first image, we add
+    // the grid points to the set of points, if so requested
+
+    if (!state.labeldxdydone)
+      add_label_grid_values(*piter, theArea, worldpts);
+
+    // For pixelgrids we must repeat the process for all new
+    // background images, since the pixel spacing changes
+    // every time. Note! We assume the following calling order!
+
+    add_label_point_values(*piter, theArea, vals);
+    add_label_pixelgrid_values(*piter, theArea, *xr, vals);
+
+    // Fill the contours
+
+    draw_contour_fills(*xr, theArea, *piter, t, interp, vals);
+
+    // Pattern fill the contours
+
+    draw_contour_patterns(*xr, theArea, *piter, t, interp);
+
+    // Stroke the contours
+
+    draw_contour_strokes(*xr, theArea, *piter, t, interp);
+
+    // Save contour symbol coordinates
+
+    save_contour_symbols(*xr, theArea, *piter, vals);
+
+    // Save symbol fill coordinates
+
+    save_contour_fonts(*xr, theArea, *piter, vals);
+
+    // Save contour label coordinates
+
+    save_contour_labels(*xr, theArea, *piter, t, interp);
+
+    // Draw optional overlay
+
+    draw_overlay(*xr, *piter);
+  }
+
+  // Draw graticule
+
+  draw_graticule(*xr, theArea);
+
+  // Bang the foreground
+
+  draw_foreground(*xr);
+
+  // Draw wind arrows if so requested
+
+  {
+    Profiler::Phase phase("arrows");
+    draw_wind_arrows(*xr, theArea);
+  }
+
+  // Save high/low pressure marker coordinates
+
+  save_pressure_markers(theArea);
+
+  // dx and dy labels have now been extracted into a list,
+  // disable adding them again and again and again..
+
+  state.labeldxdydone = true;
+
+  return xr;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Return a contour limit as a JSON value
+ */
+// ----------------------------------------------------------------------
+
+string json_limit(float theLimit)
+{
+  if (theLimit == kFloatMissing)
+    return "null";
+  return NFmiStringTools::Convert(theLimit);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Write the contours of a single target as GeoJSON
+ *
+ * The contour fills and lines of all specs are written as features
+ * in geographic coordinates directly from the contourer, without
+ * converting them to paths or projecting them. The file is written
+ * under a temporary name and then renamed.
+ */
+// ----------------------------------------------------------------------
+
+void render_vectors(const RenderFrame &theFrame,
+                    const DrawTarget &theTarget,
+                    const std::string &theFilename)
+{
+  RenderState &state = *renderstate;
+  const NFmiTime &t = theFrame.time;
+
+  ostringstream tmpname;
+  tmpname << theFilename << '.' << getpid() << '.' << std::this_thread::get_id() << ".tmp";
+  const string tmpfile = tmpname.str();
+
+  {
+    ofstream out(tmpfile.c_str(), ios::out | ios::binary | ios::trunc);
+    if (!out)
+      throw runtime_error("Failed to open '" + tmpfile + "' for writing");
+
+    GeoJsonWriter writer(out, globals.vectorprecision);
+
+    auto plan = state.plan.cbegin();
+    for (const ContourSpec &spec : state.specs)
+    {
+      Profiler::Record record("spec", std::to_string(time_key(t)), spec.param());
+      activate_plan(*plan);
+
+      if (globals.verbose)
+        report_queryinfo(spec.param(), plan->stream);
+
+      LazyCoordinates worldpts(*theTarget.area, *state.queryinfo);
+      prepare_values(spec, *plan, worldpts, t, nullptr);
+
+      const NFmiGrid &grid = *state.queryinfo->Grid();
+      const string param = "{\"param\":\"" + spec.param() + "\",";
+
+      vector<pair<float, float> > limits;
+      for (const ContourRange &range : spec.contourFills())
+        limits.push_back(make_pair(range.lolimit(), range.hilimit()));
+
+      const auto fills = state.calculator.geometries(limits, plan->interpolation);
+      for (std::size_t i = 0; i < fills.size(); i++)
+        if (fills[i])
+          writer.feature(*fills[i],
+                         grid,
+                         param + "\"lolimit\":" + json_limit(limits[i].first) +
+                             ",\"hilimit\":" + json_limit(limits[i].second) + "}");
+
+      vector<float> values;
+      for (const ContourValue &value : spec.contourValues())
+        values.push_back(value.value());
+
+      const auto lines = state.calculator.geometries(values, plan->interpolation);
+      for (std::size_t i = 0; i < lines.size(); i++)
+        if (lines[i])
+          writer.feature(*lines[i], grid, param + "\"value\":" + json_limit(values[i]) + "}");
+
+      ++plan;
+    }
+
+    writer.finish();
+    if (!out)
+      throw runtime_error("Failed to write '" + tmpfile + "'");
+  }
+
+  if (!NFmiFileSystem::RenameFile(tmpfile, theFilename))
+  {
+    NFmiFileSystem::RemoveFile(tmpfile);
+    throw runtime_error("Failed to rename '" + tmpfile + "' to '" + theFilename + "'");
+  }
+
+  if (globals.verbose)
+    cout << "Wrote " << theFilename << endl;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Place and render the labels of a single target
+ *
+ * The label positions depend on the previous image of the target,
+ * hence the targets must be labelled in time order.
+ */
+// ----------------------------------------------------------------------
+
+void label_target(ImagineXr_or_NFmiImage &img, const NFmiTime &theTime, const NFmiArea &theArea)
+{
+  RenderState &state = *renderstate;
+  Profiler::Phase phase("labels");
+
+  locate_labels(img.Width(), img.Height());
+
+  // Draw contour symbols
+
+  draw_contour_symbols(img);
+
+  // Draw contour fonts
+
+  draw_contour_fonts(img);
+
+  // Label the contours
+
+  draw_contour_labels(img);
+
+  // Draw labels
+
+  for (const ContourSpec &spec : state.specs)
+  {
+    draw_label_markers(img, spec, theArea);
+    draw_label_texts(img, spec, theArea);
+  }
+
+  // Draw high/low pressure markers
+
+  draw_pressure_markers(img, theArea);
+
+  // Bang the combine image (legend, logo, whatever)
+
+  globals.drawCombine(img);
+
+  // Finally, draw a time stamp on the image if so
+  // requested
+
+  const string stamp = globals.getImageStampText(theTime);
+  globals.drawImageStampText(img, stamp);
+
+  // Advance in time
+
+  globals.labellocator.nextTime();
+  globals.pressurelocator.nextTime();
+  globals.symbollocator.nextTime();
+  globals.imagelocator.nextTime();
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Hard link an image file under a new name
+ *
+ * The link is made under a temporary name and then renamed, so that
+ * an existing file is replaced atomically.
+ *
+ * \return False if the link could not be made
+ */
+// ----------------------------------------------------------------------
+
+bool link_image(const std::string &theSource, const std::string &theFilename)
+{
+  ostringstream tmpname;
+  tmpname << theFilename << '.' << getpid() << '.' << std::this_thread::get_id() << ".tmp";
+  const string tmpfile = tmpname.str();
+
+  if (link(theSource.c_str(), tmpfile.c_str()) != 0)
+    return false;
+
+  if (rename(tmpfile.c_str(), theFilename.c_str()) != 0)
+  {
+    unlink(tmpfile.c_str());
+    return false;
+  }
+  return true;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Make a requested link to a written image
+ *
+ * If the file system does not support hard links, the image is
+ * saved as usual.
+ */
+// ----------------------------------------------------------------------
+
+void make_link(const std::string &theSource, const SavedImage::Link &theLink)
+{
+  if (theLink.filename == theSource || link_image(theSource, theLink.filename))
+  {
+    if (globals.verbose)
+      cout << "Linking '" << theLink.filename << "' to '" << theSource << "'" << endl;
+  }
+  else
+  {
+#ifdef IMAGINE_WITH_CAIRO
+    write_image(*theLink.image, false);
+#else
+    write_image(*theLink.image, theLink.filename, globals.format, false);
+#endif
+  }
+  write_manifest(theLink.filename, theLink.manifest);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Mark an image written and make the links waiting for it
+ */
+// ----------------------------------------------------------------------
+
+void finish_saved_image(SavedImage &theSave)
+{
+  std::vector<SavedImage::Link> links;
+  {
+    std::lock_guard<std::mutex> lock(theSave.mutex);
+    theSave.written = true;
+    links.swap(theSave.links);
+  }
+  for (const SavedImage::Link &link : links)
+    make_link(theSave.filename, link);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Save a rendered image and its manifest
+ *
+ * If a saved image record is given, the links waiting for the image
+ * are made once it has been written.
+ */
+// ----------------------------------------------------------------------
+
+void save_target(const std::shared_ptr<ImagineXr_or_NFmiImage> &theImage,
+                 const std::string &theFilename,
+                 const std::string &theManifest,
+                 bool theReleaseFlag,
+                 const std::shared_ptr<SavedImage> &theSave)
+{
+#ifdef IMAGINE_WITH_CAIRO
+  assert(theImage->Filename() != "");
+  if (writequeue != nullptr)
+  {
+    writequeue->push(
+        [theImage, theFilename, theManifest, theSave]()
+        {
+          write_image(*theImage, false);
+          write_manifest(theFilename, theManifest);
+          if (theSave)
+            finish_saved_image(*theSave);
+        });
+  }
+  else
+  {
+    write_image(*theImage, theReleaseFlag);
+    write_manifest(theFilename, theManifest);
+    if (theSave)
+      finish_saved_image(*theSave);
+  }
+#else
+  if (writequeue != nullptr)
+  {
+    writequeue->push(
+        [theImage, theFilename, theManifest, theSave]()
+        {
+          write_image(*theImage, theFilename, globals.format, false);
+          write_manifest(theFilename, theManifest);
+          if (theSave)
+            finish_saved_image(*theSave);
+        });
+  }
+  else
+  {
+    write_image(*theImage, theFilename, globals.format, theReleaseFlag);
+    write_manifest(theFilename, theManifest);
+    if (theSave)
+      finish_saved_image(*theSave);
+  }
+#endif
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Link a rendered image to an identical saved image
+ *
+ * The link is made immediately if the saved image has already been
+ * written, otherwise by its writer.
+ */
+// ----------------------------------------------------------------------
+
+void link_target(const std::shared_ptr<ImagineXr_or_NFmiImage> &theImage,
+                 const std::string &theFilename,
+                 const std::string &theManifest,
+                 SavedImage &theSave)
+{
+  SavedImage::Link link;
+  link.image = theImage;
+  link.filename = theFilename;
+  link.manifest = theManifest;
+  {
+    std::lock_guard<std::mutex> lock(theSave.mutex);
+    if (!theSave.written)
+    {
+      theSave.links.push_back(link);
+      return;
+    }
+  }
+  make_link(theSave.filename, link);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Copy the pixels of an image
+ */
+// ----------------------------------------------------------------------
+
+std::vector<NFmiColorTools::Color> image_pixels(const ImagineXr_or_NFmiImage &img)
+{
+  std::vector<NFmiColorTools::Color> pixels;
+  pixels.reserve(static_cast<std::size_t>(img.Width()) * img.Height());
+  for (int j = 0; j < img.Height(); j++)
+    for (int i = 0; i < img.Width(); i++)
+      pixels.push_back(img(i, j));
+  return pixels;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Test whether an image equals the last one saved for the target
+ *
+ * The pixel hashes are compared first, and the pixels themselves only
+ * if the hashes match. Otherwise the image becomes the last one saved
+ * for the target. This must be called in time order.
+ *
+ * \return The saved image record of the image
+ */
+// ----------------------------------------------------------------------
+
+std::shared_ptr<SavedImage> match_saved_image(DrawTarget &theTarget,
+                                              const ImagineXr_or_NFmiImage &img,
+                                              const std::string &theFilename,
+                                              bool &theMatch)
+{
+  std::vector<NFmiColorTools::Color> pixels = image_pixels(img);
+  std::size_t hash = boost::hash_value(img.Width());
+  boost::hash_combine(hash, img.Height());
+  boost::hash_range(hash, pixels.begin(), pixels.end());
+
+  const std::shared_ptr<SavedImage> &last = theTarget.lastsave;
+  theMatch = (last && theTarget.lasthash == hash && last->width == img.Width() &&
+              last->height == img.Height() && last->pixels == pixels);
+  if (!theMatch)
+  {
+    std::shared_ptr<SavedImage> save = std::make_shared<SavedImage>();
+    save->filename = theFilename;
+    save->width = img.Width();
+    save->height = img.Height();
+    save->pixels = std::move(pixels);
+    theTarget.lastsave = save;
+    theTarget.lasthash = hash;
+  }
+  return theTarget.lastsave;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Test whether all pixels of the image have the same color
+ */
+// ----------------------------------------------------------------------
+
+bool uniform_image(const ImagineXr_or_NFmiImage &img)
+{
+  const NFmiColorTools::Color color = img(0, 0);
+  for (int j = 0; j < img.Height(); j++)
+    for (int i = 0; i < img.Width(); i++)
+      if (img(i, j) != color)
+        return false;
+  return true;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Render a single time step
+ *
+ * The rendering state of the current thread is used. The values
+ * and contours are shared by all the targets, only the projection
+ * and rasterization are repeated for each target. If a queue is
+ * given, the locators are used only when it is the turn of this
+ * frame, and the used images are not released from the image cache.
+ */
+// ----------------------------------------------------------------------
+
+void render_frame(const RenderFrame &theFrame,
+                  std::size_t theIndex,
+                  DrawTargets &theTargets,
+                  RenderQueue *theQueue)
+{
+  RenderState &state = *renderstate;
+  Profiler::Record record("frame", std::to_string(time_key(theFrame.time)), "");
+
+  // Activate the time of the frame
+
+  for (unsigned int qi = 0; qi < state.querystreams.size(); qi++)
+    state.querystreams[qi]->TimeIndex(theFrame.timeindexes[qi]);
+
+  if (!state.planned)
+    plan_specs();
+
+  // Render the contours of all targets whose images are out of date
+
+  std::vector<std::shared_ptr<ImagineXr_or_NFmiImage> > images(theTargets.size());
+  for (std::size_t k = 0; k < theTargets.size(); k++)
+  {
+    if (theFrame.filenames[k].empty())
+      continue;
+    TargetScope scope(k, *theTargets[k], false);
+    if (theTargets[k]->vectors)
+    {
+      render_vectors(theFrame, *theTargets[k], theFrame.filenames[k]);
+      write_manifest(theFrame.filenames[k], theFrame.manifests[k]);
+    }
+    else
+      images[k] = render_target(theFrame, *theTargets[k], theFrame.filenames[k]);
+  }
 
-  // Now choose the marker positions and draw them
+  // The rest depends on the label positions of the previous
+  // time step, and must hence be done in time order
 
-  const ExtremaLocator::ExtremaCoordinates &extrema = globals.pressurelocator.chooseCoordinates();
+  std::unique_lock<std::mutex> lock;
+  if (theQueue != nullptr)
+  {
+    Profiler::Phase phase("wait");
+    lock = std::unique_lock<std::mutex>(theQueue->mutex);
+    theQueue->turnchanged.wait(lock,
+                               [&] { return theQueue->failed || theQueue->turn == theIndex; });
+    if (theQueue->failed)
+      return;
+  }
 
-  NFmiColorTools::NFmiBlendRule lowrule = ColorTools::checkrule(globals.lowpressurerule);
-  NFmiColorTools::NFmiBlendRule highrule = ColorTools::checkrule(globals.highpressurerule);
+  std::vector<std::shared_ptr<SavedImage> > saves(theTargets.size());
+  std::vector<char> linked(theTargets.size(), false);
 
-  for (ExtremaLocator::ExtremaCoordinates::const_iterator eit = extrema.begin();
-       eit != extrema.end();
-       ++eit)
+  for (std::size_t k = 0; k < theTargets.size(); k++)
   {
-    for (ExtremaLocator::Coordinates::const_iterator it = eit->second.begin();
-         it != eit->second.end();
-         ++it)
+    if (!images[k])
+      continue;
+    TargetScope scope(k, *theTargets[k], true);
+    label_target(*images[k], theFrame.time, *theTargets[k]->area);
+
+    // Unchanged images are linked to the previous one instead of saving
+
+    if (globals.reuseframes)
     {
-      NFmiPoint wxy(it->first * 1000, it->second * 1000);
-      NFmiPoint latlon = theArea.WorldXYToLatLon(wxy);
-      /// latlon = MeridianTools::Relocate(latlon,theArea);
-      NFmiPoint xy = theArea.ToXY(latlon);
+      bool match = false;
+      saves[k] = match_saved_image(*theTargets[k], *images[k], theFrame.filenames[k], match);
+      linked[k] = match;
+    }
+  }
 
-      switch (eit->first)
+  if (theQueue != nullptr)
+  {
+    ++theQueue->turn;
+    lock.unlock();
+    theQueue->turnchanged.notify_all();
+  }
+
+  // Save
+
+  const bool releaseimages = (theQueue == nullptr && writequeue == nullptr);
+
+  for (std::size_t k = 0; k < theTargets.size(); k++)
+  {
+    // Tiles with nothing to show are left out
+
+    if (images[k] && !theTargets[k]->tilename.empty() && uniform_image(*images[k]))
+    {
+      if (globals.verbose)
+        cout << "Not saving uniform tile " << theFrame.filenames[k] << endl;
+      continue;
+    }
+    if (!images[k])
+      continue;
+    if (linked[k])
+    {
+      Profiler::count("linked_images");
+      link_target(images[k], theFrame.filenames[k], theFrame.manifests[k], *saves[k]);
+    }
+    else
+      save_target(
+          images[k], theFrame.filenames[k], theFrame.manifests[k], releaseimages, saves[k]);
+  }
+
+  state.lastframe = static_cast<long>(theIndex);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Render frames from the queue until it is exhausted
+ */
+// ----------------------------------------------------------------------
+
+void render_frames(const std::vector<RenderFrame> &theFrames,
+                   DrawTargets &theTargets,
+                   RenderState &theState,
+                   RenderQueue &theQueue)
+{
+  renderstate = &theState;
+  try
+  {
+    for (;;)
+    {
+      std::size_t i = theQueue.next++;
+      if (i >= theFrames.size())
+        break;
       {
-        case ExtremaLocator::Minimum:
-          img.Composite(globals.lowpressureimage,
-                        lowrule,
-                        kFmiAlignCenter,
-                        static_cast<int>(round(xy.X())),
-                        static_cast<int>(round(xy.Y())),
-                        globals.lowpressurefactor);
-          break;
-        case ExtremaLocator::Maximum:
-          img.Composite(globals.highpressureimage,
-                        highrule,
-                        kFmiAlignCenter,
-                        static_cast<int>(round(xy.X())),
-                        static_cast<int>(round(xy.Y())),
-                        globals.highpressurefactor);
+        std::lock_guard<std::mutex> lock(theQueue.mutex);
+        if (theQueue.failed)
           break;
       }
+      render_frame(theFrames[i], i, theTargets, &theQueue);
+    }
+  }
+  catch (...)
+  {
+    std::lock_guard<std::mutex> lock(theQueue.mutex);
+    if (!theQueue.failed)
+    {
+      theQueue.failed = true;
+      theQueue.error = std::current_exception();
     }
+    theQueue.turnchanged.notify_all();
   }
+  renderstate = nullptr;
 }
 
 // ----------------------------------------------------------------------
 /*!
- * \brief Draw the foreground onto the image
+ * \brief Render the frames in parallel
+ *
+ * Each thread gets its own query data iterators, contour calculator
+ * and copy of the contour specifications. The calculators share the
+ * contour cache. The frames and the work within them share the
+ * workers of the task scheduler, hence threads left over when there
+ * are fewer frames than threads, or idle while waiting for the turn
+ * to label, are used for calculating the contours of the frames in
+ * parallel. Once done, the state of the thread which rendered
+ * the last frame is made the global state, just like in serial mode.
  */
 // ----------------------------------------------------------------------
 
-void draw_foreground(ImagineXr_or_NFmiImage &img)
+void render_frames_in_parallel(const std::vector<RenderFrame> &theFrames,
+                               DrawTargets &theTargets,
+                               unsigned int theThreads)
 {
-  if (globals.foreground.empty())
-    return;
+  if (theThreads > theFrames.size())
+    theThreads = static_cast<unsigned int>(theFrames.size());
 
-  NFmiColorTools::NFmiBlendRule rule = ColorTools::checkrule(globals.foregroundrule);
+  std::vector<std::unique_ptr<RenderState> > states;
+  for (unsigned int i = 0; i < theThreads; i++)
+  {
+    std::unique_ptr<RenderState> state(new RenderState);
+    for (const auto &q : globals.querystreams)
+      state->querystreams.push_back(q->Clone());
+    state->calculator.shareCache(globals.calculator);
+    state->threads = globals.threads;
+    state->calculator.threads(state->threads);
+    state->calculator.stripes(globals.contourstripes);
+    state->calculator.isobands(globals.contourengine == "isobands");
+    state->specs = globals.specs;
+    state->targetstates.resize(theTargets.size() - 1);
+    for (auto &target : state->targetstates)
+      target.specs = globals.specs;
+    states.push_back(std::move(state));
+  }
 
-  img.Composite(globals.getImage(globals.foreground), rule, kFmiAlignNorthWest, 0, 0, 1);
+  RenderQueue queue;
+  TaskScheduler::run(theThreads,
+                     theThreads,
+                     [&](std::size_t i)
+                     { render_frames(theFrames, theTargets, *states[i], queue); });
+
+  // Images may be released only once all threads are done
+
+  globals.releaseImages();
+
+  if (queue.error)
+    std::rethrow_exception(queue.error);
+
+  for (const auto &state : states)
+  {
+    if (state->lastframe == static_cast<long>(theFrames.size()) - 1)
+    {
+      globals.querystreams = state->querystreams;
+      globals.specs = state->specs;
+    }
+  }
 }
 
 // ----------------------------------------------------------------------
 /*!
- * \brief Handle "draw contours" command
+ * \brief Render all time steps for the given targets
+ *
+ * \param theAfter If given, only the time steps after it are rendered
+ * \param theLast The last time step accepted for rendering, if any
+ * \return True if some time step was accepted
  */
 // ----------------------------------------------------------------------
 
-void do_draw_contours(istream &theInput)
+bool draw_time_steps(DrawTargets &targets, const NFmiTime *theAfter, NFmiTime &theLast)
 {
   // 1. Make sure query data has been read
   // 2. Make sure image has been initialized
@@ -5022,25 +8401,15 @@ void do_draw_contours(istream &theInput)
   //     11. Label all specified points
   //   12. Draw arrows if requested
   //   13. Save the image
+  //
+  // With multiple threads the accepted times are collected
+  // first, and then rendered in parallel.
 
   globals.labellocator.clear();
   globals.pressurelocator.clear();
   globals.symbollocator.clear();
   globals.imagelocator.clear();
 
-  if (globals.querystreams.empty())
-    throw runtime_error("No query data has been read!");
-
-  std::shared_ptr<NFmiArea> area = globals.createArea();
-
-  // This message intentionally ignores globals.verbose
-
-  if (!globals.background.empty())
-    cout << "Contouring for background " << globals.background << endl;
-
-  if (globals.verbose)
-    report_area(*area);
-
   // Establish querydata timelimits and initialize
   // the XY-coordinates simultaneously.
 
@@ -5051,21 +8420,18 @@ void do_draw_contours(istream &theInput)
 
   NFmiTime time1, time2;
 
-  NFmiDataMatrix<float> vals;
-  NFmiDataMatrix<float> maskvalues;
-
   unsigned int qi;
   for (qi = 0; qi < globals.querystreams.size(); qi++)
   {
     // Establish time limits
 
-    globals.queryinfo = globals.querystreams[qi];
+    LazyQueryData &q = *globals.querystreams[qi];
 
-    globals.queryinfo->LastTime();
-    NFmiTime t2 = globals.queryinfo->ValidTime();
+    q.LastTime();
+    NFmiTime t2 = q.ValidTime();
 
-    globals.queryinfo->FirstTime();
-    NFmiTime t1 = globals.queryinfo->ValidTime();
+    q.FirstTime();
+    NFmiTime t1 = q.ValidTime();
 
     if (qi == 0)
     {
@@ -5086,6 +8452,49 @@ void do_draw_contours(istream &theInput)
     cout << "Data start time " << time1 << endl << "Data end time " << time2 << endl;
   }
 
+  // In serial mode the frames are rendered as soon as they are found
+
+  const bool parallel = (globals.threads > 1);
+
+  RenderState serialstate;
+  if (!parallel)
+  {
+    serialstate.querystreams = globals.querystreams;
+    serialstate.calculator.shareCache(globals.calculator);
+    serialstate.calculator.isobands(globals.contourengine == "isobands");
+    serialstate.targetstates.resize(targets.size() - 1);
+    for (auto &target : serialstate.targetstates)
+      target.specs = globals.specs;
+    serialstate.specs.swap(globals.specs);
+    renderstate = &serialstate;
+  }
+
+  std::vector<RenderFrame> frames;
+
+  // Save the images in separate threads if so requested
+
+  std::unique_ptr<WriteQueue> writer;
+  if (globals.writers > 0)
+    writer.reset(new WriteQueue(globals.writers));
+  WriteQueueScope writerscope(writer.get());
+
+  // In serial mode the data of upcoming frames may be read in the
+  // background while the pending frames are rendered
+
+  std::unique_ptr<Prefetcher> reader;
+  PrefetcherScope readerscope(nullptr);
+  std::deque<RenderFrame> pending;
+
+  auto render_pending = [&](std::size_t theLimit)
+  {
+    while (pending.size() > theLimit)
+    {
+      render_frame(pending.front(), 0, targets, nullptr);
+      pending.pop_front();
+      reader->release();
+    }
+  };
+
   // Skip to first time
 
   NFmiMetTime tmptime(time1,
@@ -5099,7 +8508,6 @@ void do_draw_contours(istream &theInput)
   // Loop over all times
 
   int imagesdone = 0;
-  bool labeldxdydone = false;
   for (;;)
   {
     if (imagesdone >= globals.timesteps)
@@ -5122,15 +8530,9 @@ void do_draw_contours(istream &theInput)
     bool ok = true;
     for (qi = 0; ok && qi < globals.querystreams.size(); qi++)
     {
-      globals.queryinfo = globals.querystreams[qi];
-      globals.queryinfo->ResetTime();
-      while (globals.queryinfo->NextTime())
-      {
-        NFmiTime loc = globals.queryinfo->ValidTime();
-        if (!loc.IsLessThan(t))
-          break;
-      }
-      NFmiTime tnow = globals.queryinfo->ValidTime();
+      LazyQueryData &q = *globals.querystreams[qi];
+      q.FindTimeAtOrAfter(t);
+      NFmiTime tnow = q.ValidTime();
 
       // we wanted
 
@@ -5184,11 +8586,17 @@ void do_draw_contours(istream &theInput)
     if (!ok)
       continue;
 
+    // In follow mode the time steps handled earlier are skipped
+
+    if (theAfter != nullptr && !theAfter->IsLessThan(t))
+      continue;
+
     // The image is accepted for rendering, but
     // we might not overwrite an existing one.
     // Hence we update the counter here already.
 
     imagesdone++;
+    theLast = t;
 
     // Create the filename
 
@@ -5199,7 +8607,7 @@ void do_draw_contours(istream &theInput)
     if (globals.verbose)
       cout << "Time is " << datatimestr.CharPtr() << endl;
 
-    string filename = globals.savepath + "/" + globals.prefix + datatimestr.CharPtr();
+    string filename = globals.prefix + datatimestr.CharPtr();
 
     if (globals.timestampflag)
     {
@@ -5211,266 +8619,760 @@ void do_draw_contours(istream &theInput)
       }
     }
 
-    filename += globals.suffix + "." + globals.format;
+    filename += globals.suffix;
 
     // In force-mode we always write, but otherwise
     // we first check if the output image already
     // exists. If so, we assume it is up to date
-    // and skip to the next time stamp.
+    // and skip to the next target or time stamp. With
+    // manifests the inputs of the image must also be
+    // unchanged.
+
+    RenderFrame frame;
+    frame.time = t;
 
-    if (!globals.force && !NFmiFileSystem::FileEmpty(filename))
+    bool outdated = false;
+    for (const auto &target : targets)
     {
-      if (globals.verbose)
-        cout << "Not overwriting " << filename << endl;
-      continue;
-    }
+      const string &format = (target->vectors ? string("geojson") : globals.format);
+      string file = target->savepath + "/" + filename + target->tilename + "." + format;
+      const string manifest =
+          (globals.manifest ? product_manifest(t, target->background) : string());
 
-    // Initialize the background
+      if (!assigned_to_shard())
+      {
+        if (globals.verbose)
+          cout << "Leaving " << file << " to another shard" << endl;
+        file.clear();
+      }
+      else if (!globals.force && !NFmiFileSystem::FileEmpty(file) &&
+               (!globals.manifest || manifest_matches(file, manifest)))
+      {
+        if (globals.verbose)
+          cout << "Not overwriting " << file << endl;
+        file.clear();
+      }
+      else if (!claim_image(file))
+      {
+        if (globals.verbose)
+          cout << "Already claimed " << file << endl;
+        file.clear();
+      }
+      else
+      {
+        outdated = true;
+        if (!target->tilename.empty())
+          NFmiFileSystem::CreateDirectory(file.substr(0, file.rfind('/')));
+      }
 
-    int imgwidth = static_cast<int>(area->Width() + 0.5);
-    int imgheight = static_cast<int>(area->Height() + 0.5);
+      frame.filenames.push_back(file);
+      frame.manifests.push_back(manifest);
+    }
 
-    NFmiColorTools::Color erasecolor = ColorTools::checkcolor(globals.erase);
+    if (!outdated)
+      continue;
 
-#ifdef IMAGINE_WITH_CAIRO
-    ImagineXr *xr = new ImagineXr(imgwidth, imgheight, filename, globals.format);
+    for (qi = 0; qi < globals.querystreams.size(); qi++)
+      frame.timeindexes.push_back(globals.querystreams[qi]->TimeIndex());
 
-    if (globals.background.empty())
+    if (parallel)
+      frames.push_back(frame);
+    else
     {
-      xr->Erase(erasecolor);
+      try
+      {
+        if (globals.prefetch == 0)
+          render_frame(frame, 0, targets, nullptr);
+        else
+        {
+          if (!reader)
+          {
+            if (!serialstate.planned)
+              plan_specs();
+            reader.reset(new Prefetcher(serialstate));
+            prefetcher = reader.get();
+          }
+          reader->request(frame.timeindexes, frame.time);
+          pending.push_back(frame);
+          render_pending(globals.prefetch);
+        }
+      }
+      catch (...)
+      {
+        globals.specs.swap(serialstate.specs);
+        renderstate = nullptr;
+        throw;
+      }
     }
-    else
+  }
+
+  if (!parallel)
+  {
+    try
+    {
+      if (reader)
+        render_pending(0);
+    }
+    catch (...)
     {
-      const ImagineXr &xr2 = globals.getImage(globals.background);
+      globals.specs.swap(serialstate.specs);
+      renderstate = nullptr;
+      throw;
+    }
+    globals.specs.swap(serialstate.specs);
+    renderstate = nullptr;
+  }
+  else if (!frames.empty())
+    render_frames_in_parallel(frames, targets, globals.threads);
 
-      if ((xr2.Width() != xr->Width()) || (xr2.Height() != xr->Height()))
-        throw runtime_error("Background image size does not match area size");
+  // Wait for the images to be saved
 
-      xr->Composite(xr2);
-    }
-#else
-    std::shared_ptr<Imagine::NFmiImage> image;
-    if (globals.background.empty())
+  if (writer)
+  {
+    writer->finish();
+    globals.releaseImages();
+  }
+
+  return (imagesdone > 0);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Wait until the querydata files have been updated
+ *
+ * The files are polled every "follow" interval. A changed file is
+ * accepted only once it has stayed the same for one interval and is
+ * not empty, so that files still being written are not read.
+ *
+ * \return False if nothing changed within the "follow" timeout
+ */
+// ----------------------------------------------------------------------
+
+bool wait_for_querydata()
+{
+  string previous = globals.queryfilestamp;
+  int waited = 0;
+  for (;;)
+  {
+    if (globals.followtimeout > 0 && waited >= globals.followtimeout)
+      return false;
+
+    std::this_thread::sleep_for(std::chrono::seconds(globals.followinterval));
+    waited += globals.followinterval;
+
+    bool complete = true;
+    string stamp;
+    for (const string &file : globals.queryfilenames)
     {
-      image.reset(new Imagine::NFmiImage(imgwidth, imgheight, erasecolor));
+      complete &= !NFmiFileSystem::FileEmpty(file);
+      stamp += QueryDataPool::identity(file) + '\n';
     }
-    else
+
+    if (complete && stamp != globals.queryfilestamp && stamp == previous)
     {
-      image.reset(new Imagine::NFmiImage(globals.getImage(globals.background)));
-      if (imgwidth != image->Width() || imgheight != image->Height())
-      {
-        throw runtime_error("Background image size does not match area size");
-      }
+      globals.querystreams = globals.itsQueryDataPool.get(globals.queryfilenames);
+      globals.queryfilestamp = stamp;
+      return true;
     }
-    if (image.get() == 0)
-      throw runtime_error("Failed to allocate a new image for rendering");
+    previous = stamp;
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Render the time steps, and in follow mode new ones as they appear
+ *
+ * In follow mode the querydata files are read again whenever they
+ * change, and only the time steps after the last one handled so far
+ * are rendered. The contour and image caches stay as they are, and
+ * only the pages of the new time steps of the memory mapped files
+ * are actually read from the disk.
+ */
+// ----------------------------------------------------------------------
+
+void draw_targets(DrawTargets &targets)
+{
+  NFmiTime last;
+  bool found = draw_time_steps(targets, nullptr, last);
+
+  if (globals.followinterval <= 0)
+    return;
+
+  while (wait_for_querydata())
+  {
+    if (globals.verbose)
+      cout << "Querydata updated, rendering new time steps" << endl;
+    if (draw_time_steps(targets, found ? &last : nullptr, last))
+      found = true;
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Handle "draw contours" command
+ */
+// ----------------------------------------------------------------------
+
+void do_draw_contours(istream &theInput)
+{
+  if (globals.querystreams.empty())
+    throw runtime_error("No query data has been read!");
+
+  // Each time step is rendered for all targets. Without explicit
+  // targets the projection, background and savepath settings are used.
+
+  std::vector<RenderTarget> targetspecs = globals.targets;
+  if (targetspecs.empty())
+    targetspecs.push_back(RenderTarget{globals.projection, globals.background, globals.savepath});
+
+  DrawTargets targets;
+  for (const RenderTarget &spec : targetspecs)
+  {
+    std::unique_ptr<DrawTarget> target(new DrawTarget);
+    target->projection = spec.projection;
+    target->background = spec.background;
+    target->savepath = spec.savepath;
+    target->area = Globals::createArea(spec.projection);
+
+    // This message intentionally ignores globals.verbose
+
+    if (!target->background.empty())
+      cout << "Contouring for background " << target->background << endl;
+
+    if (globals.verbose)
+      report_area(*target->area);
+
+    targets.push_back(std::move(target));
+  }
+
+  draw_targets(targets);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Handle "draw vectors" command
+ *
+ * Writes the contours as GeoJSON instead of rendering images. The
+ * projection is needed only for smoothing in world coordinates.
+ */
+// ----------------------------------------------------------------------
+
+void do_draw_vectors(istream &theInput)
+{
+  if (globals.querystreams.empty())
+    throw runtime_error("No query data has been read!");
+
+  std::unique_ptr<DrawTarget> target(new DrawTarget);
+  target->projection = globals.projection;
+  target->savepath = globals.savepath;
+  target->area = globals.createArea();
+  target->vectors = true;
+
+  DrawTargets targets;
+  targets.push_back(std::move(target));
+  draw_targets(targets);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Handle "vectorprecision" command
+ */
+// ----------------------------------------------------------------------
+
+void do_vectorprecision(istream &theInput)
+{
+  theInput >> globals.vectorprecision;
+
+  check_errors(theInput, "vectorprecision");
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Handle "autoresolution" command
+ */
+// ----------------------------------------------------------------------
+
+void do_autoresolution(istream &theInput)
+{
+  theInput >> globals.autoresolution;
 
-    globals.setImageModes(*image);
-#define xr image /* HACK */
-#endif
+  check_errors(theInput, "autoresolution");
 
-    // Initialize label locator bounding box
+  if (globals.autoresolution < 0)
+    throw runtime_error("autoresolution must be nonnegative");
+}
 
-    globals.labellocator.boundingBox(globals.contourlabelimagexmargin,
-                                     globals.contourlabelimageymargin,
-                                     xr->Width() - globals.contourlabelimagexmargin,
-                                     xr->Height() - globals.contourlabelimageymargin);
+// ----------------------------------------------------------------------
+/*!
+ * \brief Handle "prefetch" command
+ */
+// ----------------------------------------------------------------------
 
-    // Initialize symbol locator bounding box with reasonably safety
-    // for large symbols
+void do_prefetch(istream &theInput)
+{
+  int steps;
+  theInput >> steps;
 
-    globals.symbollocator.boundingBox(-30, -30, xr->Width() + 30, xr->Height() + 30);
-    globals.imagelocator.boundingBox(-30, -30, xr->Width() + 30, xr->Height() + 30);
+  check_errors(theInput, "prefetch");
 
-    // Loop over all parameters
-    // The loop collects all contour label information, but
-    // does not render it yet
+  if (steps < 0)
+    throw runtime_error("prefetch must be nonnegative");
 
-    list<ContourSpec>::iterator piter;
-    list<ContourSpec>::iterator pbegin = globals.specs.begin();
-    list<ContourSpec>::iterator pend = globals.specs.end();
+  globals.prefetch = static_cast<unsigned int>(steps);
+}
 
-    for (piter = pbegin; piter != pend; ++piter)
-    {
-      // Establish the parameter
+// ----------------------------------------------------------------------
+/*!
+ * \brief Handle "filltiles" command
+ */
+// ----------------------------------------------------------------------
 
-      string name = piter->param();
-      int level = piter->level();
+void do_filltiles(istream &theInput)
+{
+  int rows;
+  theInput >> rows;
 
-      qi = choose_queryinfo(name, level);
+  check_errors(theInput, "filltiles");
 
-      if (globals.verbose)
-        report_queryinfo(name, qi);
+  if (rows < 0)
+    throw runtime_error("filltiles must be nonnegative");
 
-      // Establish the contour method
+  globals.filltiles = static_cast<unsigned int>(rows);
+}
 
-      string interpname = piter->contourInterpolation();
-      ContourInterpolation interp = ContourInterpolationValue(interpname);
-      if (interp == Missing)
-        throw runtime_error("Unknown contour interpolation method " + interpname);
+// ----------------------------------------------------------------------
+/*!
+ * \brief Handle "reuseframes" command
+ */
+// ----------------------------------------------------------------------
 
-      // Get the values.
+void do_reuseframes(istream &theInput)
+{
+  theInput >> globals.reuseframes;
+  check_errors(theInput, "reuseframes");
+}
 
-      if (!MetaFunctions::isMeta(name))
-      {
-        vals = globals.queryinfo->Values();
-        globals.unitsconverter.convert(FmiParameterName(globals.queryinfo->GetParamIdent()), vals);
-      }
-      else
-        vals = MetaFunctions::values(piter->param(), *globals.queryinfo);
+// ----------------------------------------------------------------------
+/*!
+ * \brief Handle "contourstripes" command
+ */
+// ----------------------------------------------------------------------
 
-      // Replace values if so requested
+void do_contourstripes(istream &theInput)
+{
+  int rows;
+  theInput >> rows;
 
-      if (piter->replace())
-        vals.Replace(piter->replaceSourceValue(), piter->replaceTargetValue());
+  check_errors(theInput, "contourstripes");
 
-      // Filter the values if so requested
+  if (rows < 0)
+    throw runtime_error("contourstripes must be nonnegative");
 
-      filter_values(vals, t, *piter);
+  globals.contourstripes = static_cast<unsigned int>(rows);
+}
 
-      // Expand the data if so requested
+// ----------------------------------------------------------------------
+/*!
+ * \brief Handle "profile" command
+ */
+// ----------------------------------------------------------------------
 
-      if (globals.expanddata)
-        expand_data(vals);
+void do_profile(istream &theInput)
+{
+  string filename;
+  theInput >> filename;
 
-      // Call smoother only if necessary to avoid LazyCoordinates dereferencing
+  check_errors(theInput, "profile");
 
-      LazyCoordinates worldpts(*area);
+  if (filename == "none")
+    Profiler::close();
+  else
+    Profiler::open(filename);
+}
 
-      if (piter->smoother() != "None")
-      {
-        NFmiSmoother smoother(piter->smoother(), piter->smootherFactor(), piter->smootherRadius());
+// ----------------------------------------------------------------------
+/*!
+ * \brief Return a Mercator projection for the given bounding box
+ */
+// ----------------------------------------------------------------------
 
-        vals = smoother.Smoothen(*worldpts, vals);
-      }
+string mercator_projection(
+    double theLon1, double theLat1, double theLon2, double theLat2, int theWidth, int theHeight)
+{
+  ostringstream out;
+  out << setprecision(12) << "mercator:" << theLon1 << ',' << theLat1 << ',' << theLon2 << ','
+      << theLat2 << ':' << theWidth << ',' << theHeight;
+  return out.str();
+}
 
-      // Setup the contourer with the values
+// ----------------------------------------------------------------------
+/*!
+ * \brief The longitude of the western edge of a map tile column
+ */
+// ----------------------------------------------------------------------
 
-      globals.calculator.data(vals);
+double tile_longitude(int theX, int theZoom)
+{
+  return theX * 360.0 / (1 << theZoom) - 180;
+}
 
-      // Save the data values at desired points for later
-      // use, this lets us avoid using InterpolatedValue()
-      // which does not use smoothened values.
+// ----------------------------------------------------------------------
+/*!
+ * \brief The latitude of the northern edge of a map tile row
+ */
+// ----------------------------------------------------------------------
 
-      // First, however, if this is the first image, we add
-      // the grid points to the set of points, if so requested
+double tile_latitude(int theY, int theZoom)
+{
+  const double n = kPii * (1 - 2.0 * theY / (1 << theZoom));
+  return atan(sinh(n)) * 180 / kPii;
+}
 
-      if (!labeldxdydone)
-        add_label_grid_values(*piter, *area, worldpts);
+// ----------------------------------------------------------------------
+/*!
+ * \brief The map tile column or row containing the given coordinate
+ */
+// ----------------------------------------------------------------------
 
-      // For pixelgrids we must repeat the process for all new
-      // background images, since the pixel spacing changes
-      // every time. Note! We assume the following calling order!
+int tile_index(double theFraction, int theZoom)
+{
+  const int n = 1 << theZoom;
+  return std::min(n - 1, std::max(0, static_cast<int>(floor(theFraction * n))));
+}
 
-      add_label_point_values(*piter, *area, vals);
-      add_label_pixelgrid_values(*piter, *area, *xr, vals);
+// ----------------------------------------------------------------------
+/*!
+ * \brief Handle "draw tiles" command
+ *
+ * Syntax: draw tiles <minzoom> <maxzoom> <lon1> <lat1> <lon2> <lat2>
+ *
+ * Renders the standard 256x256 pixel Web Mercator map tiles which
+ * intersect the given bounding box. The tiles of each zoom level
+ * are cut from contours projected onto the whole zoom level, so
+ * the contours are projected only once for all the tiles.
+ */
+// ----------------------------------------------------------------------
 
-      // Fill the contours
+void do_draw_tiles(istream &theInput)
+{
+  int minzoom, maxzoom;
+  double lon1, lat1, lon2, lat2;
+  theInput >> minzoom >> maxzoom >> lon1 >> lat1 >> lon2 >> lat2;
 
-      draw_contour_fills(*xr, *area, *piter, t, interp);
+  check_errors(theInput, "draw tiles");
 
-      // Pattern fill the contours
+  if (minzoom < 0 || maxzoom < minzoom || maxzoom > 20)
+    throw runtime_error("draw tiles zoom levels must be in the range 0-20");
 
-      draw_contour_patterns(*xr, *area, *piter, t, interp);
+  if (globals.querystreams.empty())
+    throw runtime_error("No query data has been read!");
 
-      // Stroke the contours
+  const int tilesize = 256;
+  const double maxlat = tile_latitude(0, 0);
 
-      draw_contour_strokes(*xr, *area, *piter, t, interp);
+  lat1 = std::max(-maxlat, std::min(maxlat, lat1));
+  lat2 = std::max(-maxlat, std::min(maxlat, lat2));
 
-      // Save contour symbol coordinates
+  DrawTargets targets;
+  for (int z = minzoom; z <= maxzoom; z++)
+  {
+    const int worldsize = tilesize << z;
+    const string worldprojection =
+        mercator_projection(-180, -maxlat, 180, maxlat, worldsize, worldsize);
+    std::shared_ptr<NFmiArea> worldarea = Globals::createArea(worldprojection);
 
-      save_contour_symbols(*xr, *area, *piter, worldpts, vals);
+    // Tile rows grow southwards
 
-      // Save symbol fill coordinates
+    const double y1 = 0.5 - log(tan(kPii / 4 + lat2 * kPii / 360)) / (2 * kPii);
+    const double y2 = 0.5 - log(tan(kPii / 4 + lat1 * kPii / 360)) / (2 * kPii);
 
-      save_contour_fonts(*xr, *area, *piter, worldpts, vals);
+    const int xmin = tile_index((lon1 + 180) / 360, z);
+    const int xmax = tile_index((lon2 + 180) / 360, z);
+    const int ymin = tile_index(y1, z);
+    const int ymax = tile_index(y2, z);
 
-      // Save contour label coordinates
+    for (int x = xmin; x <= xmax; x++)
+      for (int y = ymin; y <= ymax; y++)
+      {
+        std::unique_ptr<DrawTarget> target(new DrawTarget);
+        target->projection = mercator_projection(tile_longitude(x, z),
+                                                 tile_latitude(y + 1, z),
+                                                 tile_longitude(x + 1, z),
+                                                 tile_latitude(y, z),
+                                                 tilesize,
+                                                 tilesize);
+        target->savepath = globals.savepath;
+        target->area = Globals::createArea(target->projection);
+        target->tilename = '/' + NFmiStringTools::Convert(z) + '/' + NFmiStringTools::Convert(x) +
+                           '/' + NFmiStringTools::Convert(y);
+        target->contourprojection = worldprojection;
+        target->contourarea = worldarea;
+        target->contourx = x * tilesize;
+        target->contoury = y * tilesize;
+        targets.push_back(std::move(target));
+      }
+  }
 
-      save_contour_labels(*xr, *area, *piter, t, interp);
+  if (globals.verbose)
+    cout << "Rendering " << targets.size() << " tiles" << endl;
 
-      // Draw optional overlay
+  draw_targets(targets);
+}
 
-      draw_overlay(*xr, *piter);
-    }
+// ----------------------------------------------------------------------
+/*!
+ * \brief A draw command executed in a child process
+ *
+ * The child inherits a copy-on-write snapshot of the whole state, so
+ * commands later in the script may change the settings while the
+ * command is being executed. The output and diagnostics of the child
+ * are captured into temporary files and copied to the standard output
+ * and error in script order, and so are the errors.
+ */
+// ----------------------------------------------------------------------
 
-    // Draw graticule
+struct ScriptJob
+{
+  pid_t pid = -1;
+  FILE *output = nullptr;  // standard output of the child
+  FILE *log = nullptr;     // standard error of the child
+  FILE *error = nullptr;   // error message of the child, if any
+  std::string command;
+  bool barrier = false;  // must finish before later jobs are started
+};
 
-    draw_graticule(*xr, *area);
+std::deque<ScriptJob> runningjobs;  // in script order
 
-    // Bang the foreground
+// ----------------------------------------------------------------------
+/*!
+ * \brief Read the contents of a file
+ */
+// ----------------------------------------------------------------------
 
-    draw_foreground(*xr);
+std::string read_stream(FILE *theFile)
+{
+  std::string result;
+  rewind(theFile);
+  char buffer[4096];
+  std::size_t n;
+  while ((n = fread(buffer, 1, sizeof(buffer), theFile)) > 0)
+    result.append(buffer, n);
+  return result;
+}
 
-    // Draw wind arrows if so requested
+// ----------------------------------------------------------------------
+/*!
+ * \brief Wait for the oldest script job and report its results
+ *
+ * \return The error message of the job, empty if none
+ */
+// ----------------------------------------------------------------------
 
-    draw_wind_arrows(*xr, *area);
+std::string finish_script_job()
+{
+  ScriptJob job = runningjobs.front();
+  runningjobs.pop_front();
 
-    // Draw contour symbols
+  int status = 0;
+  while (waitpid(job.pid, &status, 0) < 0 && errno == EINTR)
+  {
+  }
 
-    draw_contour_symbols(*xr);
+  const std::string output = read_stream(job.output);
+  const std::string log = read_stream(job.log);
+  std::string error = read_stream(job.error);
+  fclose(job.output);
+  fclose(job.log);
+  fclose(job.error);
 
-    // Draw contour fonts
+  cout << output << flush;
+  cerr << log << flush;
 
-    draw_contour_fonts(*xr);
+  if (error.empty() && (!WIFEXITED(status) || WEXITSTATUS(status) != 0))
+    error = "'" + job.command + "' terminated abnormally";
+  return error;
+}
 
-    // Label the contours
+// ----------------------------------------------------------------------
+/*!
+ * \brief Wait for the script jobs and discard their results
+ *
+ * Once a job has failed, the output of the later ones is discarded,
+ * just as if the script had stopped at the failed command.
+ */
+// ----------------------------------------------------------------------
 
-    draw_contour_labels(*xr);
+void discard_script_jobs()
+{
+  while (!runningjobs.empty())
+  {
+    const ScriptJob &job = runningjobs.front();
+    while (waitpid(job.pid, nullptr, 0) < 0 && errno == EINTR)
+    {
+    }
+    fclose(job.output);
+    fclose(job.log);
+    fclose(job.error);
+    runningjobs.pop_front();
+  }
+}
 
-    // Draw labels
+// ----------------------------------------------------------------------
+/*!
+ * \brief Wait for the script jobs until at most the given number remain
+ */
+// ----------------------------------------------------------------------
 
-    for (piter = pbegin; piter != pend; ++piter)
+void finish_script_jobs(std::size_t theRemaining = 0)
+{
+  while (runningjobs.size() > theRemaining || (!runningjobs.empty() && runningjobs.back().barrier))
+  {
+    const std::string error = finish_script_job();
+    if (!error.empty())
     {
-      draw_label_markers(*xr, *piter, *area);
-      draw_label_texts(*xr, *piter, *area);
+      discard_script_jobs();
+      throw runtime_error(error);
     }
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Execute a draw command, in a child process if so requested
+ *
+ * The child works on a copy of the parent's memory, hence whatever it
+ * adds to the in-memory state is lost when it exits: the contours and
+ * coordinates it caches, the images, texts and shapes it reads, the
+ * querydata it loads into the pool and the label locations it chooses.
+ * Later commands, and in server mode later scripts, recalculate them.
+ * Only the files it writes, including the disk cache, are shared.
+ * Running the jobs as threads instead would require the global
+ * settings to be copied for each command.
+ *
+ * \param theCommand The name of the command for error messages
+ * \param theArguments The arguments of the command
+ * \param theFunction The handler of the command
+ * \param theBarrier True if later commands may depend on the output
+ * \param theWait True if earlier commands may depend on the output
+ */
+// ----------------------------------------------------------------------
 
-    // Draw high/low pressure markers
+void run_script_job(const std::string &theCommand,
+                    const std::string &theArguments,
+                    void (*theFunction)(istream &),
+                    bool theBarrier,
+                    bool theWait)
+{
+  // Sharding enumerates the images of all commands in script order
 
-    draw_pressure_markers(*xr, *area);
+  const bool concurrent = (globals.scriptjobs > 1 && globals.shards == 0);
 
-    // Bang the combine image (legend, logo, whatever)
+  if (!concurrent || theWait)
+    finish_script_jobs();
+  else
+    finish_script_jobs(globals.scriptjobs - 1);
 
-    globals.drawCombine(*xr);
+  istringstream arguments(theArguments);
+  if (!concurrent)
+  {
+    theFunction(arguments);
+    return;
+  }
 
-    // Finally, draw a time stamp on the image if so
-    // requested
+  ScriptJob job;
+  job.command = theCommand;
+  job.barrier = theBarrier;
+  job.output = tmpfile();
+  job.log = tmpfile();
+  job.error = tmpfile();
+  if (job.output == nullptr || job.log == nullptr || job.error == nullptr)
+  {
+    for (FILE *file : {job.output, job.log, job.error})
+      if (file != nullptr)
+        fclose(file);
+    throw runtime_error("Failed to create temporary files for '" + theCommand + "'");
+  }
 
-    const string stamp = globals.getImageStampText(t);
-    globals.drawImageStampText(*xr, stamp);
+  // The child has no threads but the forking one
 
-    // dx and dy labels have now been extracted into a list,
-    // disable adding them again and again and again..
+  TaskScheduler::stop();
+  cout << flush;
+  cerr << flush;
+  fflush(stdout);
+  fflush(stderr);
+  Profiler::flush();
 
-    labeldxdydone = true;
+  job.pid = fork();
+  if (job.pid < 0)
+  {
+    fclose(job.output);
+    fclose(job.log);
+    fclose(job.error);
+    throw runtime_error("Failed to fork a process for '" + theCommand + "'");
+  }
 
-    // Save
+  if (job.pid == 0)
+  {
+    dup2(fileno(job.output), 1);
+    dup2(fileno(job.log), 2);
 
-#ifdef IMAGINE_WITH_CAIRO
-    assert(xr->Filename() != "");
-    write_image(*xr);
-    delete xr;
-#else
-    write_image(*image, filename, globals.format);
-#endif
+    // The concurrent jobs share the rendering threads
 
-    // Advance in time
+    set_threads(static_cast<int>(std::max(1u, globals.threads / globals.scriptjobs)));
 
-    globals.labellocator.nextTime();
-    globals.pressurelocator.nextTime();
-    globals.symbollocator.nextTime();
-    globals.imagelocator.nextTime();
+    int status = 0;
+    try
+    {
+      theFunction(arguments);
+    }
+    catch (const std::exception &e)
+    {
+      fputs(e.what(), job.error);
+      status = 1;
+    }
+    catch (...)
+    {
+      fputs(("'" + theCommand + "' failed").c_str(), job.error);
+      status = 1;
+    }
+    cout << flush;
+    cerr << flush;
+    fflush(stdout);
+    fflush(stderr);
+    fflush(job.error);
+    Profiler::flush();
+    _exit(status);
   }
+
+  runningjobs.push_back(job);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Read the given number of command arguments
+ */
+// ----------------------------------------------------------------------
+
+std::string read_arguments(istream &theInput, int theCount)
+{
+  std::string result;
+  std::string word;
+  for (int i = 0; i < theCount && theInput >> word; i++)
+    result += word + ' ';
+  return result;
 }
 
 /****/
-static void process_cmd(const string &text)
+static void process_commands(const string &text)
 {
   istringstream in(text);
   string cmd;
-  while (in >> cmd)
+  for (;;)
   {
+    const std::streamoff start = in.tellg();
+    if (!(in >> cmd))
+      break;
+
     // Handle comments
 
     if (cmd == "#")
@@ -5483,6 +9385,24 @@ static void process_cmd(const string &text)
       do_cache(in);
     else if (cmd == "imagecache")
       do_imagecache(in);
+    else if (cmd == "textcache")
+      do_textcache(in);
+    else if (cmd == "threads")
+      do_threads(in);
+    else if (cmd == "shard")
+      do_shard(in);
+    else if (cmd == "jobfile")
+      do_jobfile(in);
+    else if (cmd == "writers")
+      do_writers(in);
+    else if (cmd == "scriptjobs")
+      do_scriptjobs(in);
+    else if (cmd == "follow")
+      do_follow(in);
+    else if (cmd == "querydatapool")
+      do_querydatapool(in);
+    else if (cmd == "manifest")
+      do_manifest(in);
     else if (cmd == "querydata")
       do_querydata(in);
     else if (cmd == "filter")
@@ -5519,10 +9439,30 @@ static void process_cmd(const string &text)
       do_timestampformat(in);
     else if (cmd == "projection")
       do_projection(in);
+    else if (cmd == "target")
+      do_target(in);
+    else if (cmd == "vectorprecision")
+      do_vectorprecision(in);
+    else if (cmd == "autoresolution")
+      do_autoresolution(in);
+    else if (cmd == "contourstripes")
+      do_contourstripes(in);
+    else if (cmd == "filltiles")
+      do_filltiles(in);
+    else if (cmd == "prefetch")
+      do_prefetch(in);
+    else if (cmd == "reuseframes")
+      do_reuseframes(in);
+    else if (cmd == "profile")
+      do_profile(in);
     else if (cmd == "erase")
       do_erase(in);
     else if (cmd == "fillrule")
       do_fillrule(in);
+    else if (cmd == "contourfillmode")
+      do_contourfillmode(in);
+    else if (cmd == "contourengine")
+      do_contourengine(in);
     else if (cmd == "strokerule")
       do_strokerule(in);
     else if (cmd == "directionparam")
@@ -5690,6 +9630,10 @@ static void process_cmd(const string &text)
       do_pressuremindistsame(in);
     else if (cmd == "pressuremindistdifferent")
       do_pressuremindistdifferent(in);
+    else if (cmd == "pressureradius")
+      do_pressureradius(in);
+    else if (cmd == "labelcoherence")
+      do_labelcoherence(in);
     else if (cmd == "labelmarker")
       do_labelmarker(in);
     else if (cmd == "labelfont")
@@ -5720,6 +9664,8 @@ static void process_cmd(const string &text)
       do_labelfile(in);
     else if (cmd == "units")
       do_units(in);
+    else if (cmd == "metaparam")
+      do_metaparam(in);
     else if (cmd == "clear")
       do_clear(in);
 
@@ -5727,17 +9673,187 @@ static void process_cmd(const string &text)
     {
       in >> cmd;
 
+      // Later commands may use the shapes as images, and earlier
+      // commands may still be reading a file about to be replaced
+
       if (cmd == "shapes")
-        do_draw_shapes(in);
+      {
+        string filename;
+        in >> filename;
+        const bool exists = NFmiFileSystem::FileExists(filename + '.' + globals.format);
+        run_script_job("draw shapes", filename, do_draw_shapes, true, exists);
+      }
       else if (cmd == "imagemap")
-        do_draw_imagemap(in);
+        run_script_job("draw imagemap", read_arguments(in, 2), do_draw_imagemap, false, false);
       else if (cmd == "contours")
-        do_draw_contours(in);
+        run_script_job("draw contours", "", do_draw_contours, false, false);
+      else if (cmd == "tiles")
+        run_script_job("draw tiles", read_arguments(in, 6), do_draw_tiles, false, false);
+      else if (cmd == "vectors")
+        run_script_job("draw vectors", "", do_draw_vectors, false, false);
       else
         throw runtime_error("draw " + cmd + " not implemented");
     }
     else
       throw runtime_error("Unknown command " + cmd);
+
+    // Remember the commands, they determine the products drawn
+
+    if (cmd[0] != '#' && cmd != "//")
+    {
+      std::streamoff end = in.tellg();
+      if (end < 0)
+        end = static_cast<std::streamoff>(text.size());
+      boost::hash_combine(globals.scripthash, text.substr(start, end - start));
+    }
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Execute a script
+ *
+ * The draw commands still running in child processes are waited for
+ * before returning. An error in them is reported before an error in
+ * a later command, just like when executing the commands in order.
+ */
+// ----------------------------------------------------------------------
+
+static void process_cmd(const string &text)
+{
+  std::exception_ptr error;
+  try
+  {
+    process_commands(text);
+  }
+  catch (...)
+  {
+    error = std::current_exception();
+  }
+
+  finish_script_jobs();
+  if (error)
+    std::rethrow_exception(error);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Execute a script received in server mode
+ *
+ * \return The reply to be sent to the client
+ */
+// ----------------------------------------------------------------------
+
+string serve_request(const string &theScript)
+{
+  try
+  {
+    // Each script is sliced independently of the earlier ones
+
+    globals.shardimages = 0;
+    process_cmd(preprocess_script(theScript));
+    return "OK\n";
+  }
+  catch (const std::exception &e)
+  {
+    string message = e.what();
+    std::replace(message.begin(), message.end(), '\n', ' ');
+    return "ERROR " + message + "\n";
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Serve scripts from standard input
+ *
+ * Each script ends with a line containing a single period, or at
+ * the end of the input.
+ */
+// ----------------------------------------------------------------------
+
+void serve_stdin()
+{
+  string script;
+  string line;
+  while (getline(cin, line))
+  {
+    if (line != ".")
+    {
+      script += line;
+      script += '\n';
+      continue;
+    }
+    cout << serve_request(script) << flush;
+    script.clear();
+  }
+
+  if (!script.empty())
+    cout << serve_request(script) << flush;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Serve scripts from a UNIX socket
+ *
+ * Each connection sends one script and closes the writing half of
+ * the connection, after which the reply is sent back.
+ */
+// ----------------------------------------------------------------------
+
+void serve_socket(const string &thePath)
+{
+  sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+
+  if (thePath.size() >= sizeof(address.sun_path))
+    throw runtime_error("Socket path too long: '" + thePath + "'");
+  strcpy(address.sun_path, thePath.c_str());
+
+  int server = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (server < 0)
+    throw runtime_error("Failed to create socket: " + string(strerror(errno)));
+
+  unlink(thePath.c_str());
+
+  if (bind(server, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0 ||
+      listen(server, 16) != 0)
+  {
+    const string error = strerror(errno);
+    close(server);
+    throw runtime_error("Failed to listen to socket '" + thePath + "': " + error);
+  }
+
+  for (;;)
+  {
+    int client = accept(server, nullptr, nullptr);
+    if (client < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      const string error = strerror(errno);
+      close(server);
+      throw runtime_error("Failed to accept a connection: " + error);
+    }
+
+    string script;
+    char buffer[4096];
+    ssize_t n;
+    while ((n = recv(client, buffer, sizeof(buffer), 0)) > 0)
+      script.append(buffer, n);
+
+    const string reply = serve_request(script);
+
+    // The client may have disconnected already, which is not our problem
+
+    for (std::size_t pos = 0; pos < reply.size();)
+    {
+      n = send(client, reply.data() + pos, reply.size() - pos, MSG_NOSIGNAL);
+      if (n <= 0)
+        break;
+      pos += n;
+    }
+    close(client);
   }
 }
 
@@ -5780,6 +9896,21 @@ int domain(int argc, const char *argv[])
 
     process_cmd(text);
   }
+
+  // In server mode the querydata and the caches stay in memory
+  // between the scripts, the command files above may be used for
+  // warming them up
+
+  if (!globals.cmdline_serve.empty())
+  {
+    if (globals.cmdline_serve == "-")
+      serve_stdin();
+    else
+      serve_socket(globals.cmdline_serve);
+  }
+
+  Profiler::close();
+
   return 0;
 }
 
@@ -24,6 +24,7 @@ using namespace std;
 
 bool ArrowCache::empty() const
 {
+  std::lock_guard<std::mutex> lock(itsMutex);
   return itsCache.empty();
 }
 
@@ -35,7 +36,9 @@ bool ArrowCache::empty() const
 
 void ArrowCache::clear()
 {
+  std::lock_guard<std::mutex> lock(itsMutex);
   itsCache.clear();
+  itsPathCache.clear();
 }
 
 // ----------------------------------------------------------------------
@@ -45,6 +48,42 @@ void ArrowCache::clear()
 // ----------------------------------------------------------------------
 
 const string& ArrowCache::find(const string& theName)
+{
+  std::lock_guard<std::mutex> lock(itsMutex);
+  return read(theName);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Return the desired arrow from the cache as a parsed path
+ *
+ * The path is parsed only once, rendering merely copies and
+ * transforms it.
+ */
+// ----------------------------------------------------------------------
+
+const Imagine::NFmiPath& ArrowCache::findPath(const string& theName)
+{
+  std::lock_guard<std::mutex> lock(itsMutex);
+  path_cache_type::const_iterator it = itsPathCache.find(theName);
+  if (it != itsPathCache.end())
+    return it->second;
+
+  Imagine::NFmiPath path;
+  path.Add(read(theName));
+
+  return itsPathCache.insert(path_cache_type::value_type(theName, path)).first->second;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Return the arrow text, reading it if necessary
+ *
+ * The caller must hold the lock.
+ */
+// ----------------------------------------------------------------------
+
+const string& ArrowCache::read(const string& theName)
 {
   cache_type::const_iterator it = itsCache.find(theName);
   if (it != itsCache.end())
@@ -8,39 +8,374 @@
 #include "ContourCache.h"
 #include "LazyQueryData.h"
 #include "NFmiTime.h"
+#include <boost/functional/hash.hpp>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iomanip>
 #include <sstream>
+#include <stdexcept>
+#include <thread>
 
 using namespace std;
 
 namespace
 {
+// ----------------------------------------------------------------------
+/*!
+ * \brief Return the time as a YYYYMMDDHHMM number
+ *
+ * This is the resolution the cache has always used for times.
+ */
+// ----------------------------------------------------------------------
+
+long long time_key(const NFmiTime& theTime)
+{
+  return ((((theTime.GetYear() * 100LL + theTime.GetMonth()) * 100 + theTime.GetDay()) * 100 +
+           theTime.GetHour()) *
+              100 +
+          theTime.GetMin());
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Estimate the memory used by a cached path
+ */
+// ----------------------------------------------------------------------
+
+std::size_t path_bytes(const Imagine::NFmiPath& thePath)
+{
+  return (sizeof(Imagine::NFmiPath) +
+          thePath.Elements().size() * sizeof(Imagine::NFmiPathData::value_type));
+}
+
+// Identifies the format of the cache files
+
+const char* disk_magic = "qdcontour2 path 1";
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Read a path from a cache file
+ *
+ * Any failure, including a signature mismatch due to a hash collision,
+ * is treated as a cache miss.
+ *
+ * \param theFile The file to read
+ * \param theSignature The expected signature of the contour
+ * \param thePath The path to assign to
+ * \return True on success
+ */
+// ----------------------------------------------------------------------
+
+bool disk_read(const std::string& theFile,
+               const std::string& theSignature,
+               Imagine::NFmiPath& thePath)
+{
+  std::ifstream in(theFile.c_str(), std::ios::in | std::ios::binary);
+  if (!in)
+    return false;
+
+  std::string magic;
+  std::string signature;
+  if (!std::getline(in, magic) || magic != disk_magic)
+    return false;
+  if (!std::getline(in, signature) || signature != theSignature)
+    return false;
+
+  std::uint64_t count;
+  if (!in.read(reinterpret_cast<char*>(&count), sizeof(count)))
+    return false;
+
+  Imagine::NFmiPath path;
+  for (std::uint64_t i = 0; i < count; i++)
+  {
+    std::int32_t op;
+    double x;
+    double y;
+    in.read(reinterpret_cast<char*>(&op), sizeof(op));
+    in.read(reinterpret_cast<char*>(&x), sizeof(x));
+    in.read(reinterpret_cast<char*>(&y), sizeof(y));
+    if (!in || op < Imagine::kFmiMoveTo || op > Imagine::kFmiCubicTo)
+      return false;
+    path.Insert(Imagine::NFmiPathElement(static_cast<Imagine::NFmiPathOperation>(op), x, y));
+  }
+
+  thePath = path;
+  return true;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Write a path into a cache file
+ *
+ * The file is written under a temporary name and then renamed, so
+ * that concurrent processes never see partially written files.
+ * Failures are ignored, the contour simply remains uncached.
+ *
+ * \param theFile The file to write
+ * \param theSignature The signature of the contour
+ * \param thePath The path to write
+ */
+// ----------------------------------------------------------------------
+
+void disk_write(const std::string& theFile,
+                const std::string& theSignature,
+                const Imagine::NFmiPath& thePath)
+{
+  std::ostringstream tmpname;
+  tmpname << theFile << '.' << getpid() << '.' << std::this_thread::get_id() << ".tmp";
+  const std::string tmpfile = tmpname.str();
+
+  {
+    std::ofstream out(tmpfile.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+    if (!out)
+      return;
+
+    out << disk_magic << '\n' << theSignature << '\n';
+
+    const Imagine::NFmiPathData& elements = thePath.Elements();
+    const std::uint64_t count = elements.size();
+    out.write(reinterpret_cast<const char*>(&count), sizeof(count));
+
+    for (const auto& element : elements)
+    {
+      const std::int32_t op = element.op;
+      out.write(reinterpret_cast<const char*>(&op), sizeof(op));
+      out.write(reinterpret_cast<const char*>(&element.x), sizeof(element.x));
+      out.write(reinterpret_cast<const char*>(&element.y), sizeof(element.y));
+    }
+
+    if (!out.flush())
+    {
+      out.close();
+      std::remove(tmpfile.c_str());
+      return;
+    }
+  }
+
+  if (std::rename(tmpfile.c_str(), theFile.c_str()) != 0)
+    std::remove(tmpfile.c_str());
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Test whether the given file exists
+ */
+// ----------------------------------------------------------------------
+
+bool file_exists(const std::string& theFile)
+{
+  struct stat info;
+  return (stat(theFile.c_str(), &info) == 0);
+}
+}  // namespace
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Test whether two keys are equal
+ */
+// ----------------------------------------------------------------------
+
+bool ContourCache::Key::operator==(const Key& theOther) const
+{
+  return (hash == theOther.hash && lolimit == theOther.lolimit && hilimit == theOther.hilimit &&
+          file == theOther.file && param == theOther.param && level == theOther.level &&
+          time == theOther.time && origintime == theOther.origintime &&
+          variant == theOther.variant);
+}
+
 // ----------------------------------------------------------------------
 /*!
  * \brief Return a cache-key for the given contour settings
  *
+ * The file names are mapped to small integers so that the key is
+ * a plain structure with a precomputed hash value. A file which has
+ * been modified since it was last seen gets a new number, hence
+ * contours of its previous version are no longer found. The mutex
+ * must be locked when this is called.
+ *
  * \param theLoLimit The lower limit of the contour
  * \param theHiLimit The upper limit of the contour
  * \param theTime The actual data time which may be interpolated
  * \param theData The query data
+ * \param theVariant Additional identity given by the caller
+ * \param theDigest Independent digest of the values, 0 if unknown
  * \return The key for the data in the cache
  */
 // ----------------------------------------------------------------------
 
-std::string cache_key(float theLoLimit,
-                      float theHiLimit,
-                      const NFmiTime& theTime,
-                      const LazyQueryData& theData)
+ContourCache::Key ContourCache::make_key(float theLoLimit,
+                                         float theHiLimit,
+                                         const NFmiTime& theTime,
+                                         const LazyQueryData& theData,
+                                         std::size_t theVariant,
+                                         std::size_t theDigest) const
 {
+  auto file = itsFiles.find(theData.Filename());
+  if (file == itsFiles.end() || file->second.mtime != theData.FileTime() ||
+      file->second.size != theData.FileSize())
+  {
+    File info;
+    info.number = itsFileNumbers++;
+    info.mtime = theData.FileTime();
+    info.size = theData.FileSize();
+    file = itsFiles.insert_or_assign(theData.Filename(), info).first;
+  }
+
+  Key key;
+  key.lolimit = theLoLimit;
+  key.hilimit = theHiLimit;
+  key.file = file->second.number;
+  key.param = theData.GetParamIdent();
+  key.level = theData.GetLevelNumber();
+  key.time = time_key(theTime);
+  key.origintime = time_key(theData.OriginTime());
+  key.variant = theVariant;
+
+  // Identical values at another time give identical contours. The
+  // variant is only a hash of the values, hence the independent digest
+  // must match too before the contours of another field are used.
+
+  if (theVariant != 0 && theDigest != 0)
+  {
+    auto slice = itsSlices.find(slice_key(key));
+    if (slice != itsSlices.end() && slice->second.digest == theDigest)
+      key.time = slice->second.time;
+  }
+
+  rehash(key);
+  return key;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Return the key identifying the values of a contour
+ *
+ * The key is the same for all contours of identical values, regardless
+ * of the limits and the time.
+ */
+// ----------------------------------------------------------------------
+
+ContourCache::Key ContourCache::slice_key(const Key& theKey)
+{
+  Key slice = theKey;
+  slice.lolimit = 0;
+  slice.hilimit = 0;
+  slice.time = 0;
+  rehash(slice);
+  return slice;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Calculate the hash value of a key
+ */
+// ----------------------------------------------------------------------
+
+void ContourCache::rehash(Key& theKey)
+{
+  theKey.hash = boost::hash_value(theKey.lolimit);
+  boost::hash_combine(theKey.hash, theKey.hilimit);
+  boost::hash_combine(theKey.hash, theKey.file);
+  boost::hash_combine(theKey.hash, theKey.param);
+  boost::hash_combine(theKey.hash, theKey.level);
+  boost::hash_combine(theKey.hash, theKey.time);
+  boost::hash_combine(theKey.hash, theKey.origintime);
+  boost::hash_combine(theKey.hash, theKey.variant);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Return a unique description of the contour for the disk cache
+ *
+ * Unlike the key, the signature is valid across processes. The
+ * mutex must be locked when this is called.
+ */
+// ----------------------------------------------------------------------
+
+std::string ContourCache::signature(const Key& theKey, const LazyQueryData& theData) const
+{
+  const File& file = itsFiles.find(theData.Filename())->second;
+
   ostringstream os;
+  os << setprecision(9) << itsPrefix << ' ' << theData.Filename() << ' ' << file.mtime << ' '
+     << file.size << ' ' << theKey.lolimit << ' ' << theKey.hilimit << ' ' << theKey.param << ' '
+     << theKey.level << ' ' << theKey.time << ' ' << theKey.origintime << ' ' << theKey.variant;
+  return os.str();
+}
 
-  os << theLoLimit << '_' << theHiLimit << '_' << theData.Filename() << '_'
-     << theTime.ToStr(kYYYYMMDDHHMM).CharPtr() << '_'
-     << theData.OriginTime().ToStr(kYYYYMMDDHHMM).CharPtr() << '_' << theData.GetParamName() << '_'
-     << theData.GetParamIdent() << '_' << theData.GetLevelNumber();
+// ----------------------------------------------------------------------
+/*!
+ * \brief Return the cache file for the given signature
+ */
+// ----------------------------------------------------------------------
 
+std::string ContourCache::disk_file(const std::string& theSignature) const
+{
+  ostringstream os;
+  os << itsDirectory << '/' << itsPrefix << '_' << hex << setw(16) << setfill('0')
+     << boost::hash_value(theSignature) << ".path";
   return os.str();
 }
-}  // namespace
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Store a path into the memory cache
+ *
+ * The mutex must be locked when this is called.
+ */
+// ----------------------------------------------------------------------
+
+void ContourCache::store(const Key& theKey,
+                         const Imagine::NFmiPath& thePath,
+                         std::size_t theDigest)
+{
+  itsList.push_front(make_pair(theKey, thePath));
+  itsData.insert(make_pair(theKey, itsList.begin()));
+  itsBytes += path_bytes(thePath);
+
+  // Later times with identical values use the time of this contour
+
+  if (theKey.variant != 0)
+  {
+    Slice& slice =
+        itsSlices.insert(make_pair(slice_key(theKey), Slice{theKey.time, theDigest, 0}))
+            .first->second;
+    ++slice.contours;
+  }
+
+  evict();
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Discard least recently used contours until within limits
+ *
+ * The mutex must be locked when this is called.
+ */
+// ----------------------------------------------------------------------
+
+void ContourCache::evict()
+{
+  if (itsMaxBytes == 0)
+    return;
+
+  while (itsBytes > itsMaxBytes && !itsList.empty())
+  {
+    const Key& key = itsList.back().first;
+    if (key.variant != 0)
+    {
+      auto slice = itsSlices.find(slice_key(key));
+      if (slice != itsSlices.end() && --slice->second.contours == 0)
+        itsSlices.erase(slice);
+    }
+    itsBytes -= path_bytes(itsList.back().second);
+    itsData.erase(key);
+    itsList.pop_back();
+  }
+}
 
 // ----------------------------------------------------------------------
 /*!
@@ -52,6 +387,7 @@ std::string cache_key(float theLoLimit,
 
 bool ContourCache::empty() const
 {
+  std::lock_guard<std::mutex> lock(itsMutex);
   return itsData.empty();
 }
 
@@ -63,7 +399,13 @@ bool ContourCache::empty() const
 
 void ContourCache::clear()
 {
+  std::lock_guard<std::mutex> lock(itsMutex);
   itsData.clear();
+  itsList.clear();
+  itsFiles.clear();
+  itsFileNumbers = 0;
+  itsSlices.clear();
+  itsBytes = 0;
 }
 
 // ----------------------------------------------------------------------
@@ -76,12 +418,69 @@ void ContourCache::clear()
 
 ContourCache::size_type ContourCache::size() const
 {
+  std::lock_guard<std::mutex> lock(itsMutex);
   return itsData.size();
 }
 
 // ----------------------------------------------------------------------
 /*!
- * \brief Test if given contour is cached
+ * \brief Return the estimated memory used by the cached contours
+ *
+ * \return The number of bytes
+ */
+// ----------------------------------------------------------------------
+
+std::size_t ContourCache::bytes() const
+{
+  std::lock_guard<std::mutex> lock(itsMutex);
+  return itsBytes;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Set the maximum memory the cached contours may use
+ *
+ * \param theMaxBytes The limit in bytes, 0 implies no limit
+ */
+// ----------------------------------------------------------------------
+
+void ContourCache::maxbytes(std::size_t theMaxBytes)
+{
+  std::lock_guard<std::mutex> lock(itsMutex);
+  itsMaxBytes = theMaxBytes;
+  evict();
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Set the directory for the persistent cache
+ *
+ * Several caches may use the same directory if their prefixes differ.
+ *
+ * \param theDirectory The directory, an empty string disables the disk cache
+ * \param thePrefix The prefix for the names of the files
+ */
+// ----------------------------------------------------------------------
+
+void ContourCache::directory(const std::string& theDirectory, const std::string& thePrefix)
+{
+  if (!theDirectory.empty())
+  {
+    struct stat info;
+    if (stat(theDirectory.c_str(), &info) != 0 || !S_ISDIR(info.st_mode))
+      throw runtime_error("Contour cache directory '" + theDirectory + "' does not exist");
+    if (access(theDirectory.c_str(), W_OK) != 0)
+      throw runtime_error("Contour cache directory '" + theDirectory + "' is not writable");
+  }
+
+  std::lock_guard<std::mutex> lock(itsMutex);
+  itsDirectory = theDirectory;
+  itsPrefix = thePrefix;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Test if given contour is cached in memory
  *
  * \param theLoLimit The lower limit of the contour
  * \param theHiLimit The upper limit of the contour
@@ -93,67 +492,154 @@ ContourCache::size_type ContourCache::size() const
 bool ContourCache::contains(float theLoLimit,
                             float theHiLimit,
                             const NFmiTime& theTime,
-                            const LazyQueryData& theData) const
+                            const LazyQueryData& theData,
+                            std::size_t theVariant,
+                            std::size_t theDigest) const
 {
-  string key = cache_key(theLoLimit, theHiLimit, theTime, theData);
-  storage_type::const_iterator it = itsData.find(key);
-  return (it != itsData.end());
+  std::lock_guard<std::mutex> lock(itsMutex);
+  Key key = make_key(theLoLimit, theHiLimit, theTime, theData, theVariant, theDigest);
+  return (itsData.find(key) != itsData.end());
 }
 
 // ----------------------------------------------------------------------
 /*!
  * \brief Find the given cached contour
  *
- * This will throw if the contour is not cached
+ * This will throw if the contour is not cached. Note that when the
+ * cache is shared by several threads another thread may discard the
+ * contour after contains has been called, use the non-throwing
+ * version instead.
  *
  * \param theLoLimit The lower limit of the contour
  * \param theHiLimit The upper limit of the contour
  * \param theTime The actual data time may be interpolated (<> ValidTime)
  * \param theData The query data
+ * \param theVariant Additional identity given by the caller
+ * \param theDigest Independent digest of the values, 0 if unknown
  * \return The path
  */
 // ----------------------------------------------------------------------
 
-const Imagine::NFmiPath& ContourCache::find(float theLoLimit,
-                                            float theHiLimit,
-                                            const NFmiTime& theTime,
-                                            const LazyQueryData& theData) const
+Imagine::NFmiPath ContourCache::find(float theLoLimit,
+                                     float theHiLimit,
+                                     const NFmiTime& theTime,
+                                     const LazyQueryData& theData,
+                                     std::size_t theVariant,
+                                     std::size_t theDigest)
 {
-  string key = cache_key(theLoLimit, theHiLimit, theTime, theData);
-  storage_type::const_iterator it = itsData.find(key);
-  if (it != itsData.end())
-    return it->second;
+  Imagine::NFmiPath path;
+  if (find(path, theLoLimit, theHiLimit, theTime, theData, theVariant, theDigest))
+    return path;
   throw runtime_error("Contour was not in the cache - use contains first!");
 }
 
 // ----------------------------------------------------------------------
 /*!
- * \brief Insert a new path into the cache
+ * \brief Find the given cached contour if it exists
+ *
+ * The contour is marked as the most recently used one. If the contour
+ * is not in memory but is found in the cache directory, it is loaded
+ * into memory.
+ *
+ * \param thePath The path to assign to
+ * \param theLoLimit The lower limit of the contour
+ * \param theHiLimit The upper limit of the contour
+ * \param theTime The actual data time may be interpolated (<> ValidTime)
+ * \param theData The query data
+ * \param theVariant Additional identity given by the caller
+ * \param theDigest Independent digest of the values, 0 if unknown
+ * \return True if the contour was found
+ */
+// ----------------------------------------------------------------------
+
+bool ContourCache::find(Imagine::NFmiPath& thePath,
+                        float theLoLimit,
+                        float theHiLimit,
+                        const NFmiTime& theTime,
+                        const LazyQueryData& theData,
+                        std::size_t theVariant,
+                        std::size_t theDigest)
+{
+  Key key;
+  std::string sig;
+  std::string file;
+  {
+    std::lock_guard<std::mutex> lock(itsMutex);
+    key = make_key(theLoLimit, theHiLimit, theTime, theData, theVariant, theDigest);
+    storage_type::const_iterator it = itsData.find(key);
+    if (it != itsData.end())
+    {
+      itsList.splice(itsList.begin(), itsList, it->second);
+      thePath = it->second->second;
+      return true;
+    }
+
+    if (itsDirectory.empty())
+      return false;
+
+    sig = signature(key, theData);
+    file = disk_file(sig);
+  }
+
+  // Read without holding the lock
+
+  if (!disk_read(file, sig, thePath))
+    return false;
+
+  std::lock_guard<std::mutex> lock(itsMutex);
+  if (itsData.find(key) == itsData.end())
+    store(key, thePath, theDigest);
+  return true;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Insert a new path into the cache unless it is already there
  *
- * This will throw if the contour is already cached
+ * Several threads may calculate the same contour simultaneously, in
+ * which case the first one inserted is kept. The path is also written
+ * into the cache directory if necessary.
  *
  * \param thePath The path to cache
  * \param theLoLimit The lower limit of the contour
  * \param theHiLimit The upper limit of the contour
  * \param theTime The actual data time may be interpolated (<> ValidTime)
  * \param theData The query data
+ * \param theVariant Additional identity given by the caller
+ * \param theDigest Independent digest of the values, 0 if unknown
+ * \return True if the path was inserted
  */
 // ----------------------------------------------------------------------
 
-void ContourCache::insert(const Imagine::NFmiPath& thePath,
+bool ContourCache::insert(const Imagine::NFmiPath& thePath,
                           float theLoLimit,
                           float theHiLimit,
                           const NFmiTime& theTime,
-                          const LazyQueryData& theData)
+                          const LazyQueryData& theData,
+                          std::size_t theVariant,
+                          std::size_t theDigest)
 {
-  string key = cache_key(theLoLimit, theHiLimit, theTime, theData);
+  std::string sig;
+  std::string file;
+  {
+    std::lock_guard<std::mutex> lock(itsMutex);
+    Key key = make_key(theLoLimit, theHiLimit, theTime, theData, theVariant, theDigest);
+
+    if (itsData.find(key) != itsData.end())
+      return false;
+
+    store(key, thePath, theDigest);
 
-  typedef pair<storage_type::const_iterator, bool> restype;
+    if (itsDirectory.empty())
+      return true;
 
-  restype result = itsData.insert(storage_type::value_type(key, thePath));
+    sig = signature(key, theData);
+    file = disk_file(sig);
+  }
 
-  if (!result.second)
-    throw runtime_error("Contour was already in the cache!");
+  if (!file_exists(file))
+    disk_write(file, sig, thePath);
+  return true;
 }
 
 // ======================================================================
@@ -8,31 +8,39 @@
 #include "ContourCalculator.h"
 #include "ContourCache.h"
 #include "DataMatrixAdapter.h"
+#include "IsobandTools.h"
 #include "LazyQueryData.h"
+#include "PathAdapter.h"
+#include "Profiler.h"
+#include "TaskScheduler.h"
+#include <boost/functional/hash.hpp>
 #include <boost/make_shared.hpp>
 #include <geos/version.h>
+#include <newbase/NFmiArea.h>
 #include <newbase/NFmiDataMatrix.h>
 #include <newbase/NFmiGrid.h>
 #include <newbase/NFmiMetTime.h>
 #include <tron/FmiBuilder.h>
 #include <tron/Tron.h>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <map>
 #include <memory>
+#include <set>
+#include <sstream>
 #include <stdexcept>
+#include <vector>
 
 typedef Tron::Traits<double, double, Tron::FmiMissing> MyTraits;
 
-typedef Tron::Contourer<DataMatrixAdapter, Tron::FmiBuilder, MyTraits, Tron::LinearInterpolation>
-    MyLinearContourer;
+// The contourers are instantiated both for GEOS geometries, which
+// the stripes need for stitching, and directly for paths
 
-typedef Tron::Contourer<DataMatrixAdapter, Tron::FmiBuilder, MyTraits, Tron::LogLinearInterpolation>
-    MyLogLinearContourer;
-
-typedef Tron::
-    Contourer<DataMatrixAdapter, Tron::FmiBuilder, MyTraits, Tron::NearestNeighbourInterpolation>
-        MyNearestContourer;
-
-typedef Tron::Contourer<DataMatrixAdapter, Tron::FmiBuilder, MyTraits, Tron::DiscreteInterpolation>
-    MyDiscreteContourer;
+template <typename Builder, typename Interpolation>
+using MyContourer = Tron::Contourer<DataMatrixAdapter, Builder, MyTraits, Interpolation>;
 
 typedef Tron::Hints<DataMatrixAdapter, MyTraits> MyHints;
 
@@ -53,9 +61,10 @@ void add_linearring(Imagine::NFmiPath &path, const LinearRing *geom)
   if (geom == nullptr || geom->isEmpty())
     return;
 
-  for (unsigned long i = 0, n = geom->getNumPoints(); i < n - 1; ++i)
+  const int n = boost::numeric_cast<int>(geom->getNumPoints());
+  for (int i = 0; i < n - 1; ++i)
   {
-    const Coordinate &coord = geom->getCoordinateN(boost::numeric_cast<int>(i));
+    const Coordinate &coord = geom->getCoordinateN(i);
     if (i == 0)
       path.MoveTo(coord.x, coord.y);
     else
@@ -74,11 +83,11 @@ void add_linestring(Imagine::NFmiPath &path, const LineString *geom)
   if (geom == nullptr || geom->isEmpty())
     return;
 
-  unsigned long n = geom->getNumPoints();
+  const int n = boost::numeric_cast<int>(geom->getNumPoints());
 
-  for (unsigned long i = 0; i < n; ++i)
+  for (int i = 0; i < n; ++i)
   {
-    const Coordinate &coord = geom->getCoordinateN(boost::numeric_cast<int>(i));
+    const Coordinate &coord = geom->getCoordinateN(i);
     if (i == 0)
       path.MoveTo(coord.x, coord.y);
     else
@@ -115,7 +124,7 @@ void add_multilinestring(Imagine::NFmiPath &path, const MultiLineString *geom)
     return;
 
   for (size_t i = 0, n = geom->getNumGeometries(); i < n; ++i)
-    add_linestring(path, dynamic_cast<const LineString *>(geom->getGeometryN(i)));
+    add_linestring(path, static_cast<const LineString *>(geom->getGeometryN(i)));
 }
 
 // ----------------------------------------------------------------------
@@ -130,7 +139,7 @@ void add_multipolygon(Imagine::NFmiPath &path, const MultiPolygon *geom)
     return;
 
   for (size_t i = 0, n = geom->getNumGeometries(); i < n; ++i)
-    add_polygon(path, dynamic_cast<const Polygon *>(geom->getGeometryN(i)));
+    add_polygon(path, static_cast<const Polygon *>(geom->getGeometryN(i)));
 }
 
 // ----------------------------------------------------------------------
@@ -156,22 +165,219 @@ void add_geometrycollection(Imagine::NFmiPath &path, const GeometryCollection *g
 
 void add_path(Imagine::NFmiPath &path, const Geometry *geom)
 {
-  if (const LinearRing *lr = dynamic_cast<const LinearRing *>(geom))
-    add_linearring(path, lr);
-  else if (const LineString *ls = dynamic_cast<const LineString *>(geom))
-    add_linestring(path, ls);
-  else if (const Polygon *p = dynamic_cast<const Polygon *>(geom))
-    add_polygon(path, p);
-  else if (const MultiLineString *ml = dynamic_cast<const MultiLineString *>(geom))
-    add_multilinestring(path, ml);
-  else if (const MultiPolygon *mpg = dynamic_cast<const MultiPolygon *>(geom))
-    add_multipolygon(path, mpg);
-  else if (const GeometryCollection *g = dynamic_cast<const GeometryCollection *>(geom))
-    add_geometrycollection(path, g);
-  else
+  if (geom == nullptr)
     throw std::runtime_error("Bad shit");
 
-  // We ignore points, multipoints and unknown types
+  // Dispatch on the type id instead of trying every type in turn
+
+  switch (geom->getGeometryTypeId())
+  {
+    case GEOS_LINEARRING:
+      add_linearring(path, static_cast<const LinearRing *>(geom));
+      break;
+    case GEOS_LINESTRING:
+      add_linestring(path, static_cast<const LineString *>(geom));
+      break;
+    case GEOS_POLYGON:
+      add_polygon(path, static_cast<const Polygon *>(geom));
+      break;
+    case GEOS_MULTILINESTRING:
+      add_multilinestring(path, static_cast<const MultiLineString *>(geom));
+      break;
+    case GEOS_MULTIPOLYGON:
+      add_multipolygon(path, static_cast<const MultiPolygon *>(geom));
+      break;
+    case GEOS_GEOMETRYCOLLECTION:
+      add_geometrycollection(path, static_cast<const GeometryCollection *>(geom));
+      break;
+    default:
+      // The contourer never produces points
+      throw std::runtime_error("Bad shit");
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief A contour geometry and the factory which created it
+ *
+ * GEOS reference counts the geometries created by a factory without
+ * synchronization, hence each contour is built with a factory of its
+ * own. The pieces of a striped contour are built by several threads
+ * and stitched by another one only after the join, hence each factory
+ * is used by one thread at a time. The geometry is destroyed first.
+ */
+// ----------------------------------------------------------------------
+
+struct FactoryGeometry
+{
+#if GEOS_VERSION_MAJOR == 3
+#if GEOS_VERSION_MINOR < 7
+  std::shared_ptr<GeometryFactory> factory = std::make_shared<GeometryFactory>();
+#else
+  GeometryFactory::Ptr factory = GeometryFactory::create();
+#endif
+#else
+#pragma message(Cannot handle current GEOS version correctly)
+#endif
+  std::shared_ptr<Geometry> geometry;
+};
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Build a contour geometry with a factory of its own
+ *
+ * \param theContour Function feeding the contour to the given builder
+ * \return The geometry, which keeps its factory alive
+ */
+// ----------------------------------------------------------------------
+
+template <typename Contour>
+std::shared_ptr<Geometry> build_geometry(Contour theContour)
+{
+  auto holder = std::make_shared<FactoryGeometry>();
+#if GEOS_VERSION_MAJOR == 3 && GEOS_VERSION_MINOR < 7
+  Tron::FmiBuilder builder(holder->factory);
+#else
+  Tron::FmiBuilder builder(*holder->factory);
+#endif
+  theContour(builder);
+  holder->geometry = builder.result();
+  return std::shared_ptr<Geometry>(holder, holder->geometry.get());
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief The union of two polygonal geometries
+ */
+// ----------------------------------------------------------------------
+
+std::shared_ptr<Geometry> union_geometry(const Geometry *theFirst, const Geometry *theSecond)
+{
+#if GEOS_VERSION_MAJOR == 3 && GEOS_VERSION_MINOR < 8
+  return std::shared_ptr<Geometry>(theFirst->Union(theSecond));
+#else
+  return std::shared_ptr<Geometry>(theFirst->Union(theSecond).release());
+#endif
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Collect the points of the line strings of a geometry
+ */
+// ----------------------------------------------------------------------
+
+typedef std::vector<Coordinate> LinePoints;
+
+void collect_lines(std::vector<LinePoints> &theLines, const Geometry *geom)
+{
+  if (geom == nullptr || geom->isEmpty())
+    return;
+
+  switch (geom->getGeometryTypeId())
+  {
+    case GEOS_LINESTRING:
+    case GEOS_LINEARRING:
+    {
+      const LineString *line = static_cast<const LineString *>(geom);
+      const int n = boost::numeric_cast<int>(line->getNumPoints());
+      LinePoints points;
+      for (int i = 0; i < n; ++i)
+        points.push_back(line->getCoordinateN(i));
+      theLines.push_back(std::move(points));
+      break;
+    }
+    case GEOS_MULTILINESTRING:
+    case GEOS_GEOMETRYCOLLECTION:
+      for (size_t i = 0, n = geom->getNumGeometries(); i < n; ++i)
+        collect_lines(theLines, geom->getGeometryN(i));
+      break;
+    default:
+      throw std::runtime_error("Contour lines must consist of line strings");
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Contour a fill into the given builder
+ */
+// ----------------------------------------------------------------------
+
+template <typename Builder>
+void contour_fill(Builder &theBuilder,
+                  float theLoLimit,
+                  float theHiLimit,
+                  ContourInterpolation theInterpolation,
+                  const DataMatrixAdapter &theData,
+                  const MyHints &theHints)
+{
+  switch (theInterpolation)
+  {
+    case Linear:
+    case Missing:
+    {
+      MyContourer<Builder, Tron::LinearInterpolation>::fill(
+          theBuilder, theData, theLoLimit, theHiLimit, theHints);
+      break;
+    }
+    case LogLinear:
+    {
+      MyContourer<Builder, Tron::LogLinearInterpolation>::fill(
+          theBuilder, theData, theLoLimit, theHiLimit, theHints);
+      break;
+    }
+    case Nearest:
+    {
+      MyContourer<Builder, Tron::NearestNeighbourInterpolation>::fill(
+          theBuilder, theData, theLoLimit, theHiLimit, theHints);
+      break;
+    }
+    case Discrete:
+    {
+      MyContourer<Builder, Tron::DiscreteInterpolation>::fill(
+          theBuilder, theData, theLoLimit, theHiLimit, theHints);
+      break;
+    }
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Contour a line into the given builder
+ */
+// ----------------------------------------------------------------------
+
+template <typename Builder>
+void contour_line(Builder &theBuilder,
+                  float theValue,
+                  ContourInterpolation theInterpolation,
+                  const DataMatrixAdapter &theData,
+                  const MyHints &theHints)
+{
+  switch (theInterpolation)
+  {
+    case Linear:
+    case Missing:
+    {
+      MyContourer<Builder, Tron::LinearInterpolation>::line(
+          theBuilder, theData, theValue, theHints);
+      break;
+    }
+    case LogLinear:
+    {
+      MyContourer<Builder, Tron::LogLinearInterpolation>::line(
+          theBuilder, theData, theValue, theHints);
+      break;
+    }
+    case Nearest:
+    {
+      throw std::runtime_error("Contour lines not supported for nearest neighbour interpolation");
+    }
+    case Discrete:
+    {
+      throw std::runtime_error("Contour lines not supported for discrete neighbour interpolation");
+      break;
+    }
+  }
 }
 
 // ----------------------------------------------------------------------
@@ -183,18 +389,81 @@ void add_path(Imagine::NFmiPath &path, const Geometry *geom)
 class ContourCalculatorPimple
 {
  public:
-  ContourCalculatorPimple() {}
+  ContourCalculatorPimple()
+      : itsAreaCache(std::make_shared<ContourCache>()),
+        itsLineCache(std::make_shared<ContourCache>()),
+        itsProjectedAreaCache(std::make_shared<ContourCache>()),
+        itsProjectedLineCache(std::make_shared<ContourCache>())
+  {
+  }
 
-  ContourCache itsAreaCache;
-  ContourCache itsLineCache;
+  std::shared_ptr<ContourCache> itsAreaCache;
+  std::shared_ptr<ContourCache> itsLineCache;
+  std::shared_ptr<ContourCache> itsProjectedAreaCache;  // pixel coordinates
+  std::shared_ptr<ContourCache> itsProjectedLineCache;
 
   std::shared_ptr<DataMatrixAdapter> itsData;  // does not own!
   std::shared_ptr<MyHints> itsHints;
   bool itsHintsOK = false;
+  std::size_t itsFingerprint = 0;
+  std::size_t itsDigest = 0;  // independent of the fingerprint, never 0
+  bool itsFingerprintOK = false;
   bool isCacheOn = false;
   bool itWasCached = false;
+  std::vector<bool> itsCachedFlags;
+  unsigned int itsThreads = 1;
+  unsigned int itsStripeRows = 0;  // minimum rows per stripe, 0 for no stripes
+  bool itsIsobands = false;        // linear fills with IsobandTools instead of Tron
+
+  std::vector<std::shared_ptr<DataMatrixAdapter> > itsStripes;
+  std::vector<std::shared_ptr<MyHints> > itsStripeHints;
+  bool itsStripesOK = false;
 
   void require_hints();
+  std::size_t stripes(std::size_t theContours) const;
+  void require_stripes(std::size_t theCount);
+  std::size_t variant(ContourInterpolation theInterpolation);
+  std::size_t variant(ContourInterpolation theInterpolation,
+                      const std::string &theAreaKey,
+                      double theSimplifyTolerance);
+
+  std::shared_ptr<Geometry> fillGeometry(float theLoLimit,
+                                         float theHiLimit,
+                                         ContourInterpolation theInterpolation) const;
+
+  std::shared_ptr<Geometry> fillGeometry(float theLoLimit,
+                                         float theHiLimit,
+                                         ContourInterpolation theInterpolation,
+                                         const DataMatrixAdapter &theData,
+                                         const MyHints &theHints) const;
+
+  std::shared_ptr<Geometry> lineGeometry(float theValue,
+                                         ContourInterpolation theInterpolation) const;
+
+  std::shared_ptr<Geometry> lineGeometry(float theValue,
+                                         ContourInterpolation theInterpolation,
+                                         const DataMatrixAdapter &theData,
+                                         const MyHints &theHints) const;
+
+  Imagine::NFmiPath fill(float theLoLimit,
+                         float theHiLimit,
+                         const NFmiGrid *theGrid,
+                         ContourInterpolation theInterpolation) const;
+
+  Imagine::NFmiPath line(float theValue,
+                         const NFmiGrid *theGrid,
+                         ContourInterpolation theInterpolation) const;
+
+  Imagine::NFmiPath stitchFills(const std::shared_ptr<Geometry> *thePieces,
+                                const NFmiGrid *theGrid) const;
+
+  Imagine::NFmiPath stitchLines(const std::shared_ptr<Geometry> *thePieces,
+                                const NFmiGrid *theGrid) const;
+
+  std::vector<bool> occupied(const std::vector<std::pair<float, float> > &theLimits) const;
+
+  template <typename Task>
+  void run(std::size_t theCount, Task theTask) const;
 
 };  // class ContourCalculatorPimple
 
@@ -215,225 +484,1345 @@ void ContourCalculatorPimple::require_hints()
 
 // ----------------------------------------------------------------------
 /*!
- *\brief Destructor
+ * \brief The number of stripes to split each contour into
+ *
+ * The grid is split only if there are fewer contours to calculate
+ * than threads, and each stripe has at least the requested number
+ * of rows of cells.
  */
 // ----------------------------------------------------------------------
 
-ContourCalculator::~ContourCalculator() {}
+std::size_t ContourCalculatorPimple::stripes(std::size_t theContours) const
+{
+  if (itsStripeRows == 0 || theContours == 0 || theContours >= itsThreads)
+    return 1;
+
+  const std::size_t rows = (itsData->height() > 0 ? itsData->height() - 1 : 0);
+  const std::size_t count = std::min<std::size_t>(itsThreads / theContours, rows / itsStripeRows);
+  return std::max<std::size_t>(1, count);
+}
+
 // ----------------------------------------------------------------------
 /*!
- * \brief Constructor
+ * \brief Require the stripes and their hints to be up to date
+ *
+ * Consecutive stripes share one row of the grid, hence each cell
+ * is contoured in exactly one stripe and the stripes meet exactly
+ * along the shared rows.
  */
 // ----------------------------------------------------------------------
 
-ContourCalculator::ContourCalculator()
+void ContourCalculatorPimple::require_stripes(std::size_t theCount)
 {
-  itsPimple.reset(new ContourCalculatorPimple());
+  if (itsStripesOK && itsStripes.size() == theCount)
+    return;
+
+  const std::size_t rows = itsData->height() - 1;
+
+  itsStripes.clear();
+  for (std::size_t s = 0; s < theCount; s++)
+  {
+    const std::size_t j1 = s * rows / theCount;
+    const std::size_t j2 = (s + 1) * rows / theCount + 1;
+    itsStripes.push_back(std::make_shared<DataMatrixAdapter>(*itsData, j1, j2));
+  }
+
+  itsStripeHints.assign(theCount, std::shared_ptr<MyHints>());
+  run(theCount, [this](std::size_t s) { itsStripeHints[s].reset(new MyHints(*itsStripes[s])); });
+  itsStripesOK = true;
 }
+
 // ----------------------------------------------------------------------
 /*!
- * \brief Clear the cache
+ * \brief Identify the contoured values for the cache
+ *
+ * The cache key describes only the origin of the data, the hash of
+ * the values and the interpolation method make sure smoothed or
+ * otherwise modified data is never mistaken for the original. The
+ * FNV-1a digest of the values is calculated at the same time, the
+ * cache requires both to match before sharing contours between
+ * different times.
  */
 // ----------------------------------------------------------------------
 
-void ContourCalculator::clearCache()
+std::size_t ContourCalculatorPimple::variant(ContourInterpolation theInterpolation)
 {
-  itsPimple->itsAreaCache.clear();
-  itsPimple->itsLineCache.clear();
+  if (!itsFingerprintOK)
+  {
+    const DataMatrixAdapter &data = *itsData;
+    std::size_t hash = boost::hash_value(data.width());
+    boost::hash_combine(hash, data.height());
+    if (data.x0() != 0 || data.y0() != 0 || data.step() != 1)
+    {
+      boost::hash_combine(hash, data.x0());
+      boost::hash_combine(hash, data.y0());
+      boost::hash_combine(hash, data.step());
+    }
+    std::uint64_t digest = 14695981039346656037ULL;
+    for (DataMatrixAdapter::size_type i = 0; i < data.width(); i++)
+      for (DataMatrixAdapter::size_type j = 0; j < data.height(); j++)
+      {
+        const float value = data(i, j);
+        boost::hash_combine(hash, value);
+        std::uint32_t bits;
+        std::memcpy(&bits, &value, sizeof(bits));
+        for (int b = 0; b < 32; b += 8)
+        {
+          digest ^= (bits >> b) & 0xff;
+          digest *= 1099511628211ULL;
+        }
+      }
+    itsFingerprint = hash;
+    itsDigest = (digest != 0 ? static_cast<std::size_t>(digest) : 1);
+    itsFingerprintOK = true;
+  }
+
+  std::size_t hash = itsFingerprint;
+  boost::hash_combine(hash, static_cast<int>(theInterpolation));
+  if (itsIsobands)
+    boost::hash_combine(hash, itsIsobands);
+  return hash;
 }
 
 // ----------------------------------------------------------------------
 /*!
- * \brief Set the cache on or off
- *
- * \param theFlag True if cache is to be set on
+ * \brief Identify the projected contours for the cache
  */
 // ----------------------------------------------------------------------
 
-void ContourCalculator::cache(bool theFlag)
+std::size_t ContourCalculatorPimple::variant(ContourInterpolation theInterpolation,
+                                             const std::string &theAreaKey,
+                                             double theSimplifyTolerance)
 {
-  itsPimple->isCacheOn = theFlag;
+  std::size_t hash = variant(theInterpolation);
+  boost::hash_combine(hash, theAreaKey);
+  boost::hash_combine(hash, theSimplifyTolerance);
+  return hash;
 }
+
 // ----------------------------------------------------------------------
 /*!
- * \brief Return whether the last contour was cached
+ * \brief Calculate a contour fill in grid coordinates
  *
- * \return True, if last returned contour was cached
+ * The hints must be up to date. Only the data and the hints are
+ * accessed, hence several fills may be calculated simultaneously.
  */
 // ----------------------------------------------------------------------
 
-bool ContourCalculator::wasCached() const
+std::shared_ptr<Geometry> ContourCalculatorPimple::fillGeometry(
+    float theLoLimit, float theHiLimit, ContourInterpolation theInterpolation) const
 {
-  return itsPimple->itWasCached;
+  return fillGeometry(theLoLimit, theHiLimit, theInterpolation, *itsData, *itsHints);
 }
+
 // ----------------------------------------------------------------------
 /*!
- * \brief Set new active data on
+ * \brief Calculate a contour fill of the given data, such as a stripe
  */
 // ----------------------------------------------------------------------
 
-void ContourCalculator::data(const NFmiDataMatrix<float> &theData)
+std::shared_ptr<Geometry> ContourCalculatorPimple::fillGeometry(
+    float theLoLimit,
+    float theHiLimit,
+    ContourInterpolation theInterpolation,
+    const DataMatrixAdapter &theData,
+    const MyHints &theHints) const
 {
-  itsPimple->itsData.reset(new DataMatrixAdapter(theData));
-  itsPimple->itsHintsOK = false;
+  return build_geometry(
+      [&](Tron::FmiBuilder &builder)
+      { contour_fill(builder, theLoLimit, theHiLimit, theInterpolation, theData, theHints); });
 }
 
 // ----------------------------------------------------------------------
 /*!
- * \brief Return the desired contour
+ * \brief Calculate a contour fill
  *
- *\return The path object
+ * The hints must be up to date. The path is built directly without
+ * intermediate GEOS geometries.
  */
 // ----------------------------------------------------------------------
 
-Imagine::NFmiPath ContourCalculator::contour(const LazyQueryData &theData,
-                                             float theLoLimit,
-                                             float theHiLimit,
-                                             const NFmiTime &theTime,
-                                             ContourInterpolation theInterpolation)
+Imagine::NFmiPath ContourCalculatorPimple::fill(float theLoLimit,
+                                                float theHiLimit,
+                                                const NFmiGrid *theGrid,
+                                                ContourInterpolation theInterpolation) const
 {
-  if (itsPimple->itsData.get() == 0)
-    throw std::runtime_error("ContourCalculator:: No data set before calling contour");
+  PathAdapter builder;
+  contour_fill(builder, theLoLimit, theHiLimit, theInterpolation, *itsData, *itsHints);
 
-  if (itsPimple->isCacheOn &&
-      itsPimple->itsAreaCache.contains(theLoLimit, theHiLimit, theTime, theData))
-  {
-    itsPimple->itWasCached = true;
-    return itsPimple->itsAreaCache.find(theLoLimit, theHiLimit, theTime, theData);
-  }
+  Imagine::NFmiPath path = builder.path();
+  path.InvGrid(theGrid);
 
-  itsPimple->require_hints();
+  return path;
+}
 
-  // Build the contours
+// ----------------------------------------------------------------------
+/*!
+ * \brief Calculate a contour line in grid coordinates
+ *
+ * The hints must be up to date.
+ */
+// ----------------------------------------------------------------------
 
-#if GEOS_VERSION_MAJOR == 3
-#if GEOS_VERSION_MINOR < 7
-  std::shared_ptr<GeometryFactory> geomFactory = std::make_shared<GeometryFactory>();
-  Tron::FmiBuilder builder(geomFactory);
-#else
-  geos::geom::GeometryFactory::Ptr geomFactory(geos::geom::GeometryFactory::create());
-  Tron::FmiBuilder builder(*geomFactory);
-#endif
-#else
-#pragma message(Cannot handle current GEOS version correctly)
-#endif
+std::shared_ptr<Geometry> ContourCalculatorPimple::lineGeometry(
+    float theValue, ContourInterpolation theInterpolation) const
+{
+  return lineGeometry(theValue, theInterpolation, *itsData, *itsHints);
+}
 
-  switch (theInterpolation)
-  {
-    case Linear:
-    case Missing:
-    {
-      MyLinearContourer::fill(
-          builder, *(itsPimple->itsData), theLoLimit, theHiLimit, *(itsPimple->itsHints));
-      break;
-    }
-    case LogLinear:
-    {
-      MyLogLinearContourer::fill(
-          builder, *(itsPimple->itsData), theLoLimit, theHiLimit, *(itsPimple->itsHints));
-      break;
-    }
-    case Nearest:
-    {
-      MyNearestContourer::fill(
-          builder, *(itsPimple->itsData), theLoLimit, theHiLimit, *(itsPimple->itsHints));
-      break;
-    }
-    case Discrete:
-    {
-      MyDiscreteContourer::fill(
-          builder, *(itsPimple->itsData), theLoLimit, theHiLimit, *(itsPimple->itsHints));
-      break;
-    }
-  }
+// ----------------------------------------------------------------------
+/*!
+ * \brief Calculate a contour line of the given data, such as a stripe
+ */
+// ----------------------------------------------------------------------
 
-  auto geom = builder.result();
+std::shared_ptr<Geometry> ContourCalculatorPimple::lineGeometry(
+    float theValue,
+    ContourInterpolation theInterpolation,
+    const DataMatrixAdapter &theData,
+    const MyHints &theHints) const
+{
+  return build_geometry([&](Tron::FmiBuilder &builder)
+                        { contour_line(builder, theValue, theInterpolation, theData, theHints); });
+}
 
-  Imagine::NFmiPath path;
-  add_path(path, geom.get());
+// ----------------------------------------------------------------------
+/*!
+ * \brief Calculate a contour line
+ *
+ * The hints must be up to date. The path is built directly without
+ * intermediate GEOS geometries.
+ */
+// ----------------------------------------------------------------------
 
-  path.InvGrid(theData.Grid());
+Imagine::NFmiPath ContourCalculatorPimple::line(float theValue,
+                                                const NFmiGrid *theGrid,
+                                                ContourInterpolation theInterpolation) const
+{
+  PathAdapter builder;
+  contour_line(builder, theValue, theInterpolation, *itsData, *itsHints);
 
-  if (itsPimple->isCacheOn)
-    itsPimple->itsAreaCache.insert(path, theLoLimit, theHiLimit, theTime, theData);
+  Imagine::NFmiPath path = builder.path();
+  path.InvGrid(theGrid);
 
-  itsPimple->itWasCached = false;
   return path;
 }
 
 // ----------------------------------------------------------------------
 /*!
- * \brief Return the desired contour line
+ * \brief Stitch the contour fills of the stripes together
  *
- *\return The path object
+ * The stripes share the seam rows and the contourer calculates the
+ * crossings of each cell edge from the values at its end points only,
+ * hence the polygons of adjacent stripes meet exactly at the seams
+ * and their union has the topology of the contour of the full grid.
+ * Should the union fail, the polygons are still returned as is, since
+ * they fill the same pixels as the union.
+ *
+ * \param thePieces The fills of the stripes in order
  */
 // ----------------------------------------------------------------------
 
-Imagine::NFmiPath ContourCalculator::contour(const LazyQueryData &theData,
-                                             float theValue,
-                                             const NFmiTime &theTime,
-                                             ContourInterpolation theInterpolation)
+Imagine::NFmiPath ContourCalculatorPimple::stitchFills(const std::shared_ptr<Geometry> *thePieces,
+                                                       const NFmiGrid *theGrid) const
 {
-  if (itsPimple->itsData.get() == 0)
-    throw std::runtime_error("ContourCalculator:: No data set before calling contour");
+  Imagine::NFmiPath path;
 
-  if (itsPimple->isCacheOn &&
-      itsPimple->itsLineCache.contains(theValue, kFloatMissing, theTime, theData))
+  try
+  {
+    std::shared_ptr<Geometry> result;
+    for (std::size_t s = 0; s < itsStripes.size(); s++)
+    {
+      const std::shared_ptr<Geometry> &piece = thePieces[s];
+      if (!piece || piece->isEmpty())
+        continue;
+      result = (result ? union_geometry(result.get(), piece.get()) : piece);
+    }
+    if (result)
+      add_path(path, result.get());
+  }
+  catch (const std::exception &)
   {
-    itsPimple->itWasCached = true;
-    return itsPimple->itsLineCache.find(theValue, kFloatMissing, theTime, theData);
+    Imagine::NFmiPath pieces;
+    for (std::size_t s = 0; s < itsStripes.size(); s++)
+      if (thePieces[s] && !thePieces[s]->isEmpty())
+        add_path(pieces, thePieces[s].get());
+    path = pieces;
   }
 
-  itsPimple->require_hints();
+  path.InvGrid(theGrid);
+  return path;
+}
 
-#if GEOS_VERSION_MAJOR == 3
-#if GEOS_VERSION_MINOR < 7
-  std::shared_ptr<GeometryFactory> geomFactory = std::make_shared<GeometryFactory>();
-  Tron::FmiBuilder builder(geomFactory);
-#else
-  geos::geom::GeometryFactory::Ptr geomFactory(geos::geom::GeometryFactory::create());
-  Tron::FmiBuilder builder(*geomFactory);
-#endif
-#else
-#pragma message(Cannot handle current GEOS version correctly)
-#endif
+// ----------------------------------------------------------------------
+/*!
+ * \brief Stitch the contour lines of the stripes together
+ *
+ * A line crossing a seam ends in one stripe exactly where it
+ * continues in the next one, hence the fragments are joined at
+ * their common end points on the seams. Points shared by more than
+ * two fragments are ambiguous and left unjoined.
+ *
+ * \param thePieces The lines of the stripes in order
+ */
+// ----------------------------------------------------------------------
 
-  switch (theInterpolation)
+Imagine::NFmiPath ContourCalculatorPimple::stitchLines(const std::shared_ptr<Geometry> *thePieces,
+                                                       const NFmiGrid *theGrid) const
+{
+  std::vector<LinePoints> lines;
+  std::vector<double> seams;
+  for (std::size_t s = 0; s < itsStripes.size(); s++)
   {
-    case Linear:
-    case Missing:
+    collect_lines(lines, thePieces[s].get());
+    if (s > 0)
+      seams.push_back(itsStripes[s]->y0());
+  }
+
+  // Index the end points on the seams
+
+  typedef std::pair<double, double> Point;
+  std::map<Point, std::size_t> starts;
+  std::map<Point, std::size_t> ends;
+  std::set<Point> ambiguous;
+
+  auto add = [&](std::map<Point, std::size_t> &theIndex, const Coordinate &theCoord, std::size_t i)
+  {
+    if (std::find(seams.begin(), seams.end(), theCoord.y) == seams.end())
+      return;
+    const Point point(theCoord.x, theCoord.y);
+    if (!theIndex.insert(std::make_pair(point, i)).second)
+      ambiguous.insert(point);
+  };
+
+  for (std::size_t i = 0; i < lines.size(); i++)
+    if (lines[i].size() > 1)
     {
-      MyLinearContourer::line(builder, *(itsPimple->itsData), theValue, *(itsPimple->itsHints));
-      break;
+      add(starts, lines[i].front(), i);
+      add(ends, lines[i].back(), i);
     }
-    case LogLinear:
+
+  for (const Point &point : ambiguous)
+  {
+    starts.erase(point);
+    ends.erase(point);
+  }
+
+  const std::size_t none = lines.size();
+
+  auto find = [&](const std::map<Point, std::size_t> &theIndex, const Coordinate &theCoord)
+  {
+    auto it = theIndex.find(Point(theCoord.x, theCoord.y));
+    return (it == theIndex.end() ? none : it->second);
+  };
+
+  // Each fragment has at most one predecessor and one successor, hence
+  // walking backwards either finds the start of the line or returns
+  // to the same fragment on a closed line
+
+  Imagine::NFmiPath path;
+  std::vector<bool> used(lines.size(), false);
+
+  for (std::size_t i = 0; i < lines.size(); i++)
+  {
+    if (used[i] || lines[i].size() < 2)
+      continue;
+
+    std::size_t first = i;
+    for (std::size_t k = find(ends, lines[first].front()); k != none && k != i;
+         k = find(ends, lines[first].front()))
+      first = k;
+
+    std::size_t k = first;
+    path.MoveTo(lines[k].front().x, lines[k].front().y);
+    do
     {
-      MyLogLinearContourer::line(builder, *(itsPimple->itsData), theValue, *(itsPimple->itsHints));
-      break;
+      used[k] = true;
+      for (std::size_t p = 1; p < lines[k].size(); p++)
+        path.LineTo(lines[k][p].x, lines[k][p].y);
+      k = find(starts, lines[k].back());
+    } while (k != none && !used[k]);
+  }
+
+  path.InvGrid(theGrid);
+  return path;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Find the contours which may be nonempty
+ *
+ * Each grid cell is classified once against the sorted limits of all
+ * the contours. A contour can be nonempty only if the value range
+ * of some cell intersects the closed range of the contour, the rest
+ * are known to be empty and need not be calculated at all. Contours
+ * with a missing limit are always calculated.
+ *
+ * \param theLimits The lower and upper limits of the contours
+ * \return Flags for the contours which must be calculated
+ */
+// ----------------------------------------------------------------------
+
+std::vector<bool> ContourCalculatorPimple::occupied(
+    const std::vector<std::pair<float, float> > &theLimits) const
+{
+  std::vector<bool> result(theLimits.size(), true);
+
+  const DataMatrixAdapter &data = *itsData;
+  const DataMatrixAdapter::size_type width = data.width();
+  const DataMatrixAdapter::size_type height = data.height();
+
+  if (width < 2 || height < 2)
+    return result;
+
+  // The sorted unique breakpoints
+
+  std::vector<float> breaks;
+  for (const auto &limits : theLimits)
+  {
+    if (limits.first != kFloatMissing)
+      breaks.push_back(limits.first);
+    if (limits.second != kFloatMissing)
+      breaks.push_back(limits.second);
+  }
+  std::sort(breaks.begin(), breaks.end());
+  breaks.erase(std::unique(breaks.begin(), breaks.end()), breaks.end());
+
+  if (breaks.empty())
+    return result;
+
+  // Odd positions are the breakpoints, even ones the gaps between them
+
+  auto position = [&breaks](float theValue) -> std::size_t
+  {
+    auto it = std::lower_bound(breaks.begin(), breaks.end(), theValue);
+    std::size_t k = it - breaks.begin();
+    return (it != breaks.end() && *it == theValue ? 2 * k + 1 : 2 * k);
+  };
+
+  const std::size_t npositions = 2 * breaks.size() + 1;
+  std::vector<int> changes(npositions + 1, 0);
+
+  // Mark the positions covered by each cell. Note that the data
+  // wraps around horizontally, hence the last column is included too.
+
+  float lastmin = 0;
+  float lastmax = -1;
+  std::size_t lastlo = 0;
+  std::size_t lasthi = 0;
+
+  for (DataMatrixAdapter::size_type j = 0; j + 1 < height; j++)
+    for (DataMatrixAdapter::size_type i = 0; i < width; i++)
+    {
+      const float values[4] = {data(i, j), data(i + 1, j), data(i, j + 1), data(i + 1, j + 1)};
+
+      float minvalue = 0;
+      float maxvalue = -1;
+      for (float value : values)
+      {
+        if (value == kFloatMissing)
+          continue;
+        if (std::isnan(value))
+          return result;
+        if (minvalue > maxvalue)
+          minvalue = maxvalue = value;
+        else
+        {
+          minvalue = std::min(minvalue, value);
+          maxvalue = std::max(maxvalue, value);
+        }
+      }
+
+      if (minvalue > maxvalue)
+        continue;
+
+      // Neighbouring cells usually have the same classification
+
+      if (minvalue != lastmin || maxvalue != lastmax)
+      {
+        lastmin = minvalue;
+        lastmax = maxvalue;
+        lastlo = position(minvalue);
+        lasthi = position(maxvalue);
+      }
+
+      ++changes[lastlo];
+      --changes[lasthi + 1];
     }
-    case Nearest:
+
+  // Cumulative counts of covered positions
+
+  std::vector<std::size_t> covered(npositions + 1, 0);
+  int depth = 0;
+  for (std::size_t p = 0; p < npositions; p++)
+  {
+    depth += changes[p];
+    covered[p + 1] = covered[p] + (depth > 0 ? 1 : 0);
+  }
+
+  for (std::size_t i = 0; i < theLimits.size(); i++)
+  {
+    const float lo = theLimits[i].first;
+    const float hi = theLimits[i].second;
+    if (lo == kFloatMissing || hi == kFloatMissing)
+      continue;
+    std::size_t a = position(lo);
+    std::size_t b = position(hi);
+    if (a > b)
+      std::swap(a, b);
+    result[i] = (covered[b + 1] > covered[a]);
+  }
+
+  return result;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Run the given tasks using the allowed number of threads
+ *
+ * The task is called with indices 0...theCount-1. The first
+ * exception thrown by any task is rethrown once all threads
+ * are done.
+ */
+// ----------------------------------------------------------------------
+
+template <typename Task>
+void ContourCalculatorPimple::run(std::size_t theCount, Task theTask) const
+{
+  TaskScheduler::run(theCount, itsThreads, theTask);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ *\brief Destructor
+ */
+// ----------------------------------------------------------------------
+
+ContourCalculator::~ContourCalculator() {}
+// ----------------------------------------------------------------------
+/*!
+ * \brief Constructor
+ */
+// ----------------------------------------------------------------------
+
+ContourCalculator::ContourCalculator()
+{
+  itsPimple.reset(new ContourCalculatorPimple());
+}
+// ----------------------------------------------------------------------
+/*!
+ * \brief Clear the cache
+ */
+// ----------------------------------------------------------------------
+
+void ContourCalculator::clearCache()
+{
+  itsPimple->itsAreaCache->clear();
+  itsPimple->itsLineCache->clear();
+  itsPimple->itsProjectedAreaCache->clear();
+  itsPimple->itsProjectedLineCache->clear();
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Share the contour caches of another calculator
+ *
+ * This is used when several threads contour the same data in
+ * parallel: each thread has a calculator of its own, but all
+ * of them use and fill the same caches.
+ *
+ * \param theCalc The calculator whose caches are to be shared
+ */
+// ----------------------------------------------------------------------
+
+void ContourCalculator::shareCache(const ContourCalculator &theCalc)
+{
+  itsPimple->itsAreaCache = theCalc.itsPimple->itsAreaCache;
+  itsPimple->itsLineCache = theCalc.itsPimple->itsLineCache;
+  itsPimple->itsProjectedAreaCache = theCalc.itsPimple->itsProjectedAreaCache;
+  itsPimple->itsProjectedLineCache = theCalc.itsPimple->itsProjectedLineCache;
+  itsPimple->isCacheOn = theCalc.itsPimple->isCacheOn;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Set the cache on or off
+ *
+ * \param theFlag True if cache is to be set on
+ */
+// ----------------------------------------------------------------------
+
+void ContourCalculator::cache(bool theFlag)
+{
+  itsPimple->isCacheOn = theFlag;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Limit the memory used by the caches
+ *
+ * The limit applies separately to the contour and contour line caches
+ * and to their projected counterparts.
+ *
+ * \param theMaxBytes The limit in bytes, 0 implies no limit
+ */
+// ----------------------------------------------------------------------
+
+void ContourCalculator::cacheMaxBytes(std::size_t theMaxBytes)
+{
+  itsPimple->itsAreaCache->maxbytes(theMaxBytes);
+  itsPimple->itsLineCache->maxbytes(theMaxBytes);
+  itsPimple->itsProjectedAreaCache->maxbytes(theMaxBytes);
+  itsPimple->itsProjectedLineCache->maxbytes(theMaxBytes);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Set the directory for the persistent caches
+ *
+ * \param theDirectory The directory, an empty string disables the disk cache
+ */
+// ----------------------------------------------------------------------
+
+void ContourCalculator::cacheDirectory(const std::string &theDirectory)
+{
+  itsPimple->itsAreaCache->directory(theDirectory, "contour");
+  itsPimple->itsLineCache->directory(theDirectory, "line");
+}
+// ----------------------------------------------------------------------
+/*!
+ * \brief Return whether the last contour was cached
+ *
+ * \return True, if last returned contour was cached
+ */
+// ----------------------------------------------------------------------
+
+bool ContourCalculator::wasCached() const
+{
+  return itsPimple->itWasCached;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Return whether the given contour of the last set was cached
+ *
+ * \param theIndex The index of the contour in the last set of contours
+ * \return True, if the contour was cached
+ */
+// ----------------------------------------------------------------------
+
+bool ContourCalculator::wasCached(std::size_t theIndex) const
+{
+  return itsPimple->itsCachedFlags.at(theIndex);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Set the number of threads used for calculating contour sets
+ *
+ * \param theThreads The number of threads, 0 and 1 imply no threading
+ */
+// ----------------------------------------------------------------------
+
+void ContourCalculator::threads(unsigned int theThreads)
+{
+  itsPimple->itsThreads = std::max(1u, theThreads);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Set the minimum height of the stripes contoured in parallel
+ *
+ * When fewer contours are calculated than there are threads, the grid
+ * is split into horizontal stripes of at least the given number of
+ * rows, which are contoured in parallel and then stitched together.
+ *
+ * \param theRows The minimum number of rows, 0 disables the stripes
+ */
+// ----------------------------------------------------------------------
+
+void ContourCalculator::stripes(unsigned int theRows)
+{
+  itsPimple->itsStripeRows = theRows;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Select the engine for linearly interpolated fills
+ *
+ * By default all contours are calculated with Tron. When enabled,
+ * the linearly interpolated fills returned by contours() are instead
+ * calculated all at once in one pass over the grid, see IsobandTools.
+ * The geometries are always calculated with Tron.
+ *
+ * \param theFlag True for IsobandTools, false for Tron
+ */
+// ----------------------------------------------------------------------
+
+void ContourCalculator::isobands(bool theFlag)
+{
+  itsPimple->itsIsobands = theFlag;
+}
+// ----------------------------------------------------------------------
+/*!
+ * \brief Set new active data on
+ */
+// ----------------------------------------------------------------------
+
+void ContourCalculator::data(const NFmiDataMatrix<float> &theData)
+{
+  itsPimple->itsData.reset(new DataMatrixAdapter(theData));
+  itsPimple->itsHintsOK = false;
+  itsPimple->itsStripesOK = false;
+  itsPimple->itsFingerprintOK = false;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Set new active data, of which only a window is contoured
+ *
+ * The contours are still in the coordinates of the full grid. The
+ * window is [i1,i2) x [j1,j2) and must be nonempty.
+ */
+// ----------------------------------------------------------------------
+
+void ContourCalculator::data(const NFmiDataMatrix<float> &theData,
+                             std::size_t theI1,
+                             std::size_t theJ1,
+                             std::size_t theI2,
+                             std::size_t theJ2)
+{
+  if (theI1 >= theI2 || theJ1 >= theJ2 || theI2 > theData.NX() || theJ2 > theData.NY())
+    throw std::runtime_error("ContourCalculator:: Invalid data window");
+
+  itsPimple->itsData.reset(new DataMatrixAdapter(theData, theI1, theJ1, theI2, theJ2));
+  itsPimple->itsHintsOK = false;
+  itsPimple->itsStripesOK = false;
+  itsPimple->itsFingerprintOK = false;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Set new active data of reduced resolution
+ *
+ * Element (i,j) of the data is located at (x0 + i*step, y0 + j*step)
+ * in the coordinates of the full grid, which are then used for the
+ * contours.
+ */
+// ----------------------------------------------------------------------
+
+void ContourCalculator::data(const NFmiDataMatrix<float> &theData,
+                             float theX0,
+                             float theY0,
+                             float theStep)
+{
+  if (theData.NX() < 2 || theData.NY() < 2 || theStep <= 0)
+    throw std::runtime_error("ContourCalculator:: Invalid reduced resolution data");
+
+  itsPimple->itsData.reset(new DataMatrixAdapter(theData, theX0, theY0, theStep));
+  itsPimple->itsHintsOK = false;
+  itsPimple->itsStripesOK = false;
+  itsPimple->itsFingerprintOK = false;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Return the desired contour
+ *
+ *\return The path object
+ */
+// ----------------------------------------------------------------------
+
+Imagine::NFmiPath ContourCalculator::contour(const LazyQueryData &theData,
+                                             float theLoLimit,
+                                             float theHiLimit,
+                                             const NFmiTime &theTime,
+                                             ContourInterpolation theInterpolation)
+{
+  std::vector<std::pair<float, float> > limits(1, std::make_pair(theLoLimit, theHiLimit));
+  Imagine::NFmiPath path = std::move(contours(theData, limits, theTime, theInterpolation).front());
+  itsPimple->itWasCached = itsPimple->itsCachedFlags.front();
+  return path;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Return the desired contour line
+ *
+ *\return The path object
+ */
+// ----------------------------------------------------------------------
+
+Imagine::NFmiPath ContourCalculator::contour(const LazyQueryData &theData,
+                                             float theValue,
+                                             const NFmiTime &theTime,
+                                             ContourInterpolation theInterpolation)
+{
+  std::vector<float> values(1, theValue);
+  Imagine::NFmiPath path = std::move(contours(theData, values, theTime, theInterpolation).front());
+  itsPimple->itWasCached = itsPimple->itsCachedFlags.front();
+  return path;
+}
+
+namespace
+{
+// ----------------------------------------------------------------------
+/*!
+ * \brief The profile counter of the vertices of a contour fill
+ */
+// ----------------------------------------------------------------------
+
+std::string band_counter(float theLoLimit, float theHiLimit)
+{
+  std::ostringstream out;
+  out << "vertices[";
+  if (theLoLimit != kFloatMissing)
+    out << theLoLimit;
+  out << ',';
+  if (theHiLimit != kFloatMissing)
+    out << theHiLimit;
+  out << ']';
+  return out.str();
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief The profile counter of the vertices of a contour line
+ */
+// ----------------------------------------------------------------------
+
+std::string band_counter(float theValue)
+{
+  std::ostringstream out;
+  out << "vertices[" << theValue << ']';
+  return out.str();
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Count the vertices of the calculated paths for the profile
+ *
+ * The counter names are formatted only when profiling is enabled.
+ *
+ * \param theCounter Returns the name of the counter of a path
+ */
+// ----------------------------------------------------------------------
+
+template <typename Counter>
+void count_vertices(const std::vector<Imagine::NFmiPath> &thePaths,
+                    const std::vector<std::size_t> &theIndexes,
+                    Counter theCounter)
+{
+  if (!Profiler::enabled())
+    return;
+
+  long long vertices = 0;
+  for (std::size_t i : theIndexes)
+  {
+    const long long n = static_cast<long long>(thePaths[i].Elements().size());
+    Profiler::count(theCounter(i), n);
+    vertices += n;
+  }
+  Profiler::count("vertices", vertices);
+}
+
+}  // namespace
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Return the desired contours
+ *
+ * If so requested, linearly interpolated fills which are not in the
+ * cache are all calculated in one pass over the grid, see isobands().
+ * Otherwise the grid is first classified against all the limits at
+ * once to find the contours which are certainly empty. The remaining
+ * contours which are not in the cache are calculated in parallel
+ * using the hints shared by all of them. If there are fewer
+ * of them than threads, the grid may also be split into stripes which
+ * are contoured in parallel, see stripes(). The paths are
+ * returned in the order of the limits, so that rendering them
+ * in order gives the same result as calculating them one by one.
+ *
+ * \param theLimits The lower and upper limits of the contours
+ * \return The path objects
+ */
+// ----------------------------------------------------------------------
+
+std::vector<Imagine::NFmiPath> ContourCalculator::contours(
+    const LazyQueryData &theData,
+    const std::vector<std::pair<float, float> > &theLimits,
+    const NFmiTime &theTime,
+    ContourInterpolation theInterpolation)
+{
+  if (itsPimple->itsData.get() == 0)
+    throw std::runtime_error("ContourCalculator:: No data set before calling contour");
+
+  const std::size_t n = theLimits.size();
+  std::vector<Imagine::NFmiPath> paths(n);
+  itsPimple->itsCachedFlags.assign(n, false);
+
+  // Collect the contours which must be calculated
+
+  const std::size_t variant = (itsPimple->isCacheOn ? itsPimple->variant(theInterpolation) : 0);
+  const std::size_t digest = itsPimple->itsDigest;
+
+  std::vector<std::size_t> missing;
+  for (std::size_t i = 0; i < n; i++)
+  {
+    const float lo = theLimits[i].first;
+    const float hi = theLimits[i].second;
+    if (itsPimple->isCacheOn &&
+        itsPimple->itsAreaCache->find(paths[i], lo, hi, theTime, theData, variant, digest))
+      itsPimple->itsCachedFlags[i] = true;
+    else
+      missing.push_back(i);
+  }
+
+  Profiler::count("cache_hits", static_cast<long long>(n - missing.size()));
+  Profiler::count("cache_misses", static_cast<long long>(missing.size()));
+
+  if (!missing.empty())
+  {
+    Profiler::Phase phase("contour");
+
+    const NFmiGrid *grid = theData.Grid();
+    const ContourCalculatorPimple &pimple = *itsPimple;
+
+    // Bands of linearly interpolated data are calculated all at once
+
+    std::vector<std::size_t> bands;
+    std::vector<std::size_t> others;
+    for (std::size_t i : missing)
     {
-      throw std::runtime_error("Contour lines not supported for nearest neighbour interpolation");
+      if (pimple.itsIsobands && theInterpolation == Linear &&
+          IsobandTools::contourable(theLimits[i]))
+        bands.push_back(i);
+      else
+        others.push_back(i);
     }
-    case Discrete:
+
+    if (!bands.empty())
     {
-      throw std::runtime_error("Contour lines not supported for discrete neighbour interpolation");
-      break;
+      std::vector<IsobandTools::Band> limits;
+      for (std::size_t i : bands)
+        limits.push_back(theLimits[i]);
+      std::vector<Imagine::NFmiPath> fills =
+          IsobandTools::fills(*pimple.itsData, limits, pimple.itsThreads);
+      pimple.run(bands.size(),
+                 [&](std::size_t k)
+                 {
+                   fills[k].InvGrid(grid);
+                   paths[bands[k]] = std::move(fills[k]);
+                 });
+    }
+
+    // Empty contours need not be calculated
+
+    std::vector<std::size_t> work = others;
+    if (others.size() > 1)
+    {
+      const std::vector<bool> flags = itsPimple->occupied(theLimits);
+      work.clear();
+      for (std::size_t i : others)
+        if (flags[i])
+          work.push_back(i);
+    }
+
+    const std::size_t stripes = itsPimple->stripes(work.size());
+    if (stripes > 1)
+      itsPimple->require_stripes(stripes);
+    else if (!work.empty())
+      itsPimple->require_hints();
+
+    if (stripes > 1)
+    {
+      std::vector<std::shared_ptr<Geometry> > pieces(work.size() * stripes);
+      pimple.run(pieces.size(),
+                 [&](std::size_t t)
+                 {
+                   const std::size_t i = work[t / stripes];
+                   const std::size_t s = t % stripes;
+                   pieces[t] = pimple.fillGeometry(theLimits[i].first,
+                                                   theLimits[i].second,
+                                                   theInterpolation,
+                                                   *pimple.itsStripes[s],
+                                                   *pimple.itsStripeHints[s]);
+                 });
+      pimple.run(work.size(),
+                 [&](std::size_t k)
+                 { paths[work[k]] = pimple.stitchFills(&pieces[k * stripes], grid); });
     }
+    else
+      pimple.run(work.size(),
+                 [&](std::size_t k)
+                 {
+                   const std::size_t i = work[k];
+                   paths[i] =
+                       pimple.fill(theLimits[i].first, theLimits[i].second, grid, theInterpolation);
+                 });
+
+    work.insert(work.end(), bands.begin(), bands.end());
+    count_vertices(paths,
+                   work,
+                   [&](std::size_t i)
+                   { return band_counter(theLimits[i].first, theLimits[i].second); });
+
+    // The same contour may have been requested several times, or
+    // calculated simultaneously by another thread
+
+    if (itsPimple->isCacheOn)
+      for (std::size_t i : missing)
+        itsPimple->itsAreaCache->insert(
+            paths[i], theLimits[i].first, theLimits[i].second, theTime, theData, variant, digest);
   }
 
-  std::shared_ptr<Geometry> geom = builder.result();
+  itsPimple->itWasCached = missing.empty();
+  return paths;
+}
 
-  Imagine::NFmiPath path;
-  add_path(path, geom.get());
+// ----------------------------------------------------------------------
+/*!
+ * \brief Return the desired contour lines
+ *
+ * The lines are classified and calculated similarly to the contours.
+ *
+ * \param theValues The values to be contoured
+ * \return The path objects
+ */
+// ----------------------------------------------------------------------
 
-  path.InvGrid(theData.Grid());
+std::vector<Imagine::NFmiPath> ContourCalculator::contours(const LazyQueryData &theData,
+                                                           const std::vector<float> &theValues,
+                                                           const NFmiTime &theTime,
+                                                           ContourInterpolation theInterpolation)
+{
+  if (itsPimple->itsData.get() == 0)
+    throw std::runtime_error("ContourCalculator:: No data set before calling contour");
 
-  if (itsPimple->isCacheOn)
-    itsPimple->itsLineCache.insert(path, theValue, kFloatMissing, theTime, theData);
+  const std::size_t n = theValues.size();
+  std::vector<Imagine::NFmiPath> paths(n);
+  itsPimple->itsCachedFlags.assign(n, false);
 
-  itsPimple->itWasCached = false;
-  return path;
+  const std::size_t variant = (itsPimple->isCacheOn ? itsPimple->variant(theInterpolation) : 0);
+  const std::size_t digest = itsPimple->itsDigest;
+
+  std::vector<std::size_t> missing;
+  for (std::size_t i = 0; i < n; i++)
+  {
+    const float value = theValues[i];
+    if (itsPimple->isCacheOn &&
+        itsPimple->itsLineCache->find(
+            paths[i], value, kFloatMissing, theTime, theData, variant, digest))
+      itsPimple->itsCachedFlags[i] = true;
+    else
+      missing.push_back(i);
+  }
+
+  Profiler::count("cache_hits", static_cast<long long>(n - missing.size()));
+  Profiler::count("cache_misses", static_cast<long long>(missing.size()));
+
+  if (!missing.empty())
+  {
+    Profiler::Phase phase("contour");
+
+    std::vector<std::size_t> work = missing;
+    if (missing.size() > 1)
+    {
+      std::vector<std::pair<float, float> > limits;
+      for (float value : theValues)
+        limits.push_back(std::make_pair(value, value));
+      const std::vector<bool> flags = itsPimple->occupied(limits);
+      work.clear();
+      for (std::size_t i : missing)
+        if (flags[i])
+          work.push_back(i);
+    }
+
+    const std::size_t stripes = itsPimple->stripes(work.size());
+    if (stripes > 1)
+      itsPimple->require_stripes(stripes);
+    else if (!work.empty())
+      itsPimple->require_hints();
+
+    const NFmiGrid *grid = theData.Grid();
+    const ContourCalculatorPimple &pimple = *itsPimple;
+    if (stripes > 1)
+    {
+      std::vector<std::shared_ptr<Geometry> > pieces(work.size() * stripes);
+      pimple.run(pieces.size(),
+                 [&](std::size_t t)
+                 {
+                   const std::size_t s = t % stripes;
+                   pieces[t] = pimple.lineGeometry(theValues[work[t / stripes]],
+                                                   theInterpolation,
+                                                   *pimple.itsStripes[s],
+                                                   *pimple.itsStripeHints[s]);
+                 });
+      pimple.run(work.size(),
+                 [&](std::size_t k)
+                 { paths[work[k]] = pimple.stitchLines(&pieces[k * stripes], grid); });
+    }
+    else
+      pimple.run(work.size(),
+                 [&](std::size_t k)
+                 {
+                   const std::size_t i = work[k];
+                   paths[i] = pimple.line(theValues[i], grid, theInterpolation);
+                 });
+    count_vertices(paths, work, [&](std::size_t i) { return band_counter(theValues[i]); });
+
+    if (itsPimple->isCacheOn)
+      for (std::size_t i : missing)
+        itsPimple->itsLineCache->insert(
+            paths[i], theValues[i], kFloatMissing, theTime, theData, variant, digest);
+  }
+
+  itsPimple->itWasCached = missing.empty();
+  return paths;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Return the desired contours as geometries in grid coordinates
+ *
+ * The geometries are not cached. Contours which are known to be
+ * empty are returned as null pointers.
+ *
+ * \param theLimits The lower and upper limits of the contours
+ * \return The geometries in the order of the limits
+ */
+// ----------------------------------------------------------------------
+
+std::vector<std::shared_ptr<geos::geom::Geometry> > ContourCalculator::geometries(
+    const std::vector<std::pair<float, float> > &theLimits, ContourInterpolation theInterpolation)
+{
+  if (itsPimple->itsData.get() == 0)
+    throw std::runtime_error("ContourCalculator:: No data set before calling contour");
+
+  const std::vector<bool> flags = itsPimple->occupied(theLimits);
+  std::vector<std::size_t> work;
+  for (std::size_t i = 0; i < theLimits.size(); i++)
+    if (flags[i])
+      work.push_back(i);
+
+  if (!work.empty())
+    itsPimple->require_hints();
+
+  std::vector<std::shared_ptr<Geometry> > geoms(theLimits.size());
+  const ContourCalculatorPimple &pimple = *itsPimple;
+  pimple.run(work.size(),
+             [&](std::size_t k)
+             {
+               const std::size_t i = work[k];
+               geoms[i] =
+                   pimple.fillGeometry(theLimits[i].first, theLimits[i].second, theInterpolation);
+             });
+  return geoms;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Return the desired contour lines as geometries in grid coordinates
+ *
+ * \param theValues The values to be contoured
+ * \return The geometries in the order of the values
+ */
+// ----------------------------------------------------------------------
+
+std::vector<std::shared_ptr<geos::geom::Geometry> > ContourCalculator::geometries(
+    const std::vector<float> &theValues, ContourInterpolation theInterpolation)
+{
+  if (itsPimple->itsData.get() == 0)
+    throw std::runtime_error("ContourCalculator:: No data set before calling contour");
+
+  std::vector<std::pair<float, float> > limits;
+  for (float value : theValues)
+    limits.push_back(std::make_pair(value, value));
+  const std::vector<bool> flags = itsPimple->occupied(limits);
+
+  std::vector<std::size_t> work;
+  for (std::size_t i = 0; i < theValues.size(); i++)
+    if (flags[i])
+      work.push_back(i);
+
+  if (!work.empty())
+    itsPimple->require_hints();
+
+  std::vector<std::shared_ptr<Geometry> > geoms(theValues.size());
+  const ContourCalculatorPimple &pimple = *itsPimple;
+  pimple.run(work.size(),
+             [&](std::size_t k)
+             {
+               const std::size_t i = work[k];
+               geoms[i] = pimple.lineGeometry(theValues[i], theInterpolation);
+             });
+  return geoms;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Return the desired contours projected onto the given area
+ *
+ * The projected paths are cached separately for each area, hence
+ * drawing the same contours on several backgrounds with the same
+ * projection needs to project the paths only once.
+ *
+ * \param theLimits The lower and upper limits of the contours
+ * \param theArea The area to project to
+ * \param theAreaKey Unique identifier for the area
+ * \return The path objects in pixel coordinates
+ */
+// ----------------------------------------------------------------------
+
+std::vector<Imagine::NFmiPath> ContourCalculator::contours(
+    const LazyQueryData &theData,
+    const std::vector<std::pair<float, float> > &theLimits,
+    const NFmiTime &theTime,
+    ContourInterpolation theInterpolation,
+    const NFmiArea &theArea,
+    const std::string &theAreaKey)
+{
+  if (!itsPimple->isCacheOn)
+  {
+    std::vector<Imagine::NFmiPath> paths = contours(theData, theLimits, theTime, theInterpolation);
+    Profiler::Phase phase("project");
+    for (auto &path : paths)
+      path.Project(&theArea);
+    return paths;
+  }
+
+  if (itsPimple->itsData.get() == 0)
+    throw std::runtime_error("ContourCalculator:: No data set before calling contour");
+
+  const std::size_t n = theLimits.size();
+  const std::size_t variant = itsPimple->variant(theInterpolation, theAreaKey, 0);
+  const std::size_t digest = itsPimple->itsDigest;
+
+  std::vector<Imagine::NFmiPath> paths(n);
+  std::vector<bool> cached(n, false);
+
+  std::vector<std::size_t> missing;
+  std::vector<std::pair<float, float> > limits;
+  for (std::size_t i = 0; i < n; i++)
+  {
+    const float lo = theLimits[i].first;
+    const float hi = theLimits[i].second;
+    if (itsPimple->itsProjectedAreaCache->find(paths[i], lo, hi, theTime, theData, variant, digest))
+      cached[i] = true;
+    else
+    {
+      missing.push_back(i);
+      limits.push_back(theLimits[i]);
+    }
+  }
+
+  if (!missing.empty())
+  {
+    std::vector<Imagine::NFmiPath> gridpaths =
+        contours(theData, limits, theTime, theInterpolation);
+
+    Profiler::Phase phase("project");
+    for (std::size_t k = 0; k < missing.size(); k++)
+    {
+      const std::size_t i = missing[k];
+      const float lo = theLimits[i].first;
+      const float hi = theLimits[i].second;
+      cached[i] = itsPimple->itsCachedFlags[k];
+      paths[i] = std::move(gridpaths[k]);
+      paths[i].Project(&theArea);
+      itsPimple->itsProjectedAreaCache->insert(paths[i], lo, hi, theTime, theData, variant, digest);
+    }
+  }
+
+  itsPimple->itsCachedFlags = cached;
+  itsPimple->itWasCached = (std::find(cached.begin(), cached.end(), false) == cached.end());
+  return paths;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Return the desired contour lines projected onto the given area
+ *
+ * The lines may also be simplified, in which case the simplified
+ * lines are cached.
+ *
+ * \param theValues The values to be contoured
+ * \param theArea The area to project to
+ * \param theAreaKey Unique identifier for the area
+ * \param theSimplifyTolerance The tolerance of SimplifyLines, 0 for none
+ * \return The path objects in pixel coordinates
+ */
+// ----------------------------------------------------------------------
+
+std::vector<Imagine::NFmiPath> ContourCalculator::contours(const LazyQueryData &theData,
+                                                           const std::vector<float> &theValues,
+                                                           const NFmiTime &theTime,
+                                                           ContourInterpolation theInterpolation,
+                                                           const NFmiArea &theArea,
+                                                           const std::string &theAreaKey,
+                                                           double theSimplifyTolerance)
+{
+  if (!itsPimple->isCacheOn)
+  {
+    std::vector<Imagine::NFmiPath> paths = contours(theData, theValues, theTime, theInterpolation);
+    Profiler::Phase phase("project");
+    for (auto &path : paths)
+    {
+      path.Project(&theArea);
+      if (theSimplifyTolerance > 0)
+        path.SimplifyLines(theSimplifyTolerance);
+    }
+    return paths;
+  }
+
+  if (itsPimple->itsData.get() == 0)
+    throw std::runtime_error("ContourCalculator:: No data set before calling contour");
+
+  const std::size_t n = theValues.size();
+  const std::size_t variant =
+      itsPimple->variant(theInterpolation, theAreaKey, theSimplifyTolerance);
+  const std::size_t digest = itsPimple->itsDigest;
+
+  std::vector<Imagine::NFmiPath> paths(n);
+  std::vector<bool> cached(n, false);
+
+  std::vector<std::size_t> missing;
+  std::vector<float> values;
+  for (std::size_t i = 0; i < n; i++)
+  {
+    if (itsPimple->itsProjectedLineCache->find(
+            paths[i], theValues[i], kFloatMissing, theTime, theData, variant, digest))
+      cached[i] = true;
+    else
+    {
+      missing.push_back(i);
+      values.push_back(theValues[i]);
+    }
+  }
+
+  if (!missing.empty())
+  {
+    std::vector<Imagine::NFmiPath> gridpaths =
+        contours(theData, values, theTime, theInterpolation);
+
+    Profiler::Phase phase("project");
+    for (std::size_t k = 0; k < missing.size(); k++)
+    {
+      const std::size_t i = missing[k];
+      const float value = theValues[i];
+      cached[i] = itsPimple->itsCachedFlags[k];
+      paths[i] = std::move(gridpaths[k]);
+      paths[i].Project(&theArea);
+      if (theSimplifyTolerance > 0)
+        paths[i].SimplifyLines(theSimplifyTolerance);
+      itsPimple->itsProjectedLineCache->insert(
+          paths[i], value, kFloatMissing, theTime, theData, variant, digest);
+    }
+  }
+
+  itsPimple->itsCachedFlags = cached;
+  itsPimple->itWasCached = (std::find(cached.begin(), cached.end(), false) == cached.end());
+  return paths;
 }
 
 // ======================================================================
@@ -8,6 +8,8 @@
 #include "ContourSpec.h"
 #include "NFmiColorTools.h"
 #include "NoiseTools.h"
+#include <iomanip>
+#include <sstream>
 
 // ----------------------------------------------------------------------
 /*!
@@ -1365,7 +1367,7 @@ void ContourSpec::despeckle(
  */
 // ----------------------------------------------------------------------
 
-void ContourSpec::despeckle(NFmiDataMatrix<float>& theValues) const
+void ContourSpec::despeckle(NFmiDataMatrix<float>& theValues, unsigned int theThreads) const
 {
   if (!itHasDespeckle)
     return;
@@ -1375,7 +1377,33 @@ void ContourSpec::despeckle(NFmiDataMatrix<float>& theValues) const
                         itsDespeckleHiLimit,
                         itsDespeckleRadius,
                         itsDespeckleWeight,
-                        itsDespeckleIterations);
+                        itsDespeckleIterations,
+                        theThreads);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Return a key identifying the value processing settings
+ *
+ * Two specifications with the same parameter, level and processing
+ * key produce identical grids for contouring.
+ */
+// ----------------------------------------------------------------------
+
+std::string ContourSpec::processingKey() const
+{
+  std::ostringstream os;
+  os << std::setprecision(9) << itsParam << ' ' << itsLevel << ' ' << itHasReplace;
+  if (itHasReplace)
+    os << ' ' << itsReplaceSourceValue << ' ' << itsReplaceTargetValue;
+  os << ' ' << itHasDespeckle;
+  if (itHasDespeckle)
+    os << ' ' << itsDespeckleLoLimit << ' ' << itsDespeckleHiLimit << ' ' << itsDespeckleRadius
+       << ' ' << itsDespeckleWeight << ' ' << itsDespeckleIterations;
+  os << ' ' << itsSmoother;
+  if (itsSmoother != "None")
+    os << ' ' << itsSmootherRadius << ' ' << itsSmootherFactor;
+  return os.str();
 }
 
 // ----------------------------------------------------------------------
@@ -40,13 +40,21 @@
  *
  * If there is no bounding box, we simply choose the first one
  * available.
+ *
+ * When a coherence tolerance has been set, the markers of the previous
+ * timestep are kept first, each one moved to the nearest candidate of
+ * the same type within the tolerance.
  */
 // ======================================================================
 
 #include "ExtremaLocator.h"
 
+#include <algorithm>
 #include <cmath>
+#include <set>
 #include <stdexcept>
+#include <unordered_map>
+#include <vector>
 
 using namespace std;
 
@@ -88,6 +96,173 @@ double mindistance(double theX, double theY, const T& theCoords)
   return best;
 }
 
+// ----------------------------------------------------------------------
+/*!
+ * \brief Index of the extrema candidates
+ *
+ * The candidates of each type are ordered by their distance to the
+ * previous choices, with ties broken by the original order. Without
+ * previous choices the first candidate is preferred.
+ *
+ * For removal the candidates are bucketed on a uniform grid whose cell
+ * size equals the larger of the minimum distances, hence all candidates
+ * too close to a chosen point are found from the adjacent cells. Erased
+ * candidates are only marked dead in the grid, since their containers
+ * may be deleted afterwards.
+ */
+// ----------------------------------------------------------------------
+
+class CandidateIndex
+{
+ public:
+  CandidateIndex(ExtremaLocator::ExtremaCoordinates& theCandidates,
+                 const ExtremaLocator::ExtremaCoordinates& thePrevious,
+                 double theCellSize)
+      : itsCellSize(theCellSize > 0 ? theCellSize : 1.0)
+  {
+    for (auto& cit : theCandidates)
+    {
+      auto pit = thePrevious.find(cit.first);
+      auto& order = itsOrder[cit.first];
+
+      for (auto it = cit.second.begin(); it != cit.second.end(); ++it)
+      {
+        Entry entry;
+        entry.type = cit.first;
+        entry.coords = &cit.second;
+        entry.it = it;
+        entry.alive = true;
+        entry.dist = 0;
+        if (pit != thePrevious.end())
+          entry.dist = mindistance(it->first, it->second, pit->second);
+
+        const std::size_t seq = itsEntries.size();
+        itsEntries.push_back(entry);
+        order.insert(Order(entry.dist, seq));
+        itsCells[key(cell(it->first), cell(it->second))].push_back(seq);
+      }
+    }
+  }
+
+  // The preferred remaining candidate of the given type
+
+  ExtremaLocator::Coordinates::iterator best(ExtremaLocator::Extremum theType)
+  {
+    const auto& order = itsOrder[theType];
+    if (order.empty())
+      throw std::runtime_error("Internal error in ExtremaLocator::chooseCoordinates()");
+    return itsEntries[order.begin()->second].it;
+  }
+
+  // The nearest remaining candidate of the given type within the tolerance
+
+  bool nearest(const ExtremaLocator::XY& thePoint,
+               ExtremaLocator::Extremum theType,
+               double theTolerance,
+               ExtremaLocator::XY& theBest) const
+  {
+    const long long cx = cell(thePoint.first);
+    const long long cy = cell(thePoint.second);
+    const long long n = static_cast<long long>(std::ceil(theTolerance / itsCellSize));
+
+    double best = -1;
+    for (long long i = cx - n; i <= cx + n; i++)
+      for (long long j = cy - n; j <= cy + n; j++)
+      {
+        auto pos = itsCells.find(key(i, j));
+        if (pos == itsCells.end())
+          continue;
+
+        for (std::size_t seq : pos->second)
+        {
+          const Entry& entry = itsEntries[seq];
+          if (!entry.alive || entry.type != theType)
+            continue;
+
+          const double dist =
+              distance(thePoint.first, thePoint.second, entry.it->first, entry.it->second);
+          if (dist <= theTolerance && (best < 0 || dist < best))
+          {
+            best = dist;
+            theBest = *entry.it;
+          }
+        }
+      }
+    return (best >= 0);
+  }
+
+  // Erase all candidates too close to the chosen point
+
+  void remove(const ExtremaLocator::XY& thePoint,
+              ExtremaLocator::Extremum theType,
+              double theSameDistance,
+              double theDifferentDistance)
+  {
+    const long long cx = cell(thePoint.first);
+    const long long cy = cell(thePoint.second);
+
+    for (long long i = cx - 1; i <= cx + 1; i++)
+      for (long long j = cy - 1; j <= cy + 1; j++)
+      {
+        auto pos = itsCells.find(key(i, j));
+        if (pos == itsCells.end())
+          continue;
+
+        for (std::size_t seq : pos->second)
+        {
+          Entry& entry = itsEntries[seq];
+          if (!entry.alive)
+            continue;
+
+          const double dist =
+              distance(thePoint.first, thePoint.second, entry.it->first, entry.it->second);
+
+          bool erase = false;
+
+          if (entry.type != theType)
+            erase = (dist < theDifferentDistance);
+          else
+            erase = (dist < theSameDistance);
+
+          if (erase)
+          {
+            itsOrder[entry.type].erase(Order(entry.dist, seq));
+            entry.coords->erase(entry.it);
+            entry.alive = false;
+          }
+        }
+      }
+  }
+
+ private:
+  struct Entry
+  {
+    ExtremaLocator::Extremum type;
+    ExtremaLocator::Coordinates* coords;
+    ExtremaLocator::Coordinates::iterator it;
+    double dist;
+    bool alive;
+  };
+
+  typedef std::pair<double, std::size_t> Order;
+
+  double itsCellSize;
+  std::vector<Entry> itsEntries;
+  std::map<ExtremaLocator::Extremum, std::set<Order> > itsOrder;
+  std::unordered_map<unsigned long long, std::vector<std::size_t> > itsCells;
+
+  long long cell(double theValue) const
+  {
+    return static_cast<long long>(std::floor(theValue / itsCellSize));
+  }
+
+  static unsigned long long key(long long theX, long long theY)
+  {
+    return (static_cast<unsigned long long>(theX) << 32) ^
+           (static_cast<unsigned long long>(theY) & 0xffffffffULL);
+  }
+};
+
 }  // namespace
 
 // ----------------------------------------------------------------------
@@ -107,6 +282,7 @@ ExtremaLocator::~ExtremaLocator() {}
 ExtremaLocator::ExtremaLocator()
     : itsMinDistanceToSame(500),
       itsMinDistanceToDifferent(500),
+      itsCoherence(0),
       itsPreviousCoordinates(),
       itsCurrentCoordinates()
 {
@@ -137,6 +313,23 @@ void ExtremaLocator::clear()
   itsCurrentCoordinates.clear();
 }
 
+// ----------------------------------------------------------------------
+/*!
+ * \brief Swap the earlier label locations with another locator
+ *
+ * The settings are not swapped. This lets one locator be used for
+ * several image sequences rendered alternately.
+ *
+ * \param theOther The locator holding the locations of another sequence
+ */
+// ----------------------------------------------------------------------
+
+void ExtremaLocator::swapHistory(ExtremaLocator& theOther)
+{
+  swap(itsPreviousCoordinates, theOther.itsPreviousCoordinates);
+  swap(itsCurrentCoordinates, theOther.itsCurrentCoordinates);
+}
+
 // ----------------------------------------------------------------------
 /*!
  * \brief Set the minimum distance to label of same value
@@ -171,6 +364,22 @@ void ExtremaLocator::minDistanceToDifferent(float theDistance)
   itsMinDistanceToDifferent = theDistance;
 }
 
+// ----------------------------------------------------------------------
+/*!
+ * \brief Set the distance within which previous markers are kept
+ *
+ * \param theTolerance The maximum distance in pixels, 0 disables
+ */
+// ----------------------------------------------------------------------
+
+void ExtremaLocator::coherence(float theTolerance)
+{
+  if (theTolerance < 0)
+    throw runtime_error("ExtremaLocator: Coherence tolerance cannot be negative");
+
+  itsCoherence = theTolerance;
+}
+
 // ----------------------------------------------------------------------
 /*!
  * \brief Initialize next time step
@@ -222,6 +431,28 @@ const ExtremaLocator::ExtremaCoordinates& ExtremaLocator::chooseCoordinates()
   ExtremaCoordinates choices;
   swap(itsCurrentCoordinates, candidates);
 
+  CandidateIndex index(candidates,
+                       itsPreviousCoordinates,
+                       std::max(itsMinDistanceToSame, itsMinDistanceToDifferent));
+
+  // Keep the previous markers which have not moved too much
+
+  if (itsCoherence > 0)
+  {
+    for (const auto& pit : itsPreviousCoordinates)
+      for (const XY& previous : pit.second)
+      {
+        XY point;
+        if (!index.nearest(previous, pit.first, itsCoherence, point))
+          continue;
+
+        choices[pit.first].push_back(point);
+        index.remove(point, pit.first, itsMinDistanceToSame, itsMinDistanceToDifferent);
+      }
+
+    removeEmpties(candidates);
+  }
+
   while (!candidates.empty())
   {
     for (ExtremaCoordinates::iterator cit = candidates.begin(); cit != candidates.end(); ++cit)
@@ -236,9 +467,7 @@ const ExtremaLocator::ExtremaCoordinates& ExtremaLocator::chooseCoordinates()
 
       const Extremum value = cit->first;
 
-      Coordinates::const_iterator best = chooseOne(cit->second, value);
-      if (best == cit->second.end())
-        throw runtime_error("Internal error in ExtremaLocator::chooseLabels()");
+      Coordinates::const_iterator best = index.best(value);
 
       // add the best label coordinate
 
@@ -247,7 +476,8 @@ const ExtremaLocator::ExtremaCoordinates& ExtremaLocator::chooseCoordinates()
 
       // and erase all candidates too close to the accepted coordinate
 
-      removeCandidates(candidates, *best, value);
+      const XY point = *best;
+      index.remove(point, value, itsMinDistanceToSame, itsMinDistanceToDifferent);
     }
 
     // Now we erase any possible empty containers left behind
@@ -260,114 +490,6 @@ const ExtremaLocator::ExtremaCoordinates& ExtremaLocator::chooseCoordinates()
   return itsCurrentCoordinates;
 }
 
-// ----------------------------------------------------------------------
-/*!
- * \brief Choose a label location from given candidates
- *
- * \param theCandidates The list of candidates
- * \param theType The extremum type
- */
-// ----------------------------------------------------------------------
-
-ExtremaLocator::Coordinates::const_iterator ExtremaLocator::chooseOne(
-    const Coordinates& theCandidates, Extremum theType)
-{
-  ExtremaCoordinates::const_iterator pit = itsPreviousCoordinates.find(theType);
-  if (pit == itsPreviousCoordinates.end())
-    return chooseClosestToBorder(theCandidates, theType);
-
-  return chooseClosestToPrevious(theCandidates, pit->second, theType);
-}
-
-// ----------------------------------------------------------------------
-/*!
- * \brief Choose a label location from given candidates closest to earlier ones
- *
- * \param theCandidates The list of candidates
- * \param thePreviousChoises The list of choises from previous timestep
- * \param theType The extremum type
- */
-// ----------------------------------------------------------------------
-
-ExtremaLocator::Coordinates::const_iterator ExtremaLocator::chooseClosestToPrevious(
-    const Coordinates& theCandidates, const Coordinates& thePreviousChoises, Extremum theType)
-{
-  double bestdist = -1;
-  Coordinates::const_iterator best = theCandidates.end();
-
-  for (Coordinates::const_iterator it = theCandidates.begin(); it != theCandidates.end(); ++it)
-  {
-    double mindist = mindistance(it->first, it->second, thePreviousChoises);
-    if (bestdist < 0 || mindist < bestdist)
-    {
-      bestdist = mindist;
-      best = it;
-    }
-  }
-  return best;
-}
-
-// ----------------------------------------------------------------------
-/*!
- * \brief Choose a label location closest to the bounding box
- *
- * \param theCandidates The list of candidates
- * \param theType The extremum type
- */
-// ----------------------------------------------------------------------
-
-ExtremaLocator::Coordinates::const_iterator ExtremaLocator::chooseClosestToBorder(
-    const Coordinates& theCandidates, Extremum theType)
-{
-  if (theCandidates.empty())
-    return theCandidates.end();
-
-  return theCandidates.begin();
-}
-
-// ----------------------------------------------------------------------
-/*!
- * \brief Remove candidates too close to the chosen point
- *
- * Note that the code erases only candidate coordinates and may
- * leave empty containers behind. This is necessary so that
- * any top level iterators will not become invalidated.
- *
- * \param theCandidates The candidates to clean up
- * \param thePoint The chosen point
- * \param theParam The chosen parameter
- * \param theContour The chosen contour value
- */
-// ----------------------------------------------------------------------
-
-void ExtremaLocator::removeCandidates(ExtremaCoordinates& theCandidates,
-                                      const XY& thePoint,
-                                      Extremum theType)
-{
-  for (ExtremaCoordinates::iterator pit = theCandidates.begin(); pit != theCandidates.end();)
-  {
-    const Extremum etype = pit->first;
-
-    for (Coordinates::iterator it = pit->second.begin(); it != pit->second.end();)
-    {
-      const double dist = distance(thePoint.first, thePoint.second, it->first, it->second);
-
-      bool erase = false;
-
-      if (etype != theType)
-        erase = (dist < itsMinDistanceToDifferent);
-      else
-        erase = (dist < itsMinDistanceToSame);
-
-      if (erase)
-        it = pit->second.erase(it);
-      else
-        ++it;
-    }
-    ++pit;
-  }
-}
-
 // ----------------------------------------------------------------------
 /*!
  * \brief Remove any empty subcontainers from the candidates
@@ -0,0 +1,275 @@
+// ======================================================================
+/*!
+ * \file
+ * \brief Implementation of class GeoJsonWriter
+ */
+// ======================================================================
+
+#include "GeoJsonWriter.h"
+
+#include <geos/geom/Coordinate.h>
+#include <geos/geom/Geometry.h>
+#include <geos/geom/LineString.h>
+#include <geos/geom/LinearRing.h>
+#include <geos/geom/Polygon.h>
+#include <newbase/NFmiGrid.h>
+#include <newbase/NFmiPoint.h>
+
+#include <cmath>
+#include <iomanip>
+#include <sstream>
+#include <stdexcept>
+
+using namespace std;
+using namespace geos::geom;
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Constructor
+ *
+ * \param theOutput The stream to write to
+ * \param thePrecision The number of decimals, negative for full precision
+ */
+// ----------------------------------------------------------------------
+
+GeoJsonWriter::GeoJsonWriter(ostream& theOutput, int thePrecision)
+    : itsOutput(theOutput), itsPrecision(thePrecision)
+{
+  if (itsPrecision >= 0)
+    itsScale = pow(10.0, itsPrecision);
+  itsOutput << "{\"type\":\"FeatureCollection\",\"features\":[";
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Write a feature
+ *
+ * Empty geometries and geometries which vanish when quantized
+ * are not written.
+ *
+ * \param theGeometry The geometry in grid coordinates
+ * \param theGrid The grid used to convert the coordinates
+ * \param theProperties The JSON object of the feature properties
+ */
+// ----------------------------------------------------------------------
+
+void GeoJsonWriter::feature(const Geometry& theGeometry,
+                            const NFmiGrid& theGrid,
+                            const string& theProperties)
+{
+  if (isFinished)
+    throw runtime_error("GeoJsonWriter: cannot add features after finish");
+
+  itsGrid = &theGrid;
+  itsText.clear();
+  if (!geometry(theGeometry))
+    return;
+
+  if (!itsFirstFeature)
+    itsOutput << ',';
+  itsFirstFeature = false;
+
+  itsOutput << "{\"type\":\"Feature\",\"properties\":" << theProperties
+            << ",\"geometry\":" << itsText << '}';
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief End the feature collection
+ */
+// ----------------------------------------------------------------------
+
+void GeoJsonWriter::finish()
+{
+  if (!isFinished)
+    itsOutput << "]}\n";
+  isFinished = true;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Append text to the geometry being written
+ */
+// ----------------------------------------------------------------------
+
+void GeoJsonWriter::write(const string& theText)
+{
+  itsText += theText;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Write the coordinates of a line or ring
+ *
+ * \param theLine The line in grid coordinates
+ * \param theMinimum The minimum number of distinct points required
+ * \return False if the line was degenerate and nothing was written
+ */
+// ----------------------------------------------------------------------
+
+bool GeoJsonWriter::points(const LineString& theLine, std::size_t theMinimum)
+{
+  Points pts;
+  const std::size_t n = theLine.getNumPoints();
+  pts.reserve(n);
+  for (std::size_t i = 0; i < n; i++)
+  {
+    const Coordinate& c = theLine.getCoordinateN(static_cast<int>(i));
+    const NFmiPoint latlon = itsGrid->GridToLatLon(NFmiPoint(c.x, c.y));
+    double x = latlon.X();
+    double y = latlon.Y();
+    if (itsPrecision >= 0)
+    {
+      x = round(x * itsScale) / itsScale;
+      y = round(y * itsScale) / itsScale;
+      if (!pts.empty() && pts.back().first == x && pts.back().second == y)
+        continue;
+    }
+    pts.push_back(make_pair(x, y));
+  }
+
+  if (pts.size() < theMinimum)
+    return false;
+
+  ostringstream out;
+  if (itsPrecision >= 0)
+    out << fixed << setprecision(itsPrecision);
+  else
+    out << setprecision(10);
+
+  out << '[';
+  for (std::size_t i = 0; i < pts.size(); i++)
+  {
+    if (i > 0)
+      out << ',';
+    out << '[' << pts[i].first << ',' << pts[i].second << ']';
+  }
+  out << ']';
+  write(out.str());
+  return true;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Write the rings of a polygon
+ *
+ * Degenerate holes are left out, a degenerate exterior ring
+ * discards the whole polygon.
+ */
+// ----------------------------------------------------------------------
+
+bool GeoJsonWriter::polygon(const Polygon& thePolygon)
+{
+  const std::size_t start = itsText.size();
+  write("[");
+  if (!points(*thePolygon.getExteriorRing(), 4))
+  {
+    itsText.resize(start);
+    return false;
+  }
+  for (std::size_t i = 0; i < thePolygon.getNumInteriorRing(); i++)
+  {
+    const std::size_t pos = itsText.size();
+    write(",");
+    if (!points(*thePolygon.getInteriorRingN(i), 4))
+      itsText.resize(pos);
+  }
+  write("]");
+  return true;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Write a geometry object
+ *
+ * Points are ignored, just like when contours are converted to paths.
+ *
+ * \return False if nothing was written
+ */
+// ----------------------------------------------------------------------
+
+bool GeoJsonWriter::geometry(const Geometry& theGeometry)
+{
+  if (theGeometry.isEmpty())
+    return false;
+
+  const std::size_t start = itsText.size();
+  bool ok = false;
+
+  switch (theGeometry.getGeometryTypeId())
+  {
+    case GEOS_LINESTRING:
+    case GEOS_LINEARRING:
+    {
+      write("{\"type\":\"LineString\",\"coordinates\":");
+      ok = points(static_cast<const LineString&>(theGeometry), 2);
+      break;
+    }
+    case GEOS_POLYGON:
+    {
+      write("{\"type\":\"Polygon\",\"coordinates\":");
+      ok = polygon(static_cast<const Polygon&>(theGeometry));
+      break;
+    }
+    case GEOS_MULTILINESTRING:
+    {
+      write("{\"type\":\"MultiLineString\",\"coordinates\":[");
+      for (std::size_t i = 0; i < theGeometry.getNumGeometries(); i++)
+      {
+        const std::size_t pos = itsText.size();
+        if (ok)
+          write(",");
+        if (points(static_cast<const LineString&>(*theGeometry.getGeometryN(i)), 2))
+          ok = true;
+        else
+          itsText.resize(pos);
+      }
+      write("]");
+      break;
+    }
+    case GEOS_MULTIPOLYGON:
+    {
+      write("{\"type\":\"MultiPolygon\",\"coordinates\":[");
+      for (std::size_t i = 0; i < theGeometry.getNumGeometries(); i++)
+      {
+        const std::size_t pos = itsText.size();
+        if (ok)
+          write(",");
+        if (polygon(static_cast<const Polygon&>(*theGeometry.getGeometryN(i))))
+          ok = true;
+        else
+          itsText.resize(pos);
+      }
+      write("]");
+      break;
+    }
+    case GEOS_GEOMETRYCOLLECTION:
+    {
+      write("{\"type\":\"GeometryCollection\",\"geometries\":[");
+      for (std::size_t i = 0; i < theGeometry.getNumGeometries(); i++)
+      {
+        const std::size_t pos = itsText.size();
+        if (ok)
+          write(",");
+        if (geometry(*theGeometry.getGeometryN(i)))
+          ok = true;
+        else
+          itsText.resize(pos);
+      }
+      write("]");
+      break;
+    }
+    default:
+      break;
+  }
+
+  if (!ok)
+  {
+    itsText.resize(start);
+    return false;
+  }
+  write("}");
+  return true;
+}
+
+// ======================================================================
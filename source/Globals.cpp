@@ -37,8 +37,19 @@ using namespace std;
 Globals::Globals()
     : verbose(false),
       force(false),
+      threads(1),
+      writers(0),
+      scriptjobs(1),
+      followinterval(0),
+      followtimeout(0),
+      manifest(false),
+      scripthash(0),
       cmdline_querydata(),
       cmdline_files(),
+      shard(0),
+      shards(0),
+      shardimages(0),
+      jobfile(),
       datapath(Optional<string>("qdcontour::querydata_path", ".")),
       mapspath(Optional<string>("qdcontour::maps_path", ".")),
       savepath("."),
@@ -71,12 +82,21 @@ Globals::Globals()
       foreground(),
       mask(),
       combine(),
+      targets(),
+      vectorprecision(-1),
+      autoresolution(0),
+      contourstripes(0),
+      prefetch(0),
+      filltiles(0),
+      reuseframes(false),
       combinex(0),
       combiney(0),
       combinerule("Over"),
       combinefactor(1),
       erase("transparent"),
       fillrule("Atop"),
+      contourfillmode("vector"),
+      contourengine("tron"),
       strokerule("Atop"),
       contourlinewidth(1),
       arrowlinewidth(CAIRO_NORMAL_LINE_WIDTH),
@@ -101,8 +121,8 @@ Globals::Globals()
       windarrowsxydy(-1),
       arrowpoints(),
       queryfilelist(),
+      queryfilestamp(),
       queryfilenames(),
-      queryinfo(),
       querydatalevel(-1),
       timesteps(24),
       timestep(0),
@@ -136,6 +156,7 @@ Globals::Globals()
       lowpressurerule("Over"),
       lowpressurefactor(1),
       lowpressuremaximum(1020),
+      pressureradius(0),
       pressurelocator(),
       labellocator(),
       symbollocator(),
@@ -150,6 +171,10 @@ Globals::Globals()
       itsImageCache(),
       itsImageCacheOn(true),
       itsArrowCache(),
+      itsShapeCache(),
+      itsTextCache(),
+      itsTextCacheOn(false),
+      itsQueryDataPool(),
       graticulecolor(""),
       graticulelon1(),
       graticulelat1(),
@@ -187,6 +212,23 @@ const ImagineXr_or_NFmiImage &Globals::getImage(const string &theFile) const
   return itsImageCache.getImage(theFile);
 }
 
+// ----------------------------------------------------------------------
+/*!
+ * \brief Release images once no image is being rendered
+ *
+ * All images are released if the image cache is off, otherwise
+ * only the least recently used ones exceeding the memory limit.
+ */
+// ----------------------------------------------------------------------
+
+void Globals::releaseImages() const
+{
+  if (!itsImageCacheOn)
+    itsImageCache.clear();
+  else
+    itsImageCache.release();
+}
+
 // ----------------------------------------------------------------------
 /*!
  * \brief Set image modes
@@ -218,10 +260,21 @@ void Globals::setImageModes(Imagine::NFmiImage &theImage) const
 
 std::shared_ptr<NFmiArea> Globals::createArea() const
 {
-  if (projection.empty())
+  return createArea(projection);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Return the area object for the given projection
+ */
+// ----------------------------------------------------------------------
+
+std::shared_ptr<NFmiArea> Globals::createArea(const std::string &theProjection)
+{
+  if (theProjection.empty())
     throw runtime_error("A projection specification is required");
 
-  return NFmiAreaFactory::Create(projection);
+  return NFmiAreaFactory::Create(theProjection);
 }
 
 // ----------------------------------------------------------------------
@@ -9,6 +9,10 @@
 
 #include "UnitsConverter.h"
 
+#include <map>
+#include <mutex>
+#include <utility>
+
 namespace GramTools
 {
 // size of the spot at the origin
@@ -29,9 +33,18 @@ const float barb_angle = 45.f / 180.f * 3.14159265358979323846f;
 // Flag side length
 const float flag_length = 7;
 
+namespace
+{
+// Built glyphs by speed in knots and mirroring for the southern hemisphere
+typedef std::map<std::pair<int, bool>, Imagine::NFmiPath> glyph_cache;
+
+std::mutex glyph_mutex;
+glyph_cache flag_glyphs;
+glyph_cache line_glyphs;
+
 // ----------------------------------------------------------------------
 /*!
- * \brief Return meteorological arrow flags for the given wind speed
+ * \brief Convert the speed to rounded knots
  *
  * Note: the speed is converted to knots and then rounded so that
  *       if the user prints the values rounded to integers next
@@ -39,12 +52,20 @@ const float flag_length = 7;
  */
 // ----------------------------------------------------------------------
 
-Imagine::NFmiPath metarrowflags(float theSpeed)
+int knots(float theSpeed)
 {
-  Imagine::NFmiPath path;
+  return static_cast<int>(round(theSpeed / 0.5144444444f));
+}
 
-  if (theSpeed == kFloatMissing)
-    return path;
+// ----------------------------------------------------------------------
+/*!
+ * \brief Build meteorological arrow flags for the given speed in knots
+ */
+// ----------------------------------------------------------------------
+
+Imagine::NFmiPath build_metarrowflags(int speed)
+{
+  Imagine::NFmiPath path;
 
   // Mark the spot with a small dot
   path.MoveTo(spot_size, spot_size);
@@ -53,9 +74,6 @@ Imagine::NFmiPath metarrowflags(float theSpeed)
   path.LineTo(-spot_size, spot_size);
   path.LineTo(spot_size, spot_size);
 
-  // The actual speed in knots
-  const int speed = static_cast<int>(round(theSpeed / 0.5144444444f));
-
   // Handle bad cases
   if (speed < 50)
     return path;
@@ -85,25 +103,14 @@ Imagine::NFmiPath metarrowflags(float theSpeed)
 
 // ----------------------------------------------------------------------
 /*!
- * \brief Return meteorological arrow lines for the given wind speed
- *
- * Note: the speed is converted to knots and then rounded so that
- *       if the user prints the values rounded to integers next
- *       to the arrow, the value and the arrow will match
+ * \brief Build meteorological arrow lines for the given speed in knots
  */
 // ----------------------------------------------------------------------
 
-Imagine::NFmiPath metarrowlines(float theSpeed)
+Imagine::NFmiPath build_metarrowlines(int speed)
 {
   Imagine::NFmiPath path;
 
-  // Handle bad cases
-  if (theSpeed == kFloatMissing)
-    return path;
-
-  // The actual speed in knots
-  const int speed = static_cast<int>(round(theSpeed / 0.5144444444f));
-
   // Handle bad cases
   if (speed < 5)
     return path;
@@ -159,32 +166,86 @@ Imagine::NFmiPath metarrowlines(float theSpeed)
   return path;
 }
 
+// ----------------------------------------------------------------------
+/*!
+ * \brief Return a glyph from the cache, building it if necessary
+ *
+ * Arrows are rendered for thousands of points per image, but there
+ * are only a few distinct glyphs since the speed is rounded to knots.
+ */
+// ----------------------------------------------------------------------
+
+template <typename Builder>
+Imagine::NFmiPath cached_glyph(glyph_cache& theCache,
+                               float theSpeed,
+                               bool theMirror,
+                               Builder theBuilder)
+{
+  if (theSpeed == kFloatMissing)
+    return Imagine::NFmiPath();
+
+  const auto key = std::make_pair(knots(theSpeed), theMirror);
+
+  std::lock_guard<std::mutex> lock(glyph_mutex);
+  auto it = theCache.find(key);
+  if (it == theCache.end())
+  {
+    Imagine::NFmiPath path = theBuilder(key.first);
+    if (theMirror)
+      path.Scale(-1, 1);
+    it = theCache.insert(glyph_cache::value_type(key, path)).first;
+  }
+  return it->second;
+}
+
+}  // namespace
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Return meteorological arrow flags for the given wind speed
+ */
+// ----------------------------------------------------------------------
+
+Imagine::NFmiPath metarrowflags(float theSpeed)
+{
+  return cached_glyph(flag_glyphs, theSpeed, false, build_metarrowflags);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Return meteorological arrow lines for the given wind speed
+ */
+// ----------------------------------------------------------------------
+
+Imagine::NFmiPath metarrowlines(float theSpeed)
+{
+  return cached_glyph(line_glyphs, theSpeed, false, build_metarrowlines);
+}
+
 // ----------------------------------------------------------------------
 /*!
  * \brief Return meteorological arrow flags for the given wind speed
+ *
+ * The arrow is mirrored on the southern hemisphere.
  */
 // ----------------------------------------------------------------------
 
 Imagine::NFmiPath metarrowflags(float theSpeed, const NFmiPoint& theLatLon)
 {
-  Imagine::NFmiPath path = metarrowflags(theSpeed);
-  if (theLatLon.Y() < 0)
-    path.Scale(-1, 1);
-  return path;
+  return cached_glyph(flag_glyphs, theSpeed, theLatLon.Y() < 0, build_metarrowflags);
 }
 
 // ----------------------------------------------------------------------
 /*!
  * \brief Return meteorological arrow lines for the given wind speed
+ *
+ * The arrow is mirrored on the southern hemisphere.
  */
 // ----------------------------------------------------------------------
 
 Imagine::NFmiPath metarrowlines(float theSpeed, const NFmiPoint& theLatLon)
 {
-  Imagine::NFmiPath path = metarrowlines(theSpeed);
-  if (theLatLon.Y() < 0)
-    path.Scale(-1, 1);
-  return path;
+  return cached_glyph(line_glyphs, theSpeed, theLatLon.Y() < 0, build_metarrowlines);
 }
 
 }  // namespace GramTools
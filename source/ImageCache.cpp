@@ -6,11 +6,29 @@
 
 #include "ImageCache.h"
 
+#include <stdexcept>
+
 //#include <iostream>
 
 using namespace Imagine;
 using namespace std;
 
+namespace
+{
+// ----------------------------------------------------------------------
+/*!
+ * \brief Estimate the memory used by a decoded image
+ */
+// ----------------------------------------------------------------------
+
+std::size_t image_bytes(const ImagineXr_or_NFmiImage& theImage)
+{
+  return static_cast<std::size_t>(theImage.Width()) * theImage.Height() *
+         sizeof(NFmiColorTools::Color);
+}
+
+}  // namespace
+
 // ----------------------------------------------------------------------
 /*!
  * \brief Clear the cache
@@ -19,26 +37,128 @@ using namespace std;
 
 void ImageCache::clear() const
 {
+  std::lock_guard<std::mutex> lock(itsMutex);
   itsCache.clear();
+  itsList.clear();
+  itsBytes = 0;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Set the maximum number of bytes the images may use
+ *
+ * Value 0 means no limit. The limit is enforced by release().
+ */
+// ----------------------------------------------------------------------
+
+void ImageCache::maxbytes(std::size_t theMaxBytes)
+{
+  std::lock_guard<std::mutex> lock(itsMutex);
+  itsMaxBytes = theMaxBytes;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Return the number of bytes used by the images
+ */
+// ----------------------------------------------------------------------
+
+std::size_t ImageCache::bytes() const
+{
+  std::lock_guard<std::mutex> lock(itsMutex);
+  return itsBytes;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Discard the least recently used images exceeding the limit
+ *
+ * This must not be called while references returned by getImage()
+ * are still in use, for example while other threads are rendering.
+ * The most recently used image is always kept.
+ */
+// ----------------------------------------------------------------------
+
+void ImageCache::release() const
+{
+  std::lock_guard<std::mutex> lock(itsMutex);
+  if (itsMaxBytes == 0)
+    return;
+
+  while (itsBytes > itsMaxBytes && itsList.size() > 1 && itsList.back().second)
+  {
+    itsBytes -= image_bytes(*itsList.back().second);
+    itsCache.erase(itsList.back().first);
+    itsList.pop_back();
+  }
 }
 
 // ----------------------------------------------------------------------
 /*!
  * \brief Find image from cache (or read it if necessary)
+ *
+ * The image is decoded without holding the lock, hence other images
+ * can be found or decoded meanwhile. Threads requesting an image
+ * which is being decoded wait for it instead of decoding it again.
  */
 // ----------------------------------------------------------------------
 
 const ImagineXr_or_NFmiImage& ImageCache::getImage(const string& theFile) const
 {
-  storage_type::const_iterator it = itsCache.find(theFile);
-  if (it != itsCache.end())
-    return it->second;
+  std::unique_lock<std::mutex> lock(itsMutex);
+  for (;;)
+  {
+    storage_type::const_iterator it = itsCache.find(theFile);
+    if (it == itsCache.end())
+      break;
+    if (it->second->second)
+    {
+      itsList.splice(itsList.begin(), itsList, it->second);
+      return *it->second->second;
+    }
+    itsDecoded.wait(lock);
+  }
+
+  // Reserve the entry, then decode
+
+  itsList.emplace_front(theFile, nullptr);
+  itsCache.insert(storage_type::value_type(theFile, itsList.begin()));
+  lock.unlock();
 
-  pair<storage_type::const_iterator, bool> ret =
-      itsCache.insert(storage_type::value_type(theFile, ImagineXr_or_NFmiImage(theFile)));
+  std::unique_ptr<ImagineXr_or_NFmiImage> image;
+  try
+  {
+    image.reset(new ImagineXr_or_NFmiImage(theFile));
+  }
+  catch (...)
+  {
+    lock.lock();
+    storage_type::iterator it = itsCache.find(theFile);
+    if (it != itsCache.end() && !it->second->second)
+    {
+      itsList.erase(it->second);
+      itsCache.erase(it);
+    }
+    itsDecoded.notify_all();
+    throw;
+  }
 
-  if (ret.second)
-    return ret.first->second;
+  // The cache may have been cleared meanwhile
 
-  throw runtime_error("ImageCache failed to store '" + theFile + "'");
+  lock.lock();
+  storage_type::iterator it = itsCache.find(theFile);
+  if (it == itsCache.end())
+  {
+    itsList.emplace_front(theFile, nullptr);
+    it = itsCache.insert(storage_type::value_type(theFile, itsList.begin())).first;
+  }
+  if (!it->second->second)
+  {
+    itsBytes += image_bytes(*image);
+    it->second->second = std::move(image);
+  }
+  itsDecoded.notify_all();
+  return *it->second->second;
 }
+
+// ======================================================================
@@ -0,0 +1,619 @@
+// ======================================================================
+/*!
+ * \file
+ * \brief Implementation of namespace IsobandTools
+ */
+// ======================================================================
+/*!
+ * \namespace IsobandTools
+ *
+ * \brief Contour fills of many bands in one pass over the grid
+ *
+ * Each grid cell is classified once against the sorted limits of the
+ * bands, and the part of the cell inside each band it intersects is
+ * clipped out as a polygon of the cell corners and of the points where
+ * the cell edges cross the limits of the band. A saddle cell, whose
+ * corners are alternately on different sides of a limit, is split into
+ * four triangles around the mean value at its centre instead.
+ *
+ * A band contains the values not below its lower limit and below its
+ * upper limit, missing limits are open. Cells with a missing value in
+ * any corner are not contoured.
+ *
+ * The polygons of adjacent cells are merged by keeping only the
+ * segments along the limits and the cell edges on the border of the
+ * valid cells, and by joining the segments into rings at their end
+ * points. The points are identified by the grid edge and the limit
+ * they are on, hence the cells sharing an edge calculate the same
+ * points and the segments are joined exactly. The rings are oriented
+ * so that the band is on the left, and the holes are hence reversed.
+ *
+ * Blocks of rows are classified in parallel, and so are the rings of
+ * the bands joined.
+ */
+// ======================================================================
+
+#include "IsobandTools.h"
+#include "TaskScheduler.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <numeric>
+#include <stdexcept>
+
+namespace IsobandTools
+{
+namespace
+{
+typedef DataMatrixAdapter::size_type size_type;
+typedef std::uint64_t PointId;
+
+// The kinds of points are in the highest bits of their identifiers
+
+const PointId node_point = 0;
+const PointId edge_point = PointId(1) << 60;
+const PointId center_point = PointId(2) << 60;
+const PointId spoke_point = PointId(3) << 60;
+
+// Minimum rows of cells per parallel block
+
+const size_type block_rows = 32;
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief A band with open limits replaced by infinities
+ */
+// ----------------------------------------------------------------------
+
+struct Limits
+{
+  float lo;
+  float hi;
+  std::size_t loindex;  // index of the limit among all the limits
+  std::size_t hiindex;
+};
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief A point of a clipped polygon
+ */
+// ----------------------------------------------------------------------
+
+struct Point
+{
+  PointId id;
+  double x;
+  double y;
+  unsigned int edges;  // bit mask of the edges of the polygon the point is on
+};
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief A corner of a cell or of a triangle
+ */
+// ----------------------------------------------------------------------
+
+struct Vertex
+{
+  Point point;
+  float value;
+};
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief An edge of a cell or of a triangle
+ *
+ * The crossings are always interpolated from the canonical end point
+ * so that all cells sharing the edge get identical coordinates.
+ */
+// ----------------------------------------------------------------------
+
+struct Edge
+{
+  const Vertex *a;  // the canonical end points
+  const Vertex *b;
+  PointId id;   // identifier of the crossing of the first limit
+  bool border;  // the edge is on the border of the valid cells
+};
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief A directed boundary segment of a band
+ */
+// ----------------------------------------------------------------------
+
+struct Segment
+{
+  PointId from;
+  PointId to;
+  double x;  // the coordinates of the start point
+  double y;
+};
+
+typedef std::vector<Segment> Segments;
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Test whether a value is valid
+ */
+// ----------------------------------------------------------------------
+
+inline bool valid(float theValue)
+{
+  return theValue != kFloatMissing && !std::isnan(theValue);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Classify a value as below, inside or above the band
+ */
+// ----------------------------------------------------------------------
+
+inline int classify(float theValue, const Limits &theLimits)
+{
+  if (theValue < theLimits.lo)
+    return 0;
+  if (theValue < theLimits.hi)
+    return 1;
+  return 2;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Test whether the corners of a cell are a saddle for the limit
+ */
+// ----------------------------------------------------------------------
+
+inline bool saddle(const float *theValues, float theLimit)
+{
+  const bool below0 = (theValues[0] < theLimit);
+  return ((theValues[1] < theLimit) != below0 && (theValues[2] < theLimit) == below0 &&
+          (theValues[3] < theLimit) != below0);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief The point where an edge crosses a limit
+ *
+ * A corner equal to the limit is treated as if it were slightly above
+ * it, hence the crossing is a point of the edge distinct from the
+ * corner even if they coincide. The parts of an edge inside a band
+ * then depend only on the values at the ends of the edge, and the
+ * cells sharing the edge always agree on them.
+ */
+// ----------------------------------------------------------------------
+
+Point crossing(const Edge &theEdge, float theLimit, std::size_t theIndex, unsigned int theBit)
+{
+  const Vertex &a = *theEdge.a;
+  const Vertex &b = *theEdge.b;
+
+  const double t =
+      (static_cast<double>(theLimit) - a.value) / (static_cast<double>(b.value) - a.value);
+  Point point;
+  point.id = theEdge.id + theIndex;
+  point.x = a.point.x + t * (b.point.x - a.point.x);
+  point.y = a.point.y + t * (b.point.y - a.point.y);
+  point.edges = theBit;
+  return point;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Clip a convex polygon to a band and collect its boundary
+ *
+ * Vertex k is connected to vertex k+1 by edge k. Segments along the
+ * edges are collected only if the edge is on the border, the rest
+ * are cancelled by the same segment reversed in the adjacent cell.
+ */
+// ----------------------------------------------------------------------
+
+void clip(const Vertex *const *theVertices,
+          const Edge *theEdges,
+          std::size_t theCount,
+          const Limits &theLimits,
+          Segments &theSegments)
+{
+  Point points[12];
+  std::size_t n = 0;
+
+  auto add = [&](const Point &thePoint)
+  {
+    if (n == 0 || points[n - 1].id != thePoint.id)
+      points[n++] = thePoint;
+  };
+
+  for (std::size_t k = 0; k < theCount; k++)
+  {
+    const Vertex &p = *theVertices[k];
+    const Vertex &q = *theVertices[(k + 1) % theCount];
+    const Edge &edge = theEdges[k];
+    const unsigned int bit = 1u << k;
+    const int cp = classify(p.value, theLimits);
+    const int cq = classify(q.value, theLimits);
+
+    if (cp == 1)
+      add(p.point);
+
+    if (cp < cq)
+    {
+      if (cp == 0)
+        add(crossing(edge, theLimits.lo, theLimits.loindex, bit));
+      if (cq == 2)
+        add(crossing(edge, theLimits.hi, theLimits.hiindex, bit));
+    }
+    else if (cp > cq)
+    {
+      if (cp == 2)
+        add(crossing(edge, theLimits.hi, theLimits.hiindex, bit));
+      if (cq == 0)
+        add(crossing(edge, theLimits.lo, theLimits.loindex, bit));
+    }
+  }
+
+  if (n > 1 && points[n - 1].id == points[0].id)
+    --n;
+
+  // Degenerate polygons have no area
+
+  if (n < 3)
+    return;
+
+  for (std::size_t k = 0; k < n; k++)
+  {
+    const Point &p = points[k];
+    const Point &q = points[(k + 1) % n];
+    const unsigned int common = (p.edges & q.edges);
+    if (common != 0)
+    {
+      std::size_t e = 0;
+      while ((common & (1u << e)) == 0)
+        ++e;
+      if (!theEdges[e].border)
+        continue;
+    }
+    theSegments.push_back(Segment{p.id, q.id, p.x, p.y});
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Join the boundary segments of a band into rings
+ */
+// ----------------------------------------------------------------------
+
+Imagine::NFmiPath join(Segments &theSegments)
+{
+  Imagine::NFmiPath path;
+
+  std::sort(theSegments.begin(),
+            theSegments.end(),
+            [](const Segment &a, const Segment &b) { return a.from < b.from; });
+
+  const std::size_t n = theSegments.size();
+  std::vector<bool> used(n, false);
+
+  auto next = [&](PointId theId) -> std::size_t
+  {
+    auto it = std::lower_bound(theSegments.begin(),
+                               theSegments.end(),
+                               theId,
+                               [](const Segment &s, PointId id) { return s.from < id; });
+    for (std::size_t k = it - theSegments.begin(); k < n && theSegments[k].from == theId; k++)
+      if (!used[k])
+        return k;
+    return n;
+  };
+
+  for (std::size_t s = 0; s < n; s++)
+  {
+    if (used[s])
+      continue;
+    const PointId start = theSegments[s].from;
+    path.MoveTo(theSegments[s].x, theSegments[s].y);
+    used[s] = true;
+
+    // Rings touching at a point may be joined either way
+
+    for (std::size_t k = s; theSegments[k].to != start;)
+    {
+      k = next(theSegments[k].to);
+      if (k == n)
+        break;
+      used[k] = true;
+      path.LineTo(theSegments[k].x, theSegments[k].y);
+    }
+    path.CloseLineTo();
+  }
+
+  return path;
+}
+
+}  // namespace
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Test whether a band can be contoured
+ *
+ * A band with both limits missing contains only the missing values,
+ * which cannot be interpolated.
+ */
+// ----------------------------------------------------------------------
+
+bool contourable(const Band &theBand)
+{
+  return (theBand.first != kFloatMissing || theBand.second != kFloatMissing);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Calculate the fills of all the bands
+ *
+ * \param theData The values to contour
+ * \param theBands The bands, which must be contourable
+ * \param theThreads The maximum number of threads to use
+ * \return The fills in the order of the bands in grid coordinates
+ */
+// ----------------------------------------------------------------------
+
+std::vector<Imagine::NFmiPath> fills(const DataMatrixAdapter &theData,
+                                     const std::vector<Band> &theBands,
+                                     unsigned int theThreads)
+{
+  const std::size_t nbands = theBands.size();
+  const size_type width = theData.width();
+  const size_type height = theData.height();
+  if (width < 2 || height < 2 || nbands == 0)
+    return std::vector<Imagine::NFmiPath>(nbands);
+
+  // The sorted unique limits identify the crossings
+
+  std::vector<float> breaks;
+  for (const Band &band : theBands)
+  {
+    if (!contourable(band))
+      throw std::runtime_error("IsobandTools: a band with no limits cannot be contoured");
+    if (band.first != kFloatMissing)
+      breaks.push_back(band.first);
+    if (band.second != kFloatMissing)
+      breaks.push_back(band.second);
+  }
+  std::sort(breaks.begin(), breaks.end());
+  breaks.erase(std::unique(breaks.begin(), breaks.end()), breaks.end());
+  const std::size_t nbreaks = breaks.size();
+
+  auto index = [&breaks](float theLimit) -> std::size_t
+  { return std::lower_bound(breaks.begin(), breaks.end(), theLimit) - breaks.begin(); };
+
+  const float inf = std::numeric_limits<float>::infinity();
+  std::vector<Limits> limits(nbands);
+  for (std::size_t b = 0; b < nbands; b++)
+  {
+    const Band &band = theBands[b];
+    Limits &lim = limits[b];
+    lim.lo = (band.first == kFloatMissing ? -inf : band.first);
+    lim.hi = (band.second == kFloatMissing ? inf : band.second);
+    lim.loindex = (band.first == kFloatMissing ? 0 : index(band.first));
+    lim.hiindex = (band.second == kFloatMissing ? 0 : index(band.second));
+  }
+
+  // The bands in the order of the lower limits. If the upper limits
+  // are then in order too, the bands intersecting a cell are found
+  // by bisection.
+
+  std::vector<std::size_t> order(nbands);
+  std::iota(order.begin(), order.end(), 0);
+  std::stable_sort(order.begin(),
+                   order.end(),
+                   [&limits](std::size_t a, std::size_t b) { return limits[a].lo < limits[b].lo; });
+
+  bool ordered = true;
+  for (std::size_t k = 1; k < nbands; k++)
+    ordered &= (limits[order[k - 1]].hi <= limits[order[k]].hi);
+
+  // Cells with a missing corner
+
+  const size_type ncols = width - 1;
+  const size_type nrows = height - 1;
+  std::vector<char> cells(ncols * nrows);
+
+  const size_type nblocks =
+      std::max<size_type>(1, std::min<size_type>(theThreads, nrows / block_rows));
+
+  TaskScheduler::run(nblocks,
+                     theThreads,
+                     [&](std::size_t theBlock)
+                     {
+                       const size_type j1 = theBlock * nrows / nblocks;
+                       const size_type j2 = (theBlock + 1) * nrows / nblocks;
+                       for (size_type j = j1; j < j2; j++)
+                         for (size_type i = 0; i < ncols; i++)
+                           cells[j * ncols + i] =
+                               (valid(theData(i, j)) && valid(theData(i + 1, j)) &&
+                                valid(theData(i, j + 1)) && valid(theData(i + 1, j + 1)));
+                     });
+
+  auto inside = [&](size_type i, size_type j) -> bool { return cells[j * ncols + i] != 0; };
+
+  // Classify the blocks of rows
+
+  std::vector<std::vector<Segments> > blocks(nblocks, std::vector<Segments>(nbands));
+
+  TaskScheduler::run(
+      nblocks,
+      theThreads,
+      [&](std::size_t theBlock)
+      {
+        std::vector<Segments> &output = blocks[theBlock];
+        const size_type j1 = theBlock * nrows / nblocks;
+        const size_type j2 = (theBlock + 1) * nrows / nblocks;
+
+        Vertex corners[4];
+        Edge edges[4];
+        for (int k = 0; k < 4; k++)
+          corners[k].point.edges = (1u << k) | (1u << ((k + 3) % 4));
+
+        // The canonical direction of the top and left edges is reversed
+
+        edges[0].a = &corners[0];
+        edges[0].b = &corners[1];
+        edges[1].a = &corners[1];
+        edges[1].b = &corners[2];
+        edges[2].a = &corners[3];
+        edges[2].b = &corners[2];
+        edges[3].a = &corners[0];
+        edges[3].b = &corners[3];
+
+        const Vertex *const quad[4] = {&corners[0], &corners[1], &corners[2], &corners[3]};
+
+        // Triangle k of a split cell has corners k and k+1 and the centre.
+        // The canonical direction of the cell edges is kept.
+
+        Vertex center;
+        center.point.edges = 6;
+        Vertex triangles[4][2];
+        Edge sides[4][3];
+        const Vertex *vertices[4][3];
+        for (int k = 0; k < 4; k++)
+        {
+          Vertex *triangle = triangles[k];
+          triangle[0].point.edges = 5;
+          triangle[1].point.edges = 3;
+          vertices[k][0] = &triangle[0];
+          vertices[k][1] = &triangle[1];
+          vertices[k][2] = &center;
+          const bool reversed = (k >= 2);
+          sides[k][0].a = (reversed ? &triangle[1] : &triangle[0]);
+          sides[k][0].b = (reversed ? &triangle[0] : &triangle[1]);
+          sides[k][1].a = &triangle[1];
+          sides[k][1].b = &center;
+          sides[k][1].border = false;
+          sides[k][2].a = &triangle[0];
+          sides[k][2].b = &center;
+          sides[k][2].border = false;
+        }
+
+        for (size_type j = j1; j < j2; j++)
+          for (size_type i = 0; i < ncols; i++)
+          {
+            if (!inside(i, j))
+              continue;
+
+            const size_type ii[4] = {i, i + 1, i + 1, i};
+            const size_type jj[4] = {j, j, j + 1, j + 1};
+            float values[4];
+            for (int k = 0; k < 4; k++)
+            {
+              Vertex &corner = corners[k];
+              corner.value = values[k] = theData(ii[k], jj[k]);
+              corner.point.id = node_point + jj[k] * width + ii[k];
+              corner.point.x = theData.x(ii[k], jj[k]);
+              corner.point.y = theData.y(ii[k], jj[k]);
+            }
+
+            edges[0].id = edge_point + 2 * (j * width + i) * nbreaks;
+            edges[1].id = edge_point + (2 * (j * width + i + 1) + 1) * nbreaks;
+            edges[2].id = edge_point + 2 * ((j + 1) * width + i) * nbreaks;
+            edges[3].id = edge_point + (2 * (j * width + i) + 1) * nbreaks;
+            edges[0].border = (j == 0 || !inside(i, j - 1));
+            edges[1].border = (i + 1 == ncols || !inside(i + 1, j));
+            edges[2].border = (j + 1 == nrows || !inside(i, j + 1));
+            edges[3].border = (i == 0 || !inside(i - 1, j));
+            const bool border =
+                (edges[0].border || edges[1].border || edges[2].border || edges[3].border);
+
+            const float minvalue = *std::min_element(values, values + 4);
+            const float maxvalue = *std::max_element(values, values + 4);
+
+            // A saddle for any limit splits the cell for all the bands,
+            // so that the bands on both sides of the limit agree on it
+
+            bool split = false;
+            for (auto it = std::upper_bound(breaks.begin(), breaks.end(), minvalue);
+                 !split && it != breaks.end() && *it <= maxvalue;
+                 ++it)
+              split = saddle(values, *it);
+
+            if (split)
+            {
+              const PointId cell = j * ncols + i;
+              center.value = 0.25f * (values[0] + values[1] + values[2] + values[3]);
+              center.point.id = center_point + cell;
+              center.point.x = 0.5 * (corners[0].point.x + corners[2].point.x);
+              center.point.y = 0.5 * (corners[0].point.y + corners[2].point.y);
+              for (int k = 0; k < 4; k++)
+              {
+                const int k1 = (k + 1) % 4;
+                triangles[k][0].value = corners[k].value;
+                triangles[k][0].point.id = corners[k].point.id;
+                triangles[k][0].point.x = corners[k].point.x;
+                triangles[k][0].point.y = corners[k].point.y;
+                triangles[k][1].value = corners[k1].value;
+                triangles[k][1].point.id = corners[k1].point.id;
+                triangles[k][1].point.x = corners[k1].point.x;
+                triangles[k][1].point.y = corners[k1].point.y;
+                sides[k][0].id = edges[k].id;
+                sides[k][0].border = edges[k].border;
+                sides[k][1].id = spoke_point + (4 * cell + k1) * nbreaks;
+                sides[k][2].id = spoke_point + (4 * cell + k) * nbreaks;
+              }
+            }
+
+            std::size_t first = 0;
+            if (ordered)
+              first = std::partition_point(order.begin(),
+                                           order.end(),
+                                           [&](std::size_t b)
+                                           { return limits[b].hi <= minvalue; }) -
+                      order.begin();
+
+            for (std::size_t pos = first; pos < nbands && limits[order[pos]].lo <= maxvalue; pos++)
+            {
+              const std::size_t b = order[pos];
+              const Limits &lim = limits[b];
+              if (lim.hi <= minvalue)
+                continue;
+
+              // The boundary of a band does not pass through the inner cells inside it
+
+              if (!border && lim.lo <= minvalue && maxvalue < lim.hi)
+                continue;
+
+              if (!split)
+                clip(quad, edges, 4, lim, output[b]);
+              else
+                for (int k = 0; k < 4; k++)
+                  clip(vertices[k], sides[k], 3, lim, output[b]);
+            }
+          }
+      });
+
+  // Join the rings of each band
+
+  std::vector<Segments> segments(nbands);
+  std::vector<Imagine::NFmiPath> paths(nbands);
+  TaskScheduler::run(nbands,
+                     theThreads,
+                     [&](std::size_t b)
+                     {
+                       Segments &all = segments[b];
+                       std::size_t count = 0;
+                       for (const auto &block : blocks)
+                         count += block[b].size();
+                       all.reserve(count);
+                       for (auto &block : blocks)
+                       {
+                         all.insert(all.end(), block[b].begin(), block[b].end());
+                         Segments().swap(block[b]);
+                       }
+                       paths[b] = join(all);
+                       Segments().swap(all);
+                     });
+
+  return paths;
+}
+
+}  // namespace IsobandTools
+
+// ======================================================================
@@ -46,14 +46,23 @@
  *
  * If there is no bounding box, we simply choose the first one
  * available.
+ *
+ * When a coherence tolerance has been set, the labels of the previous
+ * timestep are kept first, each one moved to the nearest candidate of
+ * the same contour within the tolerance. The greedy search is then
+ * run only for the candidates left over, which are mostly in regions
+ * where the contours have moved. This reduces flicker in animations.
  */
 // ======================================================================
 
 #include "LabelLocator.h"
 
+#include <algorithm>
 #include <cmath>
 #include <iostream>
 #include <stdexcept>
+#include <unordered_map>
+#include <vector>
 
 using namespace std;
 
@@ -95,6 +104,144 @@ double mindistance(double theX, double theY, const T& theCoords)
   return best;
 }
 
+// ----------------------------------------------------------------------
+/*!
+ * \brief Uniform grid index of the label candidates
+ *
+ * The cell size equals the largest of the minimum distances, hence
+ * all candidates too close to a chosen label are found from the cells
+ * adjacent to it. Erased candidates are only marked dead in the index,
+ * since their containers may be deleted afterwards.
+ */
+// ----------------------------------------------------------------------
+
+class CandidateIndex
+{
+ public:
+  CandidateIndex(LabelLocator::ParamCoordinates& theCandidates, double theCellSize)
+      : itsCellSize(std::max(1.0, theCellSize))
+  {
+    for (auto& pit : theCandidates)
+      for (auto& cit : pit.second)
+        for (auto it = cit.second.begin(); it != cit.second.end(); ++it)
+        {
+          Entry entry;
+          entry.param = pit.first;
+          entry.contour = cit.first;
+          entry.coords = &cit.second;
+          entry.it = it;
+          entry.alive = true;
+          itsCells[key(cell(it->second.first), cell(it->second.second))].push_back(entry);
+        }
+  }
+
+  // Find the nearest remaining candidate of the contour within the tolerance
+
+  bool nearest(const LabelLocator::XY& thePoint,
+               int theParam,
+               float theContour,
+               double theTolerance,
+               LabelLocator::Coordinates::iterator& theBest) const
+  {
+    const long long cx = cell(thePoint.first);
+    const long long cy = cell(thePoint.second);
+    const long long n = static_cast<long long>(std::ceil(theTolerance / itsCellSize));
+
+    double best = -1;
+    for (long long i = cx - n; i <= cx + n; i++)
+      for (long long j = cy - n; j <= cy + n; j++)
+      {
+        auto pos = itsCells.find(key(i, j));
+        if (pos == itsCells.end())
+          continue;
+
+        for (const auto& entry : pos->second)
+        {
+          if (!entry.alive || entry.param != theParam || entry.contour != theContour)
+            continue;
+
+          const LabelLocator::XY& xy = entry.it->second;
+          const double dist = distance(thePoint.first, thePoint.second, xy.first, xy.second);
+          if (dist <= theTolerance && (best < 0 || dist < best))
+          {
+            best = dist;
+            theBest = entry.it;
+          }
+        }
+      }
+    return (best >= 0);
+  }
+
+  // Erase all candidates too close to the chosen point
+
+  void remove(const LabelLocator::XY& thePoint,
+              int theParam,
+              float theContour,
+              double theSameValueDistance,
+              double theDifferentValueDistance,
+              double theDifferentParameterDistance)
+  {
+    const long long cx = cell(thePoint.first);
+    const long long cy = cell(thePoint.second);
+
+    for (long long i = cx - 1; i <= cx + 1; i++)
+      for (long long j = cy - 1; j <= cy + 1; j++)
+      {
+        auto pos = itsCells.find(key(i, j));
+        if (pos == itsCells.end())
+          continue;
+
+        for (auto& entry : pos->second)
+        {
+          if (!entry.alive)
+            continue;
+
+          const LabelLocator::XY& xy = entry.it->second;
+          const double dist = distance(thePoint.first, thePoint.second, xy.first, xy.second);
+
+          bool erase = false;
+
+          if (entry.param != theParam)
+            erase = (dist < theDifferentParameterDistance);
+          else if (entry.contour != theContour)
+            erase = (dist < theDifferentValueDistance);
+          else
+            erase = (dist < theSameValueDistance);
+
+          if (erase)
+          {
+            entry.coords->erase(entry.it);
+            entry.alive = false;
+          }
+        }
+      }
+  }
+
+ private:
+  struct Entry
+  {
+    int param;
+    float contour;
+    LabelLocator::Coordinates* coords;
+    LabelLocator::Coordinates::iterator it;
+    bool alive;
+  };
+
+  double itsCellSize;
+  std::unordered_map<unsigned long long, std::vector<Entry> > itsCells;
+
+  long long cell(int theValue) const
+  {
+    return static_cast<long long>(std::floor(theValue / itsCellSize));
+  }
+
+  static unsigned long long key(long long theX, long long theY)
+  {
+    return (static_cast<unsigned long long>(theX) << 32) ^
+           (static_cast<unsigned long long>(theY) & 0xffffffffULL);
+  }
+};
+
 }  // namespace
 
 // ----------------------------------------------------------------------
@@ -120,6 +267,7 @@ LabelLocator::LabelLocator()
       itsMinDistanceToSameValue(175),
       itsMinDistanceToDifferentValue(30),
       itsMinDistanceToDifferentParameter(30),
+      itsCoherence(0),
       itsActiveParameter(0),
       itsPreviousCoordinates(),
       itsCurrentCoordinates()
@@ -152,6 +300,24 @@ void LabelLocator::clear()
   itsCurrentCoordinates.clear();
 }
 
+// ----------------------------------------------------------------------
+/*!
+ * \brief Swap the earlier label locations with another locator
+ *
+ * The settings are not swapped. This lets one locator be used for
+ * several image sequences rendered alternately.
+ *
+ * \param theOther The locator holding the locations of another sequence
+ */
+// ----------------------------------------------------------------------
+
+void LabelLocator::swapHistory(LabelLocator& theOther)
+{
+  swap(itsActiveParameter, theOther.itsActiveParameter);
+  swap(itsPreviousCoordinates, theOther.itsPreviousCoordinates);
+  swap(itsCurrentCoordinates, theOther.itsCurrentCoordinates);
+}
+
 // ----------------------------------------------------------------------
 /*!
  * \brief Set the bounding box to which all label coordinates are clipped
@@ -239,6 +405,25 @@ void LabelLocator::minDistanceToDifferentParameter(float theDistance)
   itsMinDistanceToDifferentParameter = theDistance;
 }
 
+// ----------------------------------------------------------------------
+/*!
+ * \brief Set the distance within which previous labels are kept
+ *
+ * A previous label is kept if its contour still has a candidate
+ * within the given distance. Value 0 disables the feature.
+ *
+ * \param theTolerance The maximum distance in pixels
+ */
+// ----------------------------------------------------------------------
+
+void LabelLocator::coherence(float theTolerance)
+{
+  if (theTolerance < 0)
+    throw runtime_error("LabelLocator: Coherence tolerance cannot be negative");
+
+  itsCoherence = theTolerance;
+}
+
 // ----------------------------------------------------------------------
 /*!
  * \brief Set the parameter id of the active parameter
@@ -381,6 +566,38 @@ const LabelLocator::ParamCoordinates& LabelLocator::chooseLabels()
   ParamCoordinates choices;
   swap(itsCurrentCoordinates, candidates);
 
+  CandidateIndex index(candidates,
+                       std::max(itsMinDistanceToSameValue,
+                                std::max(itsMinDistanceToDifferentValue,
+                                         itsMinDistanceToDifferentParameter)));
+
+  // Keep the previous labels whose contours have not moved too much
+
+  if (itsCoherence > 0)
+  {
+    for (const auto& pit : itsPreviousCoordinates)
+      for (const auto& cit : pit.second)
+        for (const auto& previous : cit.second)
+        {
+          Coordinates::iterator it;
+          if (!index.nearest(previous.second, pit.first, cit.first, itsCoherence, it))
+            continue;
+
+          const Coordinates::value_type best = *it;
+
+          choices[pit.first][cit.first].insert(best);
+
+          index.remove(best.second,
+                       pit.first,
+                       cit.first,
+                       itsMinDistanceToSameValue,
+                       itsMinDistanceToDifferentValue,
+                       itsMinDistanceToDifferentParameter);
+        }
+
+    removeEmpties(candidates);
+  }
+
   while (!candidates.empty())
   {
     const int param = candidates.begin()->first;
@@ -418,7 +635,12 @@ const LabelLocator::ParamCoordinates& LabelLocator::chooseLabels()
 
       // and erase all candidates too close to the accepted coordinate
 
-      removeCandidates(candidates, best.second, param, value);
+      index.remove(best.second,
+                   param,
+                   value,
+                   itsMinDistanceToSameValue,
+                   itsMinDistanceToDifferentValue,
+                   itsMinDistanceToDifferentParameter);
     }
 
     // Now we erase any possible empty containers left behind
@@ -431,57 +653,6 @@ const LabelLocator::ParamCoordinates& LabelLocator::chooseLabels()
   return itsCurrentCoordinates;
 }
 
-// ----------------------------------------------------------------------
-/*!
- * \brief Remove candidates too close to the chosen point
- *
- * Note that the code erases only candidate coordinates and may
- * leave empty containers behind. This is necessary so that
- * any top level iterators will not become invalidated.
- *
- * \param theCandidates The candidates to clean up
- * \param thePoint The chosen point
- * \param theParam The chosen parameter
- * \param theContour The chosen contour value
- */
-// ----------------------------------------------------------------------
-
-void LabelLocator::removeCandidates(ParamCoordinates& theCandidates,
-                                    const XY& thePoint,
-                                    int theParam,
-                                    float theContour)
-{
-  for (ParamCoordinates::iterator pit = theCandidates.begin(); pit != theCandidates.end();)
-  {
-    const int param = pit->first;
-    for (ContourCoordinates::iterator cit = pit->second.begin(); cit != pit->second.end();)
-    {
-      const float contour = cit->first;
-      for (Coordinates::iterator it = cit->second.begin(); it != cit->second.end();)
-      {
-        const double dist =
-            distance(thePoint.first, thePoint.second, it->second.first, it->second.second);
-
-        bool erase = false;
-
-        if (param != theParam)
-          erase = (dist < itsMinDistanceToDifferentParameter);
-        else if (contour != theContour)
-          erase = (dist < itsMinDistanceToDifferentValue);
-        else
-          erase = (dist < itsMinDistanceToSameValue);
-
-        if (erase)
-          cit->second.erase(it++);
-        else
-          ++it;
-      }
-      ++cit;
-    }
-    ++pit;
-  }
-}
-
 // ----------------------------------------------------------------------
 /*!
  * \brief Remove any empty subcontainers from the candidates
@@ -12,8 +12,8 @@
  */
 // ----------------------------------------------------------------------
 
-LazyCoordinates::LazyCoordinates(const NFmiArea &theArea)
-    : itsArea(theArea), itsInitialized(false), itsData()
+LazyCoordinates::LazyCoordinates(const NFmiArea &theArea, const LazyQueryData &theData)
+    : itsArea(theArea), itsQueryData(theData), itsInitialized(false), itsData()
 {
 }
 
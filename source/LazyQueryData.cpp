@@ -6,20 +6,78 @@
 // ======================================================================
 
 #include "LazyQueryData.h"
+#include "Profiler.h"
 #include <gis/CoordinateMatrix.h>
 #include <gis/CoordinateTransformation.h>
 #include <gis/SpatialReference.h>
+#include <newbase/NFmiArea.h>
 #include <newbase/NFmiFastQueryInfo.h>
 #include <newbase/NFmiFileSystem.h>
 #include <newbase/NFmiGrid.h>
 #include <newbase/NFmiInterpolation.h>
 #include <newbase/NFmiQueryData.h>
+#include <algorithm>
 #include <fstream>
+#include <map>
+#include <mutex>
 #include <sstream>
 #include <stdexcept>
 
 using namespace std;
 
+namespace
+{
+// ----------------------------------------------------------------------
+/*!
+ * \brief Process wide cache of coordinate matrices
+ *
+ * The key consists of the kind of coordinates, the grid identity and
+ * the target area. Coordinates are shared by all data objects on the
+ * same grid, all specs and all worker threads. The number of distinct
+ * grid and area combinations in a script is small, hence nothing is
+ * ever evicted.
+ */
+// ----------------------------------------------------------------------
+
+std::mutex coordinate_mutex;
+std::map<std::string, std::shared_ptr<Fmi::CoordinateMatrix> > coordinate_cache;
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Find cached coordinates or calculate and cache them
+ *
+ * The calculation is done while holding the lock so that threads
+ * requesting the same coordinates wait for the first one instead of
+ * repeating the work.
+ */
+// ----------------------------------------------------------------------
+
+template <typename Calculator>
+std::shared_ptr<Fmi::CoordinateMatrix> cached_coordinates(const std::string &theKey,
+                                                          Calculator theCalculator)
+{
+  std::lock_guard<std::mutex> lock(coordinate_mutex);
+  auto &coords = coordinate_cache[theKey];
+  if (!coords)
+    coords.reset(new Fmi::CoordinateMatrix(theCalculator()));
+  return coords;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Build the cache key for the given area
+ */
+// ----------------------------------------------------------------------
+
+std::string area_key(const char *theKind, const std::string &theGrid, const NFmiArea &theArea)
+{
+  ostringstream os;
+  os << theKind << ' ' << theGrid << ' ' << theArea;
+  return os.str();
+}
+
+}  // namespace
+
 // ----------------------------------------------------------------------
 /*!
  * \brief Destructor
@@ -83,11 +141,64 @@ float LazyQueryData::GetLevelNumber() const
 
 void LazyQueryData::Read(const std::string &theDataFile)
 {
+  Profiler::Phase phase("read");
+
   itsInputName = theDataFile;
   itsDataFile = theDataFile;
+  itsFileTime = NFmiFileSystem::FileModificationTime(theDataFile);
+  itsFileSize = NFmiFileSystem::FileSize(theDataFile);
 
   itsData.reset(new NFmiQueryData(theDataFile));
   itsInfo.reset(new NFmiFastQueryInfo(itsData.get()));
+
+  // The grid identity used for sharing coordinates. Point data is
+  // identified by the file since the hash alone describes no grid.
+
+  ostringstream os;
+  os << itsData->GridHashValue();
+  const NFmiGrid *grid = itsInfo->Grid();
+  if (grid != nullptr && grid->Area() != nullptr)
+    os << ' ' << grid->XNumber() << 'x' << grid->YNumber() << ' ' << *grid->Area();
+  else
+    os << ' ' << theDataFile;
+  itsGridKey = os.str();
+
+  // Index the valid times for fast searches. A copy of the
+  // iterator is used to keep the state of the original intact.
+
+  std::shared_ptr<std::vector<NFmiMetTime> > times(new std::vector<NFmiMetTime>());
+  NFmiFastQueryInfo info(*itsInfo);
+  times->reserve(info.SizeTimes());
+  for (info.ResetTime(); info.NextTime();)
+    times->push_back(info.ValidTime());
+  itsTimes = times;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Make a new iterator to the same data
+ *
+ * The clone shares the data, but has its own
+ * iterator which starts from the current position of this one. This
+ * allows several threads to access the same data simultaneously.
+ *
+ * \return The clone
+ */
+// ----------------------------------------------------------------------
+
+std::shared_ptr<LazyQueryData> LazyQueryData::Clone() const
+{
+  std::shared_ptr<LazyQueryData> clone(new LazyQueryData());
+  clone->itsInputName = itsInputName;
+  clone->itsDataFile = itsDataFile;
+  clone->itsFileTime = itsFileTime;
+  clone->itsFileSize = itsFileSize;
+  clone->itsData = itsData;
+  if (itsInfo)
+    clone->itsInfo.reset(new NFmiFastQueryInfo(*itsInfo));
+  clone->itsGridKey = itsGridKey;
+  clone->itsTimes = itsTimes;
+  return clone;
 }
 
 // ----------------------------------------------------------------------
@@ -160,6 +271,28 @@ const NFmiLevel *LazyQueryData::Level() const
 {
   return itsInfo->Level();
 }
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Return the index of the active level
+ */
+// ----------------------------------------------------------------------
+
+unsigned long LazyQueryData::LevelIndex() const
+{
+  return itsInfo->LevelIndex();
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Set the active level by its index
+ */
+// ----------------------------------------------------------------------
+
+bool LazyQueryData::LevelIndex(unsigned long theIndex)
+{
+  return itsInfo->LevelIndex(theIndex);
+}
 // ----------------------------------------------------------------------
 /*!
  *
@@ -180,6 +313,56 @@ bool LazyQueryData::PreviousTime()
 {
   return itsInfo->PreviousTime();
 }
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Return the index of the active time
+ */
+// ----------------------------------------------------------------------
+
+unsigned long LazyQueryData::TimeIndex() const
+{
+  return itsInfo->TimeIndex();
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Set the active time by its index
+ */
+// ----------------------------------------------------------------------
+
+bool LazyQueryData::TimeIndex(unsigned long theIndex)
+{
+  return itsInfo->TimeIndex(theIndex);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Activate the first time which is not before the given time
+ *
+ * This is equivalent to calling NextTime() after ResetTime() until
+ * the time is not less than the given one, but uses a binary search.
+ *
+ * \return False if all the times are before the given time
+ */
+// ----------------------------------------------------------------------
+
+bool LazyQueryData::FindTimeAtOrAfter(const NFmiTime &theTime)
+{
+  auto it = std::lower_bound(itsTimes->begin(),
+                             itsTimes->end(),
+                             theTime,
+                             [](const NFmiMetTime &theValidTime, const NFmiTime &theLimit)
+                             { return theValidTime.IsLessThan(theLimit); });
+
+  if (it == itsTimes->end())
+  {
+    itsInfo->ResetTime();
+    return false;
+  }
+
+  return itsInfo->TimeIndex(static_cast<unsigned long>(it - itsTimes->begin()));
+}
 // ----------------------------------------------------------------------
 /*!
  *
@@ -228,14 +411,15 @@ bool LazyQueryData::IsParamUsable() const
 
 std::shared_ptr<Fmi::CoordinateMatrix> LazyQueryData::Locations() const
 {
-  if (itsLocations.get() == 0)
-  {
-    itsLocations.reset(new Fmi::CoordinateMatrix(itsInfo->CoordinateMatrix()));
-    Fmi::CoordinateTransformation transformation(itsInfo->SpatialReference(), "WGS84");
-    itsLocations->transform(transformation);
-  }
-
-  return itsLocations;
+  return cached_coordinates("latlon " + itsGridKey,
+                            [this]()
+                            {
+                              Fmi::CoordinateMatrix coords(itsInfo->CoordinateMatrix());
+                              Fmi::CoordinateTransformation transformation(
+                                  itsInfo->SpatialReference(), "WGS84");
+                              coords.transform(transformation);
+                              return coords;
+                            });
 }
 
 // ----------------------------------------------------------------------
@@ -247,15 +431,8 @@ std::shared_ptr<Fmi::CoordinateMatrix> LazyQueryData::Locations() const
 std::shared_ptr<Fmi::CoordinateMatrix> LazyQueryData::LocationsWorldXY(
     const NFmiArea &theArea) const
 {
-  ostringstream os;
-  os << theArea;
-
-  if (itsLocationsWorldXY.get() == 0 || os.str() != itsLocationsArea)
-  {
-    itsLocationsArea = os.str();
-    itsLocationsWorldXY.reset(new Fmi::CoordinateMatrix(itsInfo->LocationsWorldXY(theArea)));
-  }
-  return itsLocationsWorldXY;
+  return cached_coordinates(area_key("worldxy", itsGridKey, theArea),
+                            [&]() { return itsInfo->LocationsWorldXY(theArea); });
 }
 
 // ----------------------------------------------------------------------
@@ -266,15 +443,65 @@ std::shared_ptr<Fmi::CoordinateMatrix> LazyQueryData::LocationsWorldXY(
 
 std::shared_ptr<Fmi::CoordinateMatrix> LazyQueryData::LocationsXY(const NFmiArea &theArea) const
 {
-  ostringstream os;
-  os << theArea;
+  return cached_coordinates(area_key("xy", itsGridKey, theArea),
+                            [&]() { return itsInfo->LocationsXY(theArea); });
+}
 
-  if (itsLocationsXY.get() == 0 || os.str() != itsLocationsArea)
-  {
-    itsLocationsArea = os.str();
-    itsLocationsXY.reset(new Fmi::CoordinateMatrix(itsInfo->LocationsXY(theArea)));
-  }
-  return itsLocationsXY;
+// ----------------------------------------------------------------------
+/*!
+ * \brief Latlon coordinates of the grid points via the world XY of the area
+ *
+ * These are the coordinates obtained by mapping LocationsWorldXY back
+ * with NFmiArea::WorldXYToLatLon, calculated only once per area
+ */
+// ----------------------------------------------------------------------
+
+std::shared_ptr<Fmi::CoordinateMatrix> LazyQueryData::LocationsAreaLatLon(
+    const NFmiArea &theArea) const
+{
+  // Fetch before locking the cache for the latlon coordinates
+  auto worldxy = LocationsWorldXY(theArea);
+
+  return cached_coordinates(area_key("arealatlon", itsGridKey, theArea),
+                            [&]()
+                            {
+                              Fmi::CoordinateMatrix coords(worldxy->width(), worldxy->height());
+                              for (std::size_t j = 0; j < worldxy->height(); j++)
+                                for (std::size_t i = 0; i < worldxy->width(); i++)
+                                {
+                                  NFmiPoint latlon = theArea.WorldXYToLatLon((*worldxy)(i, j));
+                                  coords.set(i, j, latlon.X(), latlon.Y());
+                                }
+                              return coords;
+                            });
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Pixel coordinates of the grid points via the world XY of the area
+ *
+ * The same as NFmiArea::ToXY applied to LocationsAreaLatLon, calculated
+ * only once per area
+ */
+// ----------------------------------------------------------------------
+
+std::shared_ptr<Fmi::CoordinateMatrix> LazyQueryData::LocationsPixelXY(
+    const NFmiArea &theArea) const
+{
+  auto latlons = LocationsAreaLatLon(theArea);
+
+  return cached_coordinates(area_key("pixelxy", itsGridKey, theArea),
+                            [&]()
+                            {
+                              Fmi::CoordinateMatrix coords(latlons->width(), latlons->height());
+                              for (std::size_t j = 0; j < latlons->height(); j++)
+                                for (std::size_t i = 0; i < latlons->width(); i++)
+                                {
+                                  NFmiPoint xy = theArea.ToXY((*latlons)(i, j));
+                                  coords.set(i, j, xy.X(), xy.Y());
+                                }
+                              return coords;
+                            });
 }
 
 // ----------------------------------------------------------------------
@@ -359,6 +586,35 @@ NFmiDataMatrix<float> LazyQueryData::Values(const NFmiMetTime &theTime)
   return itsInfo->Values(theTime);
 }
 
+// ----------------------------------------------------------------------
+/*!
+ * \brief Extract the values into the given matrix
+ *
+ * If the matrix already has the correct size, no memory is allocated.
+ *
+ * \param theValues The matrix to fill
+ */
+// ----------------------------------------------------------------------
+
+void LazyQueryData::Values(NFmiDataMatrix<float> &theValues)
+{
+  itsInfo->Values(theValues);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Extract the time interpolated values into the given matrix
+ *
+ * \param theValues The matrix to fill
+ * \param theTime The desired time
+ */
+// ----------------------------------------------------------------------
+
+void LazyQueryData::Values(NFmiDataMatrix<float> &theValues, const NFmiMetTime &theTime)
+{
+  itsInfo->Values(theValues, theTime);
+}
+
 Fmi::CoordinateMatrix LazyQueryData::CoordinateMatrix() const
 {
   return itsInfo->CoordinateMatrix();
@@ -0,0 +1,833 @@
+// ======================================================================
+/*!
+ * \file
+ * \brief Implementation of class MetaExpression
+ */
+// ======================================================================
+
+#include "MetaExpression.h"
+#include "LazyQueryData.h"
+#include "MetaFunctions.h"
+#include "TaskScheduler.h"
+#include "UnitsConverter.h"
+#include <newbase/NFmiArea.h>
+#include <newbase/NFmiEnumConverter.h>
+#include <newbase/NFmiGrid.h>
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+using namespace std;
+
+namespace
+{
+// ----------------------------------------------------------------------
+/*!
+ * \brief The operations of the postfix program
+ */
+// ----------------------------------------------------------------------
+
+enum Opcode
+{
+  kConst,
+  kLoad,
+  kNeg,
+  kNot,
+  kAdd,
+  kSub,
+  kMul,
+  kDiv,
+  kPow,
+  kLt,
+  kLe,
+  kGt,
+  kGe,
+  kEq,
+  kNe,
+  kAnd,
+  kOr,
+  kMin,
+  kMax,
+  kAbs,
+  kSqrt,
+  kExp,
+  kLog,
+  kSin,
+  kCos,
+  kIf
+};
+
+struct Instruction
+{
+  Opcode op;
+  float value;        // the constant for kConst
+  std::size_t index;  // the input for kLoad
+};
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief A grid needed by the program
+ *
+ * Parameters and meta parameters are fetched as is, gradients are
+ * calculated from their evaluated argument program.
+ */
+// ----------------------------------------------------------------------
+
+enum InputType
+{
+  kParam,
+  kMeta,
+  kGradX,
+  kGradY,
+  kGrad
+};
+
+struct Input
+{
+  InputType type;
+  FmiParameterName param;
+  std::string name;
+  std::shared_ptr<MetaExpression::Program> argument;
+};
+
+}  // namespace
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief A compiled expression
+ *
+ * The depth is the maximum size of the evaluation stack.
+ */
+// ----------------------------------------------------------------------
+
+struct MetaExpression::Program
+{
+  std::vector<Instruction> code;
+  std::vector<Input> inputs;
+  std::size_t depth = 0;
+};
+
+namespace
+{
+typedef MetaExpression::Program Program;
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Recursive descent compiler from expression to postfix program
+ */
+// ----------------------------------------------------------------------
+
+class Compiler
+{
+ public:
+  Compiler(const std::string &theExpression) : itsText(theExpression), itsPos(0) {}
+
+  std::shared_ptr<Program> compile()
+  {
+    std::shared_ptr<Program> program(new Program);
+    itsProgram = program.get();
+    itsDepth = 0;
+    parse_or();
+    skip();
+    if (itsPos != itsText.size())
+      error("unexpected '" + itsText.substr(itsPos) + "'");
+    return program;
+  }
+
+ private:
+  const std::string &itsText;
+  std::size_t itsPos;
+  Program *itsProgram = nullptr;
+  std::size_t itsDepth = 0;
+  NFmiEnumConverter itsConverter;
+
+  void error(const std::string &theMessage) const
+  {
+    throw runtime_error("Error in metaparam expression '" + itsText + "': " + theMessage);
+  }
+
+  void skip()
+  {
+    while (itsPos < itsText.size() && isspace(static_cast<unsigned char>(itsText[itsPos])))
+      ++itsPos;
+  }
+
+  bool accept(const char *theToken)
+  {
+    skip();
+    const std::size_t n = strlen(theToken);
+    if (itsText.compare(itsPos, n, theToken) != 0)
+      return false;
+    itsPos += n;
+    return true;
+  }
+
+  void expect(const char *theToken)
+  {
+    if (!accept(theToken))
+      error(std::string("expected '") + theToken + "'");
+  }
+
+  // Emit an instruction which pops the given number of values and pushes one
+
+  void emit(Opcode theOp, std::size_t thePops, float theValue = 0, std::size_t theIndex = 0)
+  {
+    Instruction instruction;
+    instruction.op = theOp;
+    instruction.value = theValue;
+    instruction.index = theIndex;
+    itsProgram->code.push_back(instruction);
+    itsDepth = itsDepth - thePops + 1;
+    itsProgram->depth = std::max(itsProgram->depth, itsDepth);
+  }
+
+  void load(const Input &theInput)
+  {
+    itsProgram->inputs.push_back(theInput);
+    emit(kLoad, 0, 0, itsProgram->inputs.size() - 1);
+  }
+
+  void parse_or()
+  {
+    parse_and();
+    while (accept("||"))
+    {
+      parse_and();
+      emit(kOr, 2);
+    }
+  }
+
+  void parse_and()
+  {
+    parse_comparison();
+    while (accept("&&"))
+    {
+      parse_comparison();
+      emit(kAnd, 2);
+    }
+  }
+
+  void parse_comparison()
+  {
+    parse_sum();
+    for (;;)
+    {
+      Opcode op;
+      if (accept("<="))
+        op = kLe;
+      else if (accept(">="))
+        op = kGe;
+      else if (accept("=="))
+        op = kEq;
+      else if (accept("!="))
+        op = kNe;
+      else if (accept("<"))
+        op = kLt;
+      else if (accept(">"))
+        op = kGt;
+      else
+        return;
+      parse_sum();
+      emit(op, 2);
+    }
+  }
+
+  void parse_sum()
+  {
+    parse_product();
+    for (;;)
+    {
+      if (accept("+"))
+      {
+        parse_product();
+        emit(kAdd, 2);
+      }
+      else if (accept("-"))
+      {
+        parse_product();
+        emit(kSub, 2);
+      }
+      else
+        return;
+    }
+  }
+
+  void parse_product()
+  {
+    parse_unary();
+    for (;;)
+    {
+      if (accept("*"))
+      {
+        parse_unary();
+        emit(kMul, 2);
+      }
+      else if (accept("/"))
+      {
+        parse_unary();
+        emit(kDiv, 2);
+      }
+      else
+        return;
+    }
+  }
+
+  void parse_unary()
+  {
+    if (accept("-"))
+    {
+      parse_unary();
+      emit(kNeg, 1);
+    }
+    else if (accept("+"))
+      parse_unary();
+    else if (accept("!"))
+    {
+      parse_unary();
+      emit(kNot, 1);
+    }
+    else
+      parse_power();
+  }
+
+  void parse_power()
+  {
+    parse_primary();
+    if (accept("^"))
+    {
+      parse_unary();
+      emit(kPow, 2);
+    }
+  }
+
+  std::size_t parse_arguments()
+  {
+    expect("(");
+    std::size_t count = 0;
+    if (!accept(")"))
+    {
+      do
+      {
+        parse_or();
+        ++count;
+      } while (accept(","));
+      expect(")");
+    }
+    return count;
+  }
+
+  void parse_function(const std::string &theName)
+  {
+    if (theName == "gradx" || theName == "grady" || theName == "grad")
+    {
+      // The argument becomes a program of its own
+
+      Input input;
+      input.type = (theName == "gradx" ? kGradX : theName == "grady" ? kGradY : kGrad);
+      input.param = kFmiBadParameter;
+
+      Program *program = itsProgram;
+      const std::size_t depth = itsDepth;
+      input.argument.reset(new Program);
+      itsProgram = input.argument.get();
+      itsDepth = 0;
+
+      expect("(");
+      parse_or();
+      expect(")");
+
+      itsProgram = program;
+      itsDepth = depth;
+      load(input);
+      return;
+    }
+
+    const std::size_t count = parse_arguments();
+
+    if (theName == "min" || theName == "max")
+    {
+      if (count < 2)
+        error(theName + " requires at least two arguments");
+      for (std::size_t i = 1; i < count; i++)
+        emit(theName == "min" ? kMin : kMax, 2);
+      return;
+    }
+
+    if (theName == "if")
+    {
+      if (count != 3)
+        error("if requires three arguments");
+      emit(kIf, 3);
+      return;
+    }
+
+    if (theName == "pow")
+    {
+      if (count != 2)
+        error("pow requires two arguments");
+      emit(kPow, 2);
+      return;
+    }
+
+    Opcode op;
+    if (theName == "abs")
+      op = kAbs;
+    else if (theName == "sqrt")
+      op = kSqrt;
+    else if (theName == "exp")
+      op = kExp;
+    else if (theName == "log")
+      op = kLog;
+    else if (theName == "sin")
+      op = kSin;
+    else if (theName == "cos")
+      op = kCos;
+    else
+      error("unknown function " + theName);
+
+    if (count != 1)
+      error(theName + " requires one argument");
+    emit(op, 1);
+  }
+
+  void parse_primary()
+  {
+    skip();
+
+    if (itsPos >= itsText.size())
+      error("unexpected end of expression");
+
+    if (accept("("))
+    {
+      parse_or();
+      expect(")");
+      return;
+    }
+
+    const char ch = itsText[itsPos];
+
+    if (isdigit(static_cast<unsigned char>(ch)) || ch == '.')
+    {
+      const char *start = itsText.c_str() + itsPos;
+      char *end = nullptr;
+      const double value = strtod(start, &end);
+      if (end == start)
+        error("bad number");
+      itsPos += (end - start);
+      emit(kConst, 0, static_cast<float>(value));
+      return;
+    }
+
+    if (isalpha(static_cast<unsigned char>(ch)) || ch == '_')
+    {
+      const std::size_t start = itsPos;
+      while (itsPos < itsText.size() &&
+             (isalnum(static_cast<unsigned char>(itsText[itsPos])) || itsText[itsPos] == '_'))
+        ++itsPos;
+      const std::string name = itsText.substr(start, itsPos - start);
+
+      skip();
+      if (itsPos < itsText.size() && itsText[itsPos] == '(')
+      {
+        parse_function(name);
+        return;
+      }
+
+      Input input;
+      input.name = name;
+      input.param = kFmiBadParameter;
+      if (MetaFunctions::isMeta(name))
+        input.type = kMeta;
+      else
+      {
+        input.type = kParam;
+        input.param = FmiParameterName(itsConverter.ToEnum(name));
+        if (input.param == kFmiBadParameter)
+          error("unknown parameter " + name);
+      }
+      load(input);
+      return;
+    }
+
+    error(std::string("unexpected '") + ch + "'");
+  }
+};
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Store the result, missing if it is not finite
+ */
+// ----------------------------------------------------------------------
+
+inline float finite(float theValue)
+{
+  return (std::isfinite(theValue) ? theValue : kFloatMissing);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Apply an unary operation to a column
+ */
+// ----------------------------------------------------------------------
+
+template <typename Op>
+void unary(float *theX, std::size_t theSize, Op theOp)
+{
+  for (std::size_t j = 0; j < theSize; j++)
+    if (theX[j] != kFloatMissing)
+      theX[j] = finite(theOp(theX[j]));
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Apply a binary operation to a column, the result replaces X
+ */
+// ----------------------------------------------------------------------
+
+template <typename Op>
+void binary(float *theX, const float *theY, std::size_t theSize, Op theOp)
+{
+  for (std::size_t j = 0; j < theSize; j++)
+  {
+    if (theX[j] == kFloatMissing || theY[j] == kFloatMissing)
+      theX[j] = kFloatMissing;
+    else
+      theX[j] = finite(theOp(theX[j], theY[j]));
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Run the program for the columns [theFirst,theLast)
+ */
+// ----------------------------------------------------------------------
+
+void run_columns(const Program &theProgram,
+                 const std::vector<NFmiDataMatrix<float> > &theGrids,
+                 NFmiDataMatrix<float> &theValues,
+                 std::size_t theFirst,
+                 std::size_t theLast)
+{
+  const std::size_t ny = theValues.NY();
+  std::vector<std::vector<float> > stack(theProgram.depth, std::vector<float>(ny));
+
+  for (std::size_t i = theFirst; i < theLast; i++)
+  {
+    std::size_t sp = 0;
+
+    for (const auto &ins : theProgram.code)
+    {
+      switch (ins.op)
+      {
+        case kConst:
+          std::fill(stack[sp].begin(), stack[sp].end(), ins.value);
+          ++sp;
+          break;
+        case kLoad:
+        {
+          const auto &column = theGrids[ins.index][i];
+          std::copy(column.begin(), column.begin() + ny, stack[sp].begin());
+          ++sp;
+          break;
+        }
+        case kIf:
+        {
+          float *c = &stack[sp - 3][0];
+          const float *a = &stack[sp - 2][0];
+          const float *b = &stack[sp - 1][0];
+          for (std::size_t j = 0; j < ny; j++)
+            if (c[j] != kFloatMissing)
+              c[j] = (c[j] != 0 ? a[j] : b[j]);
+          sp -= 2;
+          break;
+        }
+        case kNeg:
+          unary(&stack[sp - 1][0], ny, [](float x) { return -x; });
+          break;
+        case kNot:
+          unary(&stack[sp - 1][0], ny, [](float x) { return x == 0 ? 1.0f : 0.0f; });
+          break;
+        case kAbs:
+          unary(&stack[sp - 1][0], ny, [](float x) { return std::abs(x); });
+          break;
+        case kSqrt:
+          unary(&stack[sp - 1][0], ny, [](float x) { return std::sqrt(x); });
+          break;
+        case kExp:
+          unary(&stack[sp - 1][0], ny, [](float x) { return std::exp(x); });
+          break;
+        case kLog:
+          unary(&stack[sp - 1][0], ny, [](float x) { return std::log(x); });
+          break;
+        case kSin:
+          unary(&stack[sp - 1][0], ny, [](float x) { return std::sin(x); });
+          break;
+        case kCos:
+          unary(&stack[sp - 1][0], ny, [](float x) { return std::cos(x); });
+          break;
+        default:
+        {
+          float *x = &stack[sp - 2][0];
+          const float *y = &stack[sp - 1][0];
+          switch (ins.op)
+          {
+            case kAdd:
+              binary(x, y, ny, [](float a, float b) { return a + b; });
+              break;
+            case kSub:
+              binary(x, y, ny, [](float a, float b) { return a - b; });
+              break;
+            case kMul:
+              binary(x, y, ny, [](float a, float b) { return a * b; });
+              break;
+            case kDiv:
+              binary(x, y, ny, [](float a, float b) { return a / b; });
+              break;
+            case kPow:
+              binary(x, y, ny, [](float a, float b) { return std::pow(a, b); });
+              break;
+            case kLt:
+              binary(x, y, ny, [](float a, float b) { return a < b ? 1.0f : 0.0f; });
+              break;
+            case kLe:
+              binary(x, y, ny, [](float a, float b) { return a <= b ? 1.0f : 0.0f; });
+              break;
+            case kGt:
+              binary(x, y, ny, [](float a, float b) { return a > b ? 1.0f : 0.0f; });
+              break;
+            case kGe:
+              binary(x, y, ny, [](float a, float b) { return a >= b ? 1.0f : 0.0f; });
+              break;
+            case kEq:
+              binary(x, y, ny, [](float a, float b) { return a == b ? 1.0f : 0.0f; });
+              break;
+            case kNe:
+              binary(x, y, ny, [](float a, float b) { return a != b ? 1.0f : 0.0f; });
+              break;
+            case kAnd:
+              binary(x, y, ny, [](float a, float b) { return (a != 0 && b != 0) ? 1.0f : 0.0f; });
+              break;
+            case kOr:
+              binary(x, y, ny, [](float a, float b) { return (a != 0 || b != 0) ? 1.0f : 0.0f; });
+              break;
+            case kMin:
+              binary(x, y, ny, [](float a, float b) { return std::min(a, b); });
+              break;
+            case kMax:
+              binary(x, y, ny, [](float a, float b) { return std::max(a, b); });
+              break;
+            default:
+              throw runtime_error("Internal error in metaparam evaluation");
+          }
+          --sp;
+        }
+      }
+    }
+
+    std::copy(stack[0].begin(), stack[0].end(), theValues[i].begin());
+  }
+}
+
+void evaluate(const Program &theProgram,
+              LazyQueryData &theQI,
+              NFmiDataMatrix<float> &theValues,
+              unsigned int theThreads);
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Restore the parameter and the level of the data on exit
+ *
+ * The query info is shared with the caller, which expects it to be
+ * positioned as before once the expression has been evaluated.
+ */
+// ----------------------------------------------------------------------
+
+class QueryScope
+{
+ public:
+  QueryScope(LazyQueryData &theQI)
+      : itsQI(theQI),
+        itsParam(FmiParameterName(theQI.GetParamIdent())),
+        itsLevel(theQI.LevelIndex())
+  {
+  }
+
+  ~QueryScope()
+  {
+    itsQI.Param(itsParam);
+    itsQI.LevelIndex(itsLevel);
+  }
+
+ private:
+  QueryScope(const QueryScope &theScope);
+  QueryScope &operator=(const QueryScope &theScope);
+
+  LazyQueryData &itsQI;
+  FmiParameterName itsParam;
+  unsigned long itsLevel;
+};
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Fetch or calculate the grid of an input
+ */
+// ----------------------------------------------------------------------
+
+void materialize(const Input &theInput,
+                 LazyQueryData &theQI,
+                 NFmiDataMatrix<float> &theValues,
+                 unsigned int theThreads)
+{
+  switch (theInput.type)
+  {
+    case kParam:
+      if (!theQI.Param(theInput.param))
+        throw runtime_error("Parameter " + theInput.name + " is not available for metaparam");
+      theQI.Values(theValues);
+      MetaFunctions::units().convert(theInput.param, theValues);
+      break;
+    case kMeta:
+      theValues = MetaFunctions::values(theInput.name, theQI, theThreads);
+      break;
+    case kGradX:
+    case kGradY:
+    case kGrad:
+    {
+      NFmiDataMatrix<float> arg;
+      evaluate(*theInput.argument, theQI, arg, theThreads);
+
+      // grid resolution in meters for difference formulas
+      const float dx = static_cast<float>(theQI.Area()->WorldXYWidth()) /
+                       static_cast<float>(theQI.Grid()->XNumber() - 1);
+      const float dy = static_cast<float>(theQI.Area()->WorldXYHeight()) /
+                       static_cast<float>(theQI.Grid()->YNumber() - 1);
+
+      NFmiDataMatrix<float> nablax, nablay;
+      MetaFunctions::nabla(arg, dx, dy, nablax, nablay, theThreads);
+
+      if (theInput.type == kGradX)
+        theValues.swap(nablax);
+      else if (theInput.type == kGradY)
+        theValues.swap(nablay);
+      else
+      {
+        theValues.swap(nablax);
+        for (std::size_t i = 0; i < theValues.NX(); i++)
+        {
+          float *x = &theValues[i][0];
+          const float *y = &nablay[i][0];
+          for (std::size_t j = 0; j < theValues.NY(); j++)
+            if (x[j] != kFloatMissing && y[j] != kFloatMissing)
+              x[j] = std::sqrt(x[j] * x[j] + y[j] * y[j]);
+            else
+              x[j] = kFloatMissing;
+        }
+      }
+      break;
+    }
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Evaluate the program into the given matrix
+ *
+ * The inputs are materialized first, after which the columns are
+ * evaluated in parallel.
+ */
+// ----------------------------------------------------------------------
+
+void evaluate(const Program &theProgram,
+              LazyQueryData &theQI,
+              NFmiDataMatrix<float> &theValues,
+              unsigned int theThreads)
+{
+  std::vector<NFmiDataMatrix<float> > grids(theProgram.inputs.size());
+  {
+    const QueryScope scope(theQI);
+    for (std::size_t k = 0; k < grids.size(); k++)
+      materialize(theProgram.inputs[k], theQI, grids[k], theThreads);
+  }
+
+  const std::size_t nx = theQI.Grid()->XNumber();
+  const std::size_t ny = theQI.Grid()->YNumber();
+
+  for (const auto &grid : grids)
+    if (grid.NX() != nx || grid.NY() != ny)
+      throw runtime_error("Metaparam input grids are of different sizes");
+
+  theValues.Resize(nx, ny, kFloatMissing);
+
+  const std::size_t nthreads = std::max<std::size_t>(1, std::min<std::size_t>(theThreads, nx));
+
+  if (nthreads == 1)
+  {
+    run_columns(theProgram, grids, theValues, 0, nx);
+    return;
+  }
+
+  TaskScheduler::run(
+      nthreads,
+      nthreads,
+      [&](std::size_t t)
+      { run_columns(theProgram, grids, theValues, t * nx / nthreads, (t + 1) * nx / nthreads); });
+}
+
+}  // namespace
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Destructor
+ */
+// ----------------------------------------------------------------------
+
+MetaExpression::~MetaExpression() {}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Constructor
+ *
+ * Throws if the expression cannot be compiled.
+ *
+ * \param theExpression The expression to compile
+ */
+// ----------------------------------------------------------------------
+
+MetaExpression::MetaExpression(const std::string &theExpression)
+    : itsExpression(theExpression), itsProgram(Compiler(theExpression).compile())
+{
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Return the original expression
+ */
+// ----------------------------------------------------------------------
+
+const std::string &MetaExpression::expression() const
+{
+  return itsExpression;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Evaluate the expression for the current time and level
+ *
+ * \param theQI The query info
+ * \param theValues The matrix to fill
+ * \param theThreads The number of threads to use
+ */
+// ----------------------------------------------------------------------
+
+void MetaExpression::values(LazyQueryData &theQI,
+                            NFmiDataMatrix<float> &theValues,
+                            unsigned int theThreads) const
+{
+  evaluate(*itsProgram, theQI, theValues, theThreads);
+}
+
+// ======================================================================
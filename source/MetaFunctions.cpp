@@ -6,21 +6,168 @@
 // ======================================================================
 
 #include "MetaFunctions.h"
+#include "MetaExpression.h"
+#include "TaskScheduler.h"
+#include "UnitsConverter.h"
 #include <memory>
 #include <gis/CoordinateMatrix.h>
 #include <newbase/NFmiArea.h>
+#include <newbase/NFmiEnumConverter.h>
 #include <newbase/NFmiGrid.h>
 #include <newbase/NFmiLocation.h>
 #include <newbase/NFmiMetMath.h>
 #include <newbase/NFmiMetTime.h>
 #include <newbase/NFmiPoint.h>
+#include <algorithm>
+#include <atomic>
 #include <iostream>
+#include <map>
 #include <stdexcept>
+#include <tuple>
+#include <vector>
 
 using namespace std;
 
 namespace
 {
+// ----------------------------------------------------------------------
+/*!
+ * \brief Cache key for calculated meta function values
+ *
+ * The function name, the file name and the level.
+ */
+// ----------------------------------------------------------------------
+
+typedef std::tuple<std::string, std::string, float> CacheKey;
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Calculated values of a meta function
+ *
+ * The file is identified by its modification time and size, so that the
+ * values of a replaced file with the same name are not used.
+ */
+// ----------------------------------------------------------------------
+
+struct CacheEntry
+{
+  bool valid = false;
+  long long filetime = 0;
+  long long filesize = 0;
+  long long validtime = 0;
+  long long origintime = 0;
+  NFmiDataMatrix<float> values;
+};
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Calculated values of the meta functions
+ *
+ * Fills, lines and labels of the same meta parameter request the same
+ * values at each time step. Each rendering thread keeps the values of
+ * the latest time of each function, file and level, values of another
+ * time or version of the file replace them.
+ */
+// ----------------------------------------------------------------------
+
+thread_local std::map<CacheKey, CacheEntry> meta_cache;
+
+// Incremented whenever the user defined parameters are cleared, so
+// that each thread knows to forget the values it has cached
+
+std::atomic<unsigned long> meta_generation(0);
+thread_local unsigned long meta_cache_generation = 0;
+
+// Unit conversions of the parameters used in the user defined expressions
+
+UnitsConverter meta_units;
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief User defined meta parameters
+ *
+ * The parameters are defined while reading the scripts, and are only
+ * read while rendering. The ID of each parameter is decided by its
+ * position in the definition order.
+ */
+// ----------------------------------------------------------------------
+
+const int first_user_id = 10100;
+
+std::vector<std::pair<std::string, std::shared_ptr<MetaExpression> > > user_metas;
+
+const MetaExpression *find_user_meta(const std::string &theName, int *theId = nullptr)
+{
+  for (std::size_t i = 0; i < user_metas.size(); i++)
+    if (user_metas[i].first == theName)
+    {
+      if (theId != nullptr)
+        *theId = first_user_id + static_cast<int>(i);
+      return user_metas[i].second.get();
+    }
+  return nullptr;
+}
+
+// Scratch matrices for the input parameters, reused between calls
+
+thread_local NFmiDataMatrix<float> input1;
+thread_local NFmiDataMatrix<float> input2;
+thread_local NFmiDataMatrix<float> input3;
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Convert a time to a YYYYMMDDHHMM integer
+ */
+// ----------------------------------------------------------------------
+
+long long stamp(const NFmiMetTime &theTime)
+{
+  return ((((theTime.GetYear() * 100LL + theTime.GetMonth()) * 100 + theTime.GetDay()) * 100 +
+           theTime.GetHour()) *
+              100 +
+          theTime.GetMin());
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Process the columns [0,theCount) in parallel
+ *
+ * The task is called with a range of columns. Each column of a
+ * NFmiDataMatrix is contiguous, hence the tasks write to disjoint
+ * memory.
+ */
+// ----------------------------------------------------------------------
+
+template <typename Task>
+void parallel_columns(std::size_t theCount, unsigned int theThreads, Task theTask)
+{
+  const std::size_t nthreads =
+      std::max<std::size_t>(1, std::min<std::size_t>(theThreads, theCount));
+
+  if (nthreads == 1)
+  {
+    theTask(0, theCount);
+    return;
+  }
+
+  TaskScheduler::run(nthreads,
+                     nthreads,
+                     [&](std::size_t t)
+                     { theTask(t * theCount / nthreads, (t + 1) * theCount / nthreads); });
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Fetch the values of the given parameter into the matrix
+ */
+// ----------------------------------------------------------------------
+
+void fetch(LazyQueryData &theQI, FmiParameterName theParam, NFmiDataMatrix<float> &theValues)
+{
+  theQI.Param(theParam);
+  theQI.Values(theValues);
+}
+
 // ----------------------------------------------------------------------
 /*!
  * \brief Convert cloudiness value in range 0-100 to value 0-8
@@ -40,26 +187,33 @@ inline float eights(float theCloudiness)
  * \brief Return ElevationAngle matrix from given query info
  *
  * \param theQI The query info
- * \return The values in a matrix
+ * \param theValues The matrix to fill
  */
 // ----------------------------------------------------------------------
 
-NFmiDataMatrix<float> elevation_angle_values(LazyQueryData &theQI)
+void elevation_angle_values(LazyQueryData &theQI,
+                            NFmiDataMatrix<float> &theValues,
+                            unsigned int theThreads)
 {
-  NFmiDataMatrix<float> values;
-
   std::shared_ptr<Fmi::CoordinateMatrix> pts = theQI.Locations();
-  values.Resize(pts->width(), pts->height(), kFloatMissing);
-
-  for (unsigned int j = 0; j < pts->height(); j++)
-    for (unsigned int i = 0; i < pts->width(); i++)
-    {
-      NFmiLocation loc((*pts)(i, j));
-      NFmiMetTime t(theQI.ValidTime());
-      double angle = loc.ElevationAngle(t);
-      values[i][j] = static_cast<float>(angle);
-    }
-  return values;
+  theValues.Resize(pts->width(), pts->height(), kFloatMissing);
+
+  const NFmiMetTime t(theQI.ValidTime());
+
+  parallel_columns(pts->width(),
+                   theThreads,
+                   [&](std::size_t i1, std::size_t i2)
+                   {
+                     for (std::size_t i = i1; i < i2; i++)
+                     {
+                       float *values = &theValues[i][0];
+                       for (std::size_t j = 0; j < pts->height(); j++)
+                       {
+                         NFmiLocation loc((*pts)(i, j));
+                         values[j] = static_cast<float>(loc.ElevationAngle(t));
+                       }
+                     }
+                   });
 }
 
 // ----------------------------------------------------------------------
@@ -67,25 +221,51 @@ NFmiDataMatrix<float> elevation_angle_values(LazyQueryData &theQI)
  * \brief Return WindChill matrix from given query info
  *
  * \param theQI The query info
- * \return The values in a matrix
+ * \param theValues The matrix to fill
  */
 // ----------------------------------------------------------------------
 
-NFmiDataMatrix<float> wind_chill_values(LazyQueryData &theQI)
+void wind_chill_values(LazyQueryData &theQI, NFmiDataMatrix<float> &theValues)
 {
-  theQI.Param(kFmiTemperature);
-  auto t2m = theQI.Values();
-  theQI.Param(kFmiWindSpeedMS);
-  auto wspd = theQI.Values();
+  fetch(theQI, kFmiTemperature, theValues);
+  fetch(theQI, kFmiWindSpeedMS, input1);
 
   // overwrite t2m with wind chill
 
-  for (unsigned int j = 0; j < t2m.NY(); j++)
-    for (unsigned int i = 0; i < t2m.NX(); i++)
+  for (std::size_t i = 0; i < theValues.NX(); i++)
+  {
+    float *t2m = &theValues[i][0];
+    const float *wspd = &input1[i][0];
+    for (std::size_t j = 0; j < theValues.NY(); j++)
+      t2m[j] = FmiWindChill(wspd[j], t2m[j]);
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Calculate the difference of two parameters
+ *
+ * \param theValues The minuend, overwritten with the difference
+ * \param theOther The subtrahend
+ */
+// ----------------------------------------------------------------------
+
+void difference_values(NFmiDataMatrix<float> &theValues, const NFmiDataMatrix<float> &theOther)
+{
+  for (std::size_t i = 0; i < theValues.NX(); i++)
+  {
+    float *x = &theValues[i][0];
+    const float *y = &theOther[i][0];
+    for (std::size_t j = 0; j < theValues.NY(); j++)
     {
-      t2m[i][j] = FmiWindChill(wspd[i][j], t2m[i][j]);
+      if (x[j] == kFloatMissing)
+        ;
+      else if (y[j] == kFloatMissing)
+        x[j] = kFloatMissing;
+      else
+        x[j] -= y[j];
     }
-  return t2m;
+  }
 }
 
 // ----------------------------------------------------------------------
@@ -93,30 +273,18 @@ NFmiDataMatrix<float> wind_chill_values(LazyQueryData &theQI)
  * \brief Return DewDifference matrix from given query info
  *
  * \param theQI The query info
- * \return The values in a matrix
+ * \param theValues The matrix to fill
  */
 // ----------------------------------------------------------------------
 
-NFmiDataMatrix<float> dew_difference_values(LazyQueryData &theQI)
+void dew_difference_values(LazyQueryData &theQI, NFmiDataMatrix<float> &theValues)
 {
-  theQI.Param(kFmiRoadTemperature);
-  auto troad = theQI.Values();
-  theQI.Param(kFmiDewPoint);
-  auto tdew = theQI.Values();
+  fetch(theQI, kFmiRoadTemperature, theValues);
+  fetch(theQI, kFmiDewPoint, input1);
 
   // overwrite troad with troad-tdew
 
-  for (unsigned int j = 0; j < troad.NY(); j++)
-    for (unsigned int i = 0; i < troad.NX(); i++)
-    {
-      if (troad[i][j] == kFloatMissing)
-        ;
-      else if (tdew[i][j] == kFloatMissing)
-        troad[i][j] = kFloatMissing;
-      else
-        troad[i][j] -= tdew[i][j];
-    }
-  return troad;
+  difference_values(theValues, input1);
 }
 
 // ----------------------------------------------------------------------
@@ -124,30 +292,34 @@ NFmiDataMatrix<float> dew_difference_values(LazyQueryData &theQI)
  * \brief Return DewDifferenceAir matrix from given query info
  *
  * \param theQI The query info
- * \return The values in a matrix
+ * \param theValues The matrix to fill
  */
 // ----------------------------------------------------------------------
 
-NFmiDataMatrix<float> air_dew_difference_values(LazyQueryData &theQI)
+void air_dew_difference_values(LazyQueryData &theQI, NFmiDataMatrix<float> &theValues)
 {
-  theQI.Param(kFmiTemperature);
-  auto t2m = theQI.Values();
-  theQI.Param(kFmiDewPoint);
-  auto tdew = theQI.Values();
+  fetch(theQI, kFmiTemperature, theValues);
+  fetch(theQI, kFmiDewPoint, input1);
 
-  // overwrite troad with troad-tdew
+  // overwrite t2m with t2m-tdew
 
-  for (unsigned int j = 0; j < t2m.NY(); j++)
-    for (unsigned int i = 0; i < t2m.NX(); i++)
-    {
-      if (t2m[i][j] == kFloatMissing)
-        ;
-      else if (tdew[i][j] == kFloatMissing)
-        t2m[i][j] = kFloatMissing;
-      else
-        t2m[i][j] -= tdew[i][j];
-    }
-  return t2m;
+  difference_values(theValues, input1);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Convert cloudiness in the matrix to eights
+ */
+// ----------------------------------------------------------------------
+
+void eights_values(NFmiDataMatrix<float> &theValues)
+{
+  for (std::size_t i = 0; i < theValues.NX(); i++)
+  {
+    float *n = &theValues[i][0];
+    for (std::size_t j = 0; j < theValues.NY(); j++)
+      n[j] = eights(n[j]);
+  }
 }
 
 // ----------------------------------------------------------------------
@@ -155,19 +327,14 @@ NFmiDataMatrix<float> air_dew_difference_values(LazyQueryData &theQI)
  * \brief Return N matrix from given query info
  *
  * \param theQI The query info
- * \return The values in a matrix
+ * \param theValues The matrix to fill
  */
 // ----------------------------------------------------------------------
 
-NFmiDataMatrix<float> n_cloudiness(LazyQueryData &theQI)
+void n_cloudiness(LazyQueryData &theQI, NFmiDataMatrix<float> &theValues)
 {
-  theQI.Param(kFmiTotalCloudCover);
-  auto n = theQI.Values();
-
-  for (unsigned int j = 0; j < n.NY(); j++)
-    for (unsigned int i = 0; i < n.NX(); i++)
-      n[i][j] = eights(n[i][j]);
-  return n;
+  fetch(theQI, kFmiTotalCloudCover, theValues);
+  eights_values(theValues);
 }
 
 // ----------------------------------------------------------------------
@@ -175,20 +342,80 @@ NFmiDataMatrix<float> n_cloudiness(LazyQueryData &theQI)
  * \brief Return NN matrix from given query info
  *
  * \param theQI The query info
- * \return The values in a matrix
+ * \param theValues The matrix to fill
+ */
+// ----------------------------------------------------------------------
+
+void nn_cloudiness(LazyQueryData &theQI, NFmiDataMatrix<float> &theValues)
+{
+  fetch(theQI, kFmiMiddleAndLowCloudCover, theValues);
+  eights_values(theValues);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Calculate nabla for the given column range
+ *
+ * The X-part uses the neighbouring columns, the Y-part the
+ * neighbouring elements of the same column. The differences are
+ * centered except at the edges.
  */
 // ----------------------------------------------------------------------
 
-NFmiDataMatrix<float> nn_cloudiness(LazyQueryData &theQI)
+void nabla_columns(const NFmiDataMatrix<float> &theF,
+                   float theDX,
+                   float theDY,
+                   NFmiDataMatrix<float> &theNablaX,
+                   NFmiDataMatrix<float> &theNablaY,
+                   std::size_t theFirst,
+                   std::size_t theLast)
 {
-  theQI.Param(kFmiMiddleAndLowCloudCover);
-  auto nn = theQI.Values();
+  const std::size_t nx = theF.NX();
+  const std::size_t ny = theF.NY();
+
+  for (std::size_t i = theFirst; i < theLast; i++)
+  {
+    const float *f = &theF[i][0];
+    const float *fprev = (i > 0 ? &theF[i - 1][0] : nullptr);
+    const float *fnext = (i < nx - 1 ? &theF[i + 1][0] : nullptr);
+    float *nablax = &theNablaX[i][0];
+    float *nablay = &theNablaY[i][0];
+
+    for (std::size_t j = 0; j < ny; j++)
+    {
+      bool allok = f[j] != kFloatMissing;
+      if (fprev != nullptr)
+        allok &= fprev[j] != kFloatMissing;
+      if (fnext != nullptr)
+        allok &= fnext[j] != kFloatMissing;
+      if (j > 0)
+        allok &= f[j - 1] != kFloatMissing;
+      if (j < ny - 1)
+        allok &= f[j + 1] != kFloatMissing;
 
-  for (unsigned int j = 0; j < nn.NY(); j++)
-    for (unsigned int i = 0; i < nn.NX(); i++)
-      nn[i][j] = eights(nn[i][j]);
+      if (allok)
+      {
+        if (fprev == nullptr)
+          nablax[j] = (fnext[j] - f[j]) / theDX;  // forward difference
+        else if (fnext == nullptr)
+          nablax[j] = (f[j] - fprev[j]) / theDX;  // backward difference
+        else
+          nablax[j] = (fnext[j] - fprev[j]) / (2 * theDX);  // centered difference
 
-  return nn;
+        if (j == 0)
+          nablay[j] = (f[j + 1] - f[j]) / theDY;
+        else if (j == ny - 1)
+          nablay[j] = (f[j] - f[j - 1]) / theDY;
+        else
+          nablay[j] = (f[j + 1] - f[j - 1]) / (2 * theDY);
+      }
+      else
+      {
+        nablax[j] = kFloatMissing;
+        nablay[j] = kFloatMissing;
+      }
+    }
+  }
 }
 
 // ----------------------------------------------------------------------
@@ -200,6 +427,7 @@ NFmiDataMatrix<float> nn_cloudiness(LazyQueryData &theQI)
  * \param theDY The grid y-resolution
  * \param theNablaX The X-part of the nabla
  * \param theNablaY The Y-part of the nabla
+ * \param theThreads The number of threads to use
  */
 // ----------------------------------------------------------------------
 
@@ -207,46 +435,16 @@ void matrix_nabla(const NFmiDataMatrix<float> &theF,
                   float theDX,
                   float theDY,
                   NFmiDataMatrix<float> &theNablaX,
-                  NFmiDataMatrix<float> &theNablaY)
+                  NFmiDataMatrix<float> &theNablaY,
+                  unsigned int theThreads)
 {
   theNablaX.Resize(theF.NX(), theF.NY(), kFloatMissing);
   theNablaY.Resize(theF.NX(), theF.NY(), kFloatMissing);
 
-  for (unsigned int j = 0; j < theF.NY(); j++)
-    for (unsigned int i = 0; i < theF.NX(); i++)
-    {
-      bool allok = theF[i][j] != kFloatMissing;
-      if (i > 0)
-        allok &= theF[i - 1][j] != kFloatMissing;
-      if (i < theF.NX() - 1)
-        allok &= theF[i + 1][j] != kFloatMissing;
-      if (j > 0)
-        allok &= theF[i][j - 1] != kFloatMissing;
-      if (j < theF.NY() - 1)
-        allok &= theF[i][j + 1] != kFloatMissing;
-
-      if (allok)
-      {
-        if (i == 0)
-          theNablaX[i][j] = (theF[i + 1][j] - theF[i][j]) / theDX;  // forward difference
-        else if (i == theF.NX() - 1)
-          theNablaX[i][j] = (theF[i][j] - theF[i - 1][j]) / theDX;  // backward difference
-        else
-          theNablaX[i][j] = (theF[i + 1][j] - theF[i - 1][j]) / (2 * theDX);  // centered difference
-
-        if (j == 0)
-          theNablaY[i][j] = (theF[i][j + 1] - theF[i][j]) / theDY;
-        else if (j == theF.NY() - 1)
-          theNablaY[i][j] = (theF[i][j] - theF[i][j - 1]) / theDY;
-        else
-          theNablaY[i][j] = (theF[i][j + 1] - theF[i][j - 1]) / (2 * theDY);
-      }
-      else
-      {
-        theNablaX[i][j] = kFloatMissing;
-        theNablaY[i][j] = kFloatMissing;
-      }
-    }
+  parallel_columns(theF.NX(),
+                   theThreads,
+                   [&](std::size_t i1, std::size_t i2)
+                   { nabla_columns(theF, theDX, theDY, theNablaX, theNablaY, i1, i2); });
 }
 
 // ----------------------------------------------------------------------
@@ -265,17 +463,22 @@ void matrix_abs(const NFmiDataMatrix<float> &theX,
 {
   theResult.Resize(theX.NX(), theY.NY(), kFloatMissing);
 
-  for (unsigned int j = 0; j < theX.NY(); j++)
-    for (unsigned int i = 0; i < theX.NX(); i++)
+  for (std::size_t i = 0; i < theX.NX(); i++)
+  {
+    const float *xs = &theX[i][0];
+    const float *ys = &theY[i][0];
+    float *result = &theResult[i][0];
+    for (std::size_t j = 0; j < theX.NY(); j++)
     {
-      const float x = theX[i][j];
-      const float y = theY[i][j];
+      const float x = xs[j];
+      const float y = ys[j];
 
       if (x == kFloatMissing || y == kFloatMissing)
-        theResult[i][j] = kFloatMissing;
+        result[j] = kFloatMissing;
       else
-        theResult[i][j] = sqrt(x * x + y * y);
+        result[j] = sqrt(x * x + y * y);
     }
+  }
 }
 
 // ----------------------------------------------------------------------
@@ -283,18 +486,20 @@ void matrix_abs(const NFmiDataMatrix<float> &theX,
  * \brief Return T2m advection field
  *
  * \param theQI The query info
- * \return The values in a matrix
+ * \param theValues The matrix to fill
+ * \param theThreads The number of threads to use
  */
 // ----------------------------------------------------------------------
 
-NFmiDataMatrix<float> t2m_advection(LazyQueryData &theQI)
+void t2m_advection(LazyQueryData &theQI, NFmiDataMatrix<float> &theValues, unsigned int theThreads)
 {
-  theQI.Param(kFmiTemperature);
-  auto t2m = theQI.Values();
-  theQI.Param(kFmiWindSpeedMS);
-  auto wspd = theQI.Values();
-  theQI.Param(kFmiWindDirection);
-  auto wdir = theQI.Values();
+  NFmiDataMatrix<float> &t2m = input1;
+  NFmiDataMatrix<float> &wdir = input2;
+  NFmiDataMatrix<float> &wspd = theValues;
+
+  fetch(theQI, kFmiTemperature, t2m);
+  fetch(theQI, kFmiWindSpeedMS, wspd);
+  fetch(theQI, kFmiWindDirection, wdir);
 
   // advection = v dot nabla(t)
   // we overwrite wspd with the results
@@ -307,51 +512,67 @@ NFmiDataMatrix<float> t2m_advection(LazyQueryData &theQI)
 
   const float pirad = 3.14159265358979323f / 360.f;
 
-  for (unsigned int j = 0; j < t2m.NY(); j++)
-    for (unsigned int i = 0; i < t2m.NX(); i++)
-    {
-      const float ff = wspd[i][j];
-      const float fd = wdir[i][j];
-
-      wspd[i][j] = kFloatMissing;
+  const std::size_t nx = t2m.NX();
+  const std::size_t ny = t2m.NY();
 
-      if (ff != kFloatMissing && fd != kFloatMissing)
+  parallel_columns(
+      nx,
+      theThreads,
+      [&](std::size_t i1, std::size_t i2)
       {
-        bool allok = t2m[i][j] != kFloatMissing;
-        if (i > 0)
-          allok &= t2m[i - 1][j] != kFloatMissing;
-        if (i < t2m.NX() - 1)
-          allok &= t2m[i + 1][j] != kFloatMissing;
-        if (j > 0)
-          allok &= t2m[i][j - 1] != kFloatMissing;
-        if (j < t2m.NY() - 1)
-          allok &= t2m[i][j + 1] != kFloatMissing;
-
-        if (allok)
+        for (std::size_t i = i1; i < i2; i++)
         {
-          float tx, ty;
-          if (i == 0)
-            tx = (t2m[i + 1][j] - t2m[i][j]) / dx;  // forward difference
-          else if (i == t2m.NX() - 1)
-            tx = (t2m[i][j] - t2m[i - 1][j]) / dx;  // backward difference
-          else
-            tx = (t2m[i + 1][j] - t2m[i - 1][j]) / (2 * dx);  // centered difference
-
-          if (j == 0)
-            ty = (t2m[i][j + 1] - t2m[i][j]) / dy;
-          else if (j == t2m.NY() - 1)
-            ty = (t2m[i][j] - t2m[i][j - 1]) / dy;
-          else
-            ty = (t2m[i][j + 1] - t2m[i][j - 1]) / (2 * dy);
-
-          const float adv =
-              -ff * (cos(fd * pirad) * tx + sin(fd * pirad) * ty) * 3600;  // degrees/hour
-
-          wspd[i][j] = adv;
+          const float *t = &t2m[i][0];
+          const float *tprev = (i > 0 ? &t2m[i - 1][0] : nullptr);
+          const float *tnext = (i < nx - 1 ? &t2m[i + 1][0] : nullptr);
+          const float *fds = &wdir[i][0];
+          float *ffs = &wspd[i][0];
+
+          for (std::size_t j = 0; j < ny; j++)
+          {
+            const float ff = ffs[j];
+            const float fd = fds[j];
+
+            ffs[j] = kFloatMissing;
+
+            if (ff != kFloatMissing && fd != kFloatMissing)
+            {
+              bool allok = t[j] != kFloatMissing;
+              if (tprev != nullptr)
+                allok &= tprev[j] != kFloatMissing;
+              if (tnext != nullptr)
+                allok &= tnext[j] != kFloatMissing;
+              if (j > 0)
+                allok &= t[j - 1] != kFloatMissing;
+              if (j < ny - 1)
+                allok &= t[j + 1] != kFloatMissing;
+
+              if (allok)
+              {
+                float tx, ty;
+                if (tprev == nullptr)
+                  tx = (tnext[j] - t[j]) / dx;  // forward difference
+                else if (tnext == nullptr)
+                  tx = (t[j] - tprev[j]) / dx;  // backward difference
+                else
+                  tx = (tnext[j] - tprev[j]) / (2 * dx);  // centered difference
+
+                if (j == 0)
+                  ty = (t[j + 1] - t[j]) / dy;
+                else if (j == ny - 1)
+                  ty = (t[j] - t[j - 1]) / dy;
+                else
+                  ty = (t[j + 1] - t[j - 1]) / (2 * dy);
+
+                const float adv =
+                    -ff * (cos(fd * pirad) * tx + sin(fd * pirad) * ty) * 3600;  // degrees/hour
+
+                ffs[j] = adv;
+              }
+            }
+          }
         }
-      }
-    }
-  return wspd;
+      });
 }
 
 // ----------------------------------------------------------------------
@@ -359,16 +580,17 @@ NFmiDataMatrix<float> t2m_advection(LazyQueryData &theQI)
  * \brief Return Thermal Front Parameter
  *
  * \param theQI The query info
- * \return The values in a matrix
+ * \param theValues The matrix to fill
+ * \param theThreads The number of threads to use
  */
 // ----------------------------------------------------------------------
 
-NFmiDataMatrix<float> thermal_front(LazyQueryData &theQI)
+void thermal_front(LazyQueryData &theQI, NFmiDataMatrix<float> &theValues, unsigned int theThreads)
 {
-  theQI.Param(kFmiTemperature);
-  auto t2m = theQI.Values();
+  NFmiDataMatrix<float> &t2m = input1;
+  fetch(theQI, kFmiTemperature, t2m);
 
-  NFmiDataMatrix<float> tfp;
+  NFmiDataMatrix<float> &tfp = theValues;
   tfp.Resize(t2m.NX(), t2m.NY(), kFloatMissing);
 
   // thermal front parameter = (-nabla |nabla T|) dot (nabla T /|nabla T|)
@@ -380,22 +602,30 @@ NFmiDataMatrix<float> thermal_front(LazyQueryData &theQI)
                    (static_cast<float>((theQI.Grid()->YNumber())));
 
   NFmiDataMatrix<float> nablatx, nablaty;
-  matrix_nabla(t2m, dx, dy, nablatx, nablaty);
+  matrix_nabla(t2m, dx, dy, nablatx, nablaty, theThreads);
 
   NFmiDataMatrix<float> nablat;
   matrix_abs(nablatx, nablaty, nablat);
 
   NFmiDataMatrix<float> nablanablatx, nablanablaty;
-  matrix_nabla(nablat, dx, dy, nablanablatx, nablanablaty);
-
-  for (unsigned int j = 0; j < t2m.NY(); j++)
-    for (unsigned int i = 0; i < t2m.NX(); i++)
+  matrix_nabla(nablat, dx, dy, nablanablatx, nablanablaty, theThreads);
+
+  for (std::size_t i = 0; i < t2m.NX(); i++)
+  {
+    const float *nntxs = &nablanablatx[i][0];
+    const float *nntys = &nablanablaty[i][0];
+    const float *ntxs = &nablatx[i][0];
+    const float *ntys = &nablaty[i][0];
+    const float *nts = &nablat[i][0];
+    float *result = &tfp[i][0];
+
+    for (std::size_t j = 0; j < t2m.NY(); j++)
     {
-      const float nntx = nablanablatx[i][j];
-      const float nnty = nablanablaty[i][j];
-      const float ntx = nablatx[i][j];
-      const float nty = nablaty[i][j];
-      const float nt = nablat[i][j];
+      const float nntx = nntxs[j];
+      const float nnty = nntys[j];
+      const float ntx = ntxs[j];
+      const float nty = ntys[j];
+      const float nt = nts[j];
 
       if (nntx != kFloatMissing && nnty != kFloatMissing && ntx != kFloatMissing &&
           nty != kFloatMissing && nt != kFloatMissing)
@@ -403,12 +633,12 @@ NFmiDataMatrix<float> thermal_front(LazyQueryData &theQI)
         // The 1e9 factor is there just to get a convenient scale
 
         if (nt != 0)
-          tfp[i][j] = static_cast<float>(-1e9 * (nntx * ntx + nnty * nty) / nt);
+          result[j] = static_cast<float>(-1e9 * (nntx * ntx + nnty * nty) / nt);
         else
-          tfp[i][j] = 0;
+          result[j] = 0;
       }
     }
-  return tfp;
+  }
 }
 
 // ----------------------------------------------------------------------
@@ -416,31 +646,31 @@ NFmiDataMatrix<float> thermal_front(LazyQueryData &theQI)
  * \brief Probability of snow according to the Gospel of Elina Saltikoff
  *
  * \param theQI The queryinfo
- * \return The valeus in a matrix
+ * \param theValues The matrix to fill
  */
 // ----------------------------------------------------------------------
 
-NFmiDataMatrix<float> snowprob(LazyQueryData &theQI)
+void snowprob(LazyQueryData &theQI, NFmiDataMatrix<float> &theValues)
 {
-  theQI.Param(kFmiTemperature);
-  auto t2m = theQI.Values();
-  theQI.Param(kFmiHumidity);
-  auto rh = theQI.Values();
+  fetch(theQI, kFmiTemperature, theValues);
+  fetch(theQI, kFmiHumidity, input1);
 
   // overwrite t2m with snowprob
 
-  for (unsigned int j = 0; j < t2m.NY(); j++)
-    for (unsigned int i = 0; i < t2m.NX(); i++)
+  for (std::size_t i = 0; i < theValues.NX(); i++)
+  {
+    float *t2m = &theValues[i][0];
+    const float *rh = &input1[i][0];
+    for (std::size_t j = 0; j < theValues.NY(); j++)
     {
-      if (t2m[i][j] == kFloatMissing)
+      if (t2m[j] == kFloatMissing)
         ;
-      else if (rh[i][j] == kFloatMissing)
-        t2m[i][j] = kFloatMissing;
+      else if (rh[j] == kFloatMissing)
+        t2m[j] = kFloatMissing;
       else
-        t2m[i][j] =
-            static_cast<float>(100 * (1 - 1 / (1 + exp(22 - 2.7 * t2m[i][j] - 0.2 * rh[i][j]))));
+        t2m[j] = static_cast<float>(100 * (1 - 1 / (1 + exp(22 - 2.7 * t2m[j] - 0.2 * rh[j]))));
     }
-  return t2m;
+  }
 }
 
 // ----------------------------------------------------------------------
@@ -448,45 +678,171 @@ NFmiDataMatrix<float> snowprob(LazyQueryData &theQI)
  * \brief Theta E
  *
  * \param theQI The queryinfo
- * \return The values in a matrix
+ * \param theValues The matrix to fill
  */
 // ----------------------------------------------------------------------
 
-NFmiDataMatrix<float> thetae(LazyQueryData &theQI)
+void thetae(LazyQueryData &theQI, NFmiDataMatrix<float> &theValues)
 {
-  theQI.Param(kFmiTemperature);
-  auto t2m = theQI.Values();
-  theQI.Param(kFmiHumidity);
-  auto rh = theQI.Values();
-  theQI.Param(kFmiPressure);
-  auto p = theQI.Values();
+  fetch(theQI, kFmiTemperature, theValues);
+  fetch(theQI, kFmiHumidity, input1);
+  fetch(theQI, kFmiPressure, input2);
 
   // overwrite t2m with thetae
 
-  for (unsigned int j = 0; j < t2m.NY(); j++)
-    for (unsigned int i = 0; i < t2m.NX(); i++)
+  for (std::size_t i = 0; i < theValues.NX(); i++)
+  {
+    float *t2m = &theValues[i][0];
+    const float *rh = &input1[i][0];
+    const float *p = &input2[i][0];
+    for (std::size_t j = 0; j < theValues.NY(); j++)
     {
-      if (t2m[i][j] == kFloatMissing || rh[i][j] == kFloatMissing || p[i][j] == kFloatMissing)
+      if (t2m[j] == kFloatMissing || rh[j] == kFloatMissing || p[j] == kFloatMissing)
       {
-        t2m[i][j] = kFloatMissing;
+        t2m[j] = kFloatMissing;
       }
       else
       {
-        float T = t2m[i][j];
-        float RH = rh[i][j];
-        float P = p[i][j];
-        t2m[i][j] = static_cast<float>(
+        float T = t2m[j];
+        float RH = rh[j];
+        float P = p[j];
+        t2m[j] = static_cast<float>(
             (273.15 + T) * pow(1000.0 / P, 0.286) +
             (3 * (RH * (3.884266 * pow(10.0, ((7.5 * T) / (237.7 + T)))) / 100)) - 273.15);
       }
     }
-  return t2m;
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Calculate the values of the given meta function
+ */
+// ----------------------------------------------------------------------
+
+void calculate(const std::string &theFunction,
+               LazyQueryData &theQI,
+               NFmiDataMatrix<float> &theValues,
+               unsigned int theThreads)
+{
+  if (theFunction == "MetaElevationAngle")
+    elevation_angle_values(theQI, theValues, theThreads);
+  else if (theFunction == "MetaWindChill")
+    wind_chill_values(theQI, theValues);
+  else if (theFunction == "MetaDewDifference")
+    dew_difference_values(theQI, theValues);
+  else if (theFunction == "MetaN")
+    n_cloudiness(theQI, theValues);
+  else if (theFunction == "MetaNN")
+    nn_cloudiness(theQI, theValues);
+  else if (theFunction == "MetaT2mAdvection")
+    t2m_advection(theQI, theValues, theThreads);
+  else if (theFunction == "MetaThermalFront")
+    thermal_front(theQI, theValues, theThreads);
+  else if (theFunction == "MetaDewDifferenceAir")
+    air_dew_difference_values(theQI, theValues);
+  else if (theFunction == "MetaSnowProb")
+    snowprob(theQI, theValues);
+  else if (theFunction == "MetaThetaE")
+    thetae(theQI, theValues);
+  else if (const MetaExpression *expression = find_user_meta(theFunction))
+    expression->values(theQI, theValues, theThreads);
+  else
+    throw runtime_error("Unrecognized meta function " + theFunction);
 }
 
 }  // namespace
 
 namespace MetaFunctions
 {
+// ----------------------------------------------------------------------
+/*!
+ * \brief Define a new meta parameter
+ *
+ * The name may not be an existing meta parameter or newbase parameter
+ * name. Throws if the expression cannot be compiled.
+ *
+ * \param theName The name of the parameter
+ * \param theExpression The expression to calculate it from
+ */
+// ----------------------------------------------------------------------
+
+void define(const std::string &theName, const std::string &theExpression)
+{
+  if (theName.empty())
+    throw runtime_error("metaparam name missing");
+
+  // Repeating an identical definition is accepted, so that the same
+  // script can be run several times
+
+  if (const MetaExpression *old = find_user_meta(theName))
+  {
+    auto trim = [](const std::string &theText)
+    {
+      const std::string::size_type pos1 = theText.find_first_not_of(" \t\r\n");
+      if (pos1 == std::string::npos)
+        return std::string();
+      const std::string::size_type pos2 = theText.find_last_not_of(" \t\r\n");
+      return theText.substr(pos1, pos2 - pos1 + 1);
+    };
+    if (trim(old->expression()) == trim(theExpression))
+      return;
+  }
+
+  if (isMeta(theName))
+    throw runtime_error("metaparam " + theName + " is already defined");
+
+  NFmiEnumConverter converter;
+  if (converter.ToEnum(theName) != kFmiBadParameter)
+    throw runtime_error("metaparam " + theName + " is a newbase parameter name");
+
+  std::shared_ptr<MetaExpression> expression(new MetaExpression(theExpression));
+  user_metas.push_back(std::make_pair(theName, expression));
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Forget all user defined meta parameters
+ *
+ * The values cached by the threads are forgotten too, since the
+ * names may be redefined.
+ */
+// ----------------------------------------------------------------------
+
+void clear()
+{
+  user_metas.clear();
+  ++meta_generation;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Set the unit conversions of the parameters in the expressions
+ *
+ * The parameters used in the user defined meta parameters are
+ * converted like the parameters rendered directly. The values cached
+ * by the threads are forgotten, since they may have been converted
+ * differently.
+ */
+// ----------------------------------------------------------------------
+
+void units(const UnitsConverter &theConverter)
+{
+  meta_units = theConverter;
+  ++meta_generation;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Return the unit conversions of the parameters in the expressions
+ */
+// ----------------------------------------------------------------------
+
+const UnitsConverter &units()
+{
+  return meta_units;
+}
+
 // ----------------------------------------------------------------------
 /*!
  * \brief Test if the given function name is a meta function
@@ -531,6 +887,10 @@ int id(const std::string &theFunction)
     return 10008;
   if (theFunction == "MetaThetaE")
     return 10009;
+
+  int userid = 0;
+  if (find_user_meta(theFunction, &userid) != nullptr)
+    return userid;
   return 0;
 }
 
@@ -541,36 +901,79 @@ int id(const std::string &theFunction)
  * An exception is thrown if the name is not recognized. One should
  * always test with isMeta first.
  *
+ * The values of the latest time are cached per thread, hence several
+ * specs for the same meta parameter calculate it only once.
+ *
  * \param theFunction The function name
  * \param theQI The query info
+ * \param theThreads The number of threads to use
  * \return A matrix of function values
  */
 // ----------------------------------------------------------------------
 
-NFmiDataMatrix<float> values(const std::string &theFunction, LazyQueryData &theQI)
+NFmiDataMatrix<float> values(const std::string &theFunction,
+                             LazyQueryData &theQI,
+                             unsigned int theThreads)
 {
-  if (theFunction == "MetaElevationAngle")
-    return elevation_angle_values(theQI);
-  if (theFunction == "MetaWindChill")
-    return wind_chill_values(theQI);
-  if (theFunction == "MetaDewDifference")
-    return dew_difference_values(theQI);
-  if (theFunction == "MetaN")
-    return n_cloudiness(theQI);
-  if (theFunction == "MetaNN")
-    return nn_cloudiness(theQI);
-  if (theFunction == "MetaT2mAdvection")
-    return t2m_advection(theQI);
-  if (theFunction == "MetaThermalFront")
-    return thermal_front(theQI);
-  if (theFunction == "MetaDewDifferenceAir")
-    return air_dew_difference_values(theQI);
-  if (theFunction == "MetaSnowProb")
-    return snowprob(theQI);
-  if (theFunction == "MetaThetaE")
-    return thetae(theQI);
+  if (!isMeta(theFunction))
+    throw runtime_error("Unrecognized meta function " + theFunction);
+
+  // Forget all values if the definitions have changed
+
+  if (meta_cache_generation != meta_generation)
+  {
+    meta_cache.clear();
+    meta_cache_generation = meta_generation;
+  }
+
+  const long long validtime = stamp(theQI.ValidTime());
+  const long long origintime = stamp(theQI.OriginTime());
+
+  const CacheKey key(theFunction, theQI.Filename(), theQI.GetLevelNumber());
+  CacheEntry &entry = meta_cache[key];
+  if (entry.valid && entry.filetime == theQI.FileTime() && entry.filesize == theQI.FileSize() &&
+      entry.validtime == validtime && entry.origintime == origintime)
+    return entry.values;
+
+  entry.valid = false;
+  try
+  {
+    calculate(theFunction, theQI, entry.values, theThreads);
+  }
+  catch (...)
+  {
+    meta_cache.erase(key);
+    throw;
+  }
+  entry.filetime = theQI.FileTime();
+  entry.filesize = theQI.FileSize();
+  entry.validtime = validtime;
+  entry.origintime = origintime;
+  entry.valid = true;
+  return entry.values;
+}
 
-  throw runtime_error("Unrecognized meta function " + theFunction);
+// ----------------------------------------------------------------------
+/*!
+ * \brief Calculate nabla of the given data
+ *
+ * \param theF The data to nabla
+ * \param theDX The grid x-resolution
+ * \param theDY The grid y-resolution
+ * \param theNablaX The X-part of the nabla
+ * \param theNablaY The Y-part of the nabla
+ * \param theThreads The number of threads to use
+ */
+// ----------------------------------------------------------------------
+
+void nabla(const NFmiDataMatrix<float> &theF,
+           float theDX,
+           float theDY,
+           NFmiDataMatrix<float> &theNablaX,
+           NFmiDataMatrix<float> &theNablaY,
+           unsigned int theThreads)
+{
+  matrix_nabla(theF, theDX, theDY, theNablaX, theNablaY, theThreads);
 }
 
 }  // namespace MetaFunctions
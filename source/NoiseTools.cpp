@@ -5,12 +5,234 @@
 // ======================================================================
 
 #include "NoiseTools.h"
+#include "TaskScheduler.h"
+
+#include <newbase/NFmiDataModifierClasses.h>
 
 #include <algorithm>
 #include <iterator>
+#include <vector>
 
 namespace NoiseTools
 {
+namespace
+{
+// ----------------------------------------------------------------------
+/*!
+ * \brief Fenwick tree for counting ranks in a sliding window
+ *
+ * Supports adding and removing ranks and finding the k:th smallest
+ * rank in the window in logarithmic time.
+ */
+// ----------------------------------------------------------------------
+
+class RankCounter
+{
+ public:
+  RankCounter(std::size_t theSize) : itsTree(theSize + 1, 0), itsCount(0), itsTop(1)
+  {
+    while (itsTop * 2 <= theSize)
+      itsTop *= 2;
+  }
+
+  std::size_t count() const { return itsCount; }
+
+  void add(int theRank, int theDelta)
+  {
+    itsCount += theDelta;
+    for (std::size_t i = theRank + 1; i < itsTree.size(); i += (i & (~i + 1)))
+      itsTree[i] += theDelta;
+  }
+
+  // Return the 0-based k:th smallest rank
+
+  int kth(std::size_t k) const
+  {
+    std::size_t pos = 0;
+    for (std::size_t step = itsTop; step > 0; step /= 2)
+    {
+      const std::size_t next = pos + step;
+      if (next < itsTree.size() && static_cast<std::size_t>(itsTree[next]) <= k)
+      {
+        pos = next;
+        k -= itsTree[next];
+      }
+    }
+    return static_cast<int>(pos);
+  }
+
+ private:
+  std::vector<int> itsTree;
+  std::size_t itsCount;
+  std::size_t itsTop;
+};
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Sliding window weighted median filter on ranked data
+ *
+ * The values have been replaced by their ranks among the distinct
+ * values of the grid, missing values are marked with -1. Each
+ * row is processed by sliding the window horizontally, adding and
+ * removing one column at a time. Since the filter only ever outputs
+ * values of the original grid, the ranks remain valid for all
+ * iterations and the result is identical to sorting each window.
+ *
+ * \param theRanks The ranks of the values, column major
+ * \param theNewRanks The filtered ranks
+ * \param theValues The distinct values in ascending order
+ * \param theRow1 The first row to process
+ * \param theRow2 The end of the rows to process
+ */
+// ----------------------------------------------------------------------
+
+void despeckle_rows(const std::vector<int>& theRanks,
+                    std::vector<int>& theNewRanks,
+                    const std::vector<float>& theValues,
+                    size_t theNX,
+                    size_t theNY,
+                    float theLoLimit,
+                    float theHiLimit,
+                    size_t theRadius,
+                    float theWeight,
+                    size_t theRow1,
+                    size_t theRow2)
+{
+  RankCounter counter(theValues.size());
+
+  for (size_t j = theRow1; j < theRow2; j++)
+  {
+    const size_t jj1 = j - std::min(j, theRadius);
+    const size_t jj2 = std::min(theNY, j + theRadius + 1);
+
+    auto update = [&](size_t ii, int delta)
+    {
+      for (size_t jj = jj1; jj < jj2; ++jj)
+      {
+        const int rank = theRanks[ii * theNY + jj];
+        if (rank >= 0)
+          counter.add(rank, delta);
+      }
+    };
+
+    for (size_t ii = 0; ii < std::min(theNX, theRadius + 1); ++ii)
+      update(ii, 1);
+
+    for (size_t i = 0; i < theNX; i++)
+    {
+      if (i > 0)
+      {
+        if (i + theRadius < theNX)
+          update(i + theRadius, 1);
+        if (i > theRadius)
+          update(i - theRadius - 1, -1);
+      }
+
+      // Do not filter the pixel if the value is missing
+      // or the value is not in the desired range
+
+      const int oldrank = theRanks[i * theNY + j];
+      if (oldrank < 0)
+        continue;
+      const float oldvalue = theValues[oldrank];
+      if (theLoLimit != kFloatMissing && oldvalue < theLoLimit)
+        continue;
+      if (theHiLimit != kFloatMissing && oldvalue > theHiLimit)
+        continue;
+
+      if (counter.count() > 0)
+      {
+        int pos = static_cast<int>(
+            round((static_cast<float>(counter.count()) - 1) * theWeight / 100.0));
+        theNewRanks[i * theNY + j] = counter.kth(pos);
+      }
+    }
+
+    // Empty the window for the next row
+
+    for (size_t ii = theNX - std::min(theNX, theRadius + 1); ii < theNX; ++ii)
+      update(ii, -1);
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Recursive weighted median filter using sliding windows
+ *
+ * The cost per pixel is proportional to the radius instead of the
+ * area of the window. Rows are processed in parallel.
+ */
+// ----------------------------------------------------------------------
+
+void despeckle_sliding(NFmiDataMatrix<float>& theValues,
+                       float theLoLimit,
+                       float theHiLimit,
+                       size_t theRadius,
+                       float theWeight,
+                       int theIterations,
+                       unsigned int theThreads)
+{
+  const size_t nx = theValues.NX();
+  const size_t ny = theValues.NY();
+
+  // Rank the values
+
+  std::vector<float> values;
+  values.reserve(nx * ny);
+  for (size_t i = 0; i < nx; i++)
+    for (size_t j = 0; j < ny; j++)
+      if (theValues[i][j] != kFloatMissing)
+        values.push_back(theValues[i][j]);
+
+  if (values.empty())
+    return;
+
+  std::sort(values.begin(), values.end());
+  values.erase(std::unique(values.begin(), values.end()), values.end());
+
+  std::vector<int> ranks(nx * ny, -1);
+  for (size_t i = 0; i < nx; i++)
+    for (size_t j = 0; j < ny; j++)
+      if (theValues[i][j] != kFloatMissing)
+        ranks[i * ny + j] = static_cast<int>(
+            std::lower_bound(values.begin(), values.end(), theValues[i][j]) - values.begin());
+
+  // Filter
+
+  const size_t nthreads = std::max<size_t>(1, std::min<size_t>(theThreads, ny));
+
+  for (int iter = 0; iter < theIterations; ++iter)
+  {
+    std::vector<int> newranks(ranks);
+
+    TaskScheduler::run(nthreads,
+                       nthreads,
+                       [&](size_t t)
+                       {
+                         despeckle_rows(ranks,
+                                        newranks,
+                                        values,
+                                        nx,
+                                        ny,
+                                        theLoLimit,
+                                        theHiLimit,
+                                        theRadius,
+                                        theWeight,
+                                        t * ny / nthreads,
+                                        (t + 1) * ny / nthreads);
+                       });
+
+    ranks.swap(newranks);
+  }
+
+  for (size_t i = 0; i < nx; i++)
+    for (size_t j = 0; j < ny; j++)
+      if (ranks[i * ny + j] >= 0)
+        theValues[i][j] = values[ranks[i * ny + j]];
+}
+
+}  // namespace
+
 // ----------------------------------------------------------------------
 /*!
  * \brief Weighted median filter
@@ -92,11 +314,15 @@ void despeckle(NFmiDataMatrix<float>& theValues,
 /*!
  * \brief Recursive weighted median filter
  *
+ * For radius 2 and larger a sliding window algorithm is used,
+ * the results are identical.
+ *
  * \param theLoLimit Lolimit for data to filter (or kFloatMissing)
  * \param theHiLimit Hilimit for data to filter (or kFloatMissing)
  * \param theRadius The median filter radius
  * \param theWeight The median filter weight
  * \param theIterations The number of iterations
+ * \param theThreads The number of threads to use
  */
 // ----------------------------------------------------------------------
 
@@ -105,16 +331,61 @@ void despeckle(NFmiDataMatrix<float>& theValues,
                float theHiLimit,
                int theRadius,
                float theWeight,
-               int theIterations)
+               int theIterations,
+               unsigned int theThreads)
 {
   // Quick exits for trivial cases
   if (theRadius < 1 || theIterations < 1)
     return;
 
+  if (theRadius >= 2)
+  {
+    despeckle_sliding(
+        theValues, theLoLimit, theHiLimit, theRadius, theWeight, theIterations, theThreads);
+    return;
+  }
+
   for (int iter = 0; iter < theIterations; ++iter)
     despeckle(theValues, theLoLimit, theHiLimit, theRadius, theWeight);
 }
 
+// ----------------------------------------------------------------------
+/*!
+ * \brief Expand the data values
+ *
+ * First we try to calculate the mean from adjacent values.
+ * If that fails, we try to calculate the mean from diagonal values.
+ */
+// ----------------------------------------------------------------------
+
+void expand(NFmiDataMatrix<float>& theValues)
+{
+  NFmiDataModifierAvg calculator;
+
+  NFmiDataMatrix<float> tmp(theValues);
+
+  for (unsigned int j = 0; j < theValues.NY(); j++)
+    for (unsigned int i = 0; i < theValues.NX(); i++)
+    {
+      if (theValues[i][j] == kFloatMissing)
+      {
+        calculator.Clear();
+        calculator.Calculate(tmp.At(i - 1, j, kFloatMissing));
+        calculator.Calculate(tmp.At(i + 1, j, kFloatMissing));
+        calculator.Calculate(tmp.At(i, j - 1, kFloatMissing));
+        calculator.Calculate(tmp.At(i, j + 1, kFloatMissing));
+        if (calculator.CalculationResult() == kFloatMissing)
+        {
+          calculator.Calculate(tmp.At(i - 1, j - 1, kFloatMissing));
+          calculator.Calculate(tmp.At(i - 1, j + 1, kFloatMissing));
+          calculator.Calculate(tmp.At(i + 1, j - 1, kFloatMissing));
+          calculator.Calculate(tmp.At(i + 1, j + 1, kFloatMissing));
+        }
+        theValues[i][j] = calculator.CalculationResult();
+      }
+    }
+}
+
 }  // namespace NoiseTools
 
 // ======================================================================
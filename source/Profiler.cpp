@@ -0,0 +1,453 @@
+// ======================================================================
+/*!
+ * \file
+ * \brief Implementation of namespace Profiler
+ */
+// ======================================================================
+
+#include "Profiler.h"
+
+#include <atomic>
+#include <chrono>
+#include <ctime>
+#include <fstream>
+#include <iomanip>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+
+namespace Profiler
+{
+// ----------------------------------------------------------------------
+/*!
+ * \brief The time spent in one phase of a record
+ */
+// ----------------------------------------------------------------------
+
+struct PhaseData
+{
+  long long calls = 0;
+  double wall = 0;
+  double cpu = 0;
+};
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief The phases and counters of a record
+ */
+// ----------------------------------------------------------------------
+
+struct RecordData
+{
+  std::string kind;
+  std::string time;
+  std::string name;
+  double wall = 0;
+  double cpu = 0;
+  double helpers = 0;  // CPU time of the helper threads
+  std::map<std::string, PhaseData> phases;
+  std::map<std::string, long long> counters;
+  std::mutex mutex;  // protects the above from the helpers
+};
+
+namespace
+{
+std::atomic<bool> isEnabled(false);
+std::mutex itsMutex;  // protects the output and the script record
+std::ofstream itsOutput;
+RecordData itsScript;
+
+thread_local RecordData* itsCurrent = nullptr;
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Wall clock time in seconds
+ */
+// ----------------------------------------------------------------------
+
+double wall_time()
+{
+  using namespace std::chrono;
+  return duration<double>(steady_clock::now().time_since_epoch()).count();
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief CPU time of the calling thread in seconds
+ */
+// ----------------------------------------------------------------------
+
+double cpu_time()
+{
+  struct timespec ts;
+  if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0)
+    return 0;
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Quote a string for JSON
+ */
+// ----------------------------------------------------------------------
+
+std::string json_string(const std::string& theString)
+{
+  std::ostringstream out;
+  out << '"';
+  for (unsigned char ch : theString)
+  {
+    if (ch == '"' || ch == '\\')
+      out << '\\' << ch;
+    else if (ch < 0x20)
+      out << "\\u" << std::hex << std::setw(4) << std::setfill('0') << static_cast<int>(ch)
+          << std::dec;
+    else
+      out << ch;
+  }
+  out << '"';
+  return out.str();
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Format a record as a JSON line
+ */
+// ----------------------------------------------------------------------
+
+std::string json_line(const RecordData& theRecord)
+{
+  std::ostringstream out;
+  out << std::fixed << std::setprecision(6);
+  out << "{\"record\":" << json_string(theRecord.kind);
+  if (!theRecord.time.empty())
+    out << ",\"time\":" << json_string(theRecord.time);
+  if (!theRecord.name.empty())
+    out << ",\"name\":" << json_string(theRecord.name);
+  out << ",\"wall\":" << theRecord.wall << ",\"cpu\":" << theRecord.cpu;
+
+  out << ",\"phases\":{";
+  const char* separator = "";
+  for (const auto& phase : theRecord.phases)
+  {
+    out << separator << json_string(phase.first) << ":{\"calls\":" << phase.second.calls
+        << ",\"wall\":" << phase.second.wall << ",\"cpu\":" << phase.second.cpu << '}';
+    separator = ",";
+  }
+
+  out << "},\"counters\":{";
+  separator = "";
+  for (const auto& counter : theRecord.counters)
+  {
+    out << separator << json_string(counter.first) << ':' << counter.second;
+    separator = ",";
+  }
+  out << "}}\n";
+  return out.str();
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Reset the record of work done outside records
+ *
+ * The mutex must be locked by the caller.
+ */
+// ----------------------------------------------------------------------
+
+void reset_script()
+{
+  itsScript.kind = "script";
+  itsScript.wall = 0;
+  itsScript.cpu = 0;
+  itsScript.helpers = 0;
+  itsScript.phases.clear();
+  itsScript.counters.clear();
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Write and reset the record of work done outside records
+ *
+ * The mutex must be locked by the caller.
+ */
+// ----------------------------------------------------------------------
+
+void flush_script()
+{
+  if (!itsScript.phases.empty() || !itsScript.counters.empty())
+    itsOutput << json_line(itsScript);
+  reset_script();
+  itsOutput.flush();
+}
+
+}  // namespace
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Start writing the profile to the given file
+ *
+ * A previously opened profile is closed first.
+ */
+// ----------------------------------------------------------------------
+
+void open(const std::string& theFile)
+{
+  close();
+
+  std::lock_guard<std::mutex> lock(itsMutex);
+  itsOutput.open(theFile.c_str(), std::ios::out | std::ios::trunc);
+  if (!itsOutput)
+    throw std::runtime_error("Failed to open profile '" + theFile + "' for writing");
+  reset_script();
+  isEnabled = true;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Stop profiling and close the profile
+ */
+// ----------------------------------------------------------------------
+
+void close()
+{
+  std::lock_guard<std::mutex> lock(itsMutex);
+  if (!isEnabled)
+    return;
+  isEnabled = false;
+  flush_script();
+  itsOutput.close();
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Write the buffered records to the profile
+ *
+ * Needed before forking, so that the child does not write the records
+ * of the parent again.
+ */
+// ----------------------------------------------------------------------
+
+void flush()
+{
+  std::lock_guard<std::mutex> lock(itsMutex);
+  if (isEnabled)
+    itsOutput.flush();
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Test whether profiling is enabled
+ */
+// ----------------------------------------------------------------------
+
+bool enabled()
+{
+  return isEnabled;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Add to a counter of the innermost record of the thread
+ */
+// ----------------------------------------------------------------------
+
+void count(const std::string& theCounter, long long theValue)
+{
+  if (!isEnabled)
+    return;
+
+  if (itsCurrent != nullptr)
+  {
+    std::lock_guard<std::mutex> lock(itsCurrent->mutex);
+    itsCurrent->counters[theCounter] += theValue;
+  }
+  else
+  {
+    std::lock_guard<std::mutex> lock(itsMutex);
+    itsScript.counters[theCounter] += theValue;
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief The innermost record of the calling thread
+ */
+// ----------------------------------------------------------------------
+
+RecordData* current()
+{
+  return itsCurrent;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Start a new record for the calling thread
+ *
+ * \param theKind The kind of the work, for example "frame" or "spec"
+ * \param theTime The time step, if any
+ * \param theName The name of the parameter or the file, if any
+ */
+// ----------------------------------------------------------------------
+
+Record::Record(const char* theKind, const std::string& theTime, const std::string& theName)
+    : itsData(nullptr), itsParent(itsCurrent)
+{
+  if (!isEnabled)
+    return;
+
+  itsData = new RecordData;
+  itsData->kind = theKind;
+  itsData->time = theTime;
+  itsData->name = theName;
+  itsData->wall = wall_time();
+  itsData->cpu = cpu_time();
+  itsCurrent = itsData;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Write the record and return to the enclosing record
+ */
+// ----------------------------------------------------------------------
+
+Record::~Record()
+{
+  if (itsData == nullptr)
+    return;
+
+  itsData->wall = wall_time() - itsData->wall;
+  itsData->cpu = cpu_time() - itsData->cpu;
+  itsCurrent = itsParent;
+
+  std::string line;
+  {
+    std::lock_guard<std::mutex> lock(itsData->mutex);
+    itsData->cpu += itsData->helpers;
+    line = json_line(*itsData);
+  }
+  delete itsData;
+
+  std::lock_guard<std::mutex> lock(itsMutex);
+  if (isEnabled)
+    itsOutput << line;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Start timing a phase
+ */
+// ----------------------------------------------------------------------
+
+Phase::Phase(const char* theName) : itsName(nullptr), itsWall(0), itsCpu(0), itsHelpers(0)
+{
+  if (!isEnabled)
+    return;
+
+  itsName = theName;
+  itsWall = wall_time();
+  itsCpu = cpu_time();
+  if (itsCurrent != nullptr)
+  {
+    std::lock_guard<std::mutex> lock(itsCurrent->mutex);
+    itsHelpers = itsCurrent->helpers;
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Add the time spent to the innermost record of the thread
+ *
+ * The CPU time includes the helpers of the record during the phase.
+ */
+// ----------------------------------------------------------------------
+
+Phase::~Phase()
+{
+  if (itsName == nullptr)
+    return;
+
+  const double wall = wall_time() - itsWall;
+  double cpu = cpu_time() - itsCpu;
+
+  auto add = [&](RecordData& theRecord)
+  {
+    PhaseData& phase = theRecord.phases[itsName];
+    ++phase.calls;
+    phase.wall += wall;
+    phase.cpu += cpu;
+  };
+
+  if (itsCurrent != nullptr)
+  {
+    std::lock_guard<std::mutex> lock(itsCurrent->mutex);
+    cpu += itsCurrent->helpers - itsHelpers;
+    add(*itsCurrent);
+  }
+  else
+  {
+    std::lock_guard<std::mutex> lock(itsMutex);
+    if (isEnabled)
+      add(itsScript);
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Start working on behalf of a record of another thread
+ *
+ * The phases and counters of the calling thread are collected
+ * separately until the helper ends, the record may meanwhile be
+ * updated by its own thread and by other helpers. The record must
+ * outlive the helper.
+ *
+ * \param theRecord The record to help, or null for none
+ */
+// ----------------------------------------------------------------------
+
+Helper::Helper(RecordData* theRecord)
+    : itsRecord(nullptr), itsData(nullptr), itsPrevious(itsCurrent), itsCpu(0)
+{
+  if (!isEnabled || theRecord == nullptr || theRecord == itsCurrent)
+    return;
+
+  itsRecord = theRecord;
+  itsData = new RecordData;
+  itsCpu = cpu_time();
+  itsCurrent = itsData;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Add the work done to the record helped
+ */
+// ----------------------------------------------------------------------
+
+Helper::~Helper()
+{
+  if (itsData == nullptr)
+    return;
+
+  const double cpu = cpu_time() - itsCpu;
+  itsCurrent = itsPrevious;
+
+  {
+    std::lock_guard<std::mutex> lock(itsRecord->mutex);
+    itsRecord->helpers += cpu + itsData->helpers;
+    for (const auto& phase : itsData->phases)
+    {
+      PhaseData& data = itsRecord->phases[phase.first];
+      data.calls += phase.second.calls;
+      data.wall += phase.second.wall;
+      data.cpu += phase.second.cpu;
+    }
+    for (const auto& counter : itsData->counters)
+      itsRecord->counters[counter.first] += counter.second;
+  }
+
+  delete itsData;
+}
+
+}  // namespace Profiler
+
+// ======================================================================
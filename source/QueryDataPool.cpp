@@ -0,0 +1,185 @@
+// ======================================================================
+/*!
+ * \file
+ * \brief Implementation of class QueryDataPool
+ */
+// ======================================================================
+
+#include "QueryDataPool.h"
+
+#include "LazyQueryData.h"
+
+#include <newbase/NFmiFileSystem.h>
+
+#include <algorithm>
+#include <exception>
+#include <sstream>
+#include <thread>
+
+using namespace std;
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Return the identity of the given file
+ *
+ * The identity changes whenever the file is modified.
+ */
+// ----------------------------------------------------------------------
+
+string QueryDataPool::identity(const string& theFile)
+{
+  ostringstream out;
+  out << theFile << ' ' << NFmiFileSystem::FileModificationTime(theFile) << ' '
+      << NFmiFileSystem::FileSize(theFile);
+  return out.str();
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Set the maximum number of bytes the files may use
+ *
+ * Value 0 means no limit.
+ */
+// ----------------------------------------------------------------------
+
+void QueryDataPool::maxbytes(std::size_t theMaxBytes)
+{
+  std::lock_guard<std::mutex> lock(itsMutex);
+  itsMaxBytes = theMaxBytes;
+  evict(vector<string>());
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Clear the pool
+ */
+// ----------------------------------------------------------------------
+
+void QueryDataPool::clear()
+{
+  std::lock_guard<std::mutex> lock(itsMutex);
+  itsData.clear();
+  itsBytes = 0;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Return new iterators to the given files
+ *
+ * Files not found in the pool, or changed since they were read,
+ * are read in parallel.
+ */
+// ----------------------------------------------------------------------
+
+vector<std::shared_ptr<LazyQueryData> > QueryDataPool::get(const vector<string>& theFiles)
+{
+  std::lock_guard<std::mutex> lock(itsMutex);
+
+  // Establish which files must be read
+
+  vector<string> names;
+  vector<string> identities;
+  for (const string& file : theFiles)
+  {
+    if (find(names.begin(), names.end(), file) != names.end())
+      continue;
+
+    const string id = identity(file);
+    auto it = itsData.find(file);
+    if (it != itsData.end() && it->second.identity == id)
+      continue;
+
+    names.push_back(file);
+    identities.push_back(id);
+  }
+
+  // Read them in parallel
+
+  vector<std::shared_ptr<LazyQueryData> > loaded(names.size());
+  vector<std::exception_ptr> errors(names.size());
+  vector<std::thread> readers;
+
+  for (std::size_t i = 0; i < names.size(); i++)
+    readers.emplace_back(
+        [&, i]()
+        {
+          try
+          {
+            std::shared_ptr<LazyQueryData> data(new LazyQueryData());
+            data->Read(names[i]);
+            loaded[i] = data;
+          }
+          catch (...)
+          {
+            errors[i] = std::current_exception();
+          }
+        });
+
+  for (auto& reader : readers)
+    reader.join();
+
+  for (const auto& error : errors)
+    if (error)
+      std::rethrow_exception(error);
+
+  // Store them
+
+  for (std::size_t i = 0; i < names.size(); i++)
+  {
+    Entry& entry = itsData[names[i]];
+    itsBytes -= entry.bytes;
+    entry.identity = identities[i];
+    entry.bytes = NFmiFileSystem::FileSize(names[i]);
+    entry.data = loaded[i];
+    itsBytes += entry.bytes;
+  }
+
+  // Hand out iterators of their own
+
+  vector<std::shared_ptr<LazyQueryData> > ret;
+  for (const string& file : theFiles)
+  {
+    Entry& entry = itsData[file];
+    entry.lastuse = ++itsCounter;
+    ret.push_back(entry.data->Clone());
+  }
+
+  evict(theFiles);
+
+  return ret;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Discard the least recently used files exceeding the limit
+ *
+ * The given files are kept even if they alone exceed the limit.
+ * The caller must hold the lock.
+ */
+// ----------------------------------------------------------------------
+
+void QueryDataPool::evict(const vector<string>& theKeptFiles)
+{
+  if (itsMaxBytes == 0)
+    return;
+
+  while (itsBytes > itsMaxBytes)
+  {
+    auto oldest = itsData.end();
+    for (auto it = itsData.begin(); it != itsData.end(); ++it)
+    {
+      if (find(theKeptFiles.begin(), theKeptFiles.end(), it->first) != theKeptFiles.end())
+        continue;
+      if (oldest == itsData.end() || it->second.lastuse < oldest->second.lastuse)
+        oldest = it;
+    }
+
+    if (oldest == itsData.end())
+      return;
+
+    itsBytes -= oldest->second.bytes;
+    itsData.erase(oldest);
+  }
+}
+
+// ======================================================================
@@ -0,0 +1,240 @@
+// ======================================================================
+/*!
+ * \file
+ * \brief Implementation of namespace RangeTools
+ */
+// ======================================================================
+/*!
+ * \namespace RangeTools
+ *
+ * \brief Classification of values into contour ranges
+ *
+ * A value is inside a range if it is not below the lower limit and
+ * is below the upper limit. Missing limits are open, and a range with
+ * both limits missing contains only the missing values. Missing values
+ * are in no other range.
+ *
+ * The grid is classified against one range at a time by a kernel
+ * specialized for the open limits of the range, so that the inner
+ * loop has no branches and can be vectorized. The test for missing
+ * values is compiled in only when the limits alone would accept the
+ * missing value.
+ */
+// ======================================================================
+
+#include "RangeTools.h"
+
+#include <cmath>
+#include <stdexcept>
+
+namespace RangeTools
+{
+namespace
+{
+// ----------------------------------------------------------------------
+/*!
+ * \brief Range membership for the given open limits
+ *
+ * The comparisons are negated so that NaN is accepted like it always
+ * has been.
+ */
+// ----------------------------------------------------------------------
+
+template <bool HasLo, bool HasHi, bool CheckMissing>
+struct Inside
+{
+  static bool test(float theValue, float theLoLimit, float theHiLimit)
+  {
+    bool inside = true;
+    if (HasLo)
+      inside &= !(theValue < theLoLimit);
+    if (HasHi)
+      inside &= !(theValue >= theHiLimit);
+    if (CheckMissing)
+      inside &= (theValue != kFloatMissing);
+    return inside;
+  }
+};
+
+template <bool CheckMissing>
+struct Inside<false, false, CheckMissing>
+{
+  static bool test(float theValue, float, float) { return (theValue == kFloatMissing); }
+};
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Assign the range index to the unclassified values inside it
+ */
+// ----------------------------------------------------------------------
+
+template <bool HasLo, bool HasHi, bool CheckMissing>
+void classify_range(const float* theValues,
+                    std::size_t theCount,
+                    float theLoLimit,
+                    float theHiLimit,
+                    std::uint16_t theIndex,
+                    std::uint16_t* theIndexes)
+{
+  for (std::size_t k = 0; k < theCount; k++)
+  {
+    const bool inside =
+        Inside<HasLo, HasHi, CheckMissing>::test(theValues[k], theLoLimit, theHiLimit);
+    theIndexes[k] = ((theIndexes[k] == none && inside) ? theIndex : theIndexes[k]);
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Choose the kernel for the limits of the range
+ */
+// ----------------------------------------------------------------------
+
+void classify_range(const float* theValues,
+                    std::size_t theCount,
+                    const Range& theRange,
+                    std::uint16_t theIndex,
+                    std::uint16_t* theIndexes)
+{
+  const float lo = theRange.first;
+  const float hi = theRange.second;
+  const bool haslo = (lo != kFloatMissing);
+  const bool hashi = (hi != kFloatMissing);
+
+  // Would the limits accept the missing value
+
+  const bool check = ((!haslo || !(kFloatMissing < lo)) && (!hashi || !(kFloatMissing >= hi)));
+
+  if (!haslo && !hashi)
+    classify_range<false, false, false>(theValues, theCount, lo, hi, theIndex, theIndexes);
+  else if (!haslo)
+  {
+    if (check)
+      classify_range<false, true, true>(theValues, theCount, lo, hi, theIndex, theIndexes);
+    else
+      classify_range<false, true, false>(theValues, theCount, lo, hi, theIndex, theIndexes);
+  }
+  else if (!hashi)
+  {
+    if (check)
+      classify_range<true, false, true>(theValues, theCount, lo, hi, theIndex, theIndexes);
+    else
+      classify_range<true, false, false>(theValues, theCount, lo, hi, theIndex, theIndexes);
+  }
+  else
+  {
+    if (check)
+      classify_range<true, true, true>(theValues, theCount, lo, hi, theIndex, theIndexes);
+    else
+      classify_range<true, true, false>(theValues, theCount, lo, hi, theIndex, theIndexes);
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Make sure the ranges can be indexed
+ */
+// ----------------------------------------------------------------------
+
+void check_ranges(const std::vector<Range>& theRanges)
+{
+  if (theRanges.size() >= none)
+    throw std::runtime_error("RangeTools: Too many ranges to classify");
+}
+
+}  // namespace
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Test whether two ranges may contain the same value
+ */
+// ----------------------------------------------------------------------
+
+bool overlap(const Range& theRange1, const Range& theRange2)
+{
+  auto missing = [](const Range& theRange)
+  { return (theRange.first == kFloatMissing && theRange.second == kFloatMissing); };
+  auto lower = [](const Range& theRange)
+  { return (theRange.first == kFloatMissing ? -HUGE_VALF : theRange.first); };
+  auto upper = [](const Range& theRange)
+  { return (theRange.second == kFloatMissing ? HUGE_VALF : theRange.second); };
+
+  if (missing(theRange1) || missing(theRange2))
+    return (missing(theRange1) && missing(theRange2));
+  return (lower(theRange1) < upper(theRange2) && lower(theRange2) < upper(theRange1));
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Test whether no two ranges may contain the same value
+ */
+// ----------------------------------------------------------------------
+
+bool disjoint(const std::vector<Range>& theRanges)
+{
+  for (std::size_t i = 0; i < theRanges.size(); i++)
+    for (std::size_t j = i + 1; j < theRanges.size(); j++)
+      if (overlap(theRanges[i], theRanges[j]))
+        return false;
+  return true;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Find the first range containing each value
+ *
+ * \param theValues The values
+ * \param theCount The number of values
+ * \param theRanges The ranges in order of preference
+ * \param theIndexes The index of the range of each value, or none
+ */
+// ----------------------------------------------------------------------
+
+void classify(const float* theValues,
+              std::size_t theCount,
+              const std::vector<Range>& theRanges,
+              std::vector<std::uint16_t>& theIndexes)
+{
+  check_ranges(theRanges);
+  theIndexes.assign(theCount, none);
+  if (theCount == 0)
+    return;
+
+  for (std::size_t r = 0; r < theRanges.size(); r++)
+    classify_range(
+        theValues, theCount, theRanges[r], static_cast<std::uint16_t>(r), &theIndexes[0]);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Find the first range containing each grid value
+ *
+ * The columns of the grid are classified one at a time, since they
+ * are stored separately.
+ *
+ * \param theValues The grid
+ * \param theRanges The ranges in order of preference
+ * \param theIndexes The index of the range of element (i,j) at i*NY+j, or none
+ */
+// ----------------------------------------------------------------------
+
+void classify(const NFmiDataMatrix<float>& theValues,
+              const std::vector<Range>& theRanges,
+              std::vector<std::uint16_t>& theIndexes)
+{
+  check_ranges(theRanges);
+  const std::size_t nx = theValues.NX();
+  const std::size_t ny = theValues.NY();
+  theIndexes.assign(nx * ny, none);
+  if (ny == 0)
+    return;
+
+  for (std::size_t i = 0; i < nx; i++)
+    for (std::size_t r = 0; r < theRanges.size(); r++)
+      classify_range(
+          &theValues[i][0], ny, theRanges[r], static_cast<std::uint16_t>(r), &theIndexes[i * ny]);
+}
+
+}  // namespace RangeTools
+
+// ======================================================================
@@ -0,0 +1,91 @@
+// ======================================================================
+/*!
+ * \file
+ * \brief Implementation of class ShapeCache
+ */
+// ======================================================================
+
+#include "ShapeCache.h"
+
+#include <newbase/NFmiArea.h>
+#include <newbase/NFmiFileSystem.h>
+
+#include <iomanip>
+#include <sstream>
+
+using namespace std;
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Return the identity of the given shapefile
+ *
+ * The shapefile may be named with or without the .shp suffix.
+ */
+// ----------------------------------------------------------------------
+
+string ShapeCache::identity(const string& theFile)
+{
+  string file = theFile + ".shp";
+  if (!NFmiFileSystem::FileExists(file))
+    file = theFile;
+
+  ostringstream out;
+  out << NFmiFileSystem::FileModificationTime(file) << ' ' << NFmiFileSystem::FileSize(file);
+  return out.str();
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Clear the cache
+ */
+// ----------------------------------------------------------------------
+
+void ShapeCache::clear()
+{
+  std::lock_guard<std::mutex> lock(itsMutex);
+  itsCache.clear();
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Return the shapefile projected onto the given area
+ *
+ * The file is read without holding the lock. Should two threads read
+ * the same shape simultaneously, the first one is kept.
+ */
+// ----------------------------------------------------------------------
+
+std::shared_ptr<const Imagine::NFmiGeoShape> ShapeCache::find(const string& theFile,
+                                                              const NFmiArea& theArea)
+{
+  const string id = identity(theFile);
+
+  ostringstream out;
+  out << setprecision(12) << theArea;
+  const string areakey = out.str();
+
+  {
+    std::lock_guard<std::mutex> lock(itsMutex);
+    Entry& entry = itsCache[theFile];
+    if (entry.identity != id)
+    {
+      entry.identity = id;
+      entry.shapes.clear();
+    }
+    auto it = entry.shapes.find(areakey);
+    if (it != entry.shapes.end())
+      return it->second;
+  }
+
+  std::shared_ptr<Imagine::NFmiGeoShape> shape =
+      std::make_shared<Imagine::NFmiGeoShape>(theFile, Imagine::kFmiGeoShapeEsri);
+  shape->ProjectXY(theArea);
+
+  std::lock_guard<std::mutex> lock(itsMutex);
+  Entry& entry = itsCache[theFile];
+  if (entry.identity != id)
+    return shape;
+  return entry.shapes.emplace(areakey, shape).first->second;
+}
+
+// ======================================================================
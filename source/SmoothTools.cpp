@@ -0,0 +1,223 @@
+// ======================================================================
+/*!
+ * \brief Implementation of namespace SmoothTools
+ */
+// ======================================================================
+
+#include "SmoothTools.h"
+#include "TaskScheduler.h"
+#include <newbase/NFmiSmoother.h>
+
+#include <algorithm>
+#include <cmath>
+#include <list>
+#include <mutex>
+#include <tuple>
+#include <vector>
+
+namespace SmoothTools
+{
+namespace
+{
+// ----------------------------------------------------------------------
+/*!
+ * \brief A block of rows smoothened by one thread
+ *
+ * Rows [first,last) are produced from the input rows [lo,hi), which
+ * include a halo wide enough to contain every point within the
+ * smoothing radius. The coordinates of the input rows are extracted
+ * once when the plan is made.
+ */
+// ----------------------------------------------------------------------
+
+struct Block
+{
+  std::size_t first;
+  std::size_t last;
+  std::size_t lo;
+  std::size_t hi;
+  Fmi::CoordinateMatrix points;
+};
+
+typedef std::vector<Block> Plan;
+
+// Plans are made once per coordinates, radius and thread count. The
+// coordinates are owned by the process wide coordinate cache of
+// LazyQueryData, hence they are kept alive by the key itself. Only
+// the most recently used plans are kept, since each one holds a copy
+// of the coordinates.
+
+typedef std::tuple<std::shared_ptr<Fmi::CoordinateMatrix>, float, unsigned int> PlanKey;
+
+const std::size_t max_plans = 16;
+
+std::mutex plan_mutex;
+std::list<std::pair<PlanKey, std::shared_ptr<Plan> > > plan_cache;  // most recent first
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Number of halo rows needed for the given radius
+ *
+ * The halo is the radius divided by the smallest distance between
+ * vertically adjacent points, plus a safety margin. Zero is returned
+ * if the rows are degenerate, meaning the grid must not be split.
+ */
+// ----------------------------------------------------------------------
+
+std::size_t halo_rows(const Fmi::CoordinateMatrix& thePoints, float theRadius)
+{
+  const std::size_t nx = thePoints.width();
+  const std::size_t ny = thePoints.height();
+
+  double mindist = -1;
+  for (std::size_t j = 0; j + 1 < ny; j++)
+    for (std::size_t i = 0; i < nx; i++)
+    {
+      const double dist = std::hypot(thePoints.x(i, j + 1) - thePoints.x(i, j),
+                                     thePoints.y(i, j + 1) - thePoints.y(i, j));
+      if (std::isfinite(dist) && (mindist < 0 || dist < mindist))
+        mindist = dist;
+    }
+
+  if (mindist <= 0)
+    return 0;
+
+  return static_cast<std::size_t>(std::ceil(theRadius / mindist)) + 2;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Make the block plan
+ *
+ * An empty plan means the grid is processed in one piece, either
+ * since the halo would be as large as the blocks themselves or since
+ * the halo cannot be determined.
+ */
+// ----------------------------------------------------------------------
+
+std::shared_ptr<Plan> make_plan(const Fmi::CoordinateMatrix& thePoints,
+                                float theRadius,
+                                unsigned int theThreads)
+{
+  std::shared_ptr<Plan> plan(new Plan);
+
+  const std::size_t nx = thePoints.width();
+  const std::size_t ny = thePoints.height();
+  const std::size_t halo = halo_rows(thePoints, theRadius);
+
+  if (halo == 0)
+    return plan;
+
+  const std::size_t nblocks = std::min<std::size_t>(theThreads, ny / (2 * halo));
+  if (nblocks < 2)
+    return plan;
+
+  for (std::size_t b = 0; b < nblocks; b++)
+  {
+    Block block;
+    block.first = b * ny / nblocks;
+    block.last = (b + 1) * ny / nblocks;
+    block.lo = (block.first > halo ? block.first - halo : 0);
+    block.hi = std::min(ny, block.last + halo);
+    block.points = Fmi::CoordinateMatrix(nx, block.hi - block.lo);
+    for (std::size_t j = block.lo; j < block.hi; j++)
+      for (std::size_t i = 0; i < nx; i++)
+        block.points.set(i, j - block.lo, thePoints.x(i, j), thePoints.y(i, j));
+    plan->push_back(std::move(block));
+  }
+
+  return plan;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Find or make the block plan
+ */
+// ----------------------------------------------------------------------
+
+std::shared_ptr<Plan> get_plan(const std::shared_ptr<Fmi::CoordinateMatrix>& thePoints,
+                               float theRadius,
+                               unsigned int theThreads)
+{
+  const PlanKey key(thePoints, theRadius, theThreads);
+
+  std::lock_guard<std::mutex> lock(plan_mutex);
+  for (auto it = plan_cache.begin(); it != plan_cache.end(); ++it)
+    if (it->first == key)
+    {
+      plan_cache.splice(plan_cache.begin(), plan_cache, it);
+      return it->second;
+    }
+
+  std::shared_ptr<Plan> plan = make_plan(*thePoints, theRadius, theThreads);
+  plan_cache.push_front(std::make_pair(key, plan));
+  if (plan_cache.size() > max_plans)
+    plan_cache.pop_back();
+  return plan;
+}
+
+}  // namespace
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Smoothen the values using NFmiSmoother in parallel
+ *
+ * The grid is split into row blocks, each of which is smoothened
+ * separately together with a halo of rows covering the smoothing
+ * radius. Since the smoother only uses points within the radius,
+ * the result is identical to smoothening the full grid at once.
+ *
+ * \param theSmoother The smoother name
+ * \param theFactor The smoother factor
+ * \param theRadius The smoother radius in meters
+ * \param thePoints The world coordinates of the grid points
+ * \param theValues The values to smoothen
+ * \param theThreads The number of threads to use
+ * \return The smoothened values
+ */
+// ----------------------------------------------------------------------
+
+NFmiDataMatrix<float> smoothen(const std::string& theSmoother,
+                               int theFactor,
+                               float theRadius,
+                               const std::shared_ptr<Fmi::CoordinateMatrix>& thePoints,
+                               const NFmiDataMatrix<float>& theValues,
+                               unsigned int theThreads)
+{
+  NFmiSmoother smoother(theSmoother, theFactor, theRadius);
+
+  if (theThreads <= 1)
+    return smoother.Smoothen(*thePoints, theValues);
+
+  auto plan = get_plan(thePoints, theRadius, theThreads);
+  if (plan->empty())
+    return smoother.Smoothen(*thePoints, theValues);
+
+  const std::size_t nx = theValues.NX();
+  NFmiDataMatrix<float> result(nx, theValues.NY());
+
+  TaskScheduler::run(plan->size(),
+                     theThreads,
+                     [&](std::size_t b)
+                     {
+                       const Block& block = (*plan)[b];
+                       NFmiDataMatrix<float> values(nx, block.hi - block.lo);
+                       for (std::size_t i = 0; i < nx; i++)
+                         std::copy(theValues[i].begin() + block.lo,
+                                   theValues[i].begin() + block.hi,
+                                   values[i].begin());
+
+                       NFmiDataMatrix<float> smoothed = smoother.Smoothen(block.points, values);
+
+                       for (std::size_t i = 0; i < nx; i++)
+                         std::copy(smoothed[i].begin() + (block.first - block.lo),
+                                   smoothed[i].begin() + (block.last - block.lo),
+                                   result[i].begin() + block.first);
+                     });
+
+  return result;
+}
+
+}  // namespace SmoothTools
+
+// ======================================================================
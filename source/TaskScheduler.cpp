@@ -0,0 +1,344 @@
+// ======================================================================
+/*!
+ * \file
+ * \brief Implementation of namespace TaskScheduler
+ */
+// ======================================================================
+
+#include "TaskScheduler.h"
+#include "Profiler.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace TaskScheduler
+{
+namespace
+{
+typedef std::function<void()> task_type;
+
+// The tasks of one worker
+
+struct Queue
+{
+  std::mutex mutex;
+  std::deque<task_type> tasks;
+};
+
+std::mutex itsPoolMutex;  // protects starting and stopping the workers
+unsigned int itsThreads = 1;
+std::atomic<bool> isRunning(false);
+
+// One queue for each worker, and the last one for the other threads
+std::vector<std::unique_ptr<Queue> > itsQueues;
+std::vector<std::thread> itsWorkers;
+
+std::mutex itsIdleMutex;
+std::condition_variable itsIdle;
+std::atomic<long> itsQueued(0);  // tasks waiting in the queues
+bool isStopping = false;         // protected by itsIdleMutex
+
+thread_local int itsWorker = -1;  // index of the worker of the thread
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief The tasks of one run() call
+ */
+// ----------------------------------------------------------------------
+
+struct Group
+{
+  std::atomic<std::size_t> next{0};  // next index to be run
+  std::mutex mutex;
+  std::condition_variable finished;
+  std::size_t active = 0;  // threads other than the caller running tasks
+  bool closed = false;     // the caller ran out of work
+  std::exception_ptr error;
+};
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Take a task, own tasks newest first and stolen ones oldest first
+ */
+// ----------------------------------------------------------------------
+
+bool pop(std::size_t theQueue, task_type &theTask)
+{
+  {
+    Queue &queue = *itsQueues[theQueue];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (!queue.tasks.empty())
+    {
+      theTask = std::move(queue.tasks.back());
+      queue.tasks.pop_back();
+      --itsQueued;
+      return true;
+    }
+  }
+
+  const std::size_t n = itsQueues.size();
+  for (std::size_t k = 1; k < n; k++)
+  {
+    Queue &queue = *itsQueues[(theQueue + k) % n];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (!queue.tasks.empty())
+    {
+      theTask = std::move(queue.tasks.front());
+      queue.tasks.pop_front();
+      --itsQueued;
+      return true;
+    }
+  }
+  return false;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Run tasks until stopped
+ */
+// ----------------------------------------------------------------------
+
+void work(std::size_t theWorker)
+{
+  itsWorker = static_cast<int>(theWorker);
+  for (;;)
+  {
+    task_type task;
+    if (pop(theWorker, task))
+    {
+      task();
+      continue;
+    }
+
+    std::unique_lock<std::mutex> lock(itsIdleMutex);
+    itsIdle.wait(lock, [] { return isStopping || itsQueued > 0; });
+    if (isStopping && itsQueued == 0)
+      return;
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Start the workers unless already running
+ *
+ * The calling thread counts as one thread, but at least one worker
+ * is needed for the background tasks.
+ */
+// ----------------------------------------------------------------------
+
+void start()
+{
+  if (isRunning)
+    return;
+
+  std::lock_guard<std::mutex> lock(itsPoolMutex);
+  if (isRunning)
+    return;
+
+  const unsigned int workers = std::max(1u, itsThreads - 1);
+  for (unsigned int i = 0; i <= workers; i++)
+    itsQueues.emplace_back(new Queue);
+  for (unsigned int i = 0; i < workers; i++)
+    itsWorkers.emplace_back(work, i);
+  isRunning = true;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Queue a task for the workers
+ */
+// ----------------------------------------------------------------------
+
+void push(task_type theTask)
+{
+  start();
+
+  const std::size_t index =
+      (itsWorker >= 0 ? static_cast<std::size_t>(itsWorker) : itsQueues.size() - 1);
+  {
+    Queue &queue = *itsQueues[index];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    queue.tasks.push_back(std::move(theTask));
+  }
+  {
+    std::lock_guard<std::mutex> lock(itsIdleMutex);
+    ++itsQueued;
+  }
+  itsIdle.notify_one();
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Run the tasks of a group until the indices run out
+ */
+// ----------------------------------------------------------------------
+
+void run_group(Group &theGroup,
+               std::size_t theCount,
+               const std::function<void(std::size_t)> &theTask)
+{
+  try
+  {
+    for (std::size_t i = theGroup.next++; i < theCount; i = theGroup.next++)
+      theTask(i);
+  }
+  catch (...)
+  {
+    std::lock_guard<std::mutex> lock(theGroup.mutex);
+    if (!theGroup.error)
+      theGroup.error = std::current_exception();
+    theGroup.next = theCount;
+  }
+}
+
+// The workers must be joined before the threads are destroyed at exit
+
+struct Stopper
+{
+  ~Stopper() { stop(); }
+} itsStopper;
+
+}  // namespace
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Set the total number of threads
+ *
+ * Zero is taken to mean one, the running workers are restarted
+ * if the number changes.
+ */
+// ----------------------------------------------------------------------
+
+void threads(unsigned int theThreads)
+{
+  theThreads = std::max(1u, theThreads);
+  if (theThreads == itsThreads)
+    return;
+  stop();
+  itsThreads = theThreads;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief The total number of threads
+ */
+// ----------------------------------------------------------------------
+
+unsigned int threads()
+{
+  return itsThreads;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Wait for the queued tasks and join the workers
+ *
+ * The workers are started again when next needed.
+ */
+// ----------------------------------------------------------------------
+
+void stop()
+{
+  std::lock_guard<std::mutex> lock(itsPoolMutex);
+  if (!isRunning)
+    return;
+
+  {
+    std::lock_guard<std::mutex> idlelock(itsIdleMutex);
+    isStopping = true;
+  }
+  itsIdle.notify_all();
+  for (auto &worker : itsWorkers)
+    worker.join();
+
+  itsWorkers.clear();
+  itsQueues.clear();
+  isStopping = false;
+  isRunning = false;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Run the indexed tasks in parallel
+ */
+// ----------------------------------------------------------------------
+
+void run(std::size_t theCount,
+         std::size_t theMaxThreads,
+         const std::function<void(std::size_t)> &theTask)
+{
+  const std::size_t nthreads = std::min(theMaxThreads, theCount);
+
+  if (nthreads <= 1)
+  {
+    for (std::size_t i = 0; i < theCount; i++)
+      theTask(i);
+    return;
+  }
+
+  // The task and the profile record of the caller are referred to
+  // only while the caller waits for the active threads, the helpers
+  // starting later do nothing
+
+  auto group = std::make_shared<Group>();
+  Profiler::RecordData *record = Profiler::current();
+  for (std::size_t t = 1; t < nthreads; t++)
+    push(
+        [group, theCount, &theTask, record]()
+        {
+          {
+            std::lock_guard<std::mutex> lock(group->mutex);
+            if (group->closed)
+              return;
+            ++group->active;
+          }
+          {
+            Profiler::Helper helper(record);
+            run_group(*group, theCount, theTask);
+          }
+          std::lock_guard<std::mutex> lock(group->mutex);
+          if (--group->active == 0)
+            group->finished.notify_all();
+        });
+
+  run_group(*group, theCount, theTask);
+
+  std::unique_lock<std::mutex> lock(group->mutex);
+  group->closed = true;
+  group->finished.wait(lock, [&] { return group->active == 0; });
+
+  if (group->error)
+    std::rethrow_exception(group->error);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Run a task in the background
+ */
+// ----------------------------------------------------------------------
+
+void submit(std::function<void()> theTask)
+{
+  push(
+      [theTask]()
+      {
+        try
+        {
+          theTask();
+        }
+        catch (...)
+        {
+        }
+      });
+}
+
+}  // namespace TaskScheduler
+
+// ======================================================================
@@ -0,0 +1,206 @@
+// ======================================================================
+/*!
+ * \file
+ * \brief Implementation of class TextCache
+ */
+// ======================================================================
+
+#include "TextCache.h"
+
+#include "NFmiFace.h"
+#include <algorithm>
+#include <cstdio>
+#include <sstream>
+
+using namespace Imagine;
+using namespace std;
+
+namespace
+{
+// ----------------------------------------------------------------------
+/*!
+ * \brief Create the face of the given style
+ */
+// ----------------------------------------------------------------------
+
+NFmiFace make_face(const TextCache::Style& theStyle)
+{
+  NFmiFace face(theStyle.font);
+  face.Background(theStyle.background);
+  if (theStyle.background)
+  {
+    face.BackgroundColor(theStyle.backgroundcolor);
+    face.BackgroundMargin(theStyle.xmargin, theStyle.ymargin);
+  }
+  return face;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief The nominal size of the font in pixels
+ *
+ * The font specification is of the form name:widthxheight, where
+ * either dimension may be zero.
+ */
+// ----------------------------------------------------------------------
+
+int font_size(const string& theFont)
+{
+  int width = 0;
+  int height = 0;
+  const string::size_type pos = theFont.rfind(':');
+  if (pos != string::npos)
+    sscanf(theFont.c_str() + pos + 1, "%dx%d", &width, &height);
+  const int size = max(width, height);
+  return (size > 0 ? size : 64);
+}
+
+}  // namespace
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Clear the cache
+ */
+// ----------------------------------------------------------------------
+
+void TextCache::clear()
+{
+  std::lock_guard<std::mutex> lock(itsMutex);
+  itsCache.clear();
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief The number of cached texts
+ */
+// ----------------------------------------------------------------------
+
+std::size_t TextCache::size() const
+{
+  std::lock_guard<std::mutex> lock(itsMutex);
+  return itsCache.size();
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Draw a text, rendering it first if it is not cached
+ *
+ * The text is rendered over a transparent bitmap, hence for the
+ * normal Over rule the result equals drawing the text directly.
+ */
+// ----------------------------------------------------------------------
+
+void TextCache::draw(NFmiImage& theImage,
+                     const Style& theStyle,
+                     int theX,
+                     int theY,
+                     const string& theText,
+                     NFmiAlignment theAlignment,
+                     NFmiColorTools::Color theColor,
+                     NFmiColorTools::NFmiBlendRule theRule)
+{
+  ostringstream out;
+  out << theStyle.font << '\n'
+      << theStyle.background << ' ' << theStyle.backgroundcolor << ' ' << theStyle.xmargin << ' '
+      << theStyle.ymargin << ' ' << static_cast<int>(theAlignment) << ' ' << theColor << '\n'
+      << theText;
+  const string key = out.str();
+
+  std::shared_ptr<const Entry> entry;
+  {
+    std::lock_guard<std::mutex> lock(itsMutex);
+    storage_type::const_iterator it = itsCache.find(key);
+    if (it != itsCache.end())
+      entry = it->second;
+  }
+
+  if (!entry)
+  {
+    entry = render(theStyle, theText, theAlignment, theColor);
+    std::lock_guard<std::mutex> lock(itsMutex);
+    itsCache.insert(make_pair(key, entry));
+  }
+
+  if (entry->empty)
+    return;
+
+  if (entry->direct)
+  {
+    make_face(theStyle).Draw(theImage, theX, theY, theText, theAlignment, theColor, theRule);
+    return;
+  }
+
+  theImage.Composite(
+      entry->bitmap, theRule, kFmiAlignNorthWest, theX + entry->dx, theY + entry->dy, 1);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Render a text into a bitmap cropped to the drawn pixels
+ *
+ * The text is drawn into a scratch image large enough for any
+ * alignment, and the drawn pixels are then cropped. Should the text
+ * reach the edges of the scratch image, it is drawn directly with
+ * the face instead.
+ */
+// ----------------------------------------------------------------------
+
+std::shared_ptr<const TextCache::Entry> TextCache::render(const Style& theStyle,
+                                                          const string& theText,
+                                                          NFmiAlignment theAlignment,
+                                                          NFmiColorTools::Color theColor) const
+{
+  std::shared_ptr<Entry> entry = std::make_shared<Entry>();
+
+  const int size = font_size(theStyle.font);
+  const int xextent = (static_cast<int>(theText.size()) + 2) * size + theStyle.xmargin;
+  const int yextent = 2 * size + theStyle.ymargin;
+  const int width = 2 * xextent + 1;
+  const int height = 2 * yextent + 1;
+
+  const NFmiColorTools::Color transparent =
+      NFmiColorTools::MakeColor(0, 0, 0, NFmiColorTools::MaxAlpha);
+
+  NFmiImage scratch(width, height, transparent);
+  make_face(theStyle).Draw(
+      scratch, xextent, yextent, theText, theAlignment, theColor, NFmiColorTools::kFmiColorOver);
+
+  // The bounding box of the drawn pixels
+
+  int x1 = width;
+  int y1 = height;
+  int x2 = -1;
+  int y2 = -1;
+  for (int j = 0; j < height; j++)
+    for (int i = 0; i < width; i++)
+      if (NFmiColorTools::GetAlpha(scratch(i, j)) != NFmiColorTools::MaxAlpha)
+      {
+        x1 = min(x1, i);
+        y1 = min(y1, j);
+        x2 = max(x2, i);
+        y2 = max(y2, j);
+      }
+
+  if (x2 < 0)
+  {
+    entry->empty = true;
+    return entry;
+  }
+
+  if (x1 == 0 || y1 == 0 || x2 == width - 1 || y2 == height - 1)
+  {
+    entry->direct = true;
+    return entry;
+  }
+
+  entry->bitmap = NFmiImage(x2 - x1 + 1, y2 - y1 + 1, transparent);
+  for (int j = y1; j <= y2; j++)
+    for (int i = x1; i <= x2; i++)
+      entry->bitmap(i - x1, j - y1) = scratch(i, j);
+
+  entry->dx = x1 - xextent;
+  entry->dy = y1 - yextent;
+  return entry;
+}
+
+// ======================================================================
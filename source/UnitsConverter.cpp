@@ -123,80 +123,43 @@ inline float kilometers_to_flightlevel(float theValue)
 
 // ----------------------------------------------------------------------
 /*!
- * \brief Convert degrees Celsius to Fahrenheit
- */
-// ----------------------------------------------------------------------
-
-void celsius_to_fahrenheit(NFmiDataMatrix<float>& theValues)
-{
-  for (NFmiDataMatrix<float>::size_type j = 0; j < theValues.NY(); j++)
-    for (NFmiDataMatrix<float>::size_type i = 0; i < theValues.NX(); i++)
-      theValues[i][j] = celsius_to_fahrenheit(theValues[i][j]);
-}
-
-// ----------------------------------------------------------------------
-/*!
- * \brief Convert degrees Fahrenheit to Celsius
- */
-// ----------------------------------------------------------------------
-
-void fahrenheit_to_celsius(NFmiDataMatrix<float>& theValues)
-{
-  for (NFmiDataMatrix<float>::size_type j = 0; j < theValues.NY(); j++)
-    for (NFmiDataMatrix<float>::size_type i = 0; i < theValues.NX(); i++)
-      theValues[i][j] = fahrenheit_to_celsius(theValues[i][j]);
-}
-
-// ----------------------------------------------------------------------
-/*!
- * \brief Convert meters per second to knots
- */
-// ----------------------------------------------------------------------
-
-void meterspersecond_to_knots(NFmiDataMatrix<float>& theValues)
-{
-  for (NFmiDataMatrix<float>::size_type j = 0; j < theValues.NY(); j++)
-    for (NFmiDataMatrix<float>::size_type i = 0; i < theValues.NX(); i++)
-      theValues[i][j] = meterspersecond_to_knots(theValues[i][j]);
-}
-
-// ----------------------------------------------------------------------
-/*!
- * \brief Convert meters to feet
- */
-// ----------------------------------------------------------------------
-
-void meters_to_feet(NFmiDataMatrix<float>& theValues)
-{
-  for (NFmiDataMatrix<float>::size_type j = 0; j < theValues.NY(); j++)
-    for (NFmiDataMatrix<float>::size_type i = 0; i < theValues.NX(); i++)
-      theValues[i][j] = meters_to_feet(theValues[i][j]);
-}
-
-// ----------------------------------------------------------------------
-/*!
- * \brief Convert kilometers to feet
+ * \brief Convert a datamatrix, optionally replacing a value afterwards
+ *
+ * This is a single pass over the data, each column of the matrix is
+ * contiguous in memory and is processed separately. The replacement
+ * is done after the conversion, just like when calling Replace
+ * for the converted matrix.
  */
 // ----------------------------------------------------------------------
 
-void kilometers_to_feet(NFmiDataMatrix<float>& theValues)
+template <typename Conversion>
+void convert_values(NFmiDataMatrix<float>& theValues,
+                    Conversion theConversion,
+                    bool theReplaceFlag,
+                    float theSourceValue,
+                    float theTargetValue)
 {
-  for (NFmiDataMatrix<float>::size_type j = 0; j < theValues.NY(); j++)
-    for (NFmiDataMatrix<float>::size_type i = 0; i < theValues.NX(); i++)
-      theValues[i][j] = kilometers_to_feet(theValues[i][j]);
-}
-
-// ----------------------------------------------------------------------
-/*!
- * \brief Convert kilometers to flight level
- */
-// ----------------------------------------------------------------------
+  const NFmiDataMatrix<float>::size_type ny = theValues.NY();
+  if (ny == 0)
+    return;
 
-void kilometers_to_flightlevel(NFmiDataMatrix<float>& theValues)
-{
-  for (NFmiDataMatrix<float>::size_type j = 0; j < theValues.NY(); j++)
-    for (NFmiDataMatrix<float>::size_type i = 0; i < theValues.NX(); i++)
-      theValues[i][j] = kilometers_to_flightlevel(theValues[i][j]);
+  for (NFmiDataMatrix<float>::size_type i = 0; i < theValues.NX(); i++)
+  {
+    float* column = &theValues[i][0];
+    if (theReplaceFlag)
+    {
+      for (NFmiDataMatrix<float>::size_type j = 0; j < ny; j++)
+      {
+        const float value = theConversion(column[j]);
+        column[j] = (value == theSourceValue ? theTargetValue : value);
+      }
+    }
+    else
+    {
+      for (NFmiDataMatrix<float>::size_type j = 0; j < ny; j++)
+        column[j] = theConversion(column[j]);
+    }
+  }
 }
 
 // ----------------------------------------------------------------------
@@ -277,27 +240,57 @@ float UnitsConverter::convert(FmiParameterName theParam, float theValue) const
 
 void UnitsConverter::convert(FmiParameterName theParam, NFmiDataMatrix<float>& theValues) const
 {
+  if (itsConversions[theParam] != NoConversion)
+    convert(theParam, theValues, false, kFloatMissing, kFloatMissing);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Convert a datamatrix and replace a value in the same pass
+ *
+ * \param theParam The parameter whose conversion is to be applied
+ * \param theValues The values to modify
+ * \param theReplaceFlag True if values are to be replaced
+ * \param theSourceValue The converted value to be replaced
+ * \param theTargetValue The value to replace with
+ */
+// ----------------------------------------------------------------------
+
+void UnitsConverter::convert(FmiParameterName theParam,
+                             NFmiDataMatrix<float>& theValues,
+                             bool theReplaceFlag,
+                             float theSourceValue,
+                             float theTargetValue) const
+{
+  const float src = theSourceValue;
+  const float dst = theTargetValue;
+  const bool flag = theReplaceFlag;
+
   switch (itsConversions[theParam])
   {
     case NoConversion:
-      return;
+      if (flag)
+        convert_values(theValues, [](float x) { return x; }, flag, src, dst);
+      break;
     case CelsiusToFahrenheit:
-      celsius_to_fahrenheit(theValues);
+      convert_values(theValues, [](float x) { return celsius_to_fahrenheit(x); }, flag, src, dst);
       break;
     case FahrenheitToCelsius:
-      fahrenheit_to_celsius(theValues);
+      convert_values(theValues, [](float x) { return fahrenheit_to_celsius(x); }, flag, src, dst);
       break;
     case MetersPerSecondToKnots:
-      meterspersecond_to_knots(theValues);
+      convert_values(
+          theValues, [](float x) { return meterspersecond_to_knots(x); }, flag, src, dst);
       break;
     case MetersToFeet:
-      meters_to_feet(theValues);
+      convert_values(theValues, [](float x) { return meters_to_feet(x); }, flag, src, dst);
       break;
     case KiloMetersToFeet:
-      kilometers_to_feet(theValues);
+      convert_values(theValues, [](float x) { return kilometers_to_feet(x); }, flag, src, dst);
       break;
     case KiloMetersToFlightLevel:
-      kilometers_to_flightlevel(theValues);
+      convert_values(
+          theValues, [](float x) { return kilometers_to_flightlevel(x); }, flag, src, dst);
       break;
   }
 }
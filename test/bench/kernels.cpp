@@ -0,0 +1,377 @@
+// ======================================================================
+/*!
+ * \file
+ * \brief Micro benchmarks for the computational kernels
+ *
+ * Run from the test directory so that the data files are found:
+ * \code
+ * bench/kernels [filter]
+ * \endcode
+ * Each benchmark is run in batches of about 20 milliseconds, and the
+ * median and minimum time per call over the batches are reported.
+ * The median is the number to compare between commits. Only the
+ * benchmarks whose name contains the optional filter are run.
+ */
+// ======================================================================
+
+#include "ContourCalculator.h"
+#include "ExtremaLocator.h"
+#include "LabelLocator.h"
+#include "LazyQueryData.h"
+#include "MetaFunctions.h"
+#include "NoiseTools.h"
+#include "RangeTools.h"
+#include "UnitsConverter.h"
+#include <newbase/NFmiEnumConverter.h>
+#include <newbase/NFmiSettings.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+namespace
+{
+string filter;
+
+const int batches = 11;
+const double batchseconds = 0.02;
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Time the given function and print the results
+ */
+// ----------------------------------------------------------------------
+
+template <typename Function>
+void bench(const string &theName, Function theFunction)
+{
+  if (theName.find(filter) == string::npos)
+    return;
+
+  using clock = chrono::steady_clock;
+
+  // Warm up and choose the number of calls per batch
+
+  size_t calls = 1;
+  for (;;)
+  {
+    const auto start = clock::now();
+    for (size_t i = 0; i < calls; i++)
+      theFunction();
+    const double seconds = chrono::duration<double>(clock::now() - start).count();
+    if (seconds >= batchseconds || calls >= 1000000)
+      break;
+    calls = (seconds > 0 ? max(calls + 1, static_cast<size_t>(calls * batchseconds / seconds))
+                         : calls * 10);
+  }
+
+  vector<double> times;
+  for (int batch = 0; batch < batches; batch++)
+  {
+    const auto start = clock::now();
+    for (size_t i = 0; i < calls; i++)
+      theFunction();
+    times.push_back(chrono::duration<double>(clock::now() - start).count() / calls);
+  }
+  sort(times.begin(), times.end());
+
+  printf("%-56s %12.3f us %12.3f us %8zu\n",
+         theName.c_str(),
+         1e6 * times[batches / 2],
+         1e6 * times.front(),
+         calls);
+  fflush(stdout);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Evenly spaced limits over the range of the valid values
+ */
+// ----------------------------------------------------------------------
+
+vector<float> value_range(const NFmiDataMatrix<float> &theValues, int theSteps)
+{
+  float lo = 0;
+  float hi = -1;
+  for (size_t i = 0; i < theValues.NX(); i++)
+    for (size_t j = 0; j < theValues.NY(); j++)
+    {
+      const float value = theValues[i][j];
+      if (value == kFloatMissing)
+        continue;
+      if (lo > hi)
+        lo = hi = value;
+      else
+      {
+        lo = min(lo, value);
+        hi = max(hi, value);
+      }
+    }
+
+  vector<float> result;
+  if (lo < hi)
+    for (int k = 1; k < theSteps; k++)
+      result.push_back(lo + (hi - lo) * k / theSteps);
+  return result;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Benchmark contouring one parameter of a data file
+ */
+// ----------------------------------------------------------------------
+
+void bench_contours(const string &theFile, const string &theParam)
+{
+  LazyQueryData qd;
+  qd.Read(theFile);
+  NFmiEnumConverter converter;
+  if (!qd.Param(FmiParameterName(converter.ToEnum(theParam))))
+  {
+    cout << "Skipping " << theFile << ": no parameter " << theParam << endl;
+    return;
+  }
+  qd.FirstLevel();
+  qd.FirstTime();
+
+  const NFmiDataMatrix<float> values = qd.Values();
+  const vector<float> breaks = value_range(values, 10);
+  if (breaks.empty())
+  {
+    cout << "Skipping " << theFile << ": " << theParam << " is constant" << endl;
+    return;
+  }
+
+  vector<pair<float, float> > limits;
+  limits.push_back(make_pair(kFloatMissing, breaks.front()));
+  for (size_t i = 0; i + 1 < breaks.size(); i++)
+    limits.push_back(make_pair(breaks[i], breaks[i + 1]));
+  limits.push_back(make_pair(breaks.back(), kFloatMissing));
+
+  const string prefix = theFile + " " + theParam + " ";
+
+  // The data is set anew for each call so that the hints are
+  // recalculated just like for a new time step
+
+  ContourCalculator calculator;
+  calculator.cache(false);
+
+  const pair<ContourInterpolation, const char *> fills[] = {
+      {Linear, "Linear"}, {Nearest, "Nearest"}, {Discrete, "Discrete"}};
+
+  for (const auto &interp : fills)
+    bench(prefix + "fills " + interp.second,
+          [&]()
+          {
+            calculator.data(values);
+            calculator.contours(qd, limits, qd.ValidTime(), interp.first);
+          });
+
+  bench(prefix + "lines Linear",
+        [&]()
+        {
+          calculator.data(values);
+          calculator.contours(qd, breaks, qd.ValidTime(), Linear);
+        });
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Benchmark the value filters
+ */
+// ----------------------------------------------------------------------
+
+void bench_filters()
+{
+  LazyQueryData qd;
+  qd.Read("data/echotop.sqd");
+  NFmiEnumConverter converter;
+  if (!qd.Param(FmiParameterName(converter.ToEnum("EchoTop"))))
+    throw runtime_error("EchoTop missing from data/echotop.sqd");
+  qd.FirstLevel();
+  qd.FirstTime();
+
+  const NFmiDataMatrix<float> values = qd.Values();
+  NFmiDataMatrix<float> tmp;
+
+  // The copies are included in the times
+
+  bench("NoiseTools::despeckle radius 1",
+        [&]()
+        {
+          tmp = values;
+          NoiseTools::despeckle(tmp, kFloatMissing, kFloatMissing, 1, 50, 1);
+        });
+
+  bench("NoiseTools::despeckle radius 3",
+        [&]()
+        {
+          tmp = values;
+          NoiseTools::despeckle(tmp, kFloatMissing, kFloatMissing, 3, 50, 1);
+        });
+
+  bench("NoiseTools::expand",
+        [&]()
+        {
+          tmp = values;
+          NoiseTools::expand(tmp);
+        });
+
+  const vector<float> breaks = value_range(values, 10);
+  vector<RangeTools::Range> ranges;
+  ranges.push_back(RangeTools::Range(kFloatMissing, kFloatMissing));
+  for (size_t i = 0; i + 1 < breaks.size(); i++)
+    ranges.push_back(RangeTools::Range(breaks[i], breaks[i + 1]));
+  vector<uint16_t> indexes;
+
+  bench("RangeTools::classify " + to_string(ranges.size()) + " ranges",
+        [&]() { RangeTools::classify(values, ranges, indexes); });
+
+  UnitsConverter units;
+  units.setConversion(kFmiEchoTop, "kilometers_to_feet");
+  bench("UnitsConverter::convert",
+        [&]()
+        {
+          tmp = values;
+          units.convert(kFmiEchoTop, tmp, true, 0, kFloatMissing);
+        });
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Benchmark the meta functions
+ */
+// ----------------------------------------------------------------------
+
+void bench_meta()
+{
+  LazyQueryData qd;
+  qd.Read("data/kepa.fqd");
+  qd.FirstLevel();
+  qd.FirstTime();
+
+  for (const char *name : {"MetaElevationAngle", "MetaWindChill", "MetaDewDifference"})
+  {
+    try
+    {
+      MetaFunctions::values(name, qd);
+    }
+    catch (const exception &e)
+    {
+      cout << "Skipping " << name << ": " << e.what() << endl;
+      continue;
+    }
+    bench(string("MetaFunctions::values ") + name, [&]() { MetaFunctions::values(name, qd); });
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Benchmark the label and extrema locators
+ *
+ * The locators are given the same pseudo random candidates in
+ * each run.
+ */
+// ----------------------------------------------------------------------
+
+void bench_locators()
+{
+  const int width = 800;
+  const int height = 600;
+
+  mt19937 generator(12345);
+  uniform_int_distribution<int> xdist(0, width - 1);
+  uniform_int_distribution<int> ydist(0, height - 1);
+  uniform_int_distribution<int> vdist(0, 9);
+
+  struct Candidate
+  {
+    int param;
+    float value;
+    int x;
+    int y;
+  };
+  vector<Candidate> labels;
+  for (int i = 0; i < 5000; i++)
+    labels.push_back(Candidate{i % 2, 2.0f * vdist(generator), xdist(generator), ydist(generator)});
+
+  LabelLocator labellocator;
+  labellocator.minDistanceToSameValue(100);
+  labellocator.minDistanceToDifferentValue(30);
+  labellocator.minDistanceToDifferentParameter(20);
+
+  bench("LabelLocator::chooseLabels 5000 candidates",
+        [&]()
+        {
+          labellocator.clear();
+          labellocator.boundingBox(10, 10, width - 10, height - 10);
+          for (const Candidate &candidate : labels)
+          {
+            labellocator.parameter(candidate.param);
+            labellocator.add(candidate.value, candidate.x, candidate.y);
+          }
+          labellocator.chooseLabels();
+        });
+
+  vector<pair<ExtremaLocator::Extremum, ExtremaLocator::XY> > extrema;
+  for (int i = 0; i < 2000; i++)
+    extrema.push_back(make_pair(i % 2 == 0 ? ExtremaLocator::Minimum : ExtremaLocator::Maximum,
+                                ExtremaLocator::XY(xdist(generator), ydist(generator))));
+
+  ExtremaLocator extremalocator;
+  extremalocator.minDistanceToSame(200);
+  extremalocator.minDistanceToDifferent(50);
+
+  bench("ExtremaLocator::chooseCoordinates 2000 candidates",
+        [&]()
+        {
+          extremalocator.clear();
+          for (const auto &extremum : extrema)
+            extremalocator.add(extremum.first, extremum.second.first, extremum.second.second);
+          extremalocator.chooseCoordinates();
+        });
+}
+
+}  // namespace
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Main program
+ */
+// ----------------------------------------------------------------------
+
+int main(int argc, const char *argv[])
+{
+  try
+  {
+    NFmiSettings::Init();
+
+    if (argc > 1)
+      filter = argv[1];
+
+    printf("%-56s %15s %15s %8s\n", "benchmark", "median", "minimum", "calls");
+
+    bench_contours("data/hirlam.sqd", "Temperature");
+    bench_contours("data/world.sqd", "Temperature");
+    bench_contours("data/echotop.sqd", "EchoTop");
+    bench_contours("data/kepa.fqd", "Temperature");
+    bench_filters();
+    bench_meta();
+    bench_locators();
+  }
+  catch (const exception &e)
+  {
+    cerr << "Error: " << e.what() << endl;
+    return 1;
+  }
+  return 0;
+}
+
+// ======================================================================
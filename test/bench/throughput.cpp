@@ -0,0 +1,427 @@
+// ======================================================================
+/*!
+ * \file
+ * \brief End to end throughput benchmark over control scripts
+ *
+ * Run from the test directory:
+ * \code
+ * bench/throughput [-n runs] [-q qdcontour] [scripts]
+ * \endcode
+ * By default all the scripts in the conf and bench/conf directories
+ * are run. Each script is replayed to qdcontour running in server
+ * mode, so that the querydata, images and contours stay in memory
+ * between the runs just like in production:
+ *
+ * - cold: each run uses a new server process
+ * - warm: one server renders the script once to warm up and then
+ *   repeats it for the measured runs
+ *
+ * The contour cache is enabled in both modes. The frames, frame times
+ * and contour cache counters are taken from the profile written by
+ * the server, the peak resident set size from /proc.
+ */
+// ======================================================================
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <glob.h>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+namespace
+{
+// ----------------------------------------------------------------------
+/*!
+ * \brief A qdcontour server reading scripts from a pipe
+ */
+// ----------------------------------------------------------------------
+
+class Server
+{
+ public:
+  explicit Server(const string &theProgram);
+  ~Server();
+
+  string run(const string &theScript);
+  long peakRss() const;
+
+ private:
+  Server(const Server &theServer);
+  Server &operator=(const Server &theServer);
+
+  pid_t itsPid;
+  FILE *itsInput;   // the standard input of the server
+  FILE *itsOutput;  // the standard output of the server
+};
+
+Server::Server(const string &theProgram) : itsPid(-1), itsInput(nullptr), itsOutput(nullptr)
+{
+  int input[2];
+  int output[2];
+  if (pipe(input) != 0 || pipe(output) != 0)
+    throw runtime_error("Failed to create pipes for the server");
+
+  itsPid = fork();
+  if (itsPid < 0)
+    throw runtime_error("Failed to fork the server");
+
+  if (itsPid == 0)
+  {
+    dup2(input[0], 0);
+    dup2(output[1], 1);
+    close(input[0]);
+    close(input[1]);
+    close(output[0]);
+    close(output[1]);
+    execlp(theProgram.c_str(), theProgram.c_str(), "-f", "-S", "-", static_cast<char *>(nullptr));
+    perror(theProgram.c_str());
+    _exit(127);
+  }
+
+  close(input[0]);
+  close(output[1]);
+  itsInput = fdopen(input[1], "w");
+  itsOutput = fdopen(output[0], "r");
+}
+
+Server::~Server()
+{
+  if (itsInput != nullptr)
+    fclose(itsInput);
+  if (itsOutput != nullptr)
+    fclose(itsOutput);
+  if (itsPid > 0)
+    waitpid(itsPid, nullptr, 0);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Execute a script and return the reply of the server
+ */
+// ----------------------------------------------------------------------
+
+string Server::run(const string &theScript)
+{
+  fputs(theScript.c_str(), itsInput);
+  fputs("\n.\n", itsInput);
+  fflush(itsInput);
+
+  // Other output may precede the reply
+
+  char buffer[4096];
+  while (fgets(buffer, sizeof(buffer), itsOutput) != nullptr)
+  {
+    string line = buffer;
+    if (line.compare(0, 2, "OK") == 0 || line.compare(0, 5, "ERROR") == 0)
+    {
+      line.erase(line.find_last_not_of("\r\n") + 1);
+      return line;
+    }
+  }
+  return "ERROR server exited";
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief The peak resident set size of the server in kilobytes
+ */
+// ----------------------------------------------------------------------
+
+long Server::peakRss() const
+{
+  ifstream status(("/proc/" + to_string(itsPid) + "/status").c_str());
+  string line;
+  while (getline(status, line))
+    if (line.compare(0, 6, "VmHWM:") == 0)
+      return atol(line.c_str() + 6);
+  return 0;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief The totals of one profile
+ */
+// ----------------------------------------------------------------------
+
+struct Profile
+{
+  long frames = 0;
+  double framewall = 0;
+  long long hits = 0;
+  long long misses = 0;
+};
+
+// Extract a number following the given key from a JSON line
+
+bool json_number(const string &theLine, const string &theKey, double &theValue)
+{
+  const string key = "\"" + theKey + "\":";
+  const auto pos = theLine.find(key);
+  if (pos == string::npos)
+    return false;
+  theValue = atof(theLine.c_str() + pos + key.size());
+  return true;
+}
+
+Profile read_profile(const string &theFile)
+{
+  Profile profile;
+  ifstream in(theFile.c_str());
+  string line;
+  while (getline(in, line))
+  {
+    double value;
+    if (line.find("\"record\":\"frame\"") != string::npos && json_number(line, "wall", value))
+    {
+      ++profile.frames;
+      profile.framewall += value;
+    }
+    if (json_number(line, "cache_hits", value))
+      profile.hits += static_cast<long long>(value);
+    if (json_number(line, "cache_misses", value))
+      profile.misses += static_cast<long long>(value);
+  }
+  return profile;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief The measurements of one script in one mode
+ */
+// ----------------------------------------------------------------------
+
+struct Result
+{
+  vector<double> seconds;  // wall time of each run
+  Profile profile;         // totals over all runs
+  long rss = 0;
+  string error;
+};
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Wrap a script so that it is profiled and can be repeated
+ *
+ * The settings which accumulate are cleared first, since the
+ * server keeps them between the scripts.
+ */
+// ----------------------------------------------------------------------
+
+string wrap_script(const string &theScript, const string &theProfile)
+{
+  return "clear contours\nclear shapes\nclear arrows\nclear targets\n"
+         "cache 1\nprofile " +
+         theProfile + "\n" + theScript + "\nprofile none\n";
+}
+
+string read_file(const string &theFile)
+{
+  ifstream in(theFile.c_str());
+  if (!in)
+    throw runtime_error("Failed to read '" + theFile + "'");
+  stringstream buffer;
+  buffer << in.rdbuf();
+  return buffer.str();
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Time one run of a script
+ */
+// ----------------------------------------------------------------------
+
+bool time_run(Server &theServer,
+              const string &theScript,
+              const string &theProfile,
+              Result &theResult)
+{
+  const auto start = chrono::steady_clock::now();
+  const string reply = theServer.run(wrap_script(theScript, theProfile));
+  const double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+  if (reply != "OK")
+  {
+    theResult.error = reply;
+    return false;
+  }
+
+  const Profile profile = read_profile(theProfile);
+  theResult.seconds.push_back(seconds);
+  theResult.profile.frames += profile.frames;
+  theResult.profile.framewall += profile.framewall;
+  theResult.profile.hits += profile.hits;
+  theResult.profile.misses += profile.misses;
+  return true;
+}
+
+Result run_cold(const string &theProgram,
+                const string &theScript,
+                const string &theProfile,
+                int theRuns)
+{
+  Result result;
+  for (int i = 0; i < theRuns; i++)
+  {
+    Server server(theProgram);
+    if (!time_run(server, theScript, theProfile, result))
+      break;
+    result.rss = max(result.rss, server.peakRss());
+  }
+  return result;
+}
+
+Result run_warm(const string &theProgram,
+                const string &theScript,
+                const string &theProfile,
+                int theRuns)
+{
+  Result result;
+  Server server(theProgram);
+
+  Result warmup;
+  if (!time_run(server, theScript, theProfile, warmup))
+  {
+    result.error = warmup.error;
+    return result;
+  }
+
+  for (int i = 0; i < theRuns; i++)
+    if (!time_run(server, theScript, theProfile, result))
+      break;
+  result.rss = server.peakRss();
+  return result;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Print the results of one script in one mode
+ */
+// ----------------------------------------------------------------------
+
+void report(const string &theName, const char *theMode, const Result &theResult)
+{
+  if (!theResult.error.empty() || theResult.seconds.empty())
+  {
+    printf("%-40s %-5s %s\n", theName.c_str(), theMode, theResult.error.c_str());
+    return;
+  }
+
+  vector<double> seconds = theResult.seconds;
+  sort(seconds.begin(), seconds.end());
+  const double median = seconds[seconds.size() / 2];
+
+  const Profile &profile = theResult.profile;
+  const double runs = static_cast<double>(seconds.size());
+  const double frames = profile.frames / runs;
+  const double perframe = (profile.frames > 0 ? profile.framewall / profile.frames : 0);
+  const long long lookups = profile.hits + profile.misses;
+  const double hitrate = (lookups > 0 ? 100.0 * profile.hits / lookups : 0);
+
+  printf("%-40s %-5s %10.2f %8.1f %10.2f %9.1f %8.1f %8.1f\n",
+         theName.c_str(),
+         theMode,
+         1e3 * median,
+         frames,
+         1e3 * perframe,
+         perframe > 0 ? 1 / perframe : 0,
+         theResult.rss / 1024.0,
+         hitrate);
+  fflush(stdout);
+}
+
+vector<string> glob_files(const string &thePattern)
+{
+  vector<string> files;
+  glob_t matches;
+  if (glob(thePattern.c_str(), 0, nullptr, &matches) == 0)
+    for (size_t i = 0; i < matches.gl_pathc; i++)
+      files.push_back(matches.gl_pathv[i]);
+  globfree(&matches);
+  return files;
+}
+
+}  // namespace
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Main program
+ */
+// ----------------------------------------------------------------------
+
+int main(int argc, char *argv[])
+{
+  try
+  {
+    int runs = 5;
+    string program = (access("../qdcontour2", X_OK) == 0 ? "../qdcontour2" : "qdcontour2");
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:q:")) != -1)
+    {
+      if (opt == 'n')
+        runs = max(1, atoi(optarg));
+      else if (opt == 'q')
+        program = optarg;
+      else
+      {
+        cerr << "Usage: throughput [-n runs] [-q qdcontour] [scripts]" << endl;
+        return 1;
+      }
+    }
+
+    vector<string> scripts(argv + optind, argv + argc);
+    if (scripts.empty())
+    {
+      scripts = glob_files("conf/*.conf");
+      const vector<string> synthetic = glob_files("bench/conf/*.conf");
+      scripts.insert(scripts.end(), synthetic.begin(), synthetic.end());
+    }
+
+    const string profile = "results/throughput." + to_string(getpid()) + ".prof";
+    mkdir("results", 0755);
+
+    // A failing server must not kill the driver
+
+    signal(SIGPIPE, SIG_IGN);
+
+    printf("%-40s %-5s %10s %8s %10s %9s %8s %8s\n",
+           "script",
+           "mode",
+           "ms/run",
+           "frames",
+           "ms/frame",
+           "frames/s",
+           "rss MB",
+           "hits %");
+
+    for (const string &file : scripts)
+    {
+      const string script = read_file(file);
+      report(file, "cold", run_cold(program, script, profile, runs));
+      report(file, "warm", run_warm(program, script, profile, runs));
+    }
+
+    remove(profile.c_str());
+  }
+  catch (const exception &e)
+  {
+    cerr << "Error: " << e.what() << endl;
+    return 1;
+  }
+  return 0;
+}
+
+// ======================================================================